@@ -0,0 +1,225 @@
+/*
+OpenB3: an open source sound synthesis engine and JUCE application/plugin that simulates
+the magnificent sound of the Hammond B3 organ and Leslie rotating speaker
+Copyright (C) 2021-2022 Michele Perrone
+Github: https://github.com/michele-perrone/OpenPiano
+Author e-mail: perrone(dot)michele(at)outlook(dot)com
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+#endif
+
+#include "arena.h"
+
+#define ARENA_ALIGN 64 /* cache line */
+
+struct b_arena {
+	char*  base; /* the mapping, starting with this header */
+	size_t size;
+	size_t used;
+};
+
+#define ARENA_HEADER ((sizeof (struct b_arena) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+/*
+ * Maps an arena of size bytes. Pages that are never used do not take
+ * memory, so size can be generous.
+ */
+void*
+arenaCreate (size_t size, int flags)
+{
+	struct b_arena* a;
+	char*           base;
+
+	size = (size + ARENA_HEADER + 0xfffff) & ~(size_t)0xfffff;
+#ifdef _WIN32
+	(void)flags;
+	base = (char*)VirtualAlloc (NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (!base) {
+		fprintf (stderr, "arena: cannot map %zu bytes\n", size);
+		return NULL;
+	}
+#else
+	base = (char*)mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED) {
+		perror ("arena");
+		return NULL;
+	}
+#ifdef MADV_HUGEPAGE
+	if (flags & ARENA_HUGEPAGES) {
+		madvise (base, size, MADV_HUGEPAGE);
+	}
+#endif
+#endif
+	a        = (struct b_arena*)base;
+	a->base  = base;
+	a->size  = size;
+	a->used  = ARENA_HEADER;
+	return a;
+}
+
+void
+arenaDestroy (void* arena)
+{
+	struct b_arena* a = (struct b_arena*)arena;
+	if (!a) {
+		return;
+	}
+#ifdef _WIN32
+	VirtualFree (a->base, 0, MEM_RELEASE);
+#else
+	munmap (a->base, a->size);
+#endif
+}
+
+/*
+ * Returns size bytes of zeroed memory, NULL if none is left.
+ */
+void*
+arenaAlloc (void* arena, size_t size)
+{
+	struct b_arena* a = (struct b_arena*)arena;
+	size_t          n = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	char*           p;
+
+	if (!a || n < size || a->size - a->used < n) {
+		return calloc (1, size ? size : 1);
+	}
+	p = a->base + a->used;
+	a->used += n;
+	return p;
+}
+
+void
+arenaFree (void* arena, void* p)
+{
+	struct b_arena* a = (struct b_arena*)arena;
+	if (a && (char*)p >= a->base && (char*)p < a->base + a->size) {
+		return;
+	}
+	free (p);
+}
+
+char*
+arenaStrdup (void* arena, const char* s)
+{
+	size_t len = strlen (s) + 1;
+	char*  d   = (char*)arenaAlloc (arena, len);
+	if (d) {
+		memcpy (d, s, len);
+	}
+	return d;
+}
+
+size_t
+arenaUsed (const void* arena)
+{
+	const struct b_arena* a = (const struct b_arena*)arena;
+	return a ? a->used : 0;
+}
+
+static size_t
+pageSize (void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO si;
+	GetSystemInfo (&si);
+	return (size_t)si.dwPageSize;
+#else
+	return (size_t)sysconf (_SC_PAGESIZE);
+#endif
+}
+
+/*
+ * Locks the pages of len bytes at p in memory, faulting them in. Pages
+ * that cannot be locked are still faulted in, by writing to them: this
+ * must not race with other writers.
+ * return    the number of bytes locked, 0 if that failed.
+ */
+size_t
+lockMemory (void* p, size_t len)
+{
+	const size_t pg    = pageSize ();
+	char*        start = (char*)((size_t)p & ~(pg - 1));
+	char*        end   = (char*)(((size_t)p + len + pg - 1) & ~(pg - 1));
+	int          rv;
+
+	if (len == 0) {
+		return 0;
+	}
+#ifdef _WIN32
+	rv = VirtualLock (start, end - start) ? 0 : -1;
+#else
+	rv = mlock (start, end - start);
+#endif
+	if (rv == 0) {
+		return end - start;
+	}
+	for (; start < end; start += pg) {
+		volatile char* c = (char*)p > start ? (char*)p : start;
+		*c               = *c;
+	}
+	return 0;
+}
+
+void
+unlockMemory (void* p, size_t len)
+{
+	const size_t pg    = pageSize ();
+	char*        start = (char*)((size_t)p & ~(pg - 1));
+	char*        end   = (char*)(((size_t)p + len + pg - 1) & ~(pg - 1));
+
+	if (len == 0) {
+		return;
+	}
+#ifdef _WIN32
+	VirtualUnlock (start, end - start);
+#else
+	munlock (start, end - start);
+#endif
+}
+
+/*
+ * Locks the part of the arena used so far in memory, see lockMemory().
+ */
+size_t
+arenaLock (void* arena)
+{
+	struct b_arena* a = (struct b_arena*)arena;
+	size_t          len;
+
+	if (!a) {
+		return 0;
+	}
+	len = lockMemory (a->base, a->used);
+	if (!len) {
+		fprintf (stderr, "arena: cannot lock %zu bytes in memory\n", a->used);
+	}
+	return len;
+}
@@ -0,0 +1,56 @@
+/*
+OpenB3: an open source sound synthesis engine and JUCE application/plugin that simulates
+the magnificent sound of the Hammond B3 organ and Leslie rotating speaker
+Copyright (C) 2021-2022 Michele Perrone
+Github: https://github.com/michele-perrone/OpenPiano
+Author e-mail: perrone(dot)michele(at)outlook(dot)com
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+/*
+ * A per-instance arena: one mapping that the engine memory of an instance
+ * is carved from, so that the instance is created and destroyed with one
+ * system call each. Memory is handed out zeroed, and never reused.
+ * Freeing a block of the arena does nothing, the arena is released as a
+ * whole. When it is full, or for a NULL arena, the heap is used instead.
+ */
+
+#define ARENA_HUGEPAGES 0x01 /* ask for transparent huge pages */
+#define ARENA_MLOCK 0x02     /* for the owner: lock it once initialized, see arenaLock() */
+
+extern void*  arenaCreate (size_t size, int flags);
+extern void   arenaDestroy (void* a);
+extern void*  arenaAlloc (void* a, size_t size);
+extern void   arenaFree (void* a, void* p);
+extern char*  arenaStrdup (void* a, const char* s);
+extern size_t arenaUsed (const void* a);
+extern size_t arenaLock (void* a);
+
+extern size_t lockMemory (void* p, size_t len);
+extern void   unlockMemory (void* p, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
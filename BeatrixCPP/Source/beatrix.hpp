@@ -22,12 +22,111 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
  * The goal is to make the usage of Beatric much simpler.
  */
 
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
 #include "global_inst.h"
 #include "global_definitions.h"
 
+/**** Instrumentation ****/
+#define BEATRIX_LOAD_BUCKETS 24 /**< half-octave load histogram buckets */
+
+/**
+ * A copy of the instrumentation counters of an instance, taken by
+ * Beatrix::get_stats(). Times are in nanoseconds of the steady clock.
+ */
+struct BeatrixStats
+{
+    enum { TONEGEN = 0, PREAMP, REVERB, WHIRL, N_STAGES };
+
+    uint64_t blocks;          /**< calls to get_next_block() */
+    uint64_t block_ns;        /**< time spent in get_next_block() */
+    uint64_t block_max_ns;
+    uint64_t deadline_misses; /**< blocks that took longer than the audio they produced */
+
+    uint64_t fragments;                 /**< BUFFER_SIZE_SAMPLES fragments rendered */
+    uint64_t stage_ns[N_STAGES];        /**< time spent in each stage */
+    uint64_t fragment_max_ns;
+
+    /**
+     * Number of blocks by load, the time taken divided by the duration
+     * of the block. Bucket i counts loads up to load_bucket_limit(i),
+     * e.g. bucket 17 those in (0.71, 1.0]. The last bucket also counts
+     * everything above.
+     */
+    uint64_t load_histogram[BEATRIX_LOAD_BUCKETS];
+
+    int active_oscillators;      /**< activeOscLEnd of the last fragment */
+    int active_oscillators_max;
+    int core_program_length;     /**< core instructions of the last fragment */
+    int core_program_length_max;
+    int msg_queue_depth_max;     /**< pending key messages at the start of a fragment */
+
+    static double load_bucket_limit(int i)
+    {
+        return exp2 ((i - 17) * 0.5);
+    }
+    static int load_bucket(double load)
+    {
+        if (load <= load_bucket_limit (0))
+            return 0;
+        return (int)MIN (ceil (2.0 * log2 (load)) + 17, (double)(BEATRIX_LOAD_BUCKETS - 1));
+    }
+
+    /**
+     * @param p Percentile, 0.0 .. 1.0
+     * @return The upper bound of the load bucket the percentile falls in,
+     *         or 0 if no block was rendered yet
+     */
+    double load_percentile(double p) const
+    {
+        uint64_t n = 0;
+        for (int i = 0; i < BEATRIX_LOAD_BUCKETS; i++)
+            n += load_histogram[i];
+        if (n == 0)
+            return 0;
+
+        const uint64_t rank = (uint64_t)(p * (n - 1));
+        uint64_t seen = 0;
+        for (int i = 0; i < BEATRIX_LOAD_BUCKETS; i++)
+        {
+            seen += load_histogram[i];
+            if (seen > rank)
+                return load_bucket_limit (i);
+        }
+        return load_bucket_limit (BEATRIX_LOAD_BUCKETS - 1);
+    }
+};
+
+/**
+ * Objects the audio thread is done with, to be freed by another thread.
+ * push() neither blocks nor allocates, take_all() empties the list.
+ */
+template <typename T>
+struct BeatrixRetiredList
+{
+    std::atomic<T*> head{nullptr};
+
+    void push(T* p)
+    {
+        p->next = head.load (std::memory_order_relaxed);
+        while (!head.compare_exchange_weak (p->next, p, std::memory_order_release, std::memory_order_relaxed))
+            ;
+    }
+    T* take_all()
+    {
+        return head.exchange (nullptr, std::memory_order_acquire);
+    }
+};
+
 struct Beatrix
 {
     b_instance inst;
@@ -37,21 +136,117 @@ struct Beatrix
     float bufC[BUFFER_SIZE_SAMPLES];
     float bufD[2][BUFFER_SIZE_SAMPLES]; // drum, tmp.
     float bufL[2][BUFFER_SIZE_SAMPLES]; // leslie, out
+    float bufH[2][BUFFER_SIZE_SAMPLES]; // horn
     float bufJ[2][BUFFER_SIZE_SAMPLES];
     int boffset = BUFFER_SIZE_SAMPLES;
 
+    size_t object_locked = 0; // see warmup()
+
     char* defaultConfigFile    = NULL;
     char* defaultProgrammeFile = NULL;    
 
-    Beatrix(double sample_rate)
+    double sample_rate;
+
+    /*
+     * Counters written by the audio thread only and read by any other
+     * thread through get_stats(). Each counter is atomic on its own,
+     * a snapshot is not necessarily consistent across counters.
+     */
+    struct
+    {
+        std::atomic<uint64_t> blocks{0}, block_ns{0}, block_max_ns{0}, deadline_misses{0};
+        std::atomic<uint64_t> fragments{0}, stage_ns[BeatrixStats::N_STAGES]{}, fragment_max_ns{0};
+        std::atomic<uint64_t> load_histogram[BEATRIX_LOAD_BUCKETS]{};
+        std::atomic<int> active_oscillators{0}, active_oscillators_max{0};
+        std::atomic<int> core_program_length{0}, core_program_length_max{0};
+        std::atomic<int> msg_queue_depth_max{0};
+    } stats;
+    std::atomic<bool> stats_enabled{true};
+
+    /*
+     * Tone generator reconfiguration. reconfigure_tonegen() hands a new tone
+     * generator to the audio thread through pending_synth. The audio thread
+     * swaps it in between two fragments and keeps rendering the old one in
+     * fading_synth for the crossfade, after which it passes it back on
+     * retired_synths, to be freed outside the audio thread. The changed
+     * values go into the running config at the switch as well.
+     */
+    static const int TONEGEN_FADE_FRAGMENTS = 16;
+    struct ToneGeneratorSwap
     {
-        ::SampleRateD = sample_rate;
+        struct b_tonegen* synth; /**< the new one; after the switch, the one it replaced */
+        void* rc = nullptr;      /**< the changed values, see rc_stage_cfg() */
+        ToneGeneratorSwap* next = nullptr;
+    };
+    std::atomic<ToneGeneratorSwap*> pending_synth{nullptr};
+    unsigned int synth_handovers = 0;              /**< swaps handed over, worker thread only */
+    std::atomic<unsigned int> synth_takeovers{0}; /**< swaps the audio thread switched to */
+    BeatrixRetiredList<ToneGeneratorSwap> retired_synths;
+    ToneGeneratorSwap* fading_synth = nullptr;
+    int fade_fragment = 0;
+    float bufX[BUFFER_SIZE_SAMPLES];
+
+    /*
+     * Live reconfiguration. apply_config() and reload_config() change copies
+     * of the MIDI configuration, programmes, overdrive and reverb settings,
+     * and hand them to the audio thread through pending_config. The audio
+     * thread takes them over at the start of a block and passes the copies,
+     * which then hold what they replaced, back on retired_configs.
+     */
+    struct PendingConfig
+    {
+        void* midicfg = nullptr;             /**< see cloneMidiCfg() */
+        struct b_programme* progs = nullptr; /**< the MIDI program offset */
+        bool programmes = false;             /**< a programme file was read into progs */
+        struct b_reverb reverb = {};         /**< the settings, see copyReverbSettings() */
+        bool reverb_changed = false;
+        void* preamp = nullptr;              /**< the settings, see copyPreampSettings() */
+        PendingConfig* next = nullptr;
+    };
+    std::atomic<PendingConfig*> pending_config{nullptr};
+    BeatrixRetiredList<PendingConfig> retired_configs;
+    /**
+     * When set, get_next_block() leaves pending_config alone and the
+     * caller applies it with apply_pending_config() at the point of its
+     * own event stream the change belongs to. Set while not rendering.
+     */
+    bool defer_pending_config = false;
+
+    /**
+     * @param sample_rate The sample rate in Hz
+     * @param config_file Optional configuration file, read before the
+     *        engine is initialized
+     * @param programme_file Optional programme file
+     * @param prototype Optional instance, built with the same sample rate
+     *        and configuration, whose tonewheel wave tables are shared
+     *        read-only instead of being computed again. It must outlive
+     *        this instance.
+     * @param arena_flags ARENA_HUGEPAGES and/or ARENA_MLOCK, for the
+     *        arena the engine memory is placed in
+     */
+    Beatrix(double sample_rate, const char* config_file = NULL, const char* programme_file = NULL,
+            const Beatrix* prototype = NULL, int arena_flags = 0)
+    {
+        this->sample_rate = sample_rate;
 
         memset (&inst, 0, sizeof (b_instance));
 
-        alloc_all();
+        if (config_file)
+            defaultConfigFile = strdup (config_file);
+        if (programme_file)
+            defaultProgrammeFile = strdup (programme_file);
+
+        alloc_all (arena_flags);
+
+        load_files();
+
+        if (prototype && prototype->sample_rate == sample_rate)
+            setToneGeneratorWaveSource (inst.synth, prototype->inst.synth);
 
         init_all();
+
+        if (arena_flags & ARENA_MLOCK)
+            arenaLock (inst.arena);
     }
     ~Beatrix()
     {
@@ -62,22 +257,53 @@ struct Beatrix
         freeWhirl (inst.whirl);
 
         freeToneGenerator (inst.synth);
+        free_synth (fading_synth);
+        free_synth (pending_synth.exchange (nullptr));
+        free_retired_synths();
+        free_config (pending_config.exchange (nullptr));
+        free_retired_configs();
         freeMidiCfg (inst.midicfg);
         freePreamp (inst.preamp);
         freeProgs (inst.progs);
         freeRunningConfig (inst.state);
+        freeConfigKeys (inst.cfgkeys);
+        arenaDestroy (inst.arena);
+        if (object_locked)
+            unlockMemory (this, sizeof (*this));
 
         fprintf (stderr, "bye\n");
     }
-    void alloc_all()
+    /**
+     * Address space reserved for the engine memory of an instance. The
+     * default configuration uses about 2.3 MiB at 48 kHz and 4 MiB at
+     * 192 kHz, pages that are not used take no memory.
+     */
+    static const size_t ARENA_SIZE = 16 << 20;
+
+    void alloc_all(int arena_flags)
     {
-        inst.state = allocRunningConfig();
-        inst.progs = allocProgs();
-        inst.reverb = allocReverb();
-        inst.whirl = allocWhirl();
-        inst.synth = allocTonegen();
-        inst.midicfg = allocMidiCfg(inst.state);
-        inst.preamp = allocPreamp();
+        inst.arena = arenaCreate (ARENA_SIZE, arena_flags);
+        inst.state = allocRunningConfig (inst.arena);
+        inst.cfgkeys = allocConfigKeys (inst.arena);
+        inst.progs = allocProgs (inst.arena);
+        inst.reverb = allocReverb (inst.arena);
+        inst.whirl = allocWhirl (inst.arena);
+        inst.synth = allocTonegen (inst.arena, sample_rate);
+        inst.midicfg = allocMidiCfg (inst.arena, inst.state);
+        inst.preamp = allocPreamp (inst.arena, sample_rate);
+    }
+    void load_files()
+    {
+        if (defaultConfigFile)
+        {
+            fprintf (stderr, "Config file : %s\n", defaultConfigFile);
+            parseConfigurationFile (&inst, defaultConfigFile);
+        }
+        if (defaultProgrammeFile)
+        {
+            fprintf (stderr, "Programme file : %s\n", defaultProgrammeFile);
+            loadProgrammeFile (inst.progs, defaultProgrammeFile);
+        }
     }
     void init_all()
     {
@@ -95,11 +321,11 @@ struct Beatrix
 
         fprintf (stderr, "Reverb : ");
         fflush (stderr);
-        initReverb (inst.reverb, inst.midicfg, SampleRateD);
+        initReverb (inst.reverb, inst.midicfg, sample_rate);
 
         fprintf (stderr, "Whirl : ");
         fflush (stderr);
-        initWhirl (inst.whirl, inst.midicfg, SampleRateD);
+        initWhirl (inst.whirl, inst.midicfg, sample_rate);
 
         fprintf (stderr, "RC : ");
         fflush (stderr);
@@ -120,6 +346,41 @@ struct Beatrix
     }
     void get_next_block(float* buffer_L, float* buffer_R, int nframes)
     {
+        float* outputs[N_OUTPUTS] = { buffer_L, buffer_R };
+        get_next_block_stems (outputs, nframes);
+    }
+
+    /**** Separate outputs ****/
+    /**
+     * Channels of get_next_block_stems(). The mix is the horn and the
+     * drum through the microphone matrix (whirl.horn.width and
+     * whirl.drum.width), at the default width it is their sum.
+     */
+    enum Output
+    {
+        OUT_L, OUT_R,   // the stereo mix, as get_next_block() renders it
+        HORN_L, HORN_R, // the horn of the rotary speaker
+        DRUM_L, DRUM_R, // the drum of the rotary speaker
+        DRY,            // the mono signal into the rotary speaker, after overdrive and reverb
+        N_OUTPUTS
+    };
+
+    /**
+     * @brief Render the mix and the signals it is made of in one pass.
+     * The stages compute all of them anyway, the separate outputs cost a
+     * copy each.
+     * @param outputs N_OUTPUTS channels, see Output. Channels that are
+     *        NULL are not written.
+     * @param nframes Number of frames of each channel
+     */
+    void get_next_block_stems(float* const outputs[N_OUTPUTS], int nframes)
+    {
+        if (!defer_pending_config)
+            apply_pending_config();
+
+        const float* const sources[N_OUTPUTS] = { bufL[0], bufL[1], bufH[0], bufH[1], bufD[0], bufD[1], bufC };
+        const bool timed = stats_enabled.load (std::memory_order_relaxed);
+        const uint64_t t_block = timed ? now_ns() : 0;
         int written = 0;
 
         while (written < nframes)
@@ -129,20 +390,673 @@ struct Beatrix
             if (boffset >= BUFFER_SIZE_SAMPLES)
             {
                 boffset = 0;
-                oscGenerateFragment (inst.synth, bufA, BUFFER_SIZE_SAMPLES);
-                preamp (inst.preamp, bufA, bufB, BUFFER_SIZE_SAMPLES);
-                reverb (inst.reverb, bufB, bufC, BUFFER_SIZE_SAMPLES);
-                whirlProc3 (inst.whirl, bufC, bufL[0], bufL[1], bufD[0], bufD[1], BUFFER_SIZE_SAMPLES);
+                if (timed)
+                {
+                    render_fragment_timed();
+                }
+                else
+                {
+                    generate_tones();
+                    preamp (inst.preamp, bufA, bufB, BUFFER_SIZE_SAMPLES);
+                    reverb (inst.reverb, bufB, bufC, BUFFER_SIZE_SAMPLES);
+                    whirlProc4 (inst.whirl, bufC, bufL[0], bufL[1], bufH[0], bufH[1], bufD[0], bufD[1], BUFFER_SIZE_SAMPLES);
+                }
             }
 
             int nread = MIN (nremain, (BUFFER_SIZE_SAMPLES - boffset));            
 
-            memcpy (&buffer_L[written], &bufL[0][boffset], nread * sizeof (float));
-            memcpy (&buffer_R[written], &bufL[1][boffset], nread * sizeof (float));
+            for (int c = 0; c < N_OUTPUTS; c++)
+            {
+                if (outputs[c])
+                    memcpy (&outputs[c][written], &sources[c][boffset], nread * sizeof (float));
+            }
 
             written += nread;
             boffset += nread;
         }
+
+        if (timed && nframes > 0)
+        {
+            const uint64_t cost = now_ns() - t_block;
+            const double load = cost * 1e-9 * sample_rate / nframes;
+            const int bucket = BeatrixStats::load_bucket (load);
+            stat_add (stats.blocks, 1);
+            stat_add (stats.block_ns, cost);
+            stat_max (stats.block_max_ns, cost);
+            stat_add (stats.load_histogram[bucket], 1);
+            if (load > 1.0)
+                stat_add (stats.deadline_misses, 1);
+        }
+    }
+
+    /**** Realtime preparation ****/
+    static const int WARMUP_FRAGMENTS = 8;
+
+    /**
+     * @brief Fault in and lock the memory the audio thread uses, the
+     * engine arena and this object with its buffers, and render a few
+     * silent fragments through every stage so that the code and the
+     * tables it reads are cached. Without the privilege to lock memory
+     * (RLIMIT_MEMLOCK), the pages are still faulted in.
+     * Not realtime safe: meant to be called after construction, before
+     * the audio thread starts. Audio of keys held down is discarded.
+     * Tone generators built later by reconfigure_tonegen() are not locked.
+     * @return The number of bytes locked
+     */
+    size_t warmup()
+    {
+        size_t locked = arenaLock (inst.arena);
+        if (!object_locked)
+            object_locked = lockMemory (this, sizeof (*this));
+        locked += object_locked;
+
+        for (int i = 0; i < WARMUP_FRAGMENTS; i++)
+        {
+            generate_tones();
+            preamp (inst.preamp, bufA, bufB, BUFFER_SIZE_SAMPLES);
+            reverb (inst.reverb, bufB, bufC, BUFFER_SIZE_SAMPLES);
+            whirlProc4 (inst.whirl, bufC, bufL[0], bufL[1], bufH[0], bufH[1], bufD[0], bufD[1], BUFFER_SIZE_SAMPLES);
+        }
+        boffset = BUFFER_SIZE_SAMPLES;
+        return locked;
+    }
+
+    /**** Recycling ****/
+    /**
+     * @brief Return the engine to silence without rebuilding it, see
+     * BeatrixPool. The keys are released without a release envelope, and
+     * the tonewheels, vibrato scanner, overdrive, reverb and rotary speaker
+     * start again from rest. Smoothed gains jump to their targets. The
+     * settings, programmes and configuration are kept.
+     * Not realtime safe: call it while the instance renders no audio.
+     */
+    void reset()
+    {
+        free_synth (fading_synth);
+        fading_synth = nullptr;
+        free_retired_synths();
+        free_retired_configs();
+
+        resetToneGenerator (inst.synth);
+        resetPreamp (inst.preamp);
+        resetReverb (inst.reverb);
+        resetWhirl (inst.whirl);
+
+        memset (bufA, 0, sizeof (bufA));
+        memset (bufB, 0, sizeof (bufB));
+        memset (bufC, 0, sizeof (bufC));
+        memset (bufD, 0, sizeof (bufD));
+        memset (bufL, 0, sizeof (bufL));
+        memset (bufH, 0, sizeof (bufH));
+        memset (bufJ, 0, sizeof (bufJ));
+        memset (bufX, 0, sizeof (bufX));
+        boffset = BUFFER_SIZE_SAMPLES;
+    }
+
+    /**** Instrumentation ****/
+    /**
+     * @brief Copy the instrumentation counters. Lock-free, may be called
+     * from any thread while the audio thread is rendering.
+     */
+    BeatrixStats get_stats() const
+    {
+        const std::memory_order r = std::memory_order_relaxed;
+        BeatrixStats s;
+        s.blocks          = stats.blocks.load (r);
+        s.block_ns        = stats.block_ns.load (r);
+        s.block_max_ns    = stats.block_max_ns.load (r);
+        s.deadline_misses = stats.deadline_misses.load (r);
+        s.fragments       = stats.fragments.load (r);
+        for (int i = 0; i < BeatrixStats::N_STAGES; i++)
+            s.stage_ns[i] = stats.stage_ns[i].load (r);
+        s.fragment_max_ns = stats.fragment_max_ns.load (r);
+        for (int i = 0; i < BEATRIX_LOAD_BUCKETS; i++)
+            s.load_histogram[i] = stats.load_histogram[i].load (r);
+        s.active_oscillators      = stats.active_oscillators.load (r);
+        s.active_oscillators_max  = stats.active_oscillators_max.load (r);
+        s.core_program_length     = stats.core_program_length.load (r);
+        s.core_program_length_max = stats.core_program_length_max.load (r);
+        s.msg_queue_depth_max     = stats.msg_queue_depth_max.load (r);
+        return s;
+    }
+
+    /**
+     * @brief Turn the instrumentation on or off (it is on by default).
+     * When off, get_next_block() does not read the clock at all.
+     */
+    void set_stats_enabled(bool is_enabled)
+    {
+        stats_enabled.store (is_enabled, std::memory_order_relaxed);
+    }
+
+    static uint64_t now_ns()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds> (
+                   std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    /* There is only one writer, so plain load/store pairs are enough */
+    static void stat_add(std::atomic<uint64_t>& a, uint64_t v)
+    {
+        a.store (a.load (std::memory_order_relaxed) + v, std::memory_order_relaxed);
+    }
+    template <typename T>
+    static void stat_max(std::atomic<T>& a, T v)
+    {
+        if (v > a.load (std::memory_order_relaxed))
+            a.store (v, std::memory_order_relaxed);
+    }
+
+    void render_fragment_timed()
+    {
+        const int queued = (int)((inst.synth->msgQueueWriter - inst.synth->msgQueueReader + MSGQSZ) % MSGQSZ);
+
+        const uint64_t t0 = now_ns();
+        generate_tones();
+        const uint64_t t1 = now_ns();
+        struct b_tonegen* t = inst.synth;
+        preamp (inst.preamp, bufA, bufB, BUFFER_SIZE_SAMPLES);
+        const uint64_t t2 = now_ns();
+        reverb (inst.reverb, bufB, bufC, BUFFER_SIZE_SAMPLES);
+        const uint64_t t3 = now_ns();
+        whirlProc4 (inst.whirl, bufC, bufL[0], bufL[1], bufH[0], bufH[1], bufD[0], bufD[1], BUFFER_SIZE_SAMPLES);
+        const uint64_t t4 = now_ns();
+
+        stat_add (stats.fragments, 1);
+        stat_add (stats.stage_ns[BeatrixStats::TONEGEN], t1 - t0);
+        stat_add (stats.stage_ns[BeatrixStats::PREAMP], t2 - t1);
+        stat_add (stats.stage_ns[BeatrixStats::REVERB], t3 - t2);
+        stat_add (stats.stage_ns[BeatrixStats::WHIRL], t4 - t3);
+        stat_max (stats.fragment_max_ns, t4 - t0);
+
+        const int active = t->activeOscLEnd;
+        const int core = (int)(t->coreWriter - t->corePgm);
+        stats.active_oscillators.store (active, std::memory_order_relaxed);
+        stats.core_program_length.store (core, std::memory_order_relaxed);
+        stat_max (stats.active_oscillators_max, active);
+        stat_max (stats.core_program_length_max, core);
+        stat_max (stats.msg_queue_depth_max, queued);
+    }
+
+    /**
+     * Renders the tone generator into bufA. Swaps in a pending tone
+     * generator first, and crossfades from the one it replaced.
+     */
+    void generate_tones()
+    {
+        if (fading_synth == nullptr)
+        {
+            if (ToneGeneratorSwap* swap = pending_synth.exchange (nullptr))
+            {
+                struct b_tonegen* fresh = swap->synth;
+                transferToneGeneratorState (fresh, inst.synth);
+                rebindMIDIControlFunctions (inst.midicfg, inst.synth, fresh);
+                swap->synth = inst.synth;
+                swap->rc = rc_commit_staged (inst.state, swap->rc);
+                inst.synth = fresh;
+                synth_takeovers.fetch_add (1, std::memory_order_release);
+                fading_synth = swap;
+                fade_fragment = 0;
+            }
+        }
+
+        oscGenerateFragment (inst.synth, bufA, BUFFER_SIZE_SAMPLES);
+
+        if (fading_synth)
+        {
+            const float step = 1.0f / (TONEGEN_FADE_FRAGMENTS * BUFFER_SIZE_SAMPLES);
+            float g = fade_fragment * BUFFER_SIZE_SAMPLES * step;
+            oscGenerateFragment (fading_synth->synth, bufX, BUFFER_SIZE_SAMPLES);
+            for (int i = 0; i < BUFFER_SIZE_SAMPLES; i++)
+            {
+                g += step;
+                bufA[i] = bufX[i] + g * (bufA[i] - bufX[i]);
+            }
+            if (++fade_fragment == TONEGEN_FADE_FRAGMENTS)
+            {
+                retired_synths.push (fading_synth);
+                fading_synth = nullptr;
+            }
+        }
+    }
+
+    /**** Tone generator reconfiguration ****/
+    /**
+     * @brief Build a tone generator with changed osc.* or scanner.*
+     * configuration values, e.g. "osc.tuning" or "scanner.modulation.v3",
+     * and let the audio thread switch to it with a short crossfade. The keys
+     * held down, drawbars, percussion, vibrato selection and swell pedal
+     * carry over; the scanner frequency returns to "scanner.hz".
+     * Not realtime safe: call from one worker thread at a time. It blocks
+     * while the wave tables are computed, the audio thread switches over at
+     * its next fragment and does not block or allocate. The tone generator
+     * it replaced is freed by the next call, or by the destructor.
+     * A tone generator handed over before, that the audio thread has not
+     * taken yet, is dropped; this one is built with its values as well.
+     * The new values are stored in the running config at the switch.
+     * Setters called from other threads during the switch may apply to the
+     * outgoing tone generator only.
+     * @param keys Names of the configuration values
+     * @param values The new values, as they would appear in a config file
+     * @param n Number of key/value pairs
+     * @return false, and nothing changes, if a value is not a valid osc.*
+     *         or scanner.* setting; true once the tone generator is handed over
+     */
+    bool reconfigure_tonegen(const char* const keys[], const char* const values[], int n)
+    {
+        free_retired_synths();
+
+        /* Take back a tone generator the audio thread has not switched to,
+         * and let a switch in progress finish storing its values */
+        ToneGeneratorSwap* prev = pending_synth.exchange (nullptr);
+        if (prev)
+            --synth_handovers;
+        while (synth_takeovers.load (std::memory_order_acquire) != synth_handovers)
+            std::this_thread::yield();
+
+        /* The arena does not reuse memory, rebuilt tone generators are on the heap */
+        struct b_tonegen* t = allocTonegen (NULL, sample_rate);
+        rc_loop_state (inst.state, &Beatrix::reconfigure_cb, t);
+        if (prev)
+            rc_loop_staged (prev->rc, &Beatrix::reconfigure_cb, t);
+
+        for (int i = 0; i < n; i++)
+        {
+            ConfigContext cfg;
+            cfg.fname = "---reconfiguration---";
+            cfg.linenr = 0;
+            cfg.name = keys[i];
+            cfg.value = values[i];
+            if (tonegen_config (t, &cfg) < 1)
+            {
+                freeToneGenerator (t);
+                if (prev)
+                    hand_over_synth (prev);
+                return false;
+            }
+        }
+
+        /* Control functions are registered with a scratch MIDI config, they
+         * are moved over from the current tone generator on the switch */
+        void* state = allocRunningConfig (NULL);
+        void* midicfg = allocMidiCfg (NULL, state);
+        initToneGenerator (t, midicfg);
+        initVibrato (t, midicfg);
+        freeMidiCfg (midicfg);
+        freeRunningConfig (state);
+
+        /* Keep the new values when the engine is rebuilt, see restore_state_from().
+         * They are allocated here and stored by the audio thread at the switch */
+        void* rc = nullptr;
+        if (prev)
+        {
+            rc = prev->rc;
+            prev->rc = nullptr;
+            free_synth (prev);
+        }
+        for (int i = 0; i < n; i++)
+        {
+            ConfigContext cfg;
+            cfg.fname = "---reconfiguration---";
+            cfg.linenr = 0;
+            cfg.name = keys[i];
+            cfg.value = values[i];
+            rc = rc_stage_cfg (rc, &cfg);
+        }
+
+        hand_over_synth (new ToneGeneratorSwap{t, rc});
+        return true;
+    }
+
+    void hand_over_synth(ToneGeneratorSwap* swap)
+    {
+        ++synth_handovers;
+        free_synth (pending_synth.exchange (swap));
+    }
+
+    static void free_synth(ToneGeneratorSwap* swap)
+    {
+        if (swap)
+        {
+            freeToneGenerator (swap->synth);
+            rc_free_staged (swap->rc);
+            delete swap;
+        }
+    }
+
+    void free_retired_synths()
+    {
+        ToneGeneratorSwap* swap = retired_synths.take_all();
+        while (swap)
+        {
+            ToneGeneratorSwap* next = swap->next;
+            free_synth (swap);
+            swap = next;
+        }
+    }
+
+    static void reconfigure_cb(int fnid, const char* key, const char* kv, unsigned char, void* arg)
+    {
+        if (fnid >= 0)
+            return;
+        ConfigContext cfg;
+        cfg.fname = "---reconfiguration---";
+        cfg.linenr = 0;
+        cfg.name = key;
+        cfg.value = kv;
+        tonegen_config ((struct b_tonegen*)arg, &cfg);
+    }
+
+    /* The settings a rebuilt tone generator takes, see getConfigScope() */
+    static int tonegen_config(struct b_tonegen* t, ConfigContext* cfg)
+    {
+        if (strncasecmp (cfg->name, "scanner.", 8) == 0)
+            return scannerConfig (t, cfg);
+        return oscConfig (t, cfg);
+    }
+
+    /**** Config reload ****/
+    /** Counts of the parameters handled by reload_config() */
+    struct ConfigReload
+    {
+        int unchanged = 0;
+        int live = 0;     /**< applied at the next block */
+        int rebuild = 0;  /**< applied by rebuilding the tone generator */
+        int restart = 0;  /**< not applied, they need a new engine */
+    };
+
+    /**
+     * @brief Apply the parameters of a configuration file that differ from
+     * the running configuration, without rebuilding the engine.
+     * MIDI, programme, overdrive and reverb settings are changed on copies
+     * that the audio thread takes over at the start of its next block, see
+     * apply_pending_config(). osc.* and scanner.* settings are handed to
+     * reconfigure_tonegen() together. Other settings are reported on stderr
+     * and not applied, they take effect when the engine is created again.
+     * Parameters that are removed from the file keep their current value.
+     * A "program.read" directive reloads that programme file.
+     * Controller assignments learned, or a bank selected, by the audio
+     * thread until it takes the copies over are replaced by them.
+     * Not realtime safe: call from the thread that calls
+     * reconfigure_tonegen().
+     * @param path The configuration file
+     * @param result Optional, receives the counts of the parameters
+     * @return false if the file could not be read or the tone generator
+     *         could not be rebuilt with the new values
+     */
+    bool reload_config(const char* path, ConfigReload* result = NULL)
+    {
+        ReloadContext rc;
+        rc.self = this;
+        rc.pending = take_pending_config();
+
+        LOCALEGUARD_START;
+        int rv = readConfigurationFile (path, &Beatrix::reload_config_cb, &rc);
+        LOCALEGUARD_END;
+        if (rv < 0)
+        {
+            hand_over_config (rc.pending);
+            return false;
+        }
+
+        return apply_reload (rc, path, result);
+    }
+
+    /**
+     * @brief Apply configuration parameters to the running engine the way
+     * reload_config() applies those of a file, e.g. "midi.transpose".
+     * @param keys Names of the configuration values
+     * @param values The new values, as they would appear in a config file
+     * @param n Number of key/value pairs
+     * @param result Optional, receives the counts of the parameters
+     * @return false if the tone generator could not be rebuilt with the
+     *         new values, or a programme file could not be read
+     */
+    bool apply_config(const char* const keys[], const char* const values[], int n, ConfigReload* result = NULL)
+    {
+        ReloadContext rc;
+        rc.self = this;
+        rc.pending = take_pending_config();
+
+        LOCALEGUARD_START;
+        for (int i = 0; i < n; i++)
+            reload_config_cb ("---reconfiguration---", 0, keys[i], values[i], &rc);
+        LOCALEGUARD_END;
+
+        return apply_reload (rc, "---reconfiguration---", result);
+    }
+
+    /**
+     * @brief Take over the configuration changes handed to the audio
+     * thread, see reload_config(). get_next_block() calls it at the start
+     * of every block, unless defer_pending_config is set. Realtime safe: it neither blocks nor allocates.
+     * Call it from the audio thread, or while the instance renders no audio.
+     */
+    void apply_pending_config()
+    {
+        if (!pending_config.load (std::memory_order_relaxed))
+            return;
+        PendingConfig* pc = pending_config.exchange (nullptr, std::memory_order_acquire);
+        if (!pc)
+            return;
+
+        if (pc->midicfg)
+            exchangeMidiCfg (inst.midicfg, pc->midicfg);
+        if (pc->progs)
+            exchangeProgrammes (inst.progs, pc->progs, pc->programmes);
+        if (pc->reverb_changed)
+            copyReverbSettings (inst.reverb, &pc->reverb);
+        if (pc->preamp)
+            copyPreampSettings (inst.preamp, pc->preamp);
+
+        retired_configs.push (pc);
+    }
+
+    struct ReloadContext
+    {
+        Beatrix* self;
+        PendingConfig* pending;
+        ConfigReload counts;
+        std::vector<std::string> keys, values;
+        std::vector<std::string> programmes;
+    };
+
+    /* Applies what reload_config_cb() has collected */
+    bool apply_reload(ReloadContext& rc, const char* path, ConfigReload* result)
+    {
+        bool ok = true;
+        if (!rc.keys.empty())
+        {
+            std::vector<const char*> k, v;
+            for (size_t i = 0; i < rc.keys.size(); i++)
+            {
+                k.push_back (rc.keys[i].c_str());
+                v.push_back (rc.values[i].c_str());
+            }
+            ok = reconfigure_tonegen (k.data(), v.data(), (int)k.size());
+            if (!ok)
+                fprintf (stderr, "%s: tone generator settings rejected, not applied.\n", path);
+        }
+
+        for (const std::string& pgm : rc.programmes)
+            ok = stage_programmes (rc.pending, pgm.c_str()) && ok;
+
+        if (rc.pending->midicfg)
+        {
+            initMidiTables (rc.pending->midicfg);
+            midiRebindControllers (rc.pending->midicfg);
+        }
+        hand_over_config (rc.pending);
+
+        if (result)
+            *result = rc.counts;
+        return ok;
+    }
+
+    /**
+     * @brief Replace the programmes with the ones of a programme file. The
+     * file is parsed aside, the programmes only change if that succeeds,
+     * at the next block of the audio thread.
+     * The MIDI program offset and the selected bank are kept. Programmes
+     * of other banks are replaced as well, see getLibraryProgramme().
+     * Not realtime safe: call from the thread that calls reload_config().
+     * @return false if the file could not be read or parsed
+     */
+    bool reload_programmes(const char* path)
+    {
+        PendingConfig* pc = take_pending_config();
+        bool ok = stage_programmes (pc, path);
+        hand_over_config (pc);
+        return ok;
+    }
+
+    /* The changes handed over before, if the audio thread has not taken them yet */
+    PendingConfig* take_pending_config()
+    {
+        free_retired_configs();
+        PendingConfig* pc = pending_config.exchange (nullptr, std::memory_order_acquire);
+        return pc ? pc : new PendingConfig;
+    }
+
+    void hand_over_config(PendingConfig* pc)
+    {
+        if (!pc->midicfg && !pc->progs && !pc->reverb_changed && !pc->preamp)
+            free_config (pc);
+        else
+            pending_config.store (pc, std::memory_order_release);
+    }
+
+    static void free_config(PendingConfig* pc)
+    {
+        if (!pc)
+            return;
+        if (pc->midicfg)
+            freeMidiCfg (pc->midicfg);
+        if (pc->progs)
+            freeProgs (pc->progs);
+        if (pc->preamp)
+            freePreamp (pc->preamp);
+        delete pc;
+    }
+
+    void free_retired_configs()
+    {
+        PendingConfig* pc = retired_configs.take_all();
+        while (pc)
+        {
+            PendingConfig* next = pc->next;
+            free_config (pc);
+            pc = next;
+        }
+    }
+
+    /* The copy of the programmes in pc, made on first use */
+    struct b_programme* staged_progs(PendingConfig* pc)
+    {
+        if (!pc->progs && (pc->progs = allocProgs (NULL)))
+            pc->progs->MIDIControllerPgmOffset = inst.progs->MIDIControllerPgmOffset;
+        return pc->progs;
+    }
+
+    bool stage_programmes(PendingConfig* pc, const char* path)
+    {
+        struct b_programme* staged = staged_progs (pc);
+        struct b_programme* p = allocProgs (NULL);
+        if (!staged || !p)
+        {
+            if (p)
+                freeProgs (p);
+            return false;
+        }
+
+        /* 0: accepted, 1: warnings, 2: parsing stopped */
+        if (loadProgrammeFile (p, (char*)path) > 1)
+        {
+            freeProgs (p);
+            return false;
+        }
+        memcpy (staged->programmes, p->programmes, sizeof (p->programmes));
+        replaceProgrammeLibrary (staged, p);
+        freeProgs (p);
+        pc->programmes = true;
+        return true;
+    }
+
+    /*
+     * Evaluates a live parameter on the copy in pc of the module that takes
+     * it, made on first use. The running configuration records the value.
+     */
+    bool stage_config(PendingConfig* pc, const char* name, const char* value)
+    {
+        b_instance stage = inst;
+        if (strncasecmp (name, "midi.", 5) == 0)
+        {
+            if (!pc->midicfg && !(pc->midicfg = cloneMidiCfg (inst.midicfg)))
+                return false;
+            stage.midicfg = pc->midicfg;
+        }
+        else if (strncasecmp (name, "pgm.", 4) == 0)
+        {
+            if (!(stage.progs = staged_progs (pc)))
+                return false;
+        }
+        else if (strncasecmp (name, "reverb.", 7) == 0)
+        {
+            if (!pc->reverb_changed)
+                copyReverbSettings (&pc->reverb, inst.reverb);
+            pc->reverb_changed = true;
+            stage.reverb = &pc->reverb;
+        }
+        else if (strncasecmp (name, "overdrive.", 10) == 0 || strncasecmp (name, "xov.", 4) == 0)
+        {
+            if (!pc->preamp)
+            {
+                pc->preamp = allocPreamp (NULL, sample_rate);
+                copyPreampSettings (pc->preamp, inst.preamp);
+            }
+            stage.preamp = pc->preamp;
+        }
+        else
+        {
+            return false;
+        }
+        return evaluateConfigKeyValue (&stage, name, value) > 0;
+    }
+
+    static void reload_config_cb(const char* fname, int linenr, const char* name, const char* value, void* arg)
+    {
+        ReloadContext* rc = (ReloadContext*)arg;
+        Beatrix* self = rc->self;
+
+        if (strcasecmp (name, "program.read") == 0)
+        {
+            rc->programmes.push_back (value);
+            return;
+        }
+
+        const char* current = rc_get_cfg (self->inst.state, name);
+        if (current && !strcmp (current, value))
+        {
+            rc->counts.unchanged++;
+            return;
+        }
+
+        switch (getConfigScope (&self->inst, name))
+        {
+            case CFG_SCOPE_LIVE:
+                if (self->stage_config (rc->pending, name, value))
+                    rc->counts.live++;
+                break;
+            case CFG_SCOPE_REBUILD:
+                rc->keys.push_back (name);
+                rc->values.push_back (value);
+                rc->counts.rebuild++;
+                break;
+            default:
+                fprintf (stderr, "%s:%d:%s=%s: takes effect after a restart.\n", fname, linenr, name, value);
+                rc->counts.restart++;
+                break;
+        }
     }
 
     void process_midi_message(const uint8_t *midi_buffer, size_t n_messages)
@@ -150,6 +1064,254 @@ struct Beatrix
         parse_raw_midi_data(&this->inst, midi_buffer, n_messages);
     }
 
+    /**** Programmes ****/
+    /**
+     * @brief Install a programme, like a MIDI bank select followed by a
+     * program change. Call it from the thread that processes MIDI.
+     * @param bank 0 for the programmes without a bank number, up to PGM_MAXBANK
+     * @param program MIDI program number, 0-127
+     */
+    void program_change(int bank, uint8_t program)
+    {
+        selectProgrammeBank (this->inst.progs, bank);
+        installProgram (&this->inst, program);
+    }
+    int get_bank() const
+    {
+        return this->inst.progs->bankSelect;
+    }
+
+    /**** Sample rate changes ****/
+    double get_sample_rate() const
+    {
+        return this->sample_rate;
+    }
+
+    /**
+     * @brief Copy the programmes and the running configuration of another
+     * instance into this one. Not realtime safe: meant to be called on a
+     * freshly constructed instance (e.g. one built for a new sample rate)
+     * before it replaces @p other.
+     * Config-file values that are only evaluated at initialization time
+     * are not re-applied.
+     */
+    void restore_state_from(Beatrix& other)
+    {
+        /* The programme library of other banks stays with the instance that loaded it */
+        memcpy (this->inst.progs, other.inst.progs, offsetof (struct b_programme, library));
+        selectProgrammeBank (this->inst.progs, other.inst.progs->bankSelect);
+        rc_loop_state (other.inst.state, &Beatrix::restore_state_cb, this);
+    }
+
+    /**
+     * @brief Take over the keys held down and the rotor position of another
+     * instance. This is realtime safe and meant to be called on the audio
+     * thread right before this instance replaces @p other.
+     */
+    void transfer_realtime_state_from(Beatrix& other)
+    {
+        struct b_tonegen* t = this->inst.synth;
+        struct b_tonegen* o = other.inst.synth;
+        for (int k = 0; k < MAX_KEYS; k++)
+        {
+            if (o->activeKeys[k] && !t->activeKeys[k])
+                oscKeyOn (t, k, 255);
+        }
+        memcpy (t->_activeKeys, o->_activeKeys, sizeof (t->_activeKeys));
+
+        /* Angular speeds are per sample, angles are rate independent */
+        const double ratio = other.sample_rate / this->sample_rate;
+        struct b_whirl* w = this->inst.whirl;
+        struct b_whirl* ow = other.inst.whirl;
+        w->hornAngleGRD = ow->hornAngleGRD;
+        w->drumAngleGRD = ow->drumAngleGRD;
+        w->hornIncr     = ow->hornIncr * ratio;
+        w->drumIncr     = ow->drumIncr * ratio;
+        w->hornAcDc     = ow->hornAcDc;
+        w->drumAcDc     = ow->drumAcDc;
+    }
+
+    static void restore_state_cb(int fnid, const char* key, const char* kv, unsigned char val, void* arg)
+    {
+        Beatrix* self = (Beatrix*)arg;
+        if (fnid < 0)
+            evaluateConfigKeyValue (&self->inst, key, kv);
+        else
+            callMIDIControlFunction (self->inst.midicfg, key, val);
+    }
+
+    /**** Snapshots ****/
+    /**
+     * A snapshot is a binary image of the programmes, the running
+     * configuration, the MIDI controller mapping and the rotor positions.
+     * It starts with a SnapshotHeader followed by the sections in the
+     * order of SnapshotHeader::length. Multi-byte values are stored little
+     * endian, so a snapshot can be restored on a machine of either byte
+     * order.
+     */
+    static const uint32_t SNAPSHOT_MAGIC = 0x5333424f; // "OB3S" in little endian
+    static const uint32_t SNAPSHOT_VERSION = 2;
+
+    enum { SNAPSHOT_PROGRAMMES, SNAPSHOT_CONFIG, SNAPSHOT_MIDI, SNAPSHOT_ROTORS, SNAPSHOT_SECTIONS };
+
+    struct SnapshotHeader
+    {
+        uint32_t magic;
+        uint32_t version;
+        double sample_rate;
+        uint32_t length[SNAPSHOT_SECTIONS];
+    };
+    static const size_t SNAPSHOT_HEADER_SIZE = 2 * 4 + 8 + SNAPSHOT_SECTIONS * 4;
+
+    struct RotorSnapshot
+    {
+        double horn_angle;
+        double drum_angle;
+        double horn_incr; // per sample at SnapshotHeader::sample_rate
+        double drum_incr;
+        int32_t horn_acdc;
+        int32_t drum_acdc;
+    };
+    static const size_t SNAPSHOT_ROTORS_SIZE = 4 * 8 + 2 * 4;
+
+    /**
+     * True once read_snapshot() restored this instance. Its rotor position
+     * is then the saved one, which transfer_realtime_state_from() would
+     * overwrite.
+     */
+    bool snapshot_restored = false;
+
+    /**
+     * @brief Write a snapshot of this instance to @p buffer. Not realtime
+     * safe. It may be called while audio is rendered; the rotor position is
+     * then the one of a recent block.
+     * @return The size of the snapshot. Nothing is written if it is larger
+     * than @p size, so call with size 0 first to learn how much is needed.
+     */
+    size_t write_snapshot(void* buffer, size_t size)
+    {
+        SnapshotHeader h;
+        h.magic = SNAPSHOT_MAGIC;
+        h.version = SNAPSHOT_VERSION;
+        h.sample_rate = sample_rate;
+        h.length[SNAPSHOT_PROGRAMMES] = pgmSnapshotWrite (inst.progs, nullptr, 0);
+        h.length[SNAPSHOT_CONFIG] = rc_snapshot_write (inst.state, nullptr, 0);
+        h.length[SNAPSHOT_MIDI] = midiSnapshotWrite (inst.midicfg, nullptr, 0);
+        h.length[SNAPSHOT_ROTORS] = SNAPSHOT_ROTORS_SIZE;
+
+        size_t total = SNAPSHOT_HEADER_SIZE;
+        for (int i = 0; i < SNAPSHOT_SECTIONS; i++)
+            total += h.length[i];
+        if (size < total)
+            return total;
+
+        struct b_whirl* w = inst.whirl;
+        RotorSnapshot r;
+        r.horn_angle = w->hornAngleGRD;
+        r.drum_angle = w->drumAngleGRD;
+        r.horn_incr = w->hornIncr;
+        r.drum_incr = w->drumIncr;
+        r.horn_acdc = w->hornAcDc;
+        r.drum_acdc = w->drumAcDc;
+
+        unsigned char* p = (unsigned char*)buffer;
+        snapshotPut32 (&p, h.magic);
+        snapshotPut32 (&p, h.version);
+        snapshotPutDouble (&p, h.sample_rate);
+        for (int i = 0; i < SNAPSHOT_SECTIONS; i++)
+            snapshotPut32 (&p, h.length[i]);
+        pgmSnapshotWrite (inst.progs, p, h.length[SNAPSHOT_PROGRAMMES]);
+        p += h.length[SNAPSHOT_PROGRAMMES];
+        /* the running config may have grown since it was measured */
+        if (rc_snapshot_write (inst.state, p, h.length[SNAPSHOT_CONFIG]) != h.length[SNAPSHOT_CONFIG])
+            return write_snapshot (buffer, size);
+        p += h.length[SNAPSHOT_CONFIG];
+        midiSnapshotWrite (inst.midicfg, p, h.length[SNAPSHOT_MIDI]);
+        p += h.length[SNAPSHOT_MIDI];
+        snapshotPutDouble (&p, r.horn_angle);
+        snapshotPutDouble (&p, r.drum_angle);
+        snapshotPutDouble (&p, r.horn_incr);
+        snapshotPutDouble (&p, r.drum_incr);
+        snapshotPut32 (&p, (uint32_t)r.horn_acdc);
+        snapshotPut32 (&p, (uint32_t)r.drum_acdc);
+        return total;
+    }
+
+    /**
+     * @brief Restore a snapshot written by write_snapshot(), possibly by an
+     * instance running at another sample rate. Not realtime safe: meant to
+     * be called on an instance that is not rendering audio yet.
+     * MIDI control function values are applied directly. Of the config
+     * values, only those that differ from this instance's running config
+     * are evaluated, and those that are only used at initialization time
+     * are recorded but not re-applied. The saved bank is selected in the
+     * programme library this instance has loaded.
+     * @return false if the data is not a snapshot of this version. The
+     * instance is unchanged unless the data was truncated or corrupted
+     * after its header.
+     */
+    bool read_snapshot(const void* buffer, size_t size)
+    {
+        SnapshotHeader h;
+        if (size < SNAPSHOT_HEADER_SIZE)
+            return false;
+        const unsigned char* p = (const unsigned char*)buffer;
+        h.magic = snapshotGet32 (&p);
+        h.version = snapshotGet32 (&p);
+        h.sample_rate = snapshotGetDouble (&p);
+        for (int i = 0; i < SNAPSHOT_SECTIONS; i++)
+            h.length[i] = snapshotGet32 (&p);
+        if (h.magic != SNAPSHOT_MAGIC || h.version != SNAPSHOT_VERSION || !(h.sample_rate > 0)
+            || h.length[SNAPSHOT_PROGRAMMES] != pgmSnapshotWrite (inst.progs, nullptr, 0)
+            || h.length[SNAPSHOT_MIDI] != midiSnapshotWrite (inst.midicfg, nullptr, 0)
+            || h.length[SNAPSHOT_ROTORS] != SNAPSHOT_ROTORS_SIZE)
+            return false;
+
+        size_t total = SNAPSHOT_HEADER_SIZE;
+        for (int i = 0; i < SNAPSHOT_SECTIONS; i++)
+            total += h.length[i];
+        if (size < total)
+            return false;
+
+        const unsigned char* progs = p;
+        p += h.length[SNAPSHOT_PROGRAMMES];
+        if (rc_snapshot_read (inst.state, p, h.length[SNAPSHOT_CONFIG], &Beatrix::read_snapshot_cb, this) != 0)
+            return false;
+        p += h.length[SNAPSHOT_CONFIG];
+        if (midiSnapshotRead (inst.midicfg, p, h.length[SNAPSHOT_MIDI]) != 0)
+            return false;
+        p += h.length[SNAPSHOT_MIDI];
+        if (pgmSnapshotRead (inst.progs, progs, h.length[SNAPSHOT_PROGRAMMES]) != 0)
+            return false;
+
+        RotorSnapshot r;
+        r.horn_angle = snapshotGetDouble (&p);
+        r.drum_angle = snapshotGetDouble (&p);
+        r.horn_incr = snapshotGetDouble (&p);
+        r.drum_incr = snapshotGetDouble (&p);
+        r.horn_acdc = (int32_t)snapshotGet32 (&p);
+        r.drum_acdc = (int32_t)snapshotGet32 (&p);
+        const double ratio = h.sample_rate / this->sample_rate;
+        struct b_whirl* w = inst.whirl;
+        w->hornAngleGRD = r.horn_angle;
+        w->drumAngleGRD = r.drum_angle;
+        w->hornIncr     = r.horn_incr * ratio;
+        w->drumIncr     = r.drum_incr * ratio;
+        w->hornAcDc     = r.horn_acdc;
+        w->drumAcDc     = r.drum_acdc;
+        snapshot_restored = true;
+        return true;
+    }
+
+    static void read_snapshot_cb(int fnid, const char* key, const char* kv, unsigned char val, void* arg)
+    {
+        Beatrix* self = (Beatrix*)arg;
+        if (fnid < 0)
+            evaluateConfigKeyValue (&self->inst, key, kv);
+        else
+            callMIDIControlFunctionById (self->inst.midicfg, fnid, val);
+    }
+
     /**** Keys ****/
     /** Keys are numbered as such:
      *   0-- 63, upper manual (  0-- 60 in use)
@@ -176,14 +1338,28 @@ struct Beatrix
         setDrawBars (&this->inst, manual, setting);
     }
 
+    /**** Tuning ****/
+    /**
+     * @brief Set the pitch of A above middle C
+     * @param hz 220.0 ... 880.0 (440.0 by default). Only the phase
+     *        accumulator oscillators (osc.x-phase-accumulator=1) can be
+     *        retuned while playing; otherwise use osc.tuning in the config.
+     */
+    void set_tuning(double hz)
+    {
+        setTuning(this->inst.synth, hz);
+    }
+
     /**** Vibrato ****/
     void set_vibrato_upper(bool is_enabled)
     {
         setVibratoUpper(this->inst.synth, is_enabled);
+        notifyControlChangeByName (this->inst.midicfg, "vibrato.routing", getVibratoRouting (this->inst.synth) << 5);
     }
     void set_vibrato_lower(bool is_enabled)
     {
         setVibratoLower(this->inst.synth, is_enabled);
+        notifyControlChangeByName (this->inst.midicfg, "vibrato.routing", getVibratoRouting (this->inst.synth) << 5);
     }
 
     /**** Vibrato&Chorus ****/
@@ -193,41 +1369,62 @@ struct Beatrix
      */
     void set_vibrato(int vibrato_type)
     {
-        setVibrato(&this->inst.synth->inst_vibrato, vibrato_type);
+        setVibrato(this->inst.synth, vibrato_type);
+        if (vibrato_type & 3)
+        {
+            int knob = ((vibrato_type & 3) << 1) - ((vibrato_type & CHO_) ? 1 : 2);
+            notifyControlChangeByName (this->inst.midicfg, "vibrato.knob", knob * 23);
+        }
+    }
+
+    /**
+     * @brief Set the scanner frequency, the output glides to it
+     * @param hz 4.0 ... 22.0 (7.25 by default)
+     */
+    void set_vibrato_frequency(double hz)
+    {
+        setVibratoFrequency(this->inst.synth, hz);
     }
 
     /**** Percussion ****/
     void set_percussion_enabled(bool is_enabled)
     {
         setPercussionEnabled(this->inst.synth, is_enabled);
+        notifyControlChangeByName (this->inst.midicfg, "percussion.enable", is_enabled ? 127 : 0);
     }
     void set_percussion_fast(bool is_fast)
     {
         setPercussionFast(this->inst.synth, is_fast);
+        notifyControlChangeByName (this->inst.midicfg, "percussion.decay", is_fast ? 127 : 0);
     }
     void set_percussion_first(bool is_first)
     {
         setPercussionFirst(this->inst.synth, is_first);
+        notifyControlChangeByName (this->inst.midicfg, "percussion.harmonic", is_first ? 127 : 0);
     }
     void set_percussion_volume(bool is_soft)
     {
         setPercussionVolume(this->inst.synth, is_soft);
+        notifyControlChangeByName (this->inst.midicfg, "percussion.volume", is_soft ? 127 : 0);
     }
 
     /**** Overdrive ****/
     void set_preamp_clean(bool is_clean)
     {
         setClean(this->inst.preamp, is_clean);
+        notifyControlChangeByName (this->inst.midicfg, "overdrive.enable", is_clean ? 0 : 127);
     }
     void set_input_gain(float gain)
     {
         fsetInputGain(this->inst.preamp, gain);
+        notifyControlChangeByName (this->inst.midicfg, "overdrive.inputgain", gain * 127);
     }
 
     /**** Volume ****/
     void set_swell(float gain)
     {
-        this->inst.synth->swellPedalGain = this->inst.synth->outputLevelTrim * gain;
+        this->inst.synth->swellPedalGainTarget = this->inst.synth->outputLevelTrim * gain;
+        notifyControlChangeByName (this->inst.midicfg, "swellpedal1", gain * 127);
     }
 
     /**** Reverb ****/
@@ -238,6 +1435,7 @@ struct Beatrix
     void set_reverb_dry_wet(float wet)
     {
         setReverbMix(this->inst.reverb, wet);
+        notifyControlChangeByName (this->inst.midicfg, "reverb.mix", wet * 127);
     }
 
     /**** Rotary speaker ****/
@@ -0,0 +1,403 @@
+/*
+OpenB3: an open source sound synthesis engine and JUCE application/plugin that simulates
+the magnificent sound of the Hammond B3 organ and Leslie rotating speaker
+Copyright (C) 2021-2022 Michele Perrone
+Github: https://github.com/michele-perrone/OpenPiano
+Author e-mail: perrone(dot)michele(at)outlook(dot)com
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+/* Keeps initialized instances for hosts that start and stop organs often.
+ * Constructing an instance computes its tables, which takes milliseconds;
+ * acquire() hands out one that is ready instead, and release() silences
+ * it with Beatrix::reset() and returns it to the configuration of the
+ * pool for the next user.
+ */
+
+#include <algorithm>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "beatrix.hpp"
+
+struct BeatrixPool
+{
+    /**
+     * @param sample_rate The sample rate of all instances
+     * @param config_file Optional configuration file of all instances
+     * @param programme_file Optional programme file of all instances
+     * @param size Number of instances built and warmed up right away
+     * @param arena_flags See Beatrix::Beatrix()
+     */
+    BeatrixPool(double sample_rate, const char* config_file = NULL, const char* programme_file = NULL,
+                int size = 4, int arena_flags = 0)
+        : sample_rate (sample_rate), arena_flags (arena_flags)
+    {
+        if (config_file)
+            this->config_file = config_file;
+        if (programme_file)
+            this->programme_file = programme_file;
+
+        /* Never handed out, it holds the wave tables of the others and
+         * the state they return to */
+        prototype = new Beatrix (sample_rate, config_file, programme_file, NULL, arena_flags);
+        snapshot_prototype();
+
+        idle.reserve (size);
+        for (int i = 0; i < size; i++)
+            idle.push_back (add_slot());
+    }
+
+    /** Instances that were acquired must have been released */
+    ~BeatrixPool()
+    {
+        for (Slot& s : slots)
+            delete s.beatrix;
+        delete prototype;
+    }
+
+    /**
+     * @brief Hand out a ready instance, silent and in the configuration of
+     * the pool, with the given parameters applied. Builds a new one if
+     * none is idle.
+     * Not realtime safe, but without @p n it takes microseconds.
+     * @param keys Names of configuration values that differ for this
+     *        user, e.g. "midi.upper.channel". Only values that apply to a
+     *        running engine are accepted, see getConfigScope().
+     * @param values The values, as they would appear in a config file
+     * @param n Number of key/value pairs
+     * @return NULL if a value does not apply to a running engine
+     */
+    Beatrix* acquire(const char* const keys[] = NULL, const char* const values[] = NULL, int n = 0)
+    {
+        if (!live_only (keys, values, n))
+            return NULL;
+
+        Slot* s = NULL;
+        {
+            std::lock_guard<std::mutex> guard (lock);
+            if (!idle.empty())
+            {
+                s = idle.back();
+                idle.pop_back();
+            }
+        }
+        if (!s)
+            s = add_slot();
+
+        Beatrix* b = s->beatrix;
+        s->synth = b->inst.synth;
+        s->library = b->inst.progs->library;
+        s->keys.clear();
+        s->values.clear();
+        s->tainted = false;
+        {
+            std::lock_guard<std::mutex> guard (lock);
+            acquired[b] = s;
+        }
+
+        configure (b, keys, values, n);
+        b->apply_pending_config(); // not rendering yet
+        return b;
+    }
+
+    /**
+     * @brief Change parameters of an acquired instance, as acquire() does;
+     * release() restores them. Not realtime safe, but the instance may be
+     * rendering meanwhile: the audio thread takes the changes over at the
+     * start of its next block, see Beatrix::apply_config().
+     * @return false if a value does not apply to a running engine
+     */
+    bool configure(Beatrix* b, const char* const keys[], const char* const values[], int n)
+    {
+        if (!live_only (keys, values, n))
+            return false;
+
+        Slot& s = slot (b);
+        for (int i = 0; i < n; i++)
+        {
+            if (std::find (s.keys.begin(), s.keys.end(), keys[i]) != s.keys.end())
+                continue;
+            const char* current = rc_get_cfg (b->inst.state, keys[i]);
+            if (!current)
+            {
+                s.tainted = true;
+                continue;
+            }
+            s.keys.push_back (keys[i]);
+            s.values.push_back (current);
+        }
+
+        if (n > 0)
+            b->apply_config (keys, values, n);
+        return true;
+    }
+
+    /**
+     * @brief Give an instance back, once its audio thread no longer
+     * renders it. Not realtime safe.
+     * It is reset and returned to the configuration, programmes, MIDI
+     * controller mapping and controls of the pool. An instance whose
+     * tone generator or programme library was replaced, or that got a
+     * parameter the pool configuration does not set, cannot be returned
+     * to it and is built again instead.
+     */
+    void release(Beatrix* b)
+    {
+        Slot& s = slot (b);
+        {
+            std::lock_guard<std::mutex> guard (lock);
+            acquired.erase (b);
+        }
+
+        if (s.tainted || b->inst.synth != s.synth || b->pending_synth.load() || b->inst.progs->library != s.library)
+        {
+            delete b;
+            s.beatrix = build();
+        }
+        else
+        {
+            std::vector<const char*> k, v;
+            for (size_t i = 0; i < s.keys.size(); i++)
+            {
+                k.push_back (s.keys[i].c_str());
+                v.push_back (s.values[i].c_str());
+            }
+            b->apply_config (k.data(), v.data(), (int)k.size());
+            b->apply_pending_config(); // no audio thread renders it
+            b->read_snapshot (pristine.data(), pristine.size());
+            b->reset();
+        }
+
+        std::lock_guard<std::mutex> guard (lock);
+        idle.push_back (&s);
+    }
+
+    /**
+     * @brief Read the configuration file of the pool again and apply the
+     * values that changed to every instance with Beatrix::apply_config().
+     * Acquired instances take them over at their next block; a value an
+     * instance was given with configure() is kept, and release() returns
+     * it to the new one. Only values that apply to a running engine are
+     * taken, the others are reported and need a pool of their own. A
+     * "program.read" directive reloads that programme file.
+     * Not realtime safe: call it from the thread that acquires, configures
+     * and releases the instances.
+     * @param result Optional, receives the counts of the parameters
+     * @return false if the file could not be read
+     */
+    bool reload_config(Beatrix::ConfigReload* result = NULL)
+    {
+        if (config_file.empty())
+            return false;
+
+        Reload r;
+        r.pool = this;
+        LOCALEGUARD_START;
+        int rv = readConfigurationFile (config_file.c_str(), &BeatrixPool::reload_cb, &r);
+        LOCALEGUARD_END;
+        if (rv < 0)
+            return false;
+
+        std::vector<const char*> k, v;
+        for (size_t i = 0; i < r.keys.size(); i++)
+        {
+            k.push_back (r.keys[i].c_str());
+            v.push_back (r.values[i].c_str());
+        }
+        bool ok = reload_parked (prototype, k, v);
+        snapshot_prototype();
+
+        std::lock_guard<std::mutex> guard (lock);
+        for (Slot* s : idle)
+            ok = reload_parked (s->beatrix, k, v) && ok;
+        for (auto& a : acquired)
+        {
+            Slot& s = *a.second;
+            std::vector<const char*> ks, vs;
+            for (size_t i = 0; i < k.size(); i++)
+            {
+                auto it = std::find (s.keys.begin(), s.keys.end(), k[i]);
+                if (it != s.keys.end())
+                {
+                    s.values[it - s.keys.begin()] = v[i];
+                    continue;
+                }
+                ks.push_back (k[i]);
+                vs.push_back (v[i]);
+            }
+            ok = s.beatrix->apply_config (ks.data(), vs.data(), (int)ks.size()) && ok;
+        }
+
+        if (result)
+            *result = r.counts;
+        return ok;
+    }
+
+    /**
+     * @brief Read the programme file of the pool again into every instance,
+     * see Beatrix::reload_programmes(). Acquired instances take the
+     * programmes over at their next block, and are built again when they
+     * are released. Not realtime safe, see reload_config().
+     * @return false if the file could not be read or parsed
+     */
+    bool reload_programmes()
+    {
+        if (programme_file.empty() || !prototype->reload_programmes (programme_file.c_str()))
+            return false;
+        prototype->apply_pending_config();
+        snapshot_prototype();
+
+        bool ok = true;
+        std::lock_guard<std::mutex> guard (lock);
+        for (Slot* s : idle)
+        {
+            ok = s->beatrix->reload_programmes (programme_file.c_str()) && ok;
+            s->beatrix->apply_pending_config();
+        }
+        for (auto& a : acquired)
+            ok = a.second->beatrix->reload_programmes (programme_file.c_str()) && ok;
+        return ok;
+    }
+
+    /** Number of instances ready to be handed out */
+    int available()
+    {
+        std::lock_guard<std::mutex> guard (lock);
+        return (int)idle.size();
+    }
+
+    double get_sample_rate() const
+    {
+        return sample_rate;
+    }
+
+private:
+    /* What acquire() changed, so that release() can undo it */
+    struct Slot
+    {
+        Beatrix* beatrix;
+        const struct b_tonegen* synth;
+        const void* library;
+        std::vector<std::string> keys, values; // previous values
+        bool tainted;
+    };
+
+    double sample_rate;
+    int arena_flags;
+    std::string config_file;
+    std::string programme_file;
+
+    Beatrix* prototype;
+    std::vector<uint8_t> pristine; // snapshot of the prototype
+
+    std::mutex lock;
+    std::list<Slot> slots; // one per instance, they keep their address
+    std::vector<Slot*> idle;
+    std::unordered_map<const Beatrix*, Slot*> acquired;
+
+    /* The values of the configuration file that differ from the pool's */
+    struct Reload
+    {
+        BeatrixPool* pool;
+        Beatrix::ConfigReload counts;
+        std::vector<std::string> keys, values;
+    };
+
+    static void reload_cb(const char* fname, int linenr, const char* name, const char* value, void* arg)
+    {
+        Reload* r = (Reload*)arg;
+        Beatrix* prototype = r->pool->prototype;
+
+        if (strcasecmp (name, "program.read"))
+        {
+            const char* current = rc_get_cfg (prototype->inst.state, name);
+            if (current && !strcmp (current, value))
+            {
+                r->counts.unchanged++;
+                return;
+            }
+            if (getConfigScope (&prototype->inst, name) != CFG_SCOPE_LIVE)
+            {
+                fprintf (stderr, "%s:%d:%s=%s: needs a pool of its own.\n", fname, linenr, name, value);
+                r->counts.restart++;
+                return;
+            }
+            r->counts.live++;
+        }
+        r->keys.push_back (name);
+        r->values.push_back (value);
+    }
+
+    /* Applies configuration values to an instance that renders no audio */
+    static bool reload_parked(Beatrix* b, const std::vector<const char*>& k, const std::vector<const char*>& v)
+    {
+        bool ok = b->apply_config (k.data(), v.data(), (int)k.size());
+        b->apply_pending_config();
+        return ok;
+    }
+
+    void snapshot_prototype()
+    {
+        pristine.resize (prototype->write_snapshot (NULL, 0));
+        prototype->write_snapshot (pristine.data(), pristine.size());
+    }
+
+    bool live_only(const char* const keys[], const char* const values[], int n)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            if (getConfigScope (&prototype->inst, keys[i]) != CFG_SCOPE_LIVE)
+            {
+                fprintf (stderr, "%s=%s: needs a pool of its own.\n", keys[i], values[i]);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    Beatrix* build()
+    {
+        Beatrix* b = new Beatrix (sample_rate, config_file.empty() ? NULL : config_file.c_str(),
+                                  programme_file.empty() ? NULL : programme_file.c_str(), prototype, arena_flags);
+        b->warmup();
+        /* The controls as the snapshot has them, like a released instance */
+        b->read_snapshot (pristine.data(), pristine.size());
+        b->reset();
+        return b;
+    }
+
+    Slot* add_slot()
+    {
+        Beatrix* b = build();
+        std::lock_guard<std::mutex> guard (lock);
+        slots.push_back (Slot());
+        slots.back().beatrix = b;
+        return &slots.back();
+    }
+
+    Slot& slot(const Beatrix* b)
+    {
+        std::lock_guard<std::mutex> guard (lock);
+        auto it = acquired.find (b);
+        if (it == acquired.end())
+            abort(); // not acquired from this pool
+        return *it->second;
+    }
+};
@@ -0,0 +1,677 @@
+/*
+OpenB3: an open source sound synthesis engine and JUCE application/plugin that simulates
+the magnificent sound of the Hammond B3 organ and Leslie rotating speaker
+Copyright (C) 2021-2022 Michele Perrone
+Github: https://github.com/michele-perrone/OpenPiano
+Author e-mail: perrone(dot)michele(at)outlook(dot)com
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * beatrix_bench.cpp --- Engine benchmark with canned workloads.
+ *
+ * Every workload is a fixed, deterministic sequence of MIDI messages and
+ * parameter changes. It is rendered for each combination of sample rate
+ * and host block size, and the time spent in the tone generator, preamp,
+ * reverb and whirl stages is taken from the instrumentation counters of
+ * the engine. Where the kernel gives access to the hardware performance
+ * counters, the data cache misses of each run are reported as well. The
+ * results are written as JSON so that they can be compared between
+ * releases.
+ */
+
+#include "beatrix.hpp"
+
+#include <getopt.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+static const char* stage_names[BeatrixStats::N_STAGES] = { "tonegen", "preamp", "reverb", "whirl" };
+
+/*
+ * A workload is driven once per host block with the position of the
+ * block, in samples and seconds from the start.
+ */
+struct bench_workload {
+	const char* name;
+	const char* description;
+	void (*setup) (Beatrix& b);
+	void (*step) (Beatrix& b, double t, double dt);
+};
+
+/* ---------------------------------------------------------------- */
+
+#define N_HW_COUNTERS 2
+
+static const char* hw_counter_names[N_HW_COUNTERS] = { "l1d_misses", "llc_misses" };
+
+/*
+ * Hardware event counters of the calling thread. fd[i] is -1 for the
+ * counters that are not available, e.g. in most virtual machines.
+ */
+struct hw_counters {
+	int      fd[N_HW_COUNTERS];
+	uint64_t value[N_HW_COUNTERS];
+};
+
+static void
+hw_counters_open (struct hw_counters* hc)
+{
+	int i;
+	for (i = 0; i < N_HW_COUNTERS; ++i) {
+		hc->fd[i]    = -1;
+		hc->value[i] = 0;
+	}
+#ifdef __linux__
+	for (i = 0; i < N_HW_COUNTERS; ++i) {
+		struct perf_event_attr attr;
+		memset (&attr, 0, sizeof (attr));
+		attr.size           = sizeof (attr);
+		attr.disabled       = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv     = 1;
+		if (i == 0) {
+			attr.type   = PERF_TYPE_HW_CACHE;
+			attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		} else {
+			attr.type   = PERF_TYPE_HARDWARE;
+			attr.config = PERF_COUNT_HW_CACHE_MISSES;
+		}
+		hc->fd[i] = (int)syscall (SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+#endif
+}
+
+static void
+hw_counters_enable (struct hw_counters* hc, bool enable)
+{
+#ifdef __linux__
+	int i;
+	for (i = 0; i < N_HW_COUNTERS; ++i) {
+		if (hc->fd[i] >= 0) {
+			ioctl (hc->fd[i], enable ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, 0);
+		}
+	}
+#endif
+}
+
+static void
+hw_counters_close (struct hw_counters* hc)
+{
+#ifdef __linux__
+	int i;
+	for (i = 0; i < N_HW_COUNTERS; ++i) {
+		if (hc->fd[i] >= 0) {
+			const bool ok = read (hc->fd[i], &hc->value[i], sizeof (uint64_t)) == sizeof (uint64_t);
+			close (hc->fd[i]);
+			if (!ok) {
+				hc->fd[i] = -1;
+			}
+		}
+	}
+#endif
+}
+
+/* ---------------------------------------------------------------- */
+
+static inline uint64_t
+now_ns ()
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void
+midi3 (Beatrix& b, uint8_t status, uint8_t d1, uint8_t d2)
+{
+	const uint8_t msg[3] = { status, d1, d2 };
+	b.process_midi_message (msg, 3);
+}
+
+/* True once, for the host block that contains time @p at */
+static inline bool
+crosses (double t, double dt, double at)
+{
+	return t <= at && at < t + dt;
+}
+
+/* ---------------------------------------------------------------- */
+
+static void
+setup_none (Beatrix&)
+{
+}
+
+static void
+step_none (Beatrix&, double, double)
+{
+}
+
+static void
+setup_single_note (Beatrix& b)
+{
+	midi3 (b, 0x90, 69, 100);
+}
+
+/* Ten notes on each manual and a pedal note, all drawbars out */
+static void
+setup_chords (Beatrix& b)
+{
+	static const uint8_t chord[10] = { 48, 52, 55, 59, 62, 64, 67, 71, 74, 77 };
+	unsigned int         full[9]   = { 8, 8, 8, 8, 8, 8, 8, 8, 8 };
+	int                  i;
+
+	b.set_drawbars (UPPER_MANUAL, full);
+	b.set_drawbars (LOWER_MANUAL, full);
+	b.set_drawbars (PEDAL_BOARD, full);
+	b.set_percussion_enabled (true);
+	b.set_vibrato_upper (true);
+
+	for (i = 0; i < 10; ++i) {
+		midi3 (b, 0x90, chord[i], 100);
+		midi3 (b, 0x91, chord[i] - 12, 100);
+	}
+	midi3 (b, 0x92, 36, 100);
+}
+
+/* A new key every 15 ms, sweeping up and down the upper manual */
+static void
+step_glissando (Beatrix& b, double t, double dt)
+{
+	const double step = 0.015;
+	long         n0   = (long)(t / step);
+	long         n1   = (long)((t + dt) / step);
+	long         n;
+
+	for (n = n0; n < n1; ++n) {
+		int pos  = (int)((n + 1) % 120);
+		int key  = 36 + (pos < 60 ? pos : 120 - pos);
+		int prev = 36 + ((n % 120) < 60 ? (int)(n % 120) : (int)(120 - n % 120));
+		midi3 (b, 0x80, prev, 0);
+		midi3 (b, 0x90, key, 100);
+	}
+}
+
+static void
+setup_glissando (Beatrix& b)
+{
+	unsigned int full[9] = { 8, 8, 8, 8, 8, 8, 8, 8, 8 };
+	b.set_drawbars (UPPER_MANUAL, full);
+	midi3 (b, 0x90, 36, 100);
+}
+
+/*
+ * Every 50 ms the chords of setup_chords() are released and pressed
+ * again, a semitone higher, on all three manuals at once.
+ */
+static void
+step_chord_stabs (Beatrix& b, double t, double dt)
+{
+	static const uint8_t chord[10] = { 48, 52, 55, 59, 62, 64, 67, 71, 74, 77 };
+	const double         step      = 0.050;
+	long                 n0        = (long)(t / step);
+	long                 n1        = (long)((t + dt) / step);
+	long                 n;
+	int                  i;
+
+	for (n = n0; n < n1; ++n) {
+		const int prev = (int)(n % 12);
+		const int next = (int)((n + 1) % 12);
+		for (i = 0; i < 10; ++i) {
+			midi3 (b, 0x80, chord[i] + prev, 0);
+			midi3 (b, 0x81, chord[i] - 12 + prev, 0);
+		}
+		midi3 (b, 0x82, 36 + prev, 0);
+		for (i = 0; i < 10; ++i) {
+			midi3 (b, 0x90, chord[i] + next, 100);
+			midi3 (b, 0x91, chord[i] - 12 + next, 100);
+		}
+		midi3 (b, 0x92, 36 + next, 100);
+	}
+}
+
+/* A program change every 10 ms, with the chords held */
+static void
+step_program_storm (Beatrix& b, double t, double dt)
+{
+	const double step = 0.010;
+	long         n0   = (long)(t / step);
+	long         n1   = (long)((t + dt) / step);
+	long         n;
+
+	for (n = n0; n < n1; ++n) {
+		const uint8_t msg[2] = { 0xc0, (uint8_t)(n % 16) };
+		b.process_midi_message (msg, 2);
+	}
+}
+
+/* The horn and drum accelerating and braking, every second */
+static void
+step_rotor (Beatrix& b, double t, double dt)
+{
+	const double period = 1.0;
+	double       k      = (double)(long)(t / period) * period;
+	if (crosses (t, dt, k) || crosses (t, dt, k + period)) {
+		b.set_rotary_speed (((long)((t + dt) / period) & 1) ? WHIRL_FAST : WHIRL_SLOW);
+	}
+}
+
+static void
+setup_rotor (Beatrix& b)
+{
+	setup_chords (b);
+	b.set_rotary_speed (WHIRL_SLOW);
+}
+
+static void
+setup_overdrive_off (Beatrix& b)
+{
+	setup_chords (b);
+	b.set_preamp_clean (true);
+}
+
+static void
+setup_overdrive_on (Beatrix& b)
+{
+	setup_chords (b);
+	b.set_preamp_clean (false);
+	b.set_input_gain (0.6f);
+}
+
+static const struct bench_workload workloads[] = {
+	{ "silence", "no keys pressed", setup_none, step_none },
+	{ "single_note", "one key on the upper manual", setup_single_note, step_none },
+	{ "chords", "10 keys on each manual and one pedal, all drawbars out", setup_chords, step_none },
+	{ "glissando", "a new key every 15 ms on the upper manual", setup_glissando, step_glissando },
+	{ "program_storm", "chords, with a program change every 10 ms", setup_chords, step_program_storm },
+	{ "chord_stabs", "chords, all 21 keys released and pressed again every 50 ms", setup_chords, step_chord_stabs },
+	{ "rotor_accel", "chords, switching between slow and fast every second", setup_rotor, step_rotor },
+	{ "overdrive_off", "chords through the clean preamp", setup_overdrive_off, step_none },
+	{ "overdrive_on", "chords through the overdrive", setup_overdrive_on, step_none },
+};
+
+#define N_WORKLOADS (sizeof (workloads) / sizeof (workloads[0]))
+
+/* ---------------------------------------------------------------- */
+
+static void
+run_workload (const struct bench_workload* w,
+              Beatrix&                     b,
+              double                       rate,
+              int                          block_size,
+              double                       duration,
+              BeatrixStats*                st,
+              uint64_t*                    total_ns,
+              struct hw_counters*          hc)
+{
+	const uint64_t n_frames = (uint64_t)(duration * rate);
+	const double   dt       = block_size / rate;
+	uint64_t       pos;
+
+	float* L = (float*)malloc (block_size * sizeof (float));
+	float* R = (float*)malloc (block_size * sizeof (float));
+	if (!L || !R) {
+		fprintf (stderr, "FATAL: memory allocation failed for bench buffers.\n");
+		exit (1);
+	}
+
+	w->setup (b);
+
+	*total_ns = 0;
+	hw_counters_open (hc);
+	hw_counters_enable (hc, true);
+	for (pos = 0; pos < n_frames; pos += block_size) {
+		const uint64_t t0 = now_ns ();
+		w->step (b, pos / rate, dt);
+		b.get_next_block (L, R, block_size);
+		*total_ns += now_ns () - t0;
+	}
+	hw_counters_enable (hc, false);
+	hw_counters_close (hc);
+	*st = b.get_stats ();
+
+	free (L);
+	free (R);
+}
+
+static void
+print_result (FILE*                        fp,
+              bool                         first,
+              const struct bench_workload* w,
+              double                       rate,
+              int                          block_size,
+              double                       duration,
+              const BeatrixStats*          st,
+              uint64_t                     total_ns,
+              const struct hw_counters*    hc)
+{
+	const double total_s = total_ns * 1e-9;
+	int          i;
+
+	fprintf (fp, "%s\n    {\"workload\": \"%s\", \"sample_rate\": %.0f, \"block_size\": %d, ",
+	         first ? "" : ",", w->name, rate, block_size);
+	fprintf (fp, "\"audio_seconds\": %.3f, \"cpu_seconds\": %.6f, \"realtime_factor\": %.2f,\n",
+	         duration, total_s, total_s > 0 ? duration / total_s : 0);
+	fprintf (fp, "     \"block_max_us\": %.2f, \"load_p50\": %.3f, \"load_p99\": %.3f, \"deadline_misses\": %llu,\n",
+	         st->block_max_ns * 1e-3, st->load_percentile (0.5), st->load_percentile (0.99),
+	         (unsigned long long)st->deadline_misses);
+	fprintf (fp, "     \"active_oscillators_max\": %d, \"core_program_length_max\": %d, \"msg_queue_depth_max\": %d,\n",
+	         st->active_oscillators_max, st->core_program_length_max, st->msg_queue_depth_max);
+	fprintf (fp, "     \"fragments\": %llu, \"fragment_max_us\": %.2f, \"stage_us_per_fragment\": {",
+	         (unsigned long long)st->fragments, st->fragment_max_ns * 1e-3);
+	for (i = 0; i < BeatrixStats::N_STAGES; ++i) {
+		fprintf (fp, "%s\"%s\": %.3f", i ? ", " : "", stage_names[i],
+		         st->fragments ? st->stage_ns[i] * 1e-3 / st->fragments : 0);
+	}
+	fprintf (fp, "},\n     ");
+	for (i = 0; i < N_HW_COUNTERS; ++i) {
+		if (hc->fd[i] >= 0 && st->fragments) {
+			fprintf (fp, "%s\"%s_per_fragment\": %.1f", i ? ", " : "", hw_counter_names[i],
+			         (double)hc->value[i] / st->fragments);
+		} else {
+			fprintf (fp, "%s\"%s_per_fragment\": null", i ? ", " : "", hw_counter_names[i]);
+		}
+	}
+	fprintf (fp, "}");
+}
+
+/* ---------------------------------------------------------------- */
+
+/*
+ * The per-sample vibrato scanner that vibratoProc() replaced, kept as
+ * the reference for the block implementation.
+ */
+static void
+vibrato_reference (struct b_vibrato* v, float const* xp, float* yp, size_t n)
+{
+	const float  fnorm   = 1.0 / 65536.0;
+	const float  mixnorm = 0.7071067811865475;
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		const float        x = *xp++;
+		const unsigned int j = ((v->outPos << 16) + v->offsetTable[v->stator >> 16]) & 0x03FFFFFF;
+		const int          h = j >> 16;
+		const int          k = (h + 1) & 0x3FF;
+		const float        g = fnorm * ((float)(j & 0xFFFF)) * x;
+
+		v->vibBuffer[h] += x - g;
+		v->vibBuffer[k] += g;
+
+		if (v->mixedBuffers) {
+			*yp++ = (x + v->vibBuffer[v->outPos]) * mixnorm;
+		} else {
+			*yp++ = v->vibBuffer[v->outPos];
+		}
+		v->vibBuffer[v->outPos] = 0;
+		v->outPos               = (v->outPos + 1) & 0x3FF;
+		v->stator               = (v->stator + v->statorIncrement) & 0x07ffffff;
+	}
+}
+
+/*
+ * Runs vibratoProc() and the reference side by side on the same noise
+ * for every scanner setting, and reports the largest difference and
+ * the time per sample of both.
+ * @returns  The number of settings whose output differs.
+ */
+static int
+check_scanner (FILE* fp, double rate, double duration, bool* first)
+{
+	static const int settings[6] = { VIB1, VIB2, VIB3, CHO1, CHO2, CHO3 };
+	const size_t     n_frags     = (size_t)(duration * rate) / BUFFER_SIZE_SAMPLES;
+	int              n_failed    = 0;
+	int              s;
+
+	for (s = 0; s < 6; ++s) {
+		struct b_vibrato* a = (struct b_vibrato*)calloc (1, sizeof (struct b_vibrato));
+		struct b_vibrato* b = (struct b_vibrato*)calloc (1, sizeof (struct b_vibrato));
+		float             x[BUFFER_SIZE_SAMPLES], ya[BUFFER_SIZE_SAMPLES], yb[BUFFER_SIZE_SAMPLES];
+		uint64_t          ns_block = 0, ns_ref = 0;
+		float             max_diff = 0;
+		unsigned int      seed     = 1;
+		size_t            f;
+		int               i;
+
+		if (!a || !b) {
+			fprintf (stderr, "FATAL: memory allocation failed for scanner check.\n");
+			exit (1);
+		}
+		reset_vibrato (a);
+		a->SampleRateD = rate;
+		init_vibrato (a);
+		a->offsetTable   = (settings[s] & 3) == 1 ? a->offset1Table : (settings[s] & 3) == 2 ? a->offset2Table : a->offset3Table;
+		a->mixedBuffers  = settings[s] & CHO_;
+		a->effectEnabled = 1;
+		memcpy (b, a, sizeof (struct b_vibrato));
+		b->offsetTable = b->offset1Table + (a->offsetTable - a->offset1Table);
+
+		for (f = 0; f < n_frags; ++f) {
+			uint64_t t0, t1, t2;
+			for (i = 0; i < BUFFER_SIZE_SAMPLES; ++i) {
+				seed = seed * 1103515245u + 12345u;
+				x[i] = (float)((seed >> 8) & 0xffff) / 32768.f - 1.f;
+			}
+			t0 = now_ns ();
+			vibratoProc (a, x, ya, BUFFER_SIZE_SAMPLES);
+			t1 = now_ns ();
+			vibrato_reference (b, x, yb, BUFFER_SIZE_SAMPLES);
+			t2 = now_ns ();
+			ns_block += t1 - t0;
+			ns_ref += t2 - t1;
+			for (i = 0; i < BUFFER_SIZE_SAMPLES; ++i) {
+				max_diff = fmaxf (max_diff, fabsf (ya[i] - yb[i]));
+			}
+		}
+
+		n_failed += max_diff != 0;
+		fprintf (fp, "%s\n    {\"setting\": \"%s%d\", \"sample_rate\": %.0f, \"max_abs_diff\": %g, ",
+		         *first ? "" : ",", (settings[s] & CHO_) ? "C" : "V", settings[s] & 3, rate, max_diff);
+		fprintf (fp, "\"ns_per_sample\": %.3f, \"reference_ns_per_sample\": %.3f}",
+		         n_frags ? (double)ns_block / (n_frags * BUFFER_SIZE_SAMPLES) : 0,
+		         n_frags ? (double)ns_ref / (n_frags * BUFFER_SIZE_SAMPLES) : 0);
+		*first = false;
+		free (a);
+		free (b);
+	}
+	return n_failed;
+}
+
+/* Parses a comma separated list of numbers, returns the count */
+static int
+parse_list (const char* arg, double* v, int max)
+{
+	int         n = 0;
+	const char* p = arg;
+	while (n < max && *p) {
+		char* end;
+		v[n] = strtod (p, &end);
+		if (end == p) {
+			return -1;
+		}
+		++n;
+		p = (*end == ',') ? end + 1 : end;
+		if (*end && *end != ',') {
+			return -1;
+		}
+	}
+	return n;
+}
+
+static void
+usage (const char* prog)
+{
+	unsigned int i;
+	fprintf (stderr,
+	         "Usage: %s [options]\n"
+	         "Render canned workloads and report per-stage timings as JSON.\n"
+	         "\n"
+	         "Options:\n"
+	         "  -r <list>   sample rates, comma separated (default: 44100,48000,96000)\n"
+	         "  -b <list>   host block sizes, comma separated (default: 32,64,256,1024)\n"
+	         "  -d <sec>    audio rendered per run (default: 10)\n"
+	         "  -w <name>   run only the named workload, may be repeated\n"
+	         "  -o <file>   write the JSON to a file instead of stdout\n"
+	         "  -s          also compare the vibrato scanner with the per-sample\n"
+	         "              reference; exit with an error if they differ\n"
+	         "  -h          print this help and exit\n"
+	         "\n"
+	         "Workloads:\n",
+	         prog);
+	for (i = 0; i < N_WORKLOADS; ++i) {
+		fprintf (stderr, "  %-14s %s\n", workloads[i].name, workloads[i].description);
+	}
+}
+
+int
+main (int argc, char** argv)
+{
+	double      rates[16]     = { 44100, 48000, 96000 };
+	double      blocks[16]    = { 32, 64, 256, 1024 };
+	int         n_rates       = 3;
+	int         n_blocks      = 4;
+	double      duration      = 10;
+	const char* output_file   = NULL;
+	bool        selected[N_WORKLOADS];
+	bool        any_selected = false;
+	bool        scanner      = false;
+	int         rv           = 0;
+	FILE*       fp           = stdout;
+	unsigned int i;
+	int          c, r, k;
+
+	memset (selected, 0, sizeof (selected));
+
+	while ((c = getopt (argc, argv, "r:b:d:w:o:sh")) != -1) {
+		switch (c) {
+			case 'r':
+				n_rates = parse_list (optarg, rates, 16);
+				break;
+			case 'b':
+				n_blocks = parse_list (optarg, blocks, 16);
+				break;
+			case 'd':
+				duration = atof (optarg);
+				break;
+			case 'w':
+				for (i = 0; i < N_WORKLOADS; ++i) {
+					if (!strcmp (optarg, workloads[i].name)) {
+						break;
+					}
+				}
+				if (i == N_WORKLOADS) {
+					fprintf (stderr, "Unknown workload '%s'.\n", optarg);
+					return 1;
+				}
+				selected[i]  = true;
+				any_selected = true;
+				break;
+			case 'o':
+				output_file = optarg;
+				break;
+			case 's':
+				scanner = true;
+				break;
+			case 'h':
+				usage (argv[0]);
+				return 0;
+			default:
+				usage (argv[0]);
+				return 1;
+		}
+	}
+
+	if (n_rates < 1 || n_blocks < 1 || duration <= 0) {
+		fprintf (stderr, "Invalid sample rate or block size list, or duration.\n");
+		return 1;
+	}
+	for (r = 0; r < n_rates; ++r) {
+		if (rates[r] < 8000 || rates[r] > 384000) {
+			fprintf (stderr, "Invalid sample rate %g.\n", rates[r]);
+			return 1;
+		}
+	}
+	for (k = 0; k < n_blocks; ++k) {
+		if (blocks[k] < 1 || blocks[k] > 65536) {
+			fprintf (stderr, "Invalid block size %g.\n", blocks[k]);
+			return 1;
+		}
+	}
+
+	if (output_file && !(fp = fopen (output_file, "w"))) {
+		perror (output_file);
+		return 1;
+	}
+
+	fprintf (fp, "{\n  \"fragment_size\": %d,\n  \"results\": [", BUFFER_SIZE_SAMPLES);
+
+	bool first = true;
+	for (r = 0; r < n_rates; ++r) {
+		/* One prototype per rate, so that the wave tables are only built once */
+		Beatrix* prototype = new Beatrix (rates[r]);
+
+		for (i = 0; i < N_WORKLOADS; ++i) {
+			if (any_selected && !selected[i]) {
+				continue;
+			}
+			for (k = 0; k < n_blocks; ++k) {
+				BeatrixStats       st;
+				uint64_t           total_ns;
+				struct hw_counters hc;
+				Beatrix*           b = new Beatrix (rates[r], NULL, NULL, prototype);
+				run_workload (&workloads[i], *b, rates[r], (int)blocks[k], duration, &st, &total_ns, &hc);
+				delete b;
+
+				print_result (fp, first, &workloads[i], rates[r], (int)blocks[k], duration, &st, total_ns, &hc);
+				first = false;
+				fflush (fp);
+			}
+		}
+		delete prototype;
+	}
+
+	fprintf (fp, "\n  ]");
+
+	if (scanner) {
+		first = true;
+		fprintf (fp, ",\n  \"scanner_check\": [");
+		for (r = 0; r < n_rates; ++r) {
+			if (check_scanner (fp, rates[r], duration, &first)) {
+				fprintf (stderr, "Vibrato scanner differs from the reference at %g Hz.\n", rates[r]);
+				rv = 1;
+			}
+		}
+		fprintf (fp, "\n  ]");
+	}
+
+	fprintf (fp, "\n}\n");
+
+	if (output_file && fclose (fp)) {
+		perror (output_file);
+		return 1;
+	}
+	return rv;
+}
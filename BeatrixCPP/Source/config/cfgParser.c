@@ -64,6 +64,234 @@
 
 #define LINEBUFSZ 2048
 
+#ifndef CFG_MAIN
+/*
+ * Configurable modules. Each one implements a config function that claims
+ * the parameters it knows and a ConfigDoc table that lists them.
+ */
+typedef struct _configModule {
+	const char* title;
+	int (*config) (b_instance* inst, ConfigContext* cfg);
+	const ConfigDoc* (*doc) ();
+	int scope; /**< enum cfgscope, when a changed value takes effect */
+} ConfigModule;
+
+static int
+cfgMidi (b_instance* inst, ConfigContext* cfg)
+{
+	return midiConfig (inst->midicfg, cfg);
+}
+
+static int
+cfgPgm (b_instance* inst, ConfigContext* cfg)
+{
+	return pgmConfig (inst->progs, cfg);
+}
+
+static int
+cfgOsc (b_instance* inst, ConfigContext* cfg)
+{
+	return oscConfig (inst->synth, cfg);
+}
+
+static int
+cfgScanner (b_instance* inst, ConfigContext* cfg)
+{
+	return scannerConfig (inst->synth, cfg);
+}
+
+static int
+cfgAmp (b_instance* inst, ConfigContext* cfg)
+{
+	return ampConfig (inst->preamp, cfg);
+}
+
+static int
+cfgWhirl (b_instance* inst, ConfigContext* cfg)
+{
+	return whirlConfig (inst->whirl, cfg);
+}
+
+static int
+cfgReverb (b_instance* inst, ConfigContext* cfg)
+{
+	return reverbConfig (inst->reverb, cfg);
+}
+
+#ifdef HAVE_ZITACONVOLVE
+static int
+cfgConvolution (b_instance* inst, ConfigContext* cfg)
+{
+	return convolutionConfig (cfg);
+}
+#endif
+
+static const ConfigModule configModules[] = {
+	{ "MIDI Parser", cfgMidi, midiDoc, CFG_SCOPE_LIVE },
+	{ "MIDI Program Parser", cfgPgm, pgmDoc, CFG_SCOPE_LIVE },
+	{ "Tone Generator", cfgOsc, oscDoc, CFG_SCOPE_REBUILD },
+	{ "Vibrato Effect", cfgScanner, scannerDoc, CFG_SCOPE_REBUILD },
+	{ "Preamp/Overdrive Effect", cfgAmp, ampDoc, CFG_SCOPE_LIVE },
+	{ "Leslie Cabinet Effect", cfgWhirl, whirlDoc, CFG_SCOPE_RESTART },
+	{ "Reverb Effect", cfgReverb, reverbDoc, CFG_SCOPE_LIVE },
+#ifdef HAVE_ZITACONVOLVE
+	{ "Convolution Reverb Effect", cfgConvolution, convolutionDoc, CFG_SCOPE_RESTART },
+#endif
+};
+
+#define CFG_MODULES ((int)(sizeof (configModules) / sizeof (configModules[0])))
+
+/*
+ * The key registry maps parameter names to the module that claims them,
+ * so that a parameter is handed to one config function instead of all.
+ * Documented names are kept in a hash table. Documented patterns such as
+ * "osc.harmonic.w<w>.f<h>" are matched by the prefix before the '<'.
+ * Names that are in neither are offered to every module, as before.
+ */
+#define CFG_KEY_SLOTS 512 /* power of two, at least twice the documented names */
+#define CFG_KEY_PREFIXES 32
+#define CFG_ANY_MODULE (-1)
+
+struct b_cfgkeys {
+	void* arena;
+	struct {
+		const char*  name;
+		unsigned int hash;
+		int          module;
+	} slot[CFG_KEY_SLOTS];
+	struct {
+		const char* name;
+		size_t      len;
+		int         module;
+	} prefix[CFG_KEY_PREFIXES];
+	int nprefix;
+};
+
+static unsigned int
+cfgKeyHash (const char* name)
+{
+	unsigned int h = 2166136261u; /* FNV-1a, case insensitive */
+	while (*name) {
+		h ^= (unsigned char)tolower ((unsigned char)*name++);
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static void
+registerConfigKey (struct b_cfgkeys* k, const char* name, int module)
+{
+	const char* pattern = strchr (name, '<');
+
+	if (pattern) {
+		size_t len = pattern - name;
+		int    i;
+		for (i = 0; i < k->nprefix; i++) {
+			if (k->prefix[i].len == len && !strncasecmp (k->prefix[i].name, name, len)) {
+				if (k->prefix[i].module != module)
+					k->prefix[i].module = CFG_ANY_MODULE;
+				return;
+			}
+		}
+		if (k->nprefix == CFG_KEY_PREFIXES) {
+			fprintf (stderr, "cfgParser.c: too many parameter patterns, '%s' is offered to all modules.\n", name);
+			return;
+		}
+		k->prefix[k->nprefix].name   = name;
+		k->prefix[k->nprefix].len    = len;
+		k->prefix[k->nprefix].module = module;
+		k->nprefix++;
+	} else {
+		unsigned int h = cfgKeyHash (name);
+		unsigned int i = h & (CFG_KEY_SLOTS - 1);
+		unsigned int n;
+		for (n = 0; n < CFG_KEY_SLOTS; n++, i = (i + 1) & (CFG_KEY_SLOTS - 1)) {
+			if (!k->slot[i].name) {
+				k->slot[i].name   = name;
+				k->slot[i].hash   = h;
+				k->slot[i].module = module;
+				return;
+			}
+			if (k->slot[i].hash == h && !strcasecmp (k->slot[i].name, name)) {
+				if (k->slot[i].module != module)
+					k->slot[i].module = CFG_ANY_MODULE;
+				return;
+			}
+		}
+		fprintf (stderr, "cfgParser.c: parameter table full, '%s' is offered to all modules.\n", name);
+	}
+}
+
+void*
+allocConfigKeys (void* arena)
+{
+	struct b_cfgkeys* k = (struct b_cfgkeys*)arenaAlloc (arena, sizeof (struct b_cfgkeys));
+	int               m;
+	if (!k)
+		return NULL;
+	k->arena = arena;
+
+	for (m = 0; m < CFG_MODULES; m++) {
+		const ConfigDoc* d;
+		for (d = configModules[m].doc (); d && d->name; d++) {
+			registerConfigKey (k, d->name, m);
+		}
+	}
+	return k;
+}
+
+void
+freeConfigKeys (void* k)
+{
+	if (k)
+		arenaFree (((struct b_cfgkeys*)k)->arena, k);
+}
+
+/*
+ * @return the index of the module that claims the parameter, or
+ *         CFG_ANY_MODULE if it is not known.
+ */
+static int
+lookupConfigKey (const struct b_cfgkeys* k, const char* name)
+{
+	unsigned int h = cfgKeyHash (name);
+	unsigned int i = h & (CFG_KEY_SLOTS - 1);
+	size_t       best = 0;
+	int          module = CFG_ANY_MODULE;
+	int          p;
+
+	while (k->slot[i].name) {
+		if (k->slot[i].hash == h && !strcasecmp (k->slot[i].name, name))
+			return k->slot[i].module;
+		i = (i + 1) & (CFG_KEY_SLOTS - 1);
+	}
+
+	for (p = 0; p < k->nprefix; p++) {
+		if (k->prefix[p].len > best && !strncasecmp (k->prefix[p].name, name, k->prefix[p].len)) {
+			best   = k->prefix[p].len;
+			module = k->prefix[p].module;
+		}
+	}
+	return module;
+}
+
+/*
+ * @return when a changed value of the parameter takes effect, one of
+ *         enum cfgscope. Parameters that are not known need a restart.
+ */
+int
+getConfigScope (void* inst, const char* name)
+{
+	b_instance* i = (b_instance*)inst;
+	int         m;
+
+	if (!i->cfgkeys)
+		return CFG_SCOPE_RESTART;
+	m = lookupConfigKey ((struct b_cfgkeys*)i->cfgkeys, name);
+	return (m == CFG_ANY_MODULE) ? CFG_SCOPE_RESTART : configModules[m].scope;
+}
+#endif /* CFG_MAIN */
+
 /*
  * Each configurable module implements this function. The implementation
  * is idempotent. The most recent call defines the parameter's value.
@@ -80,17 +308,18 @@ distributeParameter (b_instance* inst, ConfigContext* cfg)
 	        cfg->name,
 	        cfg->value);
 #else
-//	n += mainConfig (cfg);
-	n += midiConfig (inst->midicfg, cfg);
-	n += pgmConfig (inst->progs, cfg);
-	n += oscConfig (inst->synth, cfg);
-//	n += scannerConfig (inst->synth, cfg);
-//	n += ampConfig (inst->preamp, cfg);
-//	n += whirlConfig (inst->whirl, cfg);
-//	n += reverbConfig (inst->reverb, cfg);
-#ifdef HAVE_ZITACONVOLVE
-	n += convolutionConfig (cfg);
-#endif
+	int m = CFG_ANY_MODULE;
+	if (inst->cfgkeys) {
+		m = lookupConfigKey ((struct b_cfgkeys*)inst->cfgkeys, cfg->name);
+	}
+
+	if (m != CFG_ANY_MODULE) {
+		n = configModules[m].config (inst, cfg);
+	} else {
+		for (m = 0; m < CFG_MODULES; m++) {
+			n += configModules[m].config (inst, cfg);
+		}
+	}
 
 	if (n == 0) {
 		fprintf (stderr, "%s:%d:%s=%s:Not claimed by any module.\n",
@@ -106,64 +335,81 @@ distributeParameter (b_instance* inst, ConfigContext* cfg)
 	return n;
 }
 
-void
-parseConfigurationLine (void* inst, const char* fname, int lineNumber, char* oneLine)
+/*
+ * Splits a line of a configuration file into a parameter name and value,
+ * in place.
+ * @return 0 if the line holds no parameter, 1 otherwise. The value is NULL
+ *         if the line has none.
+ */
+static int
+splitConfigurationLine (const char* fname, int lineNumber, char* oneLine, char** namep, char** valuep)
 {
-	char  delim[] = "=\n";
-	char* s       = oneLine;
+	char* s = oneLine;
 	char* name;
 	char* value;
+	char* t;
 
 	while (isspace (*s))
 		s++; /* Skip over leading spaces */
 	if (*s == '\0')
-		return; /* Skip empty lines */
+		return 0; /* Skip empty lines */
 	if (*s == '#')
-		return; /* Skip comment lines */
+		return 0; /* Skip comment lines */
 	if (*s == '=') {
 		fprintf (stderr,
 		         "%s:line %d: empty parameter name.\n",
 		         fname,
 		         lineNumber);
-		return;
+		return 0;
 	}
 
-	if ((name = strtok (s, delim)) != NULL) {
-		int i;
+	/* name=value, delimiters are '=' and newline, the value ends at a comment */
+	name = s;
+	for (t = s; *t != '\0' && *t != '=' && *t != '\n'; t++)
+		;
+	for (s = t; *s == '=' || *s == '\n'; s++)
+		;
+	value = (*s != '\0') ? s : NULL;
 
-		for (i = strlen (name) - 1; isspace (name[i]); name[i] = '\0', i--)
+	do {
+		*t-- = '\0';
+	} while (isspace (*t));
+
+	if (value) {
+		for (t = value; *t != '\0' && *t != '=' && *t != '\n' && *t != '#'; t++)
 			;
+		*t = '\0';
+		while (isspace (value[0]))
+			value++;
+		for (t = value + strlen (value); t > value && isspace (t[-1]);)
+			*--t = '\0';
+	}
 
-		if ((value = strtok (NULL, delim)) != NULL) {
-			char* t;
-			while (isspace (value[0]))
-				value++;
-			for (t = value; *t != '\0'; t++) {
-				if (*t == '#') { /* Terminate value at comment */
-					*t = '\0';
-					break;
-				}
-			}
+	*namep  = name;
+	*valuep = value;
+	return 1;
+}
 
-			i = strlen (value);
-			if (0 < i) {
-				for (i = i - 1; isspace (value[i]); value[i] = '\0', i--)
-					;
-			}
-		}
+void
+parseConfigurationLine (void* inst, const char* fname, int lineNumber, char* oneLine)
+{
+	char* name;
+	char* value;
 
-		if (strcasecmp (name, "config.read") == 0) {
-			parseConfigurationFile (inst, value);
-		} else if (strcasecmp (name, "program.read") == 0) {
-			loadProgrammeFile (((b_instance*)inst)->progs, value);
-		} else {
-			ConfigContext cfg;
-			cfg.fname  = fname;
-			cfg.linenr = lineNumber;
-			cfg.name   = name;
-			cfg.value  = value ? value : "";
-			distributeParameter ((b_instance*)inst, &cfg);
-		}
+	if (!splitConfigurationLine (fname, lineNumber, oneLine, &name, &value))
+		return;
+
+	if (strcasecmp (name, "config.read") == 0) {
+		parseConfigurationFile (inst, value);
+	} else if (strcasecmp (name, "program.read") == 0) {
+		loadProgrammeFile (((b_instance*)inst)->progs, value);
+	} else {
+		ConfigContext cfg;
+		cfg.fname  = fname;
+		cfg.linenr = lineNumber;
+		cfg.name   = name;
+		cfg.value  = value ? value : "";
+		distributeParameter ((b_instance*)inst, &cfg);
 	}
 }
 
@@ -224,17 +470,10 @@ dumpConfigDoc ()
 	    "  specified e.g. \"osc.temperament=gear60 osc.wiring-crosstalk=0.2\"\n"
 	    "\n");
 
-//	formatDoc ("Main", mainDoc ());
-	formatDoc ("MIDI Parser", midiDoc ());
-	formatDoc ("MIDI Program Parser", pgmDoc ());
-	formatDoc ("Tone Generator", oscDoc ());
-//	formatDoc ("Vibrato Effect", scannerDoc ());
-//	formatDoc ("Preamp/Overdrive Effect", ampDoc ());
-//	formatDoc ("Leslie Cabinet Effect", whirlDoc ());
-//	formatDoc ("Reverb Effect", reverbDoc ());
-#ifdef HAVE_ZITACONVOLVE
-	formatDoc ("Convolution Reverb Effect", convolutionDoc ());
-#endif
+	int m;
+	for (m = 0; m < CFG_MODULES; m++) {
+		formatDoc (configModules[m].title, configModules[m].doc ());
+	}
 
 	printf ("Filter Types (for Leslie):\n");
 	int i;
@@ -314,6 +553,43 @@ parseConfigurationFile (void* inst, const char* fname)
 	return 0;
 }
 
+/*
+ * Reads a configuration file without applying it. Each parameter is
+ * handed to the callback, in the order in which it would be applied;
+ * "config.read" is followed into the named file.
+ * @return -1 if the file can not be opened, 0 otherwise.
+ */
+int
+readConfigurationFile (const char* fname,
+                       void (*cb) (const char* fname, int linenr, const char* name, const char* value, void* arg),
+                       void* arg)
+{
+	int   lineNumber = 0;
+	char  lineBuf[LINEBUFSZ];
+	FILE* fp;
+	char* name;
+	char* value;
+
+	if ((fp = fopen (fname, "r")) == NULL) {
+		perror (fname);
+		return -1;
+	}
+
+	while (fgets (lineBuf, LINEBUFSZ, fp) != NULL) {
+		lineNumber += 1;
+		if (!splitConfigurationLine (fname, lineNumber, lineBuf, &name, &value))
+			continue;
+		if (strcasecmp (name, "config.read") == 0 && value) {
+			readConfigurationFile (value, cb, arg);
+		} else {
+			cb (fname, lineNumber, name, value ? value : "", arg);
+		}
+	}
+
+	fclose (fp);
+	return 0;
+}
+
 void
 showConfigfileContext (ConfigContext* cfg, const char* msg)
 {
@@ -56,6 +56,13 @@ enum conftype {
 	CFG_LAST
 };
 
+/* when a changed parameter takes effect */
+enum cfgscope {
+	CFG_SCOPE_LIVE = 0, /**< right away */
+	CFG_SCOPE_REBUILD,  /**< when the tone generator is rebuilt */
+	CFG_SCOPE_RESTART   /**< when the engine is created again */
+};
+
 typedef struct _configDoc {
 	const char*   name;     /**< parameter name */
 	enum conftype type;     /**< parameter type */
@@ -73,7 +80,13 @@ void parseConfigurationLine (
     char*       oneLine);
 
 int parseConfigurationFile (void* instance, const char* fname);
+int readConfigurationFile (const char* fname,
+                           void (*cb) (const char* fname, int linenr, const char* name, const char* value, void* arg),
+                           void*       arg);
+int getConfigScope (void* instance, const char* name);
 void dumpConfigDoc ();
+void* allocConfigKeys (void* arena);
+void freeConfigKeys (void* k);
 int evaluateConfigKeyValue (void* inst, const char* key, const char* value);
 void showConfigfileContext (ConfigContext* cfg, const char* msg);
 void configIntUnparsable (ConfigContext* cfg);
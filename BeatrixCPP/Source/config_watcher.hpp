@@ -0,0 +1,245 @@
+/*
+OpenB3: an open source sound synthesis engine and JUCE application/plugin that simulates
+the magnificent sound of the Hammond B3 organ and Leslie rotating speaker
+Copyright (C) 2021-2022 Michele Perrone
+Github: https://github.com/michele-perrone/OpenPiano
+Author e-mail: perrone(dot)michele(at)outlook(dot)com
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+/* Watches a configuration and a programme file and reports when they
+ * were saved, so that they can be reloaded into running engines, see
+ * BeatrixPool::reload_config() and Beatrix::reload_config().
+ */
+
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include <stdio.h>
+#include <string.h>
+
+struct BeatrixConfigWatcher
+{
+    /** Editors save in several steps, reload once the file is quiet */
+    static constexpr int DEBOUNCE_MS = 100;
+    /** How often the thread checks for stop(), and polls without inotify */
+    static constexpr int POLL_MS = 100;
+
+    /** The files passed to on_change */
+    enum { CONFIG_FILE = 1, PROGRAMME_FILE = 2 };
+
+    std::string config_file;
+    std::string programme_file;
+
+    /**
+     * @param config_file Optional configuration file. Files it includes
+     *        with "config.read" are not watched.
+     * @param programme_file Optional programme file
+     * @param on_change Called on the thread of the watcher once a file was
+     *        saved and has been quiet for DEBOUNCE_MS, with CONFIG_FILE
+     *        and/or PROGRAMME_FILE. It should hand the reload over to the
+     *        thread that configures the engines.
+     * @param arg Passed to on_change
+     */
+    BeatrixConfigWatcher(const char* config_file, const char* programme_file,
+                         void (*on_change) (int files, void* arg), void* arg)
+        : on_change (on_change), arg (arg)
+    {
+        if (config_file)
+            this->config_file = config_file;
+        if (programme_file)
+            this->programme_file = programme_file;
+    }
+    ~BeatrixConfigWatcher()
+    {
+        stop();
+    }
+
+    /**
+     * @brief Start watching on a thread of its own
+     * @return false if there is nothing to watch
+     */
+    bool start()
+    {
+        if (thread.joinable())
+            return true;
+        if (config_file.empty() && programme_file.empty())
+            return false;
+        running = true;
+        thread = std::thread (&BeatrixConfigWatcher::run, this);
+        return true;
+    }
+
+    void stop()
+    {
+        running = false;
+        if (thread.joinable())
+            thread.join();
+    }
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    struct WatchedFile
+    {
+        const std::string* path;
+        bool dirty = false;
+        clock::time_point due;
+        time_t mtime = 0;
+        off_t size = 0;
+#ifdef __linux__
+        int wd = -1;
+#endif
+    };
+
+    void (*on_change) (int files, void* arg);
+    void* arg;
+
+    std::atomic<bool> running{false};
+    std::thread thread;
+
+    static void file_stat(WatchedFile& f, bool* changed)
+    {
+        struct stat st;
+        if (stat (f.path->c_str(), &st))
+            return;
+        if (st.st_mtime != f.mtime || st.st_size != f.size)
+        {
+            f.mtime = st.st_mtime;
+            f.size = st.st_size;
+            if (changed)
+                *changed = true;
+        }
+    }
+
+    static void mark(WatchedFile& f)
+    {
+        f.dirty = true;
+        f.due = clock::now() + std::chrono::milliseconds (DEBOUNCE_MS);
+    }
+
+#ifdef __linux__
+    /* Watches the directories, editors replace files by renaming over them */
+    static int add_watch(int fd, const std::string& path)
+    {
+        size_t slash = path.rfind ('/');
+        std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr (0, slash);
+        return inotify_add_watch (fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+    }
+
+    static bool is_file(const WatchedFile& f, const struct inotify_event* ev)
+    {
+        if (f.path->empty() || ev->wd != f.wd || ev->len == 0)
+            return false;
+        size_t slash = f.path->rfind ('/');
+        const char* base = f.path->c_str() + (slash == std::string::npos ? 0 : slash + 1);
+        return !strcmp (base, ev->name);
+    }
+#endif
+
+    void run()
+    {
+        WatchedFile files[2];
+        files[0].path = &config_file;
+        files[1].path = &programme_file;
+        for (WatchedFile& f : files)
+            file_stat (f, NULL);
+
+#ifdef __linux__
+        int fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+        if (fd >= 0)
+        {
+            for (WatchedFile& f : files)
+            {
+                if (!f.path->empty() && (f.wd = add_watch (fd, *f.path)) < 0)
+                    perror (f.path->c_str());
+            }
+        }
+        else
+        {
+            perror ("inotify_init1");
+        }
+#endif
+
+        while (running)
+        {
+#ifdef __linux__
+            if (fd >= 0)
+            {
+                struct pollfd pfd = { fd, POLLIN, 0 };
+                if (poll (&pfd, 1, POLL_MS) > 0)
+                {
+                    alignas (struct inotify_event) char buf[4096];
+                    ssize_t len;
+                    while ((len = read (fd, buf, sizeof (buf))) > 0)
+                    {
+                        for (char* p = buf; p < buf + len;)
+                        {
+                            const struct inotify_event* ev = (const struct inotify_event*)p;
+                            for (WatchedFile& f : files)
+                            {
+                                if (is_file (f, ev))
+                                    mark (f);
+                            }
+                            p += sizeof (struct inotify_event) + ev->len;
+                        }
+                    }
+                }
+            }
+            else
+#endif
+            {
+                std::this_thread::sleep_for (std::chrono::milliseconds (POLL_MS));
+                for (WatchedFile& f : files)
+                {
+                    bool changed = false;
+                    if (!f.path->empty())
+                        file_stat (f, &changed);
+                    if (changed)
+                        mark (f);
+                }
+            }
+
+            const clock::time_point now = clock::now();
+            int changed = 0;
+            for (int i = 0; i < 2; i++)
+            {
+                if (files[i].dirty && now >= files[i].due)
+                {
+                    files[i].dirty = false;
+                    changed |= i == 0 ? CONFIG_FILE : PROGRAMME_FILE;
+                }
+            }
+            if (changed)
+                on_change (changed, arg);
+        }
+
+#ifdef __linux__
+        if (fd >= 0)
+            close (fd);
+#endif
+    }
+};
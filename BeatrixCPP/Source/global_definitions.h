@@ -25,18 +25,129 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 extern "C" {
 #endif
 
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
 #define MIN(A, B) (((A) < (B)) ? (A) : (B))
 
 #define UPPER_MANUAL 0
 #define LOWER_MANUAL 1
 #define PEDAL_BOARD  2
 
-extern double SampleRateD;
-
 extern unsigned int defaultPresetUpperManual[9];
 extern unsigned int defaultPresetLowerManual[9];
 extern unsigned int defaultPresetPedalBoard[9];
 
+/**
+ * Time constant (seconds) of the parameter smoothing applied to the
+ * swell pedal, reverb mix and overdrive input gain.
+ */
+#define PARAM_SMOOTH_TIME 0.015
+
+/**
+ * Advances a smoothed parameter by one block of n samples.
+ * The value moves towards its target by a one-pole step per block, and
+ * the caller interpolates linearly inside the block, so that successive
+ * blocks trace a piecewise-linear approximation of an exponential ramp.
+ * @param current  Current value; updated to the value at the end of the block.
+ * @param target   Target value written by the parameter setter.
+ * @param n        Block length in samples.
+ * @param rate     Sample rate of the instance the parameter belongs to.
+ * @returns        The per-sample increment to apply inside the block.
+ */
+static inline float
+paramRampIncrement (float* current, float target, size_t n, double rate)
+{
+	const float start = *current;
+	const float delta = target - start;
+	if (n == 0) {
+		return 0.f;
+	}
+	if (fabsf (delta) < 1e-6f) {
+		*current = target;
+		return delta / (float)n;
+	}
+	*current = start + delta * (1.f - expf (-(float)n / (float)(PARAM_SMOOTH_TIME * rate)));
+	return (*current - start) / (float)n;
+}
+
+/**
+ * Encoding of the multi-byte values of snapshots, see
+ * Beatrix::write_snapshot(). Values are stored little endian, whatever
+ * the byte order of the machine, and the cursor *p is advanced past them.
+ */
+static inline void
+snapshotPut32 (unsigned char** p, uint32_t v)
+{
+	(*p)[0] = (unsigned char)v;
+	(*p)[1] = (unsigned char)(v >> 8);
+	(*p)[2] = (unsigned char)(v >> 16);
+	(*p)[3] = (unsigned char)(v >> 24);
+	*p += 4;
+}
+
+static inline uint32_t
+snapshotGet32 (const unsigned char** p)
+{
+	const uint32_t v = (uint32_t)(*p)[0] | (uint32_t)(*p)[1] << 8 | (uint32_t)(*p)[2] << 16 | (uint32_t)(*p)[3] << 24;
+	*p += 4;
+	return v;
+}
+
+static inline void
+snapshotPut16 (unsigned char** p, uint16_t v)
+{
+	(*p)[0] = (unsigned char)v;
+	(*p)[1] = (unsigned char)(v >> 8);
+	*p += 2;
+}
+
+static inline uint16_t
+snapshotGet16 (const unsigned char** p)
+{
+	const uint16_t v = (uint16_t)((*p)[0] | (*p)[1] << 8);
+	*p += 2;
+	return v;
+}
+
+static inline void
+snapshotPutFloat (unsigned char** p, float f)
+{
+	uint32_t v;
+	memcpy (&v, &f, sizeof (v));
+	snapshotPut32 (p, v);
+}
+
+static inline float
+snapshotGetFloat (const unsigned char** p)
+{
+	const uint32_t v = snapshotGet32 (p);
+	float          f;
+	memcpy (&f, &v, sizeof (f));
+	return f;
+}
+
+static inline void
+snapshotPutDouble (unsigned char** p, double d)
+{
+	uint64_t v;
+	memcpy (&v, &d, sizeof (v));
+	snapshotPut32 (p, (uint32_t)v);
+	snapshotPut32 (p, (uint32_t)(v >> 32));
+}
+
+static inline double
+snapshotGetDouble (const unsigned char** p)
+{
+	uint64_t v = snapshotGet32 (p);
+	double   d;
+	v |= (uint64_t)snapshotGet32 (p) << 32;
+	memcpy (&d, &v, sizeof (d));
+	return d;
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -31,6 +31,7 @@ extern "C" {
 #include "vibrato.h"
 #include "whirl.h"
 
+#include "arena.h"
 #include "cfgParser.h"
 #include "main.h"
 #include "midi.h"
@@ -45,6 +46,8 @@ typedef struct b_instance {
 	void*               midicfg;
 	void*               preamp;
 	void*               state;
+	void*               cfgkeys;
+	void*               arena; /* the memory of all of the above, see arenaCreate() */
 } b_instance;
 
 /* clang-format off */
@@ -18,10 +18,10 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include "beatrix.hpp"
-
 #define _XOPEN_SOURCE 700
 
+#include "beatrix.hpp"
+
 #include <ctype.h>
 #include <fcntl.h>
 #include <getopt.h>
@@ -33,7 +33,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
 /*
@@ -50,6 +52,8 @@
 #endif
 
 #include "main.h"
+#include "smf.h"
+#include "server/render_server.h"
 
 /*
 #include "global_inst.h"
@@ -84,9 +88,553 @@ parse_preset (unsigned int* p, const char* c)
 	}
 }
 
-int main()
+/* ----------------------------------------------------------------
+ * Offline renderer
+ * ----------------------------------------------------------------*/
+
+static void
+usage (const char* prog)
+{
+	fprintf (stderr,
+	         "Usage: %s [options] <file.mid>...\n"
+	         "       %s [options] -S <socket>\n"
+	         "Render Standard MIDI Files to audio, as fast as possible.\n"
+	         "Several files are rendered in parallel, each by its own engine.\n"
+	         "With -S, serve engines to other programs on this machine instead,\n"
+	         "until interrupted. See Source/server/render_server.h for the protocol.\n"
+	         "\n"
+	         "Options:\n"
+	         "  -c <file>   configuration file\n"
+	         "  -p <file>   programme file\n"
+	         "  -o <file>   output file, single input only\n"
+	         "              (default: <file>.wav, or .raw with -f; the input\n"
+	         "              extension is kept where two names would collide)\n"
+	         "  -j <n>      number of render threads (default: number of CPUs)\n"
+	         "  -f          write raw interleaved 32bit float instead of WAV\n"
+	         "  -r <rate>   sample rate in Hz (default: 48000)\n"
+	         "  -b <n>      render block size in samples (default: 8192,\n"
+	         "              with -S the period size, default: 256)\n"
+	         "  -t <sec>    tail rendered after the last event (default: 2.0)\n"
+	         "  -S <path>   run as a render server listening on this Unix socket\n"
+	         "  -n <n>      number of engines of the render server (default: 4)\n"
+	         "  -w          with -S, reload the -c and -p files into the engines\n"
+	         "              when they are saved\n"
+	         "  -h          print this help and exit\n"
+	         "\n"
+	         "MIDI channel 1 plays the upper manual, channel 2 the lower manual\n"
+	         "and channel 3 the pedals.\n",
+	         prog, prog);
+}
+
+static void
+put_le (uint8_t* p, uint32_t v, int n)
+{
+	while (n--) {
+		*p++ = v & 0xff;
+		v >>= 8;
+	}
+}
+
+/* The RIFF chunk sizes are 32bit; longer renders need raw output (-f) */
+#define WAV_MAX_FRAMES ((UINT32_MAX - 50) / (2 * sizeof (float)))
+
+/*
+ * Writes a 58 byte header for a stereo 32bit float WAV file.
+ * Called with n_frames = 0 first and again with the final length,
+ * which must not exceed WAV_MAX_FRAMES.
+ */
+static int
+write_wav_header (FILE* fp, uint32_t rate, uint32_t n_frames)
+{
+	uint8_t        h[58];
+	const uint32_t data_len = n_frames * 2 * sizeof (float);
+
+	memcpy (h, "RIFF", 4);
+	put_le (h + 4, 50 + data_len, 4);
+	memcpy (h + 8, "WAVEfmt ", 8);
+	put_le (h + 16, 18, 4);                       /* fmt chunk size */
+	put_le (h + 20, 3, 2);                        /* WAVE_FORMAT_IEEE_FLOAT */
+	put_le (h + 22, 2, 2);                        /* channels */
+	put_le (h + 24, rate, 4);                     /* sample rate */
+	put_le (h + 28, rate * 2 * sizeof (float), 4); /* byte rate */
+	put_le (h + 32, 2 * sizeof (float), 2);       /* block align */
+	put_le (h + 34, 32, 2);                       /* bits per sample */
+	put_le (h + 36, 0, 2);                        /* extension size */
+	memcpy (h + 38, "fact", 4);
+	put_le (h + 42, 4, 4);
+	put_le (h + 46, n_frames, 4);
+	memcpy (h + 50, "data", 4);
+	put_le (h + 54, data_len, 4);
+
+	if (fseek (fp, 0, SEEK_SET) || fwrite (h, sizeof (h), 1, fp) != 1) {
+		return -1;
+	}
+	return 0;
+}
+
+static double
+wallclock ()
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Renders all events of a MIDI file. Every event is delivered to the
+ * engine at its exact sample position; get_next_block is split there.
+ * Note that the tone generator itself only picks up key changes at
+ * the start of its internal BUFFER_SIZE_SAMPLES fragments.
+ * @returns  The number of frames written, or -1 on write error.
+ */
+static int64_t
+render_smf (Beatrix&               beatrix,
+            const struct smf_file* smf,
+            double                 tail,
+            size_t                 block_size,
+            FILE*                  fp,
+            bool                   wav)
 {
-    Beatrix beatrix(48000);
+	const double   rate     = beatrix.get_sample_rate ();
+	const uint64_t n_frames = (uint64_t)ceil ((smf->duration + tail) * rate);
+	uint64_t       pos      = 0;
+	size_t         ev       = 0;
+
+	float* L  = (float*)malloc (block_size * sizeof (float));
+	float* R  = (float*)malloc (block_size * sizeof (float));
+	float* LR = (float*)malloc (2 * block_size * sizeof (float));
+
+	if (!L || !R || !LR) {
+		fprintf (stderr, "FATAL: memory allocation failed for render buffers.\n");
+		exit (1);
+	}
+
+	if (wav && write_wav_header (fp, (uint32_t)rate, 0)) {
+		pos = n_frames + 1; /* skip rendering, report error below */
+	}
+
+	while (pos < n_frames) {
+		const uint64_t end = MIN (pos + block_size, n_frames);
+		uint64_t       cur = pos;
+		size_t         i;
+
+		while (cur < end) {
+			uint64_t next = end;
+			while (ev < smf->n_events && (uint64_t)llrint (smf->events[ev].time * rate) <= cur) {
+				beatrix.process_midi_message (smf->events[ev].data, smf->events[ev].size);
+				++ev;
+			}
+			if (ev < smf->n_events) {
+				next = MIN (next, (uint64_t)llrint (smf->events[ev].time * rate));
+			}
+			beatrix.get_next_block (&L[cur - pos], &R[cur - pos], (int)(next - cur));
+			cur = next;
+		}
+
+		for (i = 0; i < end - pos; ++i) {
+			LR[2 * i]     = L[i];
+			LR[2 * i + 1] = R[i];
+		}
+		if (fwrite (LR, 2 * sizeof (float), end - pos, fp) != end - pos) {
+			break;
+		}
+		pos = end;
+	}
+
+	free (L);
+	free (R);
+	free (LR);
+
+	if (pos != n_frames) {
+		return -1;
+	}
+	if (wav && (n_frames > WAV_MAX_FRAMES || write_wav_header (fp, (uint32_t)rate, (uint32_t)n_frames))) {
+		return -1;
+	}
+	return (int64_t)n_frames;
+}
+
+/* ----------------------------------------------------------------
+ * Batch rendering
+ * ----------------------------------------------------------------*/
+
+struct render_job {
+	const char* midi_file;
+	char*       output_file;
+	off_t       cost; /**< size of the MIDI file, used for scheduling */
+	int         rv;
+};
+
+/* The jobs of one worker. The owner takes from the head, others steal from the tail */
+struct job_deque {
+	pthread_mutex_t lock;
+	size_t*         idx;
+	size_t          head;
+	size_t          tail;
+};
+
+struct render_pool {
+	struct render_job* jobs;
+	struct job_deque*  deques;
+	int                n_workers;
+
+	const char*    config_file;
+	const char*    programme_file;
+	const Beatrix* prototype;
+	double         rate;
+	size_t         block_size;
+	double         tail;
+	bool           raw;
+
+	/* Config parsing uses strtok() and setlocale(), construction is serialized */
+	pthread_mutex_t construct_lock;
+};
+
+struct render_worker {
+	struct render_pool* pool;
+	int                 id;
+	pthread_t           thread;
+};
+
+/*
+ * @param full  Keep the extension of the MIDI file, "x.mid.wav" instead
+ *              of "x.wav".
+ */
+static char*
+output_name (const char* midi_file, bool raw, bool full)
+{
+	const char* ext = raw ? ".raw" : ".wav";
+	const char* dot = strrchr (midi_file, '.');
+	size_t      len = (dot && !strchr (dot, '/') && !full) ? (size_t)(dot - midi_file) : strlen (midi_file);
+	char*       rv  = (char*)malloc (len + strlen (ext) + 1);
+	if (!rv) {
+		fprintf (stderr, "FATAL: memory allocation failed for output file name.\n");
+		exit (1);
+	}
+	memcpy (rv, midi_file, len);
+	strcpy (rv + len, ext);
+	return rv;
+}
+
+/*
+ * Gives jobs whose output names collide, e.g. for x.mid and x.midi,
+ * the full name of the MIDI file with the output extension instead.
+ * @returns  0, or -1 if output names still collide.
+ */
+static int
+resolve_output_names (struct render_job* jobs, size_t n_jobs, bool raw)
+{
+	bool*  full = (bool*)calloc (n_jobs, sizeof (bool));
+	size_t i, j;
+	int    rv = 0;
+
+	if (!full) {
+		fprintf (stderr, "FATAL: memory allocation failed for render jobs.\n");
+		exit (1);
+	}
+	for (i = 0; i < n_jobs; ++i) {
+		for (j = i + 1; j < n_jobs; ++j) {
+			if (!strcmp (jobs[i].output_file, jobs[j].output_file)) {
+				full[i] = full[j] = true;
+			}
+		}
+	}
+	for (i = 0; i < n_jobs; ++i) {
+		if (full[i]) {
+			free (jobs[i].output_file);
+			jobs[i].output_file = output_name (jobs[i].midi_file, raw, true);
+		}
+	}
+	for (i = 0; i < n_jobs && !rv; ++i) {
+		for (j = i + 1; j < n_jobs && !rv; ++j) {
+			if (!strcmp (jobs[i].output_file, jobs[j].output_file)) {
+				fprintf (stderr, "%s and %s would both be written to %s.\n",
+				         jobs[i].midi_file, jobs[j].midi_file, jobs[i].output_file);
+				rv = -1;
+			}
+		}
+	}
+	free (full);
+	return rv;
+}
+
+/*
+ * Takes the next job of a worker, stealing from the other workers
+ * once its own deque is empty. No jobs are added after the workers are
+ * started, so when all deques are empty the worker is done.
+ * @returns  The job, or NULL when there is no work left.
+ */
+static struct render_job*
+next_job (struct render_pool* pool, int id)
+{
+	int k;
+	for (k = 0; k < pool->n_workers; ++k) {
+		struct job_deque*  d   = &pool->deques[(id + k) % pool->n_workers];
+		struct render_job* job = NULL;
+		pthread_mutex_lock (&d->lock);
+		if (d->head < d->tail) {
+			job = &pool->jobs[k == 0 ? d->idx[d->head++] : d->idx[--d->tail]];
+		}
+		pthread_mutex_unlock (&d->lock);
+		if (job) {
+			return job;
+		}
+	}
+	return NULL;
+}
+
+static int
+render_file (struct render_pool* pool, struct render_job* job)
+{
+	struct smf_file* smf = smf_load (job->midi_file);
+	if (!smf) {
+		return 1;
+	}
+
+	if (!pool->raw && ceil ((smf->duration + pool->tail) * pool->rate) > WAV_MAX_FRAMES) {
+		fprintf (stderr, "%s: too long for a WAV file, use -f for raw output.\n", job->midi_file);
+		smf_free (smf);
+		return 1;
+	}
+
+	FILE* fp = fopen (job->output_file, "wb");
+	if (!fp) {
+		perror (job->output_file);
+		smf_free (smf);
+		return 1;
+	}
+
+	pthread_mutex_lock (&pool->construct_lock);
+	Beatrix* beatrix = new Beatrix (pool->rate, pool->config_file, pool->programme_file, pool->prototype);
+	pthread_mutex_unlock (&pool->construct_lock);
+
+	const double t0       = wallclock ();
+	int64_t      n_frames = render_smf (*beatrix, smf, pool->tail, pool->block_size, fp, !pool->raw);
+	const double elapsed  = wallclock () - t0;
+
+	delete beatrix;
+
+	int rv = 0;
+	if (fclose (fp) || n_frames < 0) {
+		fprintf (stderr, "%s: write error.\n", job->output_file);
+		rv = 1;
+	} else {
+		const double seconds = n_frames / pool->rate;
+		fprintf (stderr, "%s: %zu events, %.2f s of audio rendered in %.2f s (%.1fx realtime)\n",
+		         job->output_file, smf->n_events, seconds, elapsed,
+		         elapsed > 0 ? seconds / elapsed : 0);
+	}
+
+	smf_free (smf);
+	return rv;
+}
+
+static void*
+render_worker_main (void* arg)
+{
+	struct render_worker* w = (struct render_worker*)arg;
+	struct render_job*    job;
+	while ((job = next_job (w->pool, w->id)) != NULL) {
+		job->rv = render_file (w->pool, job);
+	}
+	return NULL;
+}
+
+static int
+job_cost_compare (const void* a, const void* b)
+{
+	const struct render_job* ja = (const struct render_job*)a;
+	const struct render_job* jb = (const struct render_job*)b;
+	return ja->cost > jb->cost ? -1 : (ja->cost < jb->cost);
+}
+
+int
+main (int argc, char** argv)
+{
+	const char* config_file    = NULL;
+	const char* programme_file = NULL;
+	const char* output_file    = NULL;
+	const char* socket_path    = NULL;
+	bool        raw            = false;
+	double      rate           = 48000;
+	long        block_size     = 0;
+	double      tail           = 2.0;
+	long        n_threads      = sysconf (_SC_NPROCESSORS_ONLN);
+	long        n_instances    = 4;
+	bool        watch          = false;
+	int         c;
+
+	while ((c = getopt (argc, argv, "c:p:o:j:fr:b:t:S:n:wh")) != -1) {
+		switch (c) {
+			case 'c':
+				config_file = optarg;
+				break;
+			case 'p':
+				programme_file = optarg;
+				break;
+			case 'o':
+				output_file = optarg;
+				break;
+			case 'j':
+				n_threads = atol (optarg);
+				break;
+			case 'f':
+				raw = true;
+				break;
+			case 'r':
+				rate = atof (optarg);
+				break;
+			case 'b':
+				block_size = atol (optarg);
+				break;
+			case 't':
+				tail = atof (optarg);
+				break;
+			case 'S':
+				socket_path = optarg;
+				break;
+			case 'n':
+				n_instances = atol (optarg);
+				break;
+			case 'w':
+				watch = true;
+				break;
+			case 'h':
+				usage (argv[0]);
+				return 0;
+			default:
+				usage (argv[0]);
+				return 1;
+		}
+	}
+
+	const size_t n_jobs = argc - optind;
+
+	if (socket_path ? (n_jobs > 0 || output_file) : (n_jobs == 0 || (output_file && n_jobs > 1) || watch)) {
+		usage (argv[0]);
+		return 1;
+	}
+	if (block_size == 0) {
+		block_size = socket_path ? 256 : 8192;
+	}
+	if (rate < 8000 || rate > 384000 || block_size < 1 || tail < 0 || n_threads < 1 || n_instances < 1) {
+		fprintf (stderr, "Invalid sample rate, block size, tail length, thread or engine count.\n");
+		return 1;
+	}
+	if ((config_file && access (config_file, R_OK)) || (programme_file && access (programme_file, R_OK))) {
+		perror (config_file && access (config_file, R_OK) ? config_file : programme_file);
+		return 1;
+	}
+
+	if (socket_path) {
+		struct render_server_options opt;
+		opt.socket_path    = socket_path;
+		opt.config_file    = config_file;
+		opt.programme_file = programme_file;
+		opt.rate           = rate;
+		opt.period_frames  = (int)block_size;
+		opt.n_instances    = (int)n_instances;
+		opt.n_workers      = (int)MIN (n_threads, n_instances);
+		opt.watch          = watch;
+		return render_server_main (&opt);
+	}
+
+	struct render_pool pool;
+	size_t             i;
+	int                w;
+
+	memset (&pool, 0, sizeof (struct render_pool));
+	pool.config_file    = config_file;
+	pool.programme_file = programme_file;
+	pool.rate           = rate;
+	pool.block_size     = (size_t)block_size;
+	pool.tail           = tail;
+	pool.raw            = raw;
+	pool.n_workers      = (int)MIN ((size_t)n_threads, n_jobs);
+	pool.jobs           = (struct render_job*)calloc (n_jobs, sizeof (struct render_job));
+	pool.deques         = (struct job_deque*)calloc (pool.n_workers, sizeof (struct job_deque));
+	pthread_mutex_init (&pool.construct_lock, NULL);
+
+	if (!pool.jobs || !pool.deques) {
+		fprintf (stderr, "FATAL: memory allocation failed for render jobs.\n");
+		return 1;
+	}
+
+	for (i = 0; i < n_jobs; ++i) {
+		struct stat st;
+		pool.jobs[i].midi_file   = argv[optind + i];
+		pool.jobs[i].output_file = output_file ? strdup (output_file) : output_name (argv[optind + i], raw, false);
+		pool.jobs[i].cost        = stat (argv[optind + i], &st) ? 0 : st.st_size;
+	}
+
+	if (resolve_output_names (pool.jobs, n_jobs, raw)) {
+		return 1;
+	}
+
+	/* Longest first, dealt out round-robin so that every worker starts
+	 * with a share of the big files; stealing evens out the rest. */
+	qsort (pool.jobs, n_jobs, sizeof (struct render_job), job_cost_compare);
+
+	for (w = 0; w < pool.n_workers; ++w) {
+		struct job_deque* d = &pool.deques[w];
+		pthread_mutex_init (&d->lock, NULL);
+		d->idx = (size_t*)malloc (n_jobs * sizeof (size_t));
+		if (!d->idx) {
+			fprintf (stderr, "FATAL: memory allocation failed for render jobs.\n");
+			return 1;
+		}
+		for (i = w; i < n_jobs; i += pool.n_workers) {
+			d->idx[d->tail++] = i;
+		}
+	}
+
+	/* Wave tables are computed once and shared by all engines */
+	Beatrix* prototype = NULL;
+	if (n_jobs > 1) {
+		prototype      = new Beatrix (rate, config_file, programme_file);
+		pool.prototype = prototype;
+	}
+
+	const double t0 = wallclock ();
+
+	struct render_worker* workers = (struct render_worker*)calloc (pool.n_workers, sizeof (struct render_worker));
+	if (!workers) {
+		fprintf (stderr, "FATAL: memory allocation failed for render threads.\n");
+		return 1;
+	}
+	for (w = 0; w < pool.n_workers; ++w) {
+		workers[w].pool = &pool;
+		workers[w].id   = w;
+		if (pthread_create (&workers[w].thread, NULL, render_worker_main, &workers[w])) {
+			fprintf (stderr, "FATAL: cannot create render thread.\n");
+			return 1;
+		}
+	}
+	for (w = 0; w < pool.n_workers; ++w) {
+		pthread_join (workers[w].thread, NULL);
+	}
+
+	int n_failed = 0;
+	for (i = 0; i < n_jobs; ++i) {
+		n_failed += pool.jobs[i].rv != 0;
+		free (pool.jobs[i].output_file);
+	}
+
+	if (n_jobs > 1) {
+		fprintf (stderr, "%zu files rendered with %d threads in %.2f s, %d failed.\n",
+		         n_jobs, pool.n_workers, wallclock () - t0, n_failed);
+	}
+
+	delete prototype;
+
+	for (w = 0; w < pool.n_workers; ++w) {
+		pthread_mutex_destroy (&pool.deques[w].lock);
+		free (pool.deques[w].idx);
+	}
+	pthread_mutex_destroy (&pool.construct_lock);
+	free (workers);
+	free (pool.deques);
+	free (pool.jobs);
 
-    return 0;
+	return n_failed ? 1 : 0;
 }
@@ -38,6 +38,7 @@
     #include <unistd.h>
 #endif
 
+#include "global_definitions.h"
 #include "global_inst.h"
 #include "main.h"
 #include "midi.h"
@@ -201,6 +202,8 @@ typedef struct {
 /* ---------------------------------------------------------------- */
 
 struct b_midicfg {
+	void* arena; /* of this struct; the reverse maps are on the heap */
+
 	/* Used by the MIDI parser to record message bytes */
 
 	unsigned char rcvChA; /* MIDI receive channel */
@@ -296,11 +299,12 @@ resetMidiCfg (void* mcfg)
 }
 
 void*
-allocMidiCfg (void* stateptr)
+allocMidiCfg (void* arena, void* stateptr)
 {
-	struct b_midicfg* mcfg = (struct b_midicfg*)calloc (1, sizeof (struct b_midicfg));
+	struct b_midicfg* mcfg = (struct b_midicfg*)arenaAlloc (arena, sizeof (struct b_midicfg));
 	if (!mcfg)
 		return NULL;
+	mcfg->arena = arena;
 	resetMidiCfg (mcfg);
 	mcfg->rcstate = stateptr;
 	return mcfg;
@@ -322,7 +326,7 @@ freeMidiCfg (void* mcfg)
 			t1 = t2;
 		} while (t1);
 	}
-	free (m);
+	arenaFree (m->arena, m);
 }
 
 /* ---------------------------------------------------------------- */
@@ -451,6 +455,29 @@ useMIDIControlFunction (void* mcfg, const char* cfname, void (*f) (void*, unsign
 	m->ctrlvecF[x].id = x;
 }
 
+/**
+ * Points the control functions that were registered with data pointer from
+ * to data pointer to instead. Used when a module instance is replaced while
+ * running; it does not allocate.
+ */
+void
+rebindMIDIControlFunctions (void* mcfg, const void* from, void* to)
+{
+	struct b_midicfg* m = (struct b_midicfg*)mcfg;
+	int               i;
+
+	for (i = 0; i < 128; i++) {
+		if (m->ctrlvecA[i].d == from)
+			m->ctrlvecA[i].d = to;
+		if (m->ctrlvecB[i].d == from)
+			m->ctrlvecB[i].d = to;
+		if (m->ctrlvecC[i].d == from)
+			m->ctrlvecC[i].d = to;
+		if (m->ctrlvecF[i].d == from)
+			m->ctrlvecF[i].d = to;
+	}
+}
+
 static void
 reverse_cc_map (struct b_midicfg* m, int x, uint8_t chn, uint8_t param)
 {
@@ -541,6 +568,17 @@ callMIDIControlFunction (void* mcfg, const char* cfname, unsigned char val)
 	}
 }
 
+void
+callMIDIControlFunctionById (void* mcfg, int id, unsigned char val)
+{
+	struct b_midicfg* m = (struct b_midicfg*)mcfg;
+	if (id >= 0 && id < 128 && m->ctrlvecF[id].fn) {
+		if (val > 127)
+			val = 127;
+		execControlFunction (m, &m->ctrlvecF[id], val);
+	}
+}
+
 void
 notifyControlChangeById (void* mcfg, int id, unsigned char val)
 {
@@ -1135,6 +1173,322 @@ initMidiTables (void* mcfg)
 	loadStatusTable (m);
 }
 
+/* ---------------------------------------------------------------- */
+
+/*
+ * The part of the MIDI configuration that is kept in a snapshot: channel
+ * assignments, note-to-key tables and the controller mapping. Function
+ * pointers are not saved; they are re-derived from the control functions
+ * registered with this instance.
+ */
+struct b_midisnapshot {
+	int32_t rcvCh[3];
+	int32_t transpose;
+	int32_t nsh[6];
+	int32_t split[2];
+	int32_t userExcursionStrategy;
+
+	unsigned char keyTable[3][128];
+	unsigned char ctrlUse[3][CTRL_USE_MAX];
+	midiccflags_t ctrlflg[16][128];
+};
+
+/* Size of a b_midisnapshot in a snapshot: the integers, little endian, then the tables */
+#define MIDI_SNAPSHOT_INTS 13
+#define MIDI_SNAPSHOT_SIZE (MIDI_SNAPSHOT_INTS * 4 + 3 * 128 + 3 * CTRL_USE_MAX + 16 * 128 * sizeof (midiccflags_t))
+
+static void
+midiSnapshotEncode (const struct b_midisnapshot* s, unsigned char* p)
+{
+	int i;
+	for (i = 0; i < 3; i++) {
+		snapshotPut32 (&p, (uint32_t)s->rcvCh[i]);
+	}
+	snapshotPut32 (&p, (uint32_t)s->transpose);
+	for (i = 0; i < 6; i++) {
+		snapshotPut32 (&p, (uint32_t)s->nsh[i]);
+	}
+	for (i = 0; i < 2; i++) {
+		snapshotPut32 (&p, (uint32_t)s->split[i]);
+	}
+	snapshotPut32 (&p, (uint32_t)s->userExcursionStrategy);
+	memcpy (p, s->keyTable, sizeof (s->keyTable));
+	p += sizeof (s->keyTable);
+	memcpy (p, s->ctrlUse, sizeof (s->ctrlUse));
+	p += sizeof (s->ctrlUse);
+	memcpy (p, s->ctrlflg, sizeof (s->ctrlflg));
+}
+
+static void
+midiSnapshotDecode (struct b_midisnapshot* s, const unsigned char* p)
+{
+	int i;
+	for (i = 0; i < 3; i++) {
+		s->rcvCh[i] = (int32_t)snapshotGet32 (&p);
+	}
+	s->transpose = (int32_t)snapshotGet32 (&p);
+	for (i = 0; i < 6; i++) {
+		s->nsh[i] = (int32_t)snapshotGet32 (&p);
+	}
+	for (i = 0; i < 2; i++) {
+		s->split[i] = (int32_t)snapshotGet32 (&p);
+	}
+	s->userExcursionStrategy = (int32_t)snapshotGet32 (&p);
+	memcpy (s->keyTable, p, sizeof (s->keyTable));
+	p += sizeof (s->keyTable);
+	memcpy (s->ctrlUse, p, sizeof (s->ctrlUse));
+	p += sizeof (s->ctrlUse);
+	memcpy (s->ctrlflg, p, sizeof (s->ctrlflg));
+}
+
+/*
+ * Writes the MIDI mapping of an instance to buf.
+ * @return the number of bytes needed; nothing is written if len is smaller.
+ */
+size_t
+midiSnapshotWrite (void* mcfg, void* buf, size_t len)
+{
+	struct b_midicfg*     m = (struct b_midicfg*)mcfg;
+	struct b_midisnapshot s;
+
+	if (len < MIDI_SNAPSHOT_SIZE)
+		return MIDI_SNAPSHOT_SIZE;
+
+	s.rcvCh[0]              = m->rcvChA;
+	s.rcvCh[1]              = m->rcvChB;
+	s.rcvCh[2]              = m->rcvChC;
+	s.transpose             = m->transpose;
+	s.nsh[0]                = m->nshA;
+	s.nsh[1]                = m->nshA_U;
+	s.nsh[2]                = m->nshA_PL;
+	s.nsh[3]                = m->nshA_UL;
+	s.nsh[4]                = m->nshB;
+	s.nsh[5]                = m->nshC;
+	s.split[0]              = m->splitA_PL;
+	s.split[1]              = m->splitA_UL;
+	s.userExcursionStrategy = m->userExcursionStrategy;
+
+	memcpy (s.keyTable[0], m->keyTableA, 128);
+	memcpy (s.keyTable[1], m->keyTableB, 128);
+	memcpy (s.keyTable[2], m->keyTableC, 128);
+	memcpy (s.ctrlUse[0], m->ctrlUseA, CTRL_USE_MAX);
+	memcpy (s.ctrlUse[1], m->ctrlUseB, CTRL_USE_MAX);
+	memcpy (s.ctrlUse[2], m->ctrlUseC, CTRL_USE_MAX);
+	memcpy (s.ctrlflg, m->ctrlflg, sizeof (s.ctrlflg));
+
+	midiSnapshotEncode (&s, (unsigned char*)buf);
+	return MIDI_SNAPSHOT_SIZE;
+}
+
+/*
+ * Assigns the registered control functions to the controllers in
+ * ctrlUseA, ctrlUseB and ctrlUseC, and reloads the status table for the
+ * current receive channels. The reverse maps are not touched, it does not
+ * allocate.
+ */
+static void
+assignControllers (struct b_midicfg* m)
+{
+	int i;
+
+	for (i = 0; i < 128; i++) {
+		assignMIDIControllerFunction (m->ctrlvecA, i, -1, NULL, NULL);
+		assignMIDIControllerFunction (m->ctrlvecB, i, -1, NULL, NULL);
+		assignMIDIControllerFunction (m->ctrlvecC, i, -1, NULL, NULL);
+	}
+
+	/* the mapping was checked when it was made, assign without warnings */
+	for (i = 0; i < CTRL_USE_MAX; i++) {
+		ctrl_function* f = &m->ctrlvecF[i];
+		if (f->fn == emptyControlFunction || f->fn == NULL)
+			continue;
+		if (m->ctrlUseA[i] < 128) {
+			m->ctrlvecA[m->ctrlUseA[i]].fn = f->fn;
+			m->ctrlvecA[m->ctrlUseA[i]].d  = f->d;
+			m->ctrlvecA[m->ctrlUseA[i]].id = i;
+		}
+		if (m->ctrlUseB[i] < 128) {
+			m->ctrlvecB[m->ctrlUseB[i]].fn = f->fn;
+			m->ctrlvecB[m->ctrlUseB[i]].d  = f->d;
+			m->ctrlvecB[m->ctrlUseB[i]].id = i;
+		}
+		if (m->ctrlUseC[i] < 128) {
+			m->ctrlvecC[m->ctrlUseC[i]].fn = f->fn;
+			m->ctrlvecC[m->ctrlUseC[i]].d  = f->d;
+			m->ctrlvecC[m->ctrlUseC[i]].id = i;
+		}
+	}
+
+	loadStatusTable (m);
+}
+
+/*
+ * Re-assigns the registered control functions to the controllers in
+ * ctrlUseA, ctrlUseB and ctrlUseC, and reloads the status table for the
+ * current receive channels. Used after the mapping was changed while
+ * running. Not realtime safe.
+ */
+void
+midiRebindControllers (void* mcfg)
+{
+	struct b_midicfg* m = (struct b_midicfg*)mcfg;
+	int               i;
+
+	/* drop the reverse maps, keep the registered functions */
+	for (i = 0; i < 128; i++) {
+		midiCCmap *t1, *t2;
+		for (t1 = m->ctrlvecF[i].mm; t1; t1 = t2) {
+			t2 = t1->next;
+			free (t1);
+		}
+		m->ctrlvecF[i].mm = NULL;
+	}
+
+	for (i = 0; i < CTRL_USE_MAX; i++) {
+		ctrl_function* f = &m->ctrlvecF[i];
+		if (f->fn == emptyControlFunction || f->fn == NULL)
+			continue;
+		if (m->ctrlUseA[i] < 128)
+			reverse_cc_map (m, i, m->rcvChA, m->ctrlUseA[i]);
+		if (m->ctrlUseB[i] < 128)
+			reverse_cc_map (m, i, m->rcvChB, m->ctrlUseB[i]);
+		if (m->ctrlUseC[i] < 128)
+			reverse_cc_map (m, i, m->rcvChC, m->ctrlUseC[i]);
+	}
+
+	assignControllers (m);
+}
+
+/*
+ * Allocates a copy of a MIDI configuration on the heap, with reverse maps
+ * of its own, to be changed aside while the original is in use.
+ * See exchangeMidiCfg(). Not realtime safe.
+ */
+void*
+cloneMidiCfg (void* mcfg)
+{
+	struct b_midicfg* c = (struct b_midicfg*)arenaAlloc (NULL, sizeof (struct b_midicfg));
+	int               i;
+
+	if (!c)
+		return NULL;
+	memcpy (c, mcfg, sizeof (struct b_midicfg));
+	c->arena = NULL;
+	for (i = 0; i < 128; i++) {
+		c->ctrlvecF[i].mm = NULL;
+	}
+	midiRebindControllers (c);
+	return c;
+}
+
+static void
+swapBytes (void* a, void* b, size_t n)
+{
+	unsigned char* x = (unsigned char*)a;
+	unsigned char* y = (unsigned char*)b;
+	while (n--) {
+		unsigned char t = *x;
+		*x++            = *y;
+		*y++            = t;
+	}
+}
+
+#define SWAP_FIELD(A, B, F) swapBytes (&(A)->F, &(B)->F, sizeof ((A)->F))
+
+/*
+ * Swaps the receive channels, transposes, note-to-key tables and controller
+ * mapping of mcfg with those of staged, a configuration built aside with
+ * cloneMidiCfg(). The registered control functions, a pending controller
+ * assignment and the state hooks stay with mcfg, so staged may be older
+ * than a module that was replaced since. It does not allocate: the audio
+ * thread calls it, and staged is freed afterwards with what mcfg had.
+ */
+void
+exchangeMidiCfg (void* mcfg, void* staged)
+{
+	struct b_midicfg* m = (struct b_midicfg*)mcfg;
+	struct b_midicfg* s = (struct b_midicfg*)staged;
+	int               i;
+
+	SWAP_FIELD (m, s, rcvChA);
+	SWAP_FIELD (m, s, rcvChB);
+	SWAP_FIELD (m, s, rcvChC);
+	SWAP_FIELD (m, s, transpose);
+	SWAP_FIELD (m, s, nshA);
+	SWAP_FIELD (m, s, nshA_U);
+	SWAP_FIELD (m, s, nshA_PL);
+	SWAP_FIELD (m, s, nshA_UL);
+	SWAP_FIELD (m, s, nshB);
+	SWAP_FIELD (m, s, nshC);
+	SWAP_FIELD (m, s, splitA_PL);
+	SWAP_FIELD (m, s, splitA_UL);
+	SWAP_FIELD (m, s, userExcursionStrategy);
+	SWAP_FIELD (m, s, keyTableA);
+	SWAP_FIELD (m, s, keyTableB);
+	SWAP_FIELD (m, s, keyTableC);
+	SWAP_FIELD (m, s, ctrlUseA);
+	SWAP_FIELD (m, s, ctrlUseB);
+	SWAP_FIELD (m, s, ctrlUseC);
+	SWAP_FIELD (m, s, ctrlflg);
+	for (i = 0; i < 128; i++) {
+		SWAP_FIELD (m, s, ctrlvecF[i].mm);
+	}
+
+	assignControllers (m);
+}
+
+#undef SWAP_FIELD
+
+/*
+ * Replaces the MIDI mapping of an instance with one written by
+ * midiSnapshotWrite() and re-assigns the registered control functions
+ * to the restored controllers. Not realtime safe.
+ * @return 0 on success, -1 if the data is not a valid MIDI mapping.
+ */
+int
+midiSnapshotRead (void* mcfg, const void* buf, size_t len)
+{
+	struct b_midicfg*     m = (struct b_midicfg*)mcfg;
+	struct b_midisnapshot s;
+	int                   i;
+
+	if (len != MIDI_SNAPSHOT_SIZE)
+		return -1;
+	midiSnapshotDecode (&s, (const unsigned char*)buf);
+
+	for (i = 0; i < 3; i++) {
+		if (s.rcvCh[i] < 0 || s.rcvCh[i] > 15)
+			return -1;
+	}
+
+	m->rcvChA                = s.rcvCh[0];
+	m->rcvChB                = s.rcvCh[1];
+	m->rcvChC                = s.rcvCh[2];
+	m->transpose             = s.transpose;
+	m->nshA                  = s.nsh[0];
+	m->nshA_U                = s.nsh[1];
+	m->nshA_PL               = s.nsh[2];
+	m->nshA_UL               = s.nsh[3];
+	m->nshB                  = s.nsh[4];
+	m->nshC                  = s.nsh[5];
+	m->splitA_PL             = s.split[0];
+	m->splitA_UL             = s.split[1];
+	m->userExcursionStrategy = s.userExcursionStrategy;
+	m->ccuimap               = -1;
+
+	memcpy (m->keyTableA, s.keyTable[0], 128);
+	memcpy (m->keyTableB, s.keyTable[1], 128);
+	memcpy (m->keyTableC, s.keyTable[2], 128);
+	memcpy (m->ctrlflg, s.ctrlflg, sizeof (s.ctrlflg));
+
+	memcpy (m->ctrlUseA, s.ctrlUse[0], CTRL_USE_MAX);
+	memcpy (m->ctrlUseB, s.ctrlUse[1], CTRL_USE_MAX);
+	memcpy (m->ctrlUseC, s.ctrlUse[2], CTRL_USE_MAX);
+
+	midiRebindControllers (m);
+	return 0;
+}
+
 static void
 remember_dynamic_CC_change (void* instp, int chn, int param, int fnid, midiccflags_t flags)
 {
@@ -1241,7 +1595,11 @@ process_midi_event (void* instp, const struct bmidi_event_t* ev)
        */
 
 			/*  0x00 and 0x20 are used for BANK select */
-			if (ev->d.control.param == 0x00 || ev->d.control.param == 0x20) {
+			if (ev->d.control.param == 0x00) {
+				selectProgrammeBank (inst->progs, (ev->d.control.value << 7) | (inst->progs->bankSelect & 0x7f));
+				break;
+			} else if (ev->d.control.param == 0x20) {
+				selectProgrammeBank (inst->progs, (inst->progs->bankSelect & 0x3f80) | ev->d.control.value);
 				break;
 			} else
 
@@ -39,8 +39,10 @@ enum { // 1,2,4,8,.. - adjust ctrlflg once >8 to uint16_t
 unsigned int getCtrlFlag (void* mcfg, uint8_t channel, uint8_t param);
 
 void useMIDIControlFunction (void* m, const char* cfname, void (*f) (void*, unsigned char), void* d);
+void rebindMIDIControlFunctions (void* m, const void* from, void* to);
 void callMIDIControlFunction (void* m, const char* cfname, unsigned char val);
 void notifyControlChangeByName (void* mcfg, const char* cfname, unsigned char val);
+void callMIDIControlFunctionById (void* m, int id, unsigned char val);
 void notifyControlChangeById (void* mcfg, int id, unsigned char val);
 
 extern int         getCCFunctionCount ();
@@ -71,7 +73,13 @@ extern void initControllerTable (void* mcfg);
 extern int getCCFunctionId (const char* name);
 extern void listCCAssignments (void* mctl, FILE* fp);
 
-extern void* allocMidiCfg (void* stateptr);
+extern void   midiRebindControllers (void* mcfg);
+extern void*  cloneMidiCfg (void* mcfg);
+extern void   exchangeMidiCfg (void* mcfg, void* staged);
+extern size_t midiSnapshotWrite (void* mcfg, void* buf, size_t len);
+extern int    midiSnapshotRead (void* mcfg, const void* buf, size_t len);
+
+extern void* allocMidiCfg (void* arena, void* stateptr);
 extern void freeMidiCfg (void* mcfg);
 
 #ifdef HAVE_ASEQ
@@ -0,0 +1,351 @@
+/*
+OpenB3: an open source sound synthesis engine and JUCE application/plugin that simulates
+the magnificent sound of the Hammond B3 organ and Leslie rotating speaker
+Copyright (C) 2021-2022 Michele Perrone
+Github: https://github.com/michele-perrone/OpenPiano
+Author e-mail: perrone(dot)michele(at)outlook(dot)com
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * smf.c --- Standard MIDI File reader.
+ *
+ * Reads format 0 and 1 files. The channel messages of all tracks are
+ * merged into a single list, and their tick positions are converted to
+ * seconds using the tempo map of the file. System exclusive messages and
+ * meta events other than tempo changes are skipped.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "smf.h"
+
+#define SMF_DEFAULT_TEMPO 500000 /* usec per quarter note, i.e. 120 BPM */
+
+/* An event while the tracks are read; tempo != 0 marks a tempo change */
+struct smf_rec {
+	uint64_t tick;
+	uint32_t seq;
+	uint32_t tempo;
+	uint8_t  size;
+	uint8_t  data[3];
+};
+
+struct smf_reader {
+	const uint8_t*  p;
+	const uint8_t*  end;
+	struct smf_rec* recs;
+	size_t          n_recs;
+	size_t          n_alloc;
+	uint64_t        last_tick;
+};
+
+static uint32_t
+read_be (const uint8_t* p, int n)
+{
+	uint32_t v = 0;
+	while (n--) {
+		v = (v << 8) | *p++;
+	}
+	return v;
+}
+
+/*
+ * Reads a variable length quantity.
+ * @returns  0 on success, -1 if the data is truncated.
+ */
+static int
+read_varlen (struct smf_reader* r, uint32_t* v)
+{
+	int i;
+	*v = 0;
+	for (i = 0; i < 4; i++) {
+		if (r->p >= r->end) {
+			return -1;
+		}
+		*v = (*v << 7) | (*r->p & 0x7f);
+		if (!(*r->p++ & 0x80)) {
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static struct smf_rec*
+new_rec (struct smf_reader* r, uint64_t tick)
+{
+	struct smf_rec* rec;
+	if (r->n_recs == r->n_alloc) {
+		size_t          n  = r->n_alloc ? 2 * r->n_alloc : 1024;
+		struct smf_rec* nr = (struct smf_rec*)realloc (r->recs, n * sizeof (struct smf_rec));
+		if (!nr) {
+			return NULL;
+		}
+		r->recs    = nr;
+		r->n_alloc = n;
+	}
+	rec        = &r->recs[r->n_recs];
+	rec->tick  = tick;
+	rec->seq   = (uint32_t)r->n_recs++;
+	rec->tempo = 0;
+	rec->size  = 0;
+	return rec;
+}
+
+/*
+ * Reads the events of one MTrk chunk.
+ * @returns  0 on success, -1 on malformed data or allocation failure.
+ */
+static int
+read_track (struct smf_reader* r)
+{
+	uint64_t tick    = 0;
+	uint8_t  running = 0;
+
+	while (r->p < r->end) {
+		uint32_t        delta;
+		uint8_t         status;
+		struct smf_rec* rec;
+
+		if (read_varlen (r, &delta) || r->p >= r->end) {
+			return -1;
+		}
+		tick += delta;
+
+		if (*r->p & 0x80) {
+			status = *r->p++;
+		} else if (running) {
+			status = running; /* running status, data byte follows */
+		} else {
+			return -1;
+		}
+
+		if (status == 0xff) { /* meta event */
+			uint8_t  type;
+			uint32_t len;
+			if (r->p >= r->end) {
+				return -1;
+			}
+			type = *r->p++;
+			if (read_varlen (r, &len) || (size_t)(r->end - r->p) < len) {
+				return -1;
+			}
+			if (type == 0x51 && len == 3) { /* set tempo */
+				if (!(rec = new_rec (r, tick))) {
+					return -1;
+				}
+				rec->tempo = read_be (r->p, 3);
+			}
+			r->p += len;
+			if (type == 0x2f) { /* end of track */
+				break;
+			}
+			continue;
+		}
+
+		if (status == 0xf0 || status == 0xf7) { /* sysex */
+			uint32_t len;
+			if (read_varlen (r, &len) || (size_t)(r->end - r->p) < len) {
+				return -1;
+			}
+			r->p += len;
+			running = 0;
+			continue;
+		}
+
+		if (status >= 0xf0) { /* system common, not valid in a file */
+			return -1;
+		}
+
+		running = status;
+		if (!(rec = new_rec (r, tick))) {
+			return -1;
+		}
+		rec->data[0] = status;
+		rec->size    = ((status & 0xe0) == 0xc0) ? 2 : 3; /* 0xC0, 0xD0: one data byte */
+		if ((size_t)(r->end - r->p) < (size_t)(rec->size - 1)) {
+			return -1;
+		}
+		rec->data[1] = *r->p++ & 0x7f;
+		rec->data[2] = (rec->size == 3) ? (*r->p++ & 0x7f) : 0;
+	}
+
+	if (tick > r->last_tick) {
+		r->last_tick = tick;
+	}
+	return 0;
+}
+
+static int
+rec_compare (const void* a, const void* b)
+{
+	const struct smf_rec* ra = (const struct smf_rec*)a;
+	const struct smf_rec* rb = (const struct smf_rec*)b;
+	if (ra->tick != rb->tick) {
+		return ra->tick < rb->tick ? -1 : 1;
+	}
+	/* Keep file order for simultaneous events, tracks are read in order */
+	return ra->seq < rb->seq ? -1 : (ra->seq > rb->seq);
+}
+
+static uint8_t*
+read_file (const char* fname, size_t* len)
+{
+	FILE*    fp;
+	uint8_t* buf = NULL;
+	long     n;
+
+	if ((fp = fopen (fname, "rb")) == NULL) {
+		perror (fname);
+		return NULL;
+	}
+	if (fseek (fp, 0, SEEK_END) == 0 && (n = ftell (fp)) > 0 && fseek (fp, 0, SEEK_SET) == 0) {
+		buf = (uint8_t*)malloc (n);
+		if (buf && fread (buf, 1, n, fp) != (size_t)n) {
+			free (buf);
+			buf = NULL;
+		}
+		*len = (size_t)n;
+	}
+	fclose (fp);
+	return buf;
+}
+
+/**
+ * Loads a Standard MIDI File.
+ * @param fname  Path of the file.
+ * @returns      The events of the file, or NULL on error. Free with smf_free().
+ */
+struct smf_file*
+smf_load (const char* fname)
+{
+	struct smf_reader r;
+	struct smf_file*  f;
+	uint8_t*          buf;
+	size_t            len = 0;
+	const uint8_t*    p;
+	const uint8_t*    end;
+	unsigned int      format, ntracks, division, trk;
+	double            sec_per_tick;
+	size_t            i;
+
+	if ((buf = read_file (fname, &len)) == NULL) {
+		return NULL;
+	}
+
+	memset (&r, 0, sizeof (struct smf_reader));
+	p   = buf;
+	end = buf + len;
+
+	if (len < 14 || memcmp (p, "MThd", 4) || read_be (p + 4, 4) < 6) {
+		fprintf (stderr, "%s: not a Standard MIDI File.\n", fname);
+		free (buf);
+		return NULL;
+	}
+	format   = read_be (p + 8, 2);
+	ntracks  = read_be (p + 10, 2);
+	division = read_be (p + 12, 2);
+	p += 8 + read_be (p + 4, 4);
+
+	if (format > 1) {
+		fprintf (stderr, "%s: SMF format %u is not supported.\n", fname, format);
+		free (buf);
+		return NULL;
+	}
+
+	if (division & 0x8000) {
+		int fps = -(int8_t)(division >> 8);
+		if ((fps != 24 && fps != 25 && fps != 29 && fps != 30) || !(division & 0xff)) {
+			fprintf (stderr, "%s: invalid SMPTE time division.\n", fname);
+			free (buf);
+			return NULL;
+		}
+	}
+
+	for (trk = 0; trk < ntracks && p + 8 <= end; trk++) {
+		uint32_t clen = read_be (p + 4, 4);
+		if ((size_t)(end - p - 8) < clen) {
+			fprintf (stderr, "%s: truncated track %u.\n", fname, trk);
+			break;
+		}
+		if (memcmp (p, "MTrk", 4)) { /* skip unknown chunks */
+			p += 8 + clen;
+			trk--;
+			continue;
+		}
+		r.p   = p + 8;
+		r.end = p + 8 + clen;
+		if (read_track (&r)) {
+			fprintf (stderr, "%s: malformed data in track %u.\n", fname, trk);
+			free (r.recs);
+			free (buf);
+			return NULL;
+		}
+		p += 8 + clen;
+	}
+	free (buf);
+
+	qsort (r.recs, r.n_recs, sizeof (struct smf_rec), rec_compare);
+
+	f = (struct smf_file*)calloc (1, sizeof (struct smf_file));
+	if (!f || (r.n_recs && !(f->events = (struct smf_event*)malloc (r.n_recs * sizeof (struct smf_event))))) {
+		fprintf (stderr, "FATAL: memory allocation failed for %s.\n", fname);
+		free (f);
+		free (r.recs);
+		return NULL;
+	}
+
+	if (division & 0x8000) { /* SMPTE: frames per second, ticks per frame */
+		int fps = -(int8_t)(division >> 8);
+		sec_per_tick = 1.0 / ((fps == 29 ? 29.97 : fps) * (division & 0xff));
+	} else {
+		sec_per_tick = SMF_DEFAULT_TEMPO * 1e-6 / (division ? division : 96);
+	}
+
+	{
+		uint64_t tick = 0;
+		double   time = 0;
+		for (i = 0; i < r.n_recs; i++) {
+			const struct smf_rec* rec = &r.recs[i];
+			time += (rec->tick - tick) * sec_per_tick;
+			tick = rec->tick;
+			if (rec->tempo) {
+				if (!(division & 0x8000)) {
+					sec_per_tick = rec->tempo * 1e-6 / (division ? division : 96);
+				}
+				continue;
+			}
+			f->events[f->n_events].time = time;
+			f->events[f->n_events].size = rec->size;
+			memcpy (f->events[f->n_events].data, rec->data, 3);
+			f->n_events++;
+		}
+		f->duration = time + (r.last_tick - tick) * sec_per_tick;
+	}
+
+	free (r.recs);
+	return f;
+}
+
+void
+smf_free (struct smf_file* f)
+{
+	if (!f) {
+		return;
+	}
+	free (f->events);
+	free (f);
+}
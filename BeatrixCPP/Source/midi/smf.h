@@ -0,0 +1,55 @@
+/*
+OpenB3: an open source sound synthesis engine and JUCE application/plugin that simulates
+the magnificent sound of the Hammond B3 organ and Leslie rotating speaker
+Copyright (C) 2021-2022 Michele Perrone
+Github: https://github.com/michele-perrone/OpenPiano
+Author e-mail: perrone(dot)michele(at)outlook(dot)com
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * smf.h --- Standard MIDI File reader for offline rendering.
+ */
+#ifndef SMF_H
+#define SMF_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** A channel message with its absolute time */
+struct smf_event {
+	double  time;    /**< seconds from the start of the file */
+	uint8_t size;    /**< number of valid bytes in data[] (2 or 3) */
+	uint8_t data[3]; /**< raw MIDI message, status byte first */
+};
+
+/** All channel messages of a file, merged across tracks and sorted by time */
+struct smf_file {
+	struct smf_event* events;
+	size_t            n_events;
+	double            duration; /**< time of the last event, including end-of-track */
+};
+
+extern struct smf_file* smf_load (const char* fname);
+extern void smf_free (struct smf_file* f);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SMF_H */
@@ -266,8 +266,7 @@ int
 main (int argc, char** argv)
 {
 	int   osc_port = 0;
-	void* pa       = allocPreamp ();
-	initPreamp (pa, NULL);
+	void* pa       = NULL;
 
 	int           c;
 	const char*   optstring      = "hi:o:O:p:V";
@@ -364,6 +363,9 @@ main (int argc, char** argv)
 		return (1);
 	}
 
+	pa = allocPreamp (NULL, jack_get_sample_rate (j_client));
+	initPreamp (pa, NULL);
+
 	j_input_port  = jack_port_register (j_client, "in", JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
 	j_output_port = jack_port_register (j_client, "out", JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
 
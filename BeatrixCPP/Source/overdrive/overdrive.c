@@ -5,6 +5,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include "arena.h"
+#include "global_definitions.h"
 #include "overdrive.h"
 
 
@@ -94,6 +96,10 @@ static const float ipwdef[33] = {
 
 
 struct b_preamp {
+  /* Arena of this struct */
+  void * arena;
+  /* Sample rate, set by allocPreamp() */
+  double SampleRateD;
   /* Input history buffer */
   float xzb[64];
   /* Input history writer */
@@ -129,6 +135,8 @@ struct b_preamp {
   
   /* Input gain */
   float inputGain;
+  /* Smoothed input gain, follows inputGain */
+  float inputGainZ;
   float sagZ;
   float sagFb;
   /* Variables for the inverted and biased transfer function */
@@ -236,6 +244,8 @@ float * overdrive (void *pa, const float * inBuf, float * outBuf, size_t buflen)
   float * yp = outBuf;
   int i;
   size_t n;
+  float gin = pp->inputGainZ;
+  const float dgin = paramRampIncrement (&pp->inputGainZ, pp->inputGain, buflen, pp->SampleRateD);
   
   for (n = 0; n < buflen; n++) {
     float xin;
@@ -248,7 +258,8 @@ float * overdrive (void *pa, const float * inBuf, float * outBuf, size_t buflen)
       pp->xzp = pp->xzb;
     }
     
-    xin = pp->inputGain * (*xp++);
+    xin = gin * (*xp++);
+    gin += dgin;
     pp->sagZ = (pp->sagFb * pp->sagZ) + fabsf(xin);
     pp->bias = pp->biasBase - (pp->sagZgb * pp->sagZ);
     pp->norm = 1.0 - (1.0 / (1.0 + (pp->bias * pp->bias)));
@@ -371,6 +382,7 @@ float * preamp (void * pa,
   struct b_preamp *pp = (struct b_preamp *) pa;
   if (pp->isClean) {
     memcpy(outBuf, inBuf, bufLengthSamples*sizeof(float));
+    pp->inputGainZ = pp->inputGain;
   }
   else {
     overdrive (pa, inBuf, outBuf, bufLengthSamples);
@@ -380,8 +392,10 @@ float * preamp (void * pa,
 }
 
 
-void * allocPreamp () {
-  struct b_preamp *pp = (struct b_preamp *) calloc(1, sizeof(struct b_preamp));
+void * allocPreamp (void * arena, double rate) {
+  struct b_preamp *pp = (struct b_preamp *) arenaAlloc(arena, sizeof(struct b_preamp));
+  pp->arena = arena;
+  pp->SampleRateD = rate;
   pp->xzp = &(pp->xzb[0]);
   pp->xzpe = &(pp->xzb[64]);
   pp->xzwp = &(pp->xzb[9]);
@@ -394,6 +408,7 @@ void * allocPreamp () {
   pp->isClean = 1;
   pp->outputGain = 0.8795;
   pp->inputGain = 3.5675;
+  pp->inputGainZ = pp->inputGain;
   
   
   
@@ -414,7 +429,37 @@ void * allocPreamp () {
 
 void freePreamp (void * pa) {
   struct b_preamp *pp = (struct b_preamp *) pa;
-  free(pp);
+  arenaFree(pp->arena, pp);
+}
+
+
+void resetPreamp (void * pa) {
+  struct b_preamp *pp = (struct b_preamp *) pa;
+  memset(pp->xzb, 0, sizeof(pp->xzb));
+  pp->xzp = &(pp->xzb[0]);
+  memset(pp->yzb, 0, sizeof(pp->yzb));
+  pp->yzp = &(pp->yzb[0]);
+  pp->inputGainZ = pp->inputGain;
+  pp->sagZ = 0.0;
+  pp->adwZ = 0.0;
+  pp->adwZ1 = 0.0;
+  pp->adwGfZ = 0.0;
+}
+
+
+void copyPreampSettings (void * pa, const void * src) {
+  struct b_preamp *pp = (struct b_preamp *) pa;
+  const struct b_preamp *sp = (const struct b_preamp *) src;
+  pp->outputGain = sp->outputGain;
+  pp->inputGain = sp->inputGain;
+  pp->sagFb = sp->sagFb;
+  pp->biasBase = sp->biasBase;
+  pp->bias = sp->bias;
+  pp->norm = sp->norm;
+  pp->adwFb = sp->adwFb;
+  pp->adwFb2 = sp->adwFb2;
+  pp->adwGfb = sp->adwGfb;
+  pp->sagZgb = sp->sagZgb;
 }
 
 
@@ -559,8 +604,7 @@ void fctl_biased_fat (void *d, float f) {
 void setInputGain (void *pa, unsigned char uc) {
   struct b_preamp *pp = (struct b_preamp *) pa;
   pp->inputGain = 0.001 + ((10 - 0.001) * (((float) uc) / 127.0));
-  printf ("\rINP:%10.4lf", pp->inputGain);
-  fflush (stdout);
+  fprintf (stderr, "\rINP:%10.4lf", pp->inputGain);
 }
 
 void fsetInputGain (void *d, float f) {
@@ -33,8 +33,10 @@ extern const ConfigDoc* ampDoc ();
 extern void initPreamp (void* pa, void* m);
 extern void setClean (void* pa, int useClean);
 
-extern void* allocPreamp ();
+extern void* allocPreamp (void* arena, double rate);
 extern void freePreamp (void* pa);
+extern void resetPreamp (void* pa);
+extern void copyPreampSettings (void* pa, const void* src);
 
 extern float* preamp (void* pa, float* inBuf, float* outBuf, size_t bufLengthSamples);
 extern float* overdrive (void* pa, const float* inBuf, float* outBuf, size_t buflen);
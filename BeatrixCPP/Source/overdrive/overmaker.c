@@ -311,6 +311,8 @@ moduleHeader ()
 	includeSystem ("stdlib.h");
 	includeSystem ("string.h");
 	includeSystem ("math.h");
+	includeLocal ("arena.h");
+	includeLocal ("global_definitions.h");
 
 	for (i = 0; systemIncludes[i] != NULL; i++) {
 		includeSystem (systemIncludes[i]);
@@ -638,6 +640,11 @@ moduleHeader ()
 	codeln ("struct b_preamp {");
 	pushIndent ();
 
+	commentln ("Arena of this struct");
+	codeln ("void * arena;");
+	commentln ("Sample rate, set by allocPreamp()");
+	codeln ("double SampleRateD;");
+
 	commentln ("Input history buffer");
 	sprintf (buf, "float xzb[%d];", XZB_SIZE);
 	codeln (buf);
@@ -709,6 +716,8 @@ moduleHeader ()
 	vspace (1);
 	commentln ("Input gain");
 	codeln ("float inputGain;");
+	commentln ("Smoothed input gain, follows inputGain");
+	codeln ("float inputGainZ;");
 #endif /* INPUT_GAIN */
 
 #ifdef PRE_DC_OFFSET
@@ -874,6 +883,10 @@ funcVarDef ()
 	codeln ("float * yp = outBuf;");
 	codeln ("int i;");
 	codeln ("size_t n;");
+#ifdef INPUT_GAIN
+	codeln ("float gin = pp->inputGainZ;");
+	codeln ("const float dgin = paramRampIncrement (&pp->inputGainZ, pp->inputGain, buflen, pp->SampleRateD);");
+#endif /* INPUT_GAIN */
 }
 
 /*
@@ -913,7 +926,8 @@ funcBody (void (*transferdef) (char*, char*))
 	vspace (1);
 
 #ifdef INPUT_GAIN
-	codeln ("xin = pp->inputGain * (*xp++);");
+	codeln ("xin = gin * (*xp++);");
+	codeln ("gin += dgin;");
 #else
 	codeln ("xin = *xp++;");
 #endif /* INPUT_GAIN */
@@ -1270,6 +1284,9 @@ adapterPreamp (char* funcName)
 	codeln ("if (pp->isClean) {");
 	pushIndent ();
 	codeln ("memcpy(outBuf, inBuf, bufLengthSamples*sizeof(float));");
+#ifdef INPUT_GAIN
+	codeln ("pp->inputGainZ = pp->inputGain;");
+#endif /* INPUT_GAIN */
 	popIndent ();
 	codeln ("}");
 	codeln ("else {");
@@ -1286,9 +1303,11 @@ adapterPreamp (char* funcName)
 	codeln ("}");
 
 	vspace (2);
-	codeln ("void * allocPreamp () {");
+	codeln ("void * allocPreamp (void * arena, double rate) {");
 	pushIndent ();
-	codeln ("struct b_preamp *pp = (struct b_preamp *) calloc(1, sizeof(struct b_preamp));");
+	codeln ("struct b_preamp *pp = (struct b_preamp *) arenaAlloc(arena, sizeof(struct b_preamp));");
+	codeln ("pp->arena = arena;");
+	codeln ("pp->SampleRateD = rate;");
 
 	codeln ("pp->xzp = &(pp->xzb[0]);");
 	sprintf (buf, "pp->xzpe = &(pp->xzb[%d]);", XZB_SIZE);
@@ -1325,6 +1344,7 @@ adapterPreamp (char* funcName)
 #ifdef INPUT_GAIN
 	sprintf (buf, "pp->inputGain = %g;", INPUT_GAIN);
 	codeln (buf);
+	codeln ("pp->inputGainZ = pp->inputGain;");
 #endif /* INPUT_GAIN */
 
 #ifdef PRE_DC_OFFSET
@@ -1361,7 +1381,45 @@ adapterPreamp (char* funcName)
 	codeln ("void freePreamp (void * pa) {");
 	pushIndent ();
 	codeln ("struct b_preamp *pp = (struct b_preamp *) pa;");
-	codeln ("free(pp);");
+	codeln ("arenaFree(pp->arena, pp);");
+	popIndent ();
+	codeln ("}");
+	vspace (2);
+	codeln ("void resetPreamp (void * pa) {");
+	pushIndent ();
+	codeln ("struct b_preamp *pp = (struct b_preamp *) pa;");
+	codeln ("memset(pp->xzb, 0, sizeof(pp->xzb));");
+	codeln ("pp->xzp = &(pp->xzb[0]);");
+	codeln ("memset(pp->yzb, 0, sizeof(pp->yzb));");
+	codeln ("pp->yzp = &(pp->yzb[0]);");
+#ifdef INPUT_GAIN
+	codeln ("pp->inputGainZ = pp->inputGain;");
+#endif /* INPUT_GAIN */
+#ifdef SAG_EMULATION
+	codeln ("pp->sagZ = 0.0;");
+#endif /* SAG_EMULATION */
+#ifdef TR_BIASED
+	clr_biased ();
+#endif
+	popIndent ();
+	codeln ("}");
+	vspace (2);
+	codeln ("void copyPreampSettings (void * pa, const void * src) {");
+	pushIndent ();
+	codeln ("struct b_preamp *pp = (struct b_preamp *) pa;");
+	codeln ("const struct b_preamp *sp = (const struct b_preamp *) src;");
+#ifdef OUTPUT_GAIN
+	codeln ("pp->outputGain = sp->outputGain;");
+#endif /* OUTPUT_GAIN */
+#ifdef INPUT_GAIN
+	codeln ("pp->inputGain = sp->inputGain;");
+#endif /* INPUT_GAIN */
+#ifdef SAG_EMULATION
+	codeln ("pp->sagFb = sp->sagFb;");
+#endif /* SAG_EMULATION */
+#ifdef TR_BIASED
+	cpy_biased ();
+#endif
 	popIndent ();
 	codeln ("}");
 }
@@ -1830,8 +1888,7 @@ inputGainControl ()
 	         INPUT_GAIN_HI,
 	         INPUT_GAIN_LO);
 	codeln (buf);
-	codeln ("printf (\"\\rINP:%10.4lf\", pp->inputGain);");
-	codeln ("fflush (stdout);");
+	codeln ("fprintf (stderr, \"\\rINP:%10.4lf\", pp->inputGain);");
 	popIndent ();
 	codeln ("}");
 	INTWRAP ("setInputGain")
@@ -103,6 +103,48 @@ rst_biased ()
 #endif
 }
 
+/* Clears the runtime state of the transfer function */
+void
+clr_biased ()
+{
+#ifdef ADWS_PRE_DIFF
+	codeln ("pp->adwZ = 0.0;");
+#endif /* ADWS_PRE_DIFF */
+
+#ifdef ADWS_POST_DIFF
+	codeln ("pp->adwZ1 = 0.0;");
+#endif /* ADWS_POST_DIFF */
+
+#ifdef ADWS_GFB
+	codeln ("pp->adwGfZ = 0.0;");
+#endif /* ADWS_GFB */
+}
+
+/* Copies the settings of the transfer function from sp to pp */
+void
+cpy_biased ()
+{
+	codeln ("pp->biasBase = sp->biasBase;");
+	codeln ("pp->bias = sp->bias;");
+	codeln ("pp->norm = sp->norm;");
+
+#ifdef ADWS_PRE_DIFF
+	codeln ("pp->adwFb = sp->adwFb;");
+#endif /* ADWS_PRE_DIFF */
+
+#ifdef ADWS_POST_DIFF
+	codeln ("pp->adwFb2 = sp->adwFb2;");
+#endif /* ADWS_POST_DIFF */
+
+#ifdef ADWS_GFB
+	codeln ("pp->adwGfb = sp->adwGfb;");
+#endif /* ADWS_GFB */
+
+#ifdef SAG_EMULATION
+	codeln ("pp->sagZgb = sp->sagZgb;");
+#endif
+}
+
 void
 cfg_biased ()
 {
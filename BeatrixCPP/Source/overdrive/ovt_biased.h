@@ -29,6 +29,8 @@ extern void cfg_biased ();
 extern void ctl_biased ();
 extern void ini_biased ();
 extern void rst_biased ();
+extern void clr_biased ();
+extern void cpy_biased ();
 
 extern void xfr_biased ();
 
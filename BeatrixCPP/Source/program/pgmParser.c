@@ -21,13 +21,19 @@
 #define _XOPEN_SOURCE 700
 
 #include <ctype.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
-#ifdef WIN32
-    #include <windows.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #endif
 
+#include "global_definitions.h"
 #include "pgmParser.h"
 #include "program.h"
 
@@ -52,19 +58,50 @@
 typedef int B3TokenType;
 typedef int ParseReturnCode;
 
+/*
+ * Programme definitions in banks other than 0 are indexed while the file
+ * is parsed, and compiled into one page per bank when it is done, see
+ * struct b_pgmpage. Program changes never parse or read the file.
+ */
+struct pgmlib_entry {
+	int         bank;
+	int         pgmNr;
+	int         seq;        /**< order in the file, the last definition wins */
+	int         lineNumber; /**< of the first token of the assignment list */
+	const char* start;      /**< first token of the assignment list */
+};
+
+struct pgmindex {
+	struct pgmlib_entry* entries;
+	int                  n_entries;
+	int                  n_alloc;
+};
+
+struct b_pgmlib {
+	struct b_pgmlib*   next;    /**< loaded before, searched after this one */
+	struct b_pgmlib*   retired; /**< replaced, kept until the owner is freed */
+	struct b_pgmpage** pages;   /**< sorted by bank */
+	int                n_pages;
+};
+
 typedef struct _parserstate {
-	void*       p;
-	const char* fileName;
-	FILE*       fp;
-	int         lineNumber;
-	B3TokenType nextToken;
-	char        stringBuffer[STRINGBUFFERSZ];
+	void*            p;
+	Programme*       pgm; /**< bind assignments to this record instead of p */
+	struct pgmindex* index; /**< of definitions in banks other than 0 */
+	const char*      fileName;
+	const char*      pos; /**< input, up to end */
+	const char*      end;
+	const char*      tokenStart;
+	int              lineNumber;
+	B3TokenType      nextToken;
+	char             stringBuffer[STRINGBUFFERSZ];
 } ParserState;
 
 /*
  * New syntax: 8-apr-03
  * S ::= <pgmdef> [<pgmdef>...]
- * <pgmdef> ::= [<program-number>] '{' <assignment> [[,] <assignment> ...] '}'
+ * <pgmdef> ::= [<bank> '.'] <program-number> '{' <assignment> [[,] <assignment> ...] '}'
+ * <bank> ::= <number>
  * <program-number> ::= <number>
  * <assignment> ::= <parameter> '=' <expression>
  * <expression> ::= {<number>|<constant>|<program-reference>}
@@ -72,32 +109,50 @@ typedef struct _parserstate {
  *
  */
 
+/* The "C" locale isspace() and word characters, without a call per character */
+static inline int
+isSpaceChar (int c)
+{
+	return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static inline int
+isWordChar (int c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+	       || (c == '-') || (c == '.') || (c == '_') || (c == '+');
+}
+
 /*
  * Scans the next token from the input. Tokens are:
  * '{' '}' '=' string EOF
  */
 static int
-getToken (FILE* fp, int* linePtr, char* tokbuf, size_t tblen)
+getToken (ParserState* ps, char* tokbuf, size_t tblen)
 {
-	int    c;
-	size_t tp      = 0;
-	int    tokType = TKN_VOID;
-	int    state   = 1;
+	const char* pos     = ps->pos;
+	const char* end     = ps->end;
+	int         c       = EOF;
+	size_t      tp      = 0;
+	int         tokType = TKN_VOID;
+	int         state   = 1;
 
 	tokbuf[tp]     = '\0';
 	tokbuf[tp + 1] = '\0';
 
 	/* Scan leading space */
 	while (0 < state) {
-		c = fgetc (fp);
-		if (c == EOF)
+		if (pos == end) {
+			ps->pos = pos;
 			return TKN_EOF;
+		}
+		c = (unsigned char)*pos++;
 
 		if (state == 1) {
 			if (c == '\n') {
-				*linePtr += 1;
+				ps->lineNumber += 1;
 				continue;
-			} else if (isspace (c)) {
+			} else if (isSpaceChar (c)) {
 				continue;
 			} else if (c == '#') {
 				state = 2;
@@ -106,11 +161,12 @@ getToken (FILE* fp, int* linePtr, char* tokbuf, size_t tblen)
 			}
 		} else if (state == 2) { /* Comment to end of line */
 			if (c == '\n') {
-				*linePtr += 1;
+				ps->lineNumber += 1;
 				state = 1;
 			}
 		}
 	}
+	ps->tokenStart = pos - 1;
 
 	/* Examine character */
 	if ((c == '{') || (c == '}') || (c == '=') || (c == ',')) {
@@ -124,14 +180,14 @@ getToken (FILE* fp, int* linePtr, char* tokbuf, size_t tblen)
 			state = 0;
 
 			for (;;) {
-				c = fgetc (fp);
-
-				if (c == EOF) {
+				if (pos == end) {
 					tokType = TKN_ERROR;
 					strncpy (tokbuf, "End of file in quoted string", tblen);
 					tokbuf[tblen - 1] = '\0';
+					tp                = strlen (tokbuf);
 					break;
 				}
+				c = (unsigned char)*pos++;
 
 				if (state == 0) {
 					if (c == '"') {
@@ -139,42 +195,42 @@ getToken (FILE* fp, int* linePtr, char* tokbuf, size_t tblen)
 					} else if (c == '\\') { /* Next char is escape char */
 						state = 1;
 						continue;
-					} else if (tp < tblen) { /* Append char to token buffer */
+					} else if (tp + 1 < tblen) { /* Append char to token buffer */
 						tokbuf[tp++] = c;
 					}
 				} else if (state == 1) { /* Escaped char */
-					if (tp < tblen) {
+					if (tp + 1 < tblen) {
 						tokbuf[tp++] = c;
 					}
 					state = 0;
 				}
 			}
 		} else {
-			while (isalnum (c) || (c == '-') || (c == '.') || (c == '_') || (c == '+')) {
-				if (tp < tblen) {
+			for (pos--; pos < end; pos++) {
+				c = (unsigned char)*pos;
+				if (!isWordChar (c)) {
+					break;
+				}
+				if (tp + 1 < tblen) {
 					tokbuf[tp++] = c;
 				}
-				c = fgetc (fp);
 			}
-			ungetc (c, fp);
 		}
 	}
 
 	tokbuf[tp] = '\0';
+	ps->pos    = pos;
 	return tokType;
 }
 
 /*
- * Retrieves the next token from the input file and puts it in the parser
+ * Retrieves the next token from the input and puts it in the parser
  * state.
  */
 static B3TokenType
 getNextToken (ParserState* ps)
 {
-	return ps->nextToken = getToken (ps->fp,
-	                                 &(ps->lineNumber),
-	                                 ps->stringBuffer,
-	                                 STRINGBUFFERSZ);
+	return ps->nextToken = getToken (ps, ps->stringBuffer, STRINGBUFFERSZ);
 }
 
 /*
@@ -186,22 +242,6 @@ nextTokenMatches (ParserState* ps, B3TokenType t)
 	return ps->nextToken == t;
 }
 
-/*
- * Parses an integer number by parsing a string and then parsing it as
- * a number.
- */
-static ParseReturnCode
-parseInteger (ParserState* ps, int* value)
-{
-	if (nextTokenMatches (ps, TKN_STRING)) {
-		if (sscanf (ps->stringBuffer, "%d", value) == 1) {
-			(void)getNextToken (ps);
-			return P_OK;
-		}
-	}
-	return P_ERROR; /* Not an integer */
-}
-
 /*
  * Parses an identifier (actually, a string).
  */
@@ -211,9 +251,13 @@ parseIdentifier (ParserState* ps, char* identifier)
 	if (!nextTokenMatches (ps, TKN_STRING)) {
 		return P_ERROR;
 	} else {
-		/* Should be a setter function */
-		strncpy (identifier, ps->stringBuffer, SYMBOLSIZE - 1);
-		identifier[SYMBOLSIZE - 1] = '\0';
+		/* Should be a setter function; strncpy() would pad all of it */
+		size_t n = strlen (ps->stringBuffer);
+		if (n > SYMBOLSIZE - 1) {
+			n = SYMBOLSIZE - 1;
+		}
+		memcpy (identifier, ps->stringBuffer, n);
+		identifier[n] = '\0';
 	}
 	(void)getNextToken (ps);
 	return P_OK;
@@ -263,10 +307,11 @@ stateMessage (ParserState*    ps,
 
 /*
  * Parses a list of programme property assignments and sends each to the
- * application via a call to bindToProgram(...);
+ * application via a call to bindToProgram(...), or to bindToProgramme(...)
+ * when a single record is parsed. With bind = 0 the list is only checked.
  */
 static ParseReturnCode
-parseAssignmentList (ParserState* ps, const int pgmNr)
+parseAssignmentList (ParserState* ps, const int pgmNr, const int bind)
 {
 	ParseReturnCode R;
 	char            symbol[SYMBOLSIZE];
@@ -288,7 +333,13 @@ parseAssignmentList (ParserState* ps, const int pgmNr)
 			return stateMessage (ps, R, msg);
 		}
 
-		if (bindToProgram (ps->p, ps->fileName, ps->lineNumber, pgmNr, symbol, value)) {
+		if (!bind) {
+			;
+		} else if (ps->pgm) {
+			if (bindToProgramme (ps->pgm, ps->fileName, ps->lineNumber, symbol, value)) {
+				return P_ERROR;
+			}
+		} else if (bindToProgram (ps->p, ps->fileName, ps->lineNumber, pgmNr, symbol, value)) {
 			return P_ERROR;
 		}
 
@@ -300,22 +351,130 @@ parseAssignmentList (ParserState* ps, const int pgmNr)
 	return P_OK;
 }
 
+/*
+ * Parses a program number, optionally preceded by a bank number and a dot.
+ */
+static ParseReturnCode
+parseProgramNumber (ParserState* ps, int* bank, int* pgmNr)
+{
+	char c;
+	if (nextTokenMatches (ps, TKN_STRING)) {
+		if (sscanf (ps->stringBuffer, "%d.%d%c", bank, pgmNr, &c) == 2) {
+			if (*bank < 0 || *bank > PGM_MAXBANK) {
+				return P_ERROR;
+			}
+		} else if (sscanf (ps->stringBuffer, "%d%c", pgmNr, &c) == 1) {
+			*bank = 0;
+		} else {
+			return P_ERROR;
+		}
+		(void)getNextToken (ps);
+		return P_OK;
+	}
+	return P_ERROR;
+}
+
+/*
+ * Adds a program definition to the library index. The parser state is
+ * at the first token of its assignment list.
+ */
+static ParseReturnCode
+indexProgramDefinition (ParserState* ps, int bank, int pgmNr)
+{
+	struct pgmindex*     idx = ps->index;
+	struct pgmlib_entry* e;
+
+	if ((pgmNr < 0) || (MAXPROGS <= pgmNr)) {
+		return stateMessage (ps, P_ERROR, "program number out of range");
+	}
+	if (idx->n_entries == idx->n_alloc) {
+		int                  n = idx->n_alloc ? 2 * idx->n_alloc : 256;
+		struct pgmlib_entry* x = (struct pgmlib_entry*)realloc (idx->entries, n * sizeof (struct pgmlib_entry));
+		if (!x) {
+			return stateMessage (ps, P_ERROR, "out of memory");
+		}
+		idx->entries = x;
+		idx->n_alloc = n;
+	}
+	e             = &idx->entries[idx->n_entries];
+	e->bank       = bank;
+	e->pgmNr      = pgmNr;
+	e->seq        = idx->n_entries++;
+	e->lineNumber = ps->lineNumber;
+	e->start      = ps->tokenStart;
+	return P_OK;
+}
+
+/*
+ * Skips to the end of an assignment list without looking at the
+ * assignments, which are checked when the programme is parsed.
+ */
+static ParseReturnCode
+skipAssignmentList (ParserState* ps)
+{
+	const char* pos   = ps->tokenStart;
+	int         state = 0; /* 1: quoted, 2: escaped, 3: comment */
+
+	if (nextTokenMatches (ps, TKN_EOF)) {
+		return stateMessage (ps, P_ERROR, "'}' expected");
+	}
+	for (; pos < ps->end; pos++) {
+		const char c = *pos;
+		if (c == '\n') {
+			ps->lineNumber += 1;
+		}
+		if (state == 0) {
+			if (c == '}') {
+				break;
+			} else if (c == '"') {
+				state = 1;
+			} else if (c == '#') {
+				state = 3;
+			}
+		} else if (state == 1) {
+			if (c == '"') {
+				state = 0;
+			} else if (c == '\\') {
+				state = 2;
+			}
+		} else if (state == 2) {
+			state = 1;
+		} else if (c == '\n') {
+			state = 0;
+		}
+	}
+	if (pos == ps->end) {
+		return stateMessage (ps, P_ERROR, "'}' expected");
+	}
+	ps->pos = pos + 1;
+	(void)getNextToken (ps);
+	return P_OK;
+}
+
 /*
  * Parses one program definition by reading a programme number followed
- * by an assignment list.
+ * by an assignment list. Definitions in banks other than 0 are only
+ * indexed.
  */
 static ParseReturnCode
 parseProgramDefinition (ParserState* ps)
 {
 	ParseReturnCode R;
+	int             bank;
 	int             programNumber;
-	if ((R = parseInteger (ps, &programNumber)) == P_ERROR) {
+	if ((R = parseProgramNumber (ps, &bank, &programNumber)) == P_ERROR) {
 		return stateMessage (ps, R, "program number expected");
 	}
 	if ((R = parseToken (ps, '{')) == P_ERROR) {
 		return stateMessage (ps, R, "assignment list expected");
 	}
-	return parseAssignmentList (ps, programNumber);
+	if (bank == 0) {
+		return parseAssignmentList (ps, programNumber, 1);
+	}
+	if ((R = indexProgramDefinition (ps, bank, programNumber)) == P_ERROR) {
+		return R;
+	}
+	return skipAssignmentList (ps);
 }
 
 /*
@@ -334,6 +493,195 @@ parseProgramDefinitionList (ParserState* ps)
 	return P_OK;
 }
 
+static int
+compareLibraryEntries (const void* a, const void* b)
+{
+	const struct pgmlib_entry* x = (const struct pgmlib_entry*)a;
+	const struct pgmlib_entry* y = (const struct pgmlib_entry*)b;
+	if (x->bank != y->bank)
+		return x->bank < y->bank ? -1 : 1;
+	if (x->pgmNr != y->pgmNr)
+		return x->pgmNr < y->pgmNr ? -1 : 1;
+	return x->seq < y->seq ? -1 : (x->seq > y->seq);
+}
+
+static void
+freeLibrary (struct b_pgmlib* lib)
+{
+	while (lib) {
+		struct b_pgmlib* next = lib->next;
+		int              i;
+		freeLibrary (lib->retired);
+		for (i = 0; i < lib->n_pages; i++) {
+			free (lib->pages[i]);
+		}
+		free (lib->pages);
+		free (lib);
+		lib = next;
+	}
+}
+
+/*
+ * Finds the page of a bank, in the library loaded last that has one.
+ */
+static struct b_pgmpage*
+findPage (const struct b_pgmlib* lib, int bank)
+{
+	for (; lib; lib = lib->next) {
+		int lo = 0, hi = lib->n_pages - 1;
+		while (lo <= hi) {
+			int mid = (lo + hi) / 2;
+			if (lib->pages[mid]->bank < bank) {
+				lo = mid + 1;
+			} else if (lib->pages[mid]->bank > bank) {
+				hi = mid - 1;
+			} else {
+				return lib->pages[mid];
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Compiles the definitions of one bank, entries[0..n-1], into a page.
+ * Programmes the file does not define are taken from the page the bank
+ * had before, if any, so that each page is complete.
+ */
+static struct b_pgmpage*
+compilePage (ParserState* ps, const struct pgmlib_entry* entries, int n, const struct b_pgmpage* old, ParseReturnCode* rtn)
+{
+	struct b_pgmpage* page;
+	unsigned char     defined[MAXPROGS];
+	int               count = n;
+	int               i;
+
+	memset (defined, 0, sizeof (defined));
+	for (i = 0; i < n; i++) {
+		defined[entries[i].pgmNr] = 1;
+	}
+	for (i = 0; old && i < MAXPROGS; i++) {
+		if (old->slot[i] && !defined[i]) {
+			count++;
+		}
+	}
+
+	page = (struct b_pgmpage*)calloc (1, offsetof (struct b_pgmpage, programmes) + count * sizeof (Programme));
+	if (!page) {
+		*rtn = stateMessage (ps, P_ERROR, "out of memory");
+		return NULL;
+	}
+	page->bank = entries[0].bank;
+
+	for (i = 0; i < n; i++) {
+		Programme* pgm = &page->programmes[page->n_programmes];
+		ps->pgm        = pgm;
+		ps->pos        = entries[i].start;
+		ps->tokenStart = ps->pos;
+		ps->lineNumber = entries[i].lineNumber;
+		getNextToken (ps);
+		if (parseAssignmentList (ps, entries[i].pgmNr, 1) != P_OK) {
+			*rtn = stateMessage (ps, P_ERROR, "bad program definition");
+			memset (pgm, 0, sizeof (Programme));
+			continue;
+		}
+		page->slot[entries[i].pgmNr] = ++page->n_programmes;
+	}
+	for (i = 0; old && i < MAXPROGS; i++) {
+		if (old->slot[i] && !defined[i]) {
+			page->programmes[page->n_programmes] = old->programmes[old->slot[i] - 1];
+			page->slot[i]                        = ++page->n_programmes;
+		}
+	}
+	return page;
+}
+
+/*
+ * Compiles the indexed definitions into pages, and adds them to p as the
+ * library that is searched first.
+ */
+static ParseReturnCode
+compileLibrary (ParserState* ps, struct pgmindex* idx)
+{
+	struct b_programme* progs = (struct b_programme*)ps->p;
+	struct b_pgmlib*    lib;
+	ParseReturnCode     rtn = P_OK;
+	int                 i, j, n;
+
+	/* sort by bank and program, keep the last definition of each */
+	qsort (idx->entries, idx->n_entries, sizeof (struct pgmlib_entry), compareLibraryEntries);
+	for (i = 0, n = 0; i < idx->n_entries; i++) {
+		if (i + 1 < idx->n_entries && idx->entries[i + 1].bank == idx->entries[i].bank && idx->entries[i + 1].pgmNr == idx->entries[i].pgmNr) {
+			continue;
+		}
+		idx->entries[n++] = idx->entries[i];
+	}
+	idx->n_entries = n;
+
+	for (i = 0, n = 0; i < idx->n_entries; i++) {
+		if (i == 0 || idx->entries[i].bank != idx->entries[i - 1].bank) {
+			n++;
+		}
+	}
+	lib = (struct b_pgmlib*)calloc (1, sizeof (struct b_pgmlib));
+	if (!lib || !(lib->pages = (struct b_pgmpage**)calloc (n, sizeof (struct b_pgmpage*)))) {
+		free (lib);
+		return stateMessage (ps, P_ERROR, "out of memory");
+	}
+
+	for (i = 0; i < idx->n_entries; i = j) {
+		struct b_pgmpage* page;
+		for (j = i; j < idx->n_entries && idx->entries[j].bank == idx->entries[i].bank; j++)
+			;
+		page = compilePage (ps, &idx->entries[i], j - i, findPage ((struct b_pgmlib*)progs->library, idx->entries[i].bank), &rtn);
+		if (page) {
+			lib->pages[lib->n_pages++] = page;
+		}
+	}
+
+	lib->next      = (struct b_pgmlib*)progs->library;
+	progs->library = lib;
+	progs->page    = findPage (lib, progs->bankSelect);
+	return rtn;
+}
+
+/*
+ * Parses programme definitions from memory, and releases data.
+ */
+static int
+parseProgrammeData (void* p, const char* fileName, char* data, size_t len, int mapped)
+{
+	struct pgmindex idx;
+	ParserState     ps;
+	int             rtn;
+
+	memset (&idx, 0, sizeof (idx));
+	memset (&ps, 0, sizeof (ps));
+	ps.p          = p;
+	ps.index      = &idx;
+	ps.fileName   = fileName;
+	ps.pos        = data;
+	ps.end        = data + len;
+	ps.lineNumber = 0;
+	getNextToken (&ps);
+	rtn = (int)parseProgramDefinitionList (&ps);
+
+	if (idx.n_entries > 0 && compileLibrary (&ps, &idx) == P_ERROR) {
+		rtn = (int)P_ERROR;
+	}
+	free (idx.entries);
+
+#ifndef _WIN32
+	if (mapped) {
+		munmap (data, len);
+	} else
+#endif
+	{
+		free (data);
+	}
+	return rtn;
+}
+
 /*
  * Opens the named programme file and parses its contents.
  * fileName  The path to the programme file.
@@ -342,55 +690,288 @@ parseProgramDefinitionList (ParserState* ps)
 int
 loadProgrammeFile (void* p, char* fileName)
 {
-	ParserState ps;
-	ps.p = p;
-	if ((ps.fp = fopen (fileName, "r")) != NULL) {
-		int rtn;
-		ps.fileName   = fileName;
-		ps.lineNumber = 0;
-		getNextToken (&ps);
-		rtn = (int)parseProgramDefinitionList (&ps);
-		fclose (ps.fp);
-		return rtn;
-	} else {
+	char*  data;
+	size_t len;
+	int    mapped = 0;
+#ifdef _WIN32
+	FILE* fp;
+	long  l;
+
+	if ((fp = fopen (fileName, "rb")) == NULL) {
+		perror (fileName);
+		return (int)P_ERROR;
+	}
+	fseek (fp, 0, SEEK_END);
+	l = ftell (fp);
+	fseek (fp, 0, SEEK_SET);
+	len  = l > 0 ? (size_t)l : 0;
+	data = (char*)malloc (len + 1);
+	if (!data || fread (data, 1, len, fp) != len) {
+		fprintf (stderr, "%s: read error\n", fileName);
+		free (data);
+		fclose (fp);
+		return (int)P_ERROR;
+	}
+	fclose (fp);
+#else
+	struct stat st;
+	int         fd;
+
+	if ((fd = open (fileName, O_RDONLY)) < 0 || fstat (fd, &st)) {
 		perror (fileName);
+		if (fd >= 0) {
+			close (fd);
+		}
 		return (int)P_ERROR;
 	}
+	len  = (size_t)st.st_size;
+	data = NULL;
+	if (len > 0) {
+		data = (char*)mmap (NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			perror (fileName);
+			close (fd);
+			return (int)P_ERROR;
+		}
+		mapped = 1;
+	}
+	close (fd);
+#endif
+	return parseProgrammeData (p, fileName, data, len, mapped);
 }
 
 #ifdef LV2SYNTH
 int
 loadProgrammeString (void* p, char* pdef)
 {
-	ParserState ps;
-	ps.p   = p;
-	int rv = (int)P_ERROR;
-#ifdef _WIN32
-	char temppath[MAX_PATH - 13];
-	char filename[MAX_PATH + 1];
-	if (0 == GetTempPath (sizeof (temppath), temppath))
-		return rv;
-	if (0 == GetTempFileName (temppath, "sbfpgm", 0, filename))
-		return rv;
-	FILE* f = fopen (filename, "wb");
-	if (NULL == f)
-		return rv;
-	fwrite (pdef, strlen (pdef), 1, f);
-	fclose (f);
-	if ((ps.fp = fopen (filename, "rb")) != NULL)
-#else
-	if ((ps.fp = fmemopen (pdef, strlen (pdef), "r")) != NULL)
-#endif
-	{
-		ps.fileName   = "<string-pipe>";
-		ps.lineNumber = 0;
-		getNextToken (&ps);
-		rv = (int)parseProgramDefinitionList (&ps);
-		fclose (ps.fp);
+	size_t len  = strlen (pdef);
+	char*  data = (char*)malloc (len + 1);
+	if (!data) {
+		return (int)P_ERROR;
 	}
-#ifdef _WIN32
-	unlink (filename);
-#endif
-	return rv;
+	memcpy (data, pdef, len + 1);
+	return parseProgrammeData (p, "<string-pipe>", data, len, 0);
 }
 #endif
+
+/*
+ * Copies the programme pgmNr of a bank other than 0 into pgm.
+ * return    0 if the programme was found, non-zero otherwise.
+ */
+int
+getLibraryProgramme (void* p, int bank, int pgmNr, void* pgm)
+{
+	const struct b_pgmpage* page = findPage ((struct b_pgmlib*)((struct b_programme*)p)->library, bank);
+
+	if (!page || pgmNr < 0 || MAXPROGS <= pgmNr || !page->slot[pgmNr]) {
+		return -1;
+	}
+	memcpy (pgm, &page->programmes[page->slot[pgmNr] - 1], sizeof (Programme));
+	return 0;
+}
+
+/*
+ * Selects the bank of the programmes installProgram() installs, as the
+ * 14 bit value of a MIDI bank select. Bank 0 has the programmes of the
+ * programme file that have no bank number.
+ */
+void
+selectProgrammeBank (void* p, int bank)
+{
+	struct b_programme* progs = (struct b_programme*)p;
+
+	if (bank < 0 || PGM_MAXBANK < bank) {
+		return;
+	}
+	progs->bankSelect = bank;
+	progs->page       = findPage ((struct b_pgmlib*)progs->library, bank);
+}
+
+/*
+ * Moves the libraries of from to p. The ones p had are kept until p is
+ * freed, the audio thread may still be reading them.
+ */
+void
+replaceProgrammeLibrary (void* p, void* from)
+{
+	struct b_programme* dst = (struct b_programme*)p;
+	struct b_programme* src = (struct b_programme*)from;
+	struct b_pgmlib*    lib = (struct b_pgmlib*)src->library;
+
+	if (dst->library) {
+		if (!lib && !(lib = (struct b_pgmlib*)calloc (1, sizeof (struct b_pgmlib)))) {
+			return;
+		}
+		lib->retired = (struct b_pgmlib*)dst->library;
+	}
+	dst->library = lib;
+	dst->page    = findPage (lib, dst->bankSelect);
+	src->library = NULL;
+	src->page    = NULL;
+}
+
+/*
+ * Takes over the MIDI program offset of staged, a copy changed aside, and
+ * with_programmes also its programmes and library, keeping the selected
+ * bank. The library p had moves to staged, to be freed with it. It does
+ * not allocate, the audio thread calls it.
+ */
+void
+exchangeProgrammes (void* p, void* staged, int with_programmes)
+{
+	struct b_programme* dst = (struct b_programme*)p;
+	struct b_programme* src = (struct b_programme*)staged;
+	void*               lib;
+
+	dst->MIDIControllerPgmOffset = src->MIDIControllerPgmOffset;
+	if (!with_programmes) {
+		return;
+	}
+	memcpy (dst->programmes, src->programmes, sizeof (dst->programmes));
+	lib          = dst->library;
+	dst->library = src->library;
+	dst->page    = findPage ((struct b_pgmlib*)dst->library, dst->bankSelect);
+	src->library = lib;
+	src->page    = NULL;
+}
+
+/* Size of one Programme in a snapshot, see pgmSnapshotWrite() */
+#define PGM_SNAPSHOT_ENTRY (NAMESZ + 4 * (NFLAGS + 27) + 2 * 19 + 4 * 5)
+/* Pgm offset, previous programme and bank select, then the programmes */
+#define PGM_SNAPSHOT_SIZE (3 * 4 + MAXPROGS * PGM_SNAPSHOT_ENTRY)
+
+/*
+ * Writes the programmes of bank 0, the MIDI program offset and the
+ * selected bank to buf, field by field and little endian. The library
+ * of other banks is not included, it is loaded from the programme file.
+ * @return the number of bytes needed; nothing is written if len is smaller.
+ */
+size_t
+pgmSnapshotWrite (void* p, void* buf, size_t len)
+{
+	const struct b_programme* progs = (const struct b_programme*)p;
+	unsigned char*            b     = (unsigned char*)buf;
+	int                       i, j;
+
+	if (len < PGM_SNAPSHOT_SIZE) {
+		return PGM_SNAPSHOT_SIZE;
+	}
+
+	snapshotPut32 (&b, (uint32_t)progs->MIDIControllerPgmOffset);
+	snapshotPut32 (&b, (uint32_t)progs->previousPgmNr);
+	snapshotPut32 (&b, (uint32_t)progs->bankSelect);
+	for (i = 0; i < MAXPROGS; i++) {
+		const Programme* pgm = &progs->programmes[i];
+		memcpy (b, pgm->name, NAMESZ);
+		b += NAMESZ;
+		for (j = 0; j < NFLAGS; j++) {
+			snapshotPut32 (&b, pgm->flags[j]);
+		}
+		for (j = 0; j < 9; j++) {
+			snapshotPut32 (&b, pgm->drawbars[j]);
+		}
+		for (j = 0; j < 9; j++) {
+			snapshotPut32 (&b, pgm->lowerDrawbars[j]);
+		}
+		for (j = 0; j < 9; j++) {
+			snapshotPut32 (&b, pgm->pedalDrawbars[j]);
+		}
+		snapshotPut16 (&b, (uint16_t)pgm->keyAttackEnvelope);
+		snapshotPutFloat (&b, pgm->keyAttackClickLevel);
+		snapshotPutFloat (&b, pgm->keyAttackClickDuration);
+		snapshotPut16 (&b, (uint16_t)pgm->keyReleaseEnvelope);
+		snapshotPutFloat (&b, pgm->keyReleaseClickLevel);
+		snapshotPutFloat (&b, pgm->keyReleaseClickDuration);
+		snapshotPut16 (&b, (uint16_t)pgm->scanner);
+		snapshotPut16 (&b, (uint16_t)pgm->percussionEnabled);
+		snapshotPut16 (&b, (uint16_t)pgm->percussionVolume);
+		snapshotPut16 (&b, (uint16_t)pgm->percussionSpeed);
+		snapshotPut16 (&b, (uint16_t)pgm->percussionHarmonic);
+		snapshotPut16 (&b, (uint16_t)pgm->overdriveSelect);
+		snapshotPut16 (&b, (uint16_t)pgm->rotaryEnabled);
+		snapshotPut16 (&b, (uint16_t)pgm->rotarySpeedSelect);
+		snapshotPutFloat (&b, pgm->reverbMix);
+		snapshotPut16 (&b, (uint16_t)pgm->keyboardSplitLower);
+		snapshotPut16 (&b, (uint16_t)pgm->keyboardSplitPedals);
+		for (j = 0; j < 7; j++) {
+			snapshotPut16 (&b, (uint16_t)pgm->transpose[j]);
+		}
+	}
+	return PGM_SNAPSHOT_SIZE;
+}
+
+/*
+ * Restores what pgmSnapshotWrite() wrote and selects the saved bank in
+ * the library this instance has loaded. Not realtime safe.
+ * @return 0 on success, -1 if the data is not a valid snapshot.
+ */
+int
+pgmSnapshotRead (void* p, const void* buf, size_t len)
+{
+	struct b_programme*  progs = (struct b_programme*)p;
+	const unsigned char* b     = (const unsigned char*)buf;
+	int32_t              offset, previous, bank;
+	int                  i, j;
+
+	if (len != PGM_SNAPSHOT_SIZE) {
+		return -1;
+	}
+	offset   = (int32_t)snapshotGet32 (&b);
+	previous = (int32_t)snapshotGet32 (&b);
+	bank     = (int32_t)snapshotGet32 (&b);
+	if (bank < 0 || PGM_MAXBANK < bank) {
+		return -1;
+	}
+
+	progs->MIDIControllerPgmOffset = offset;
+	progs->previousPgmNr           = previous;
+	for (i = 0; i < MAXPROGS; i++) {
+		Programme* pgm = &progs->programmes[i];
+		memcpy (pgm->name, b, NAMESZ);
+		pgm->name[NAMESZ - 1] = '\0';
+		b += NAMESZ;
+		for (j = 0; j < NFLAGS; j++) {
+			pgm->flags[j] = snapshotGet32 (&b);
+		}
+		for (j = 0; j < 9; j++) {
+			pgm->drawbars[j] = snapshotGet32 (&b);
+		}
+		for (j = 0; j < 9; j++) {
+			pgm->lowerDrawbars[j] = snapshotGet32 (&b);
+		}
+		for (j = 0; j < 9; j++) {
+			pgm->pedalDrawbars[j] = snapshotGet32 (&b);
+		}
+		pgm->keyAttackEnvelope       = (short)snapshotGet16 (&b);
+		pgm->keyAttackClickLevel     = snapshotGetFloat (&b);
+		pgm->keyAttackClickDuration  = snapshotGetFloat (&b);
+		pgm->keyReleaseEnvelope      = (short)snapshotGet16 (&b);
+		pgm->keyReleaseClickLevel    = snapshotGetFloat (&b);
+		pgm->keyReleaseClickDuration = snapshotGetFloat (&b);
+		pgm->scanner                 = (short)snapshotGet16 (&b);
+		pgm->percussionEnabled       = (short)snapshotGet16 (&b);
+		pgm->percussionVolume        = (short)snapshotGet16 (&b);
+		pgm->percussionSpeed         = (short)snapshotGet16 (&b);
+		pgm->percussionHarmonic      = (short)snapshotGet16 (&b);
+		pgm->overdriveSelect         = (short)snapshotGet16 (&b);
+		pgm->rotaryEnabled           = (short)snapshotGet16 (&b);
+		pgm->rotarySpeedSelect       = (short)snapshotGet16 (&b);
+		pgm->reverbMix               = snapshotGetFloat (&b);
+		pgm->keyboardSplitLower      = (short)snapshotGet16 (&b);
+		pgm->keyboardSplitPedals     = (short)snapshotGet16 (&b);
+		for (j = 0; j < 7; j++) {
+			pgm->transpose[j] = (short)snapshotGet16 (&b);
+		}
+	}
+	selectProgrammeBank (progs, bank);
+	return 0;
+}
+
+void
+freeProgrammeLibrary (void* p)
+{
+	struct b_programme* progs = (struct b_programme*)p;
+	freeLibrary ((struct b_pgmlib*)progs->library);
+	progs->library = NULL;
+	progs->page    = NULL;
+}
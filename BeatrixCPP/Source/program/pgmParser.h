@@ -22,6 +22,8 @@
 #ifndef PGMPARSER_H
 #define PGMPARSER_H
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -30,6 +32,13 @@ extern "C" {
 
 extern int loadProgrammeFile (void* p, char* fileName);
 extern int loadProgrammeString (void* p, char* pdef);
+extern int getLibraryProgramme (void* p, int bank, int pgmNr, void* pgm);
+extern void selectProgrammeBank (void* p, int bank);
+extern void replaceProgrammeLibrary (void* p, void* from);
+extern void exchangeProgrammes (void* p, void* staged, int with_programmes);
+extern void freeProgrammeLibrary (void* p);
+extern size_t pgmSnapshotWrite (void* p, void* buf, size_t len);
+extern int pgmSnapshotRead (void* p, const void* buf, size_t len);
 
 #ifdef __cplusplus
 }
@@ -178,9 +178,11 @@ static const SymbolMap propertySymbols[] = {
 static int
 getPropertyIndex (const char* sym)
 {
-	int i;
+	int       i;
+	const int c = tolower ((unsigned char)sym[0]);
 	for (i = 0; propertySymbols[i].propertyName != NULL; i++) {
-		if (!strcasecmp (propertySymbols[i].propertyName, sym)) {
+		/* the names are lower case, compare the first letter inline */
+		if (propertySymbols[i].propertyName[0] == c && !strcasecmp (propertySymbols[i].propertyName, sym)) {
 			return propertySymbols[i].property;
 		}
 	}
@@ -318,11 +320,7 @@ bindToProgram (void*       pp,
                const char* val)
 {
 	struct b_programme* p = (struct b_programme*)pp;
-	int                 prop;
 	char                msg[MESSAGEBUFFERSIZE];
-	float               fv;
-	int                 iv;
-	int                 rtn;
 	Programme*          PGM;
 
 	/* Check the program number */
@@ -341,6 +339,26 @@ bindToProgram (void*       pp,
 		p->previousPgmNr = pgmnr;
 	}
 
+	return bindToProgramme (PGM, fileName, lineNumber, sym, val);
+}
+
+/**
+ * Sets one property of a programme record.
+ * Return: 0 OK, non-zero error.
+ */
+int
+bindToProgramme (Programme*  PGM,
+                 const char* fileName,
+                 const int   lineNumber,
+                 const char* sym,
+                 const char* val)
+{
+	int   prop;
+	char  msg[MESSAGEBUFFERSIZE];
+	float fv;
+	int   iv;
+	int   rtn;
+
 	/* Scan for a matching property symbol */
 
 	prop = getPropertyIndex (sym);
@@ -677,6 +695,19 @@ randomizeDrawbars (unsigned int drawbars[], char* buf)
 	}
 }
 
+/**
+ * Returns programme p of the selected bank, NULL if it is not defined.
+ */
+static Programme*
+selectedProgramme (struct b_programme* progs, int p)
+{
+	if (progs->page) {
+		const int slot = progs->page->slot[p];
+		return slot ? &progs->page->programmes[slot - 1] : NULL;
+	}
+	return progs->bankSelect == 0 ? &progs->programmes[p] : NULL;
+}
+
 /**
  * This is the routine called by the MIDI parser when it detects
  * a Program Change message.
@@ -690,8 +721,8 @@ installProgram (void* instance, unsigned char uc)
 	p += inst->progs->MIDIControllerPgmOffset;
 
 	if ((0 < p) && (p < MAXPROGS)) {
-		Programme*   PGM    = &(inst->progs->programmes[p]);
-		unsigned int flags0 = PGM->flags[0];
+		Programme*   PGM    = selectedProgramme (inst->progs, p);
+		unsigned int flags0 = PGM ? PGM->flags[0] : 0;
 #ifdef DEBUG_MIDI_PROGRAM_CHANGES
 		char display[128];
 #endif
@@ -1371,11 +1402,12 @@ exportProgramms (struct b_programme* pgm, FILE* fp)
 }
 
 struct b_programme*
-allocProgs ()
+allocProgs (void* arena)
 {
-	struct b_programme* p = (struct b_programme*)calloc (1, sizeof (struct b_programme));
+	struct b_programme* p = (struct b_programme*)arenaAlloc (arena, sizeof (struct b_programme));
 	if (!p)
 		return NULL;
+	p->arena                   = arena;
 	p->previousPgmNr           = -1;
 	p->MIDIControllerPgmOffset = 1;
 	memcpy (p->programmes, defaultprogrammes, sizeof (Programme) * MAXPROGS);
@@ -1385,7 +1417,8 @@ allocProgs ()
 void
 freeProgs (struct b_programme* p)
 {
-	free (p);
+	freeProgrammeLibrary (p);
+	arenaFree (p->arena, p);
 }
 #endif
 
@@ -28,6 +28,7 @@ extern "C" {
 #include "cfgParser.h"
 
 #define MAXPROGS (129)
+#define PGM_MAXBANK (16383) /* 14 bit MIDI bank select */
 
 #define NAMESZ 22
 #define NFLAGS 1 /* The nof flag fields in Programme struct */
@@ -104,6 +105,14 @@ typedef struct _programme {
 #define FL_VCRUPR 0x20000000 /* Vib/cho upper manual routing */
 #define FL_VCRLWR 0x40000000 /* Vib/cho lower manual routing */
 
+/* The programmes of a bank other than 0, see selectProgrammeBank() */
+struct b_pgmpage {
+	int           bank;
+	int           n_programmes;
+	unsigned char slot[MAXPROGS]; /* 1 + index in programmes, 0 if not defined */
+	Programme     programmes[1];  /* n_programmes */
+};
+
 struct b_programme {
 	/**
  * This is to compensate for MIDI controllers that number the programs
@@ -113,6 +122,12 @@ struct b_programme {
 	int       MIDIControllerPgmOffset;
 	int       previousPgmNr;
 	Programme programmes[MAXPROGS];
+	void*     library; /* banks other than 0, see getLibraryProgramme() */
+
+	int               bankSelect; /* MSB from CC 0, LSB from CC 32 */
+	struct b_pgmpage* page;       /* of bankSelect, NULL if it has none */
+
+	void* arena; /* of this struct, the library is on the heap */
 };
 
 extern int pgmConfig (struct b_programme* p, ConfigContext* cfg);
@@ -128,7 +143,7 @@ extern int saveProgramm (void* inst, int pgm, char* name, int flagmask);
 extern void exportProgramms (struct b_programme* p, FILE* fp);
 extern void writeProgramm (int pgmNr, Programme* p, const char* sep, FILE* fp);
 
-extern struct b_programme* allocProgs ();
+extern struct b_programme* allocProgs (void* arena);
 extern void freeProgs (struct b_programme* p);
 
 extern int bindToProgram (void*       pp,
@@ -138,6 +153,12 @@ extern int bindToProgram (void*       pp,
                           const char* sym,
                           const char* val);
 
+extern int bindToProgramme (Programme*  PGM,
+                            const char* fileName,
+                            const int   lineNumber,
+                            const char* sym,
+                            const char* val);
+
 #ifdef __cplusplus
 }
 #endif
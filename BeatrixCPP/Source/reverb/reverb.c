@@ -92,13 +92,15 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "global_definitions.h"
 #include "midi.h" // useMIDIControlFunction
+#include "arena.h"
 #include "reverb.h"
 
 struct b_reverb*
-allocReverb ()
+allocReverb (void* arena)
 {
-	struct b_reverb* r = (struct b_reverb*)calloc (1, sizeof (struct b_reverb));
+	struct b_reverb* r = (struct b_reverb*)arenaAlloc (arena, sizeof (struct b_reverb));
 
 	if (!r) {
 		return NULL;
@@ -106,10 +108,13 @@ allocReverb ()
 		exit (1);
 	}
 
+	r->arena     = arena;
 	r->inputGain = 0.1;    /* Input gain value */
 	r->fbk       = -0.015; /* Feedback gain */
 	r->wet       = 0.1;    /* Output dry gain */
 	r->dry       = 0.9;    /* Output wet gain */
+	r->wetZ      = r->wet;
+	r->dryZ      = r->dry;
 
 	/* These are all  1/sqrt(2) = 0.7071067811865475 */
 	r->gain[0] = sqrtf (0.5); /* FBCF (feedback combfilter) */
@@ -148,9 +153,9 @@ freeReverb (struct b_reverb* r)
 {
 	int i;
 	for (i = 0; i < RV_NZ; ++i) {
-		free (r->delays[i]);
+		arenaFree (r->arena, r->delays[i]);
 	}
-	free (r);
+	arenaFree (r->arena, r);
 }
 
 /* used during initialization, set array end pointers */
@@ -160,12 +165,11 @@ setReverbPointers (struct b_reverb* r, int i)
 	if ((0 <= i) && (i < RV_NZ)) {
 		int e        = (r->end[i] * r->SampleRateD / 22050.0);
 		e            = e | 1;
-		r->delays[i] = (float*)realloc ((void*)r->delays[i], (e + 2) * sizeof (float));
+		arenaFree (r->arena, r->delays[i]);
+		r->delays[i] = (float*)arenaAlloc (r->arena, (e + 2) * sizeof (float));
 		if (!r->delays[i]) {
 			fprintf (stderr, "FATAL: memory allocation failed for reverb.\n");
 			exit (1);
-		} else {
-			memset (r->delays[i], 0, (e + 2) * sizeof (float));
 		}
 		r->endp[i] = r->delays[i] + e + 1;
 		r->idx0[i] = r->idxp[i] = &(r->delays[i][0]);
@@ -225,6 +229,20 @@ reverbConfig (struct b_reverb* r, ConfigContext* cfg)
 	return ack;
 }
 
+/*
+ * Takes over the dynamic configuration of another reverb, e.g. a copy that
+ * reverbConfig() changed aside. reverb() fades the wet and dry gains to
+ * the new values. Realtime safe.
+ */
+void
+copyReverbSettings (struct b_reverb* r, const struct b_reverb* from)
+{
+	r->inputGain = from->inputGain;
+	r->fbk       = from->fbk;
+	r->wet       = from->wet;
+	r->dry       = from->dry;
+}
+
 void
 initReverb (struct b_reverb* r, void* m, double rate)
 {
@@ -234,9 +252,28 @@ initReverb (struct b_reverb* r, void* m, double rate)
 		setReverbPointers (r, i);
 	}
 	setReverbInputGain (r, r->inputGain);
+	r->wetZ = r->wet;
+	r->dryZ = r->dry;
 	useMIDIControlFunction (m, "reverb.mix", setReverbMixFromMIDI, r);
 }
 
+/*
+ * Empties the delay lines, the mix jumps to its target.
+ */
+void
+resetReverb (struct b_reverb* r)
+{
+	int i;
+	for (i = 0; i < RV_NZ; i++) {
+		memset (r->delays[i], 0, (r->endp[i] - r->delays[i] + 1) * sizeof (float));
+		r->idxp[i] = r->idx0[i];
+	}
+	r->yy1  = 0.0;
+	r->y_1  = 0.0;
+	r->wetZ = r->wet;
+	r->dryZ = r->dry;
+}
+
 float*
 reverb (struct b_reverb* r,
         const float*     inbuf,
@@ -249,8 +286,10 @@ reverb (struct b_reverb* r,
 	const float* const  gain      = r->gain;
 	const float         inputGain = r->inputGain;
 	const float         fbk       = r->fbk;
-	const float         wet       = r->wet;
-	const float         dry       = r->dry;
+	float               wet       = r->wetZ;
+	float               dry       = r->dryZ;
+	const float         dwet      = paramRampIncrement (&r->wetZ, r->wet, bufferLengthSamples, r->SampleRateD);
+	const float         ddry      = paramRampIncrement (&r->dryZ, r->dry, bufferLengthSamples, r->SampleRateD);
 
 	unsigned int i;
 	const float* xp = inbuf;
@@ -290,6 +329,8 @@ reverb (struct b_reverb* r,
 		y_1 = fbk * xa;
 
 		*yp++ = ((wet * y) + (dry * xo));
+		wet += dwet;
+		dry += ddry;
 	}
 
 	r->y_1 = y_1 + DENORMAL_HACK;
@@ -27,6 +27,8 @@ extern "C" {
 
 #define RV_NZ 7
 struct b_reverb {
+	void* arena; /* of this struct and the delay lines */
+
 	/* static buffers, pointers */
 	float* delays[RV_NZ]; /**< delay line buffer */
 
@@ -47,10 +49,14 @@ struct b_reverb {
 	float fbk;       /**< Feedback gain */
 	float wet;       /**< Output dry gain */
 	float dry;       /**< Output wet gain */
+
+	/* smoothed state */
+	float wetZ; /**< Wet gain applied by reverb(), follows wet */
+	float dryZ; /**< Dry gain applied by reverb(), follows dry */
 };
 
 #include "../config/cfgParser.h"
-extern struct b_reverb* allocReverb ();
+extern struct b_reverb* allocReverb (void* arena);
 void freeReverb (struct b_reverb* r);
 
 extern int reverbConfig (struct b_reverb* r, ConfigContext* cfg);
@@ -67,7 +73,10 @@ extern void setReverbDry (struct b_reverb* r, float g);
 
 extern void setReverbWet (struct b_reverb* r, float g);
 
+extern void copyReverbSettings (struct b_reverb* r, const struct b_reverb* from);
+
 extern void initReverb (struct b_reverb* r, void* m, double rate);
+extern void resetReverb (struct b_reverb* r);
 
 extern float* reverb (struct b_reverb* r, const float* inbuf, float* outbuf, size_t bufferLengthSamples);
 
@@ -0,0 +1,379 @@
+/*
+OpenB3: an open source sound synthesis engine and JUCE application/plugin that simulates
+the magnificent sound of the Hammond B3 organ and Leslie rotating speaker
+Copyright (C) 2021-2022 Michele Perrone
+Github: https://github.com/michele-perrone/OpenPiano
+Author e-mail: perrone(dot)michele(at)outlook(dot)com
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * beatrix_client.cpp --- Test client of the render server.
+ *
+ * Attaches to an instance of a running server, plays a Standard MIDI File
+ * or a chord on it, and consumes the audio at the pace of a sound card,
+ * or as fast as the server renders it. Reports the periods that were not
+ * ready in time and the counters of the server. Several clients at once
+ * stand in for the front-ends of the server.
+ */
+
+#include "render_server.h"
+#include "smf.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+static void
+usage (const char* prog)
+{
+	fprintf (stderr,
+	         "Usage: %s [options] <socket> [file.mid]\n"
+	         "Play a MIDI file, or a chord, on an engine of a render server.\n"
+	         "\n"
+	         "Options:\n"
+	         "  -o <file>   write the audio as raw interleaved 32bit float\n"
+	         "  -q <n>      periods in the ring (default: %d)\n"
+	         "  -d <sec>    duration (default: the file and 2 s, or 5 s)\n"
+	         "  -s <k=v>    set a configuration value first, may be repeated\n"
+	         "  -f          consume as fast as possible instead of in real time\n"
+	         "  -h          print this help and exit\n",
+	         prog, RENDER_DEFAULT_PERIODS);
+}
+
+static double
+wallclock ()
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* The socket, with a buffer for reading replies line by line */
+struct connection {
+	int    fd;
+	size_t len;
+	char   buf[4096];
+};
+
+static int
+send_line (struct connection* c, const char* line)
+{
+	const size_t len = strlen (line);
+	if (send (c->fd, line, len, MSG_NOSIGNAL) != (ssize_t)len || send (c->fd, "\n", 1, MSG_NOSIGNAL) != 1) {
+		perror ("send");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Reads a reply, and the file descriptor that comes with it if fd is
+ * not NULL. The reply is returned without its newline.
+ * @returns  The reply, NULL if the connection was lost.
+ */
+static char*
+read_line (struct connection* c, int* fd)
+{
+	char* nl;
+	while ((nl = (char*)memchr (c->buf, '\n', c->len)) == NULL) {
+		if (c->len == sizeof (c->buf)) {
+			return NULL;
+		}
+
+		struct iovec  iov = { c->buf + c->len, sizeof (c->buf) - c->len };
+		struct msghdr msg;
+		union {
+			char           buf[CMSG_SPACE (sizeof (int))];
+			struct cmsghdr align;
+		} ctl;
+		memset (&msg, 0, sizeof (msg));
+		msg.msg_iov        = &iov;
+		msg.msg_iovlen     = 1;
+		msg.msg_control    = ctl.buf;
+		msg.msg_controllen = sizeof (ctl.buf);
+
+		const ssize_t n = recvmsg (c->fd, &msg, MSG_CMSG_CLOEXEC);
+		if (n <= 0) {
+			return NULL;
+		}
+		c->len += n;
+
+		struct cmsghdr* cm = CMSG_FIRSTHDR (&msg);
+		if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+			int received;
+			memcpy (&received, CMSG_DATA (cm), sizeof (int));
+			if (fd) {
+				*fd = received;
+			} else {
+				close (received);
+			}
+		}
+	}
+
+	/* Handed out until the next call */
+	static char line[sizeof (c->buf)];
+	const size_t len = nl - c->buf;
+	memcpy (line, c->buf, len);
+	line[len] = '\0';
+	c->len -= len + 1;
+	memmove (c->buf, nl + 1, c->len);
+	return line;
+}
+
+static int
+send_midi (struct connection* c, const uint8_t* data, size_t size)
+{
+	char line[32];
+	if (size == 2) {
+		snprintf (line, sizeof (line), "midi %02x %02x", data[0], data[1]);
+	} else {
+		snprintf (line, sizeof (line), "midi %02x %02x %02x", data[0], data[1], data[2]);
+	}
+	return send_line (c, line);
+}
+
+/* A C major chord on the upper manual, released one second before the end */
+static struct smf_file*
+test_chord (double duration)
+{
+	static const uint8_t notes[] = { 60, 64, 67, 72 };
+	const size_t         n       = sizeof (notes);
+
+	struct smf_file* f = (struct smf_file*)calloc (1, sizeof (struct smf_file));
+	f->events          = (struct smf_event*)calloc (2 * n, sizeof (struct smf_event));
+	f->n_events        = 2 * n;
+	f->duration        = duration;
+	for (size_t i = 0; i < n; ++i) {
+		struct smf_event* on  = &f->events[i];
+		struct smf_event* off = &f->events[n + i];
+		on->time              = 0.1;
+		off->time             = fmax (0.1, duration - 1.0);
+		on->size = off->size = 3;
+		on->data[0]          = 0x90;
+		off->data[0]         = 0x80;
+		on->data[1] = off->data[1] = notes[i];
+		on->data[2] = off->data[2] = 100;
+	}
+	return f;
+}
+
+int
+main (int argc, char** argv)
+{
+	const char* output_file = NULL;
+	int         n_periods   = RENDER_DEFAULT_PERIODS;
+	double      duration    = -1;
+	bool        fast        = false;
+	const char* settings[16];
+	int         n_settings = 0;
+	int         c;
+
+	while ((c = getopt (argc, argv, "o:q:d:s:fh")) != -1) {
+		switch (c) {
+			case 'o':
+				output_file = optarg;
+				break;
+			case 'q':
+				n_periods = atoi (optarg);
+				break;
+			case 'd':
+				duration = atof (optarg);
+				break;
+			case 's':
+				if (n_settings < 16) {
+					settings[n_settings++] = optarg;
+				}
+				break;
+			case 'f':
+				fast = true;
+				break;
+			case 'h':
+				usage (argv[0]);
+				return 0;
+			default:
+				usage (argv[0]);
+				return 1;
+		}
+	}
+	if (optind + 1 != argc && optind + 2 != argc) {
+		usage (argv[0]);
+		return 1;
+	}
+
+	struct smf_file* smf = NULL;
+	if (optind + 2 == argc) {
+		if (!(smf = smf_load (argv[optind + 1]))) {
+			return 1;
+		}
+		if (duration < 0) {
+			duration = smf->duration + 2.0;
+		}
+	} else {
+		if (duration < 0) {
+			duration = 5.0;
+		}
+		smf = test_chord (duration);
+	}
+
+	FILE* fp = NULL;
+	if (output_file && !(fp = fopen (output_file, "wb"))) {
+		perror (output_file);
+		return 1;
+	}
+
+	/* Connect and attach */
+	struct sockaddr_un addr;
+	memset (&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	strncpy (addr.sun_path, argv[optind], sizeof (addr.sun_path) - 1);
+
+	struct connection conn;
+	memset (&conn, 0, sizeof (conn));
+	conn.fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (conn.fd < 0 || connect (conn.fd, (struct sockaddr*)&addr, sizeof (addr))) {
+		perror (argv[optind]);
+		return 1;
+	}
+
+	char line[64];
+	snprintf (line, sizeof (line), "attach %d", n_periods);
+	int   shm_fd = -1;
+	char* reply;
+	if (send_line (&conn, line) || !(reply = read_line (&conn, &shm_fd))) {
+		fprintf (stderr, "Connection lost.\n");
+		return 1;
+	}
+	int    instance, period_frames;
+	double rate;
+	if (sscanf (reply, "ok %d %lf %d %d", &instance, &rate, &period_frames, &n_periods) != 4 || shm_fd < 0) {
+		fprintf (stderr, "attach: %s\n", reply);
+		return 1;
+	}
+
+	const size_t        size = render_ring_size (period_frames, n_periods);
+	void*               p    = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+	struct render_ring* ring = (struct render_ring*)p;
+	close (shm_fd);
+	if (p == MAP_FAILED) {
+		perror ("mmap");
+		return 1;
+	}
+	if (ring->magic != RENDER_RING_MAGIC || ring->version != RENDER_RING_VERSION || ring->n_channels != RENDER_CHANNELS) {
+		fprintf (stderr, "Incompatible server.\n");
+		return 1;
+	}
+
+	fprintf (stderr, "Instance %d: %.0f Hz, %d frames per period, %d periods (%.1f ms latency)\n",
+	         instance, rate, period_frames, n_periods, 1e3 * n_periods * period_frames / rate);
+
+	for (int i = 0; i < n_settings; ++i) {
+		char set[256];
+		snprintf (set, sizeof (set), "set %s", settings[i]);
+		char* eq = strchr (set, '=');
+		if (eq) {
+			*eq = ' ';
+		}
+		if (send_line (&conn, set) || !(reply = read_line (&conn, NULL))) {
+			fprintf (stderr, "Connection lost.\n");
+			return 1;
+		}
+		fprintf (stderr, "%s: %s\n", settings[i], reply);
+	}
+
+	/* Play. Messages are sent one period ahead of the audio consumed and
+	 * are rendered after the periods already in the ring. */
+	const uint64_t n_total  = (uint64_t)ceil (duration * rate / period_frames);
+	const double   t_period = period_frames / rate;
+	float*         LR       = (float*)malloc (2 * period_frames * sizeof (float));
+	uint64_t       late     = 0;
+	double         max_wait = 0;
+	size_t         ev       = 0;
+
+	/* Let the server fill the ring before the clock starts */
+	while (ring->write_pos.load (std::memory_order_acquire) < (uint64_t)n_periods) {
+		usleep (100);
+	}
+	const double t0 = wallclock ();
+
+	for (uint64_t k = 0; k < n_total; ++k) {
+		while (ev < smf->n_events && smf->events[ev].time < (k + 1) * t_period) {
+			if (send_midi (&conn, smf->events[ev].data, smf->events[ev].size)) {
+				return 1;
+			}
+			++ev;
+		}
+
+		if (!fast) {
+			const double due = t0 + k * t_period;
+			double       now;
+			while ((now = wallclock ()) < due) {
+				usleep ((useconds_t)fmin (1e6 * (due - now), 1000.0));
+			}
+		}
+
+		const uint64_t q = ring->read_pos.load (std::memory_order_relaxed);
+		if (ring->write_pos.load (std::memory_order_acquire) <= q) {
+			const double t_wait = wallclock ();
+			++late;
+			while (ring->write_pos.load (std::memory_order_acquire) <= q) {
+				usleep (50);
+			}
+			max_wait = fmax (max_wait, wallclock () - t_wait);
+		}
+
+		const float* L = render_ring_period (ring, q);
+		if (fp) {
+			for (int i = 0; i < period_frames; ++i) {
+				LR[2 * i]     = L[i];
+				LR[2 * i + 1] = L[period_frames + i];
+			}
+			fwrite (LR, 2 * sizeof (float), period_frames, fp);
+		}
+		ring->read_pos.store (q + 1, std::memory_order_release);
+	}
+
+	const double elapsed = wallclock () - t0;
+	fprintf (stderr, "%llu periods (%.2f s of audio) in %.2f s, %llu late, longest wait %.2f ms\n",
+	         (unsigned long long)n_total, n_total * t_period, elapsed, (unsigned long long)late, 1e3 * max_wait);
+
+	if (send_line (&conn, "stats") || !(reply = read_line (&conn, NULL))) {
+		fprintf (stderr, "Connection lost.\n");
+		return 1;
+	}
+	for (char* kv = strtok (reply + (strncmp (reply, "ok ", 3) ? 0 : 3), " "); kv; kv = strtok (NULL, " ")) {
+		printf ("%s\n", kv);
+	}
+
+	send_line (&conn, "detach");
+	read_line (&conn, NULL);
+	close (conn.fd);
+
+	munmap (p, size);
+	free (LR);
+	smf_free (smf);
+	if (fp && fclose (fp)) {
+		perror (output_file);
+		return 1;
+	}
+	return 0;
+}
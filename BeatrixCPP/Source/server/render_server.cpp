@@ -0,0 +1,901 @@
+/*
+OpenB3: an open source sound synthesis engine and JUCE application/plugin that simulates
+the magnificent sound of the Hammond B3 organ and Leslie rotating speaker
+Copyright (C) 2021-2022 Michele Perrone
+Github: https://github.com/michele-perrone/OpenPiano
+Author e-mail: perrone(dot)michele(at)outlook(dot)com
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * render_server.cpp --- Instances for other programs on the same machine.
+ *
+ * The instances come from a BeatrixPool, so they are built and warmed up
+ * before the first client connects. Each instance belongs to one of a
+ * fixed set of render threads, pinned to a CPU each and running with
+ * realtime priority when permitted. A render thread goes round its
+ * attached instances and renders a period into the ring of every one
+ * that has room, and sleeps when none has.
+ *
+ * The main thread serves the socket. It passes MIDI messages to the
+ * render threads through a queue per instance. It prepares configuration
+ * changes itself, and a render thread takes them over between the MIDI
+ * messages sent before and after them.
+ * With -w, a BeatrixConfigWatcher wakes it when the configuration or
+ * programme file was saved, and it reloads them into every instance.
+ */
+
+#include "beatrix_pool.hpp"
+#include "config_watcher.hpp"
+#include "render_server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <new>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MIDI_QUEUE_SIZE   256 /* power of two */
+#define MAX_CONNECTIONS   64
+#define MAX_LINE_LENGTH   1024
+#define RENDER_PRIORITY   70  /* SCHED_FIFO */
+
+/* ----------------------------------------------------------------
+ * Server state
+ * ----------------------------------------------------------------*/
+
+struct midi_message {
+	uint8_t size;
+	uint8_t data[3];
+};
+
+enum slot_state {
+	SLOT_FREE,      /**< owned by the main thread */
+	SLOT_ACTIVE,    /**< rendered by its render thread */
+	SLOT_DETACHING, /**< the render thread is asked to let go */
+	SLOT_DETACHED   /**< the render thread let go, back to the main thread */
+};
+
+/* An instance and the client it is attached to */
+struct render_slot {
+	int                 id;
+	int                 thread;
+	std::atomic<int>    state;
+	Beatrix*            beatrix;
+	struct render_ring* ring;
+	size_t              ring_size;
+	size_t              ring_locked;
+
+	/* Single producer (main thread), single consumer (render thread) */
+	struct midi_message   midi[MIDI_QUEUE_SIZE];
+	std::atomic<uint32_t> midi_head;
+	std::atomic<uint32_t> midi_tail;
+
+	/* Configuration changes take effect after the MIDI messages before them */
+	std::atomic<bool>     config_queued;
+	std::atomic<uint32_t> config_pos; /**< midi_head when they were handed over */
+
+	/* Counters of the attached client, reset on attach */
+	std::atomic<uint64_t> periods;
+	std::atomic<uint64_t> underruns; /**< the ring was empty when the next period was due */
+	std::atomic<uint64_t> midi_dropped;
+	uint64_t              midi_errors;
+};
+
+struct render_thread {
+	struct render_server* server;
+	int                   id;
+	pthread_t             thread;
+
+	std::atomic<uint64_t> periods;
+	std::atomic<uint64_t> busy_ns;
+	std::atomic<uint64_t> sleeps;
+};
+
+struct render_conn {
+	int                 fd;
+	struct render_slot* slot;
+	size_t              len;
+	char                line[MAX_LINE_LENGTH];
+};
+
+struct render_server {
+	const struct render_server_options* opt;
+
+	BeatrixPool*          pool;
+	struct render_slot*   slots;
+	struct render_thread* threads;
+	std::atomic<bool>     running;
+
+	int                listen_fd;
+	struct render_conn conns[MAX_CONNECTIONS];
+	int                n_conns;
+
+	/* With opt->watch, the watcher wakes the main thread to reload */
+	BeatrixConfigWatcher* watcher;
+	int                   wake_fd[2];
+	std::atomic<int>      changed_files;
+};
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void
+catchsig (int)
+{
+	stop_requested = 1;
+}
+
+/* ----------------------------------------------------------------
+ * Render threads
+ * ----------------------------------------------------------------*/
+
+static void
+make_realtime (struct render_thread* t)
+{
+	bool pinned = false;
+#ifdef __linux__
+	const long n_cpus = sysconf (_SC_NPROCESSORS_ONLN);
+	const int  cpu    = t->id % (n_cpus > 0 ? (int)n_cpus : 1);
+	cpu_set_t  cpus;
+	CPU_ZERO (&cpus);
+	CPU_SET (cpu, &cpus);
+	pinned = !pthread_setaffinity_np (pthread_self (), sizeof (cpus), &cpus);
+#endif
+
+	struct sched_param sp;
+	memset (&sp, 0, sizeof (sp));
+	sp.sched_priority   = RENDER_PRIORITY;
+	const bool realtime = !pthread_setschedparam (pthread_self (), SCHED_FIFO, &sp);
+
+	fprintf (stderr, "Render thread %d: %s, %s\n", t->id,
+	         pinned ? "pinned" : "not pinned",
+	         realtime ? "realtime" : "no realtime priority (see RLIMIT_RTPRIO)");
+}
+
+/* Passes the queued MIDI messages up to position head to the instance */
+static void
+drain_midi (struct render_slot* slot, uint32_t head)
+{
+	uint32_t tail = slot->midi_tail.load (std::memory_order_relaxed);
+	for (; (int32_t)(head - tail) > 0; ++tail) {
+		const struct midi_message* m = &slot->midi[tail % MIDI_QUEUE_SIZE];
+		slot->beatrix->process_midi_message (m->data, m->size);
+	}
+	slot->midi_tail.store (tail, std::memory_order_release);
+}
+
+/*
+ * Renders the next period of an instance, if its ring has room.
+ * @returns  true if a period was rendered.
+ */
+static bool
+render_period (struct render_slot* slot, int period_frames)
+{
+	struct render_ring* r = slot->ring;
+	const uint64_t      w = r->write_pos.load (std::memory_order_relaxed);
+	const uint64_t      q = r->read_pos.load (std::memory_order_acquire);
+
+	if (w - q >= r->n_periods) {
+		return false;
+	}
+	if (w == q && w >= r->n_periods) {
+		Beatrix::stat_add (slot->underruns, 1);
+	}
+
+	/* The head first: a change queued before any message up to it is
+	 * seen below. One queued since waits for the next period, the
+	 * instance defers them to here, see attach(). */
+	const uint32_t head = slot->midi_head.load (std::memory_order_acquire);
+	if (slot->config_queued.exchange (false, std::memory_order_acquire)) {
+		drain_midi (slot, slot->config_pos.load (std::memory_order_relaxed));
+		slot->beatrix->apply_pending_config ();
+	}
+	drain_midi (slot, head);
+
+	float* L = render_ring_period (r, w);
+	slot->beatrix->get_next_block (L, L + period_frames, period_frames);
+
+	r->write_pos.store (w + 1, std::memory_order_release);
+	Beatrix::stat_add (slot->periods, 1);
+	return true;
+}
+
+static void*
+render_thread_main (void* arg)
+{
+	struct render_thread* t = (struct render_thread*)arg;
+	struct render_server* s = t->server;
+	const int             n = s->opt->n_instances;
+
+	/* Sleep a fraction of a period, a client that frees a period finds it
+	 * rendered again soon after */
+	const double    nap_s = 0.25 * s->opt->period_frames / s->opt->rate;
+	struct timespec nap;
+	nap.tv_sec  = (time_t)nap_s;
+	nap.tv_nsec = (long)((nap_s - nap.tv_sec) * 1e9);
+
+	make_realtime (t);
+
+	while (s->running.load (std::memory_order_relaxed)) {
+		const uint64_t t0   = Beatrix::now_ns ();
+		uint64_t       done = 0;
+
+		for (int i = t->id; i < n; i += s->opt->n_workers) {
+			struct render_slot* slot  = &s->slots[i];
+			const int           state = slot->state.load (std::memory_order_acquire);
+			if (state == SLOT_DETACHING) {
+				slot->state.store (SLOT_DETACHED, std::memory_order_release);
+			} else if (state == SLOT_ACTIVE) {
+				done += render_period (slot, s->opt->period_frames);
+			}
+		}
+
+		if (done) {
+			Beatrix::stat_add (t->periods, done);
+			Beatrix::stat_add (t->busy_ns, Beatrix::now_ns () - t0);
+		} else {
+			Beatrix::stat_add (t->sleeps, 1);
+			nanosleep (&nap, NULL);
+		}
+	}
+	return NULL;
+}
+
+/* ----------------------------------------------------------------
+ * Clients
+ * ----------------------------------------------------------------*/
+
+/*
+ * Sends a reply line, and a file descriptor with it if fd >= 0.
+ * A client that does not read its replies is disconnected.
+ */
+static int
+reply (struct render_conn* c, int fd, const char* fmt, ...)
+{
+	char    buf[4096];
+	va_list ap;
+	va_start (ap, fmt);
+	int len = vsnprintf (buf, sizeof (buf) - 1, fmt, ap);
+	va_end (ap);
+	if (len < 0) {
+		return -1;
+	}
+	len        = MIN (len, (int)sizeof (buf) - 2);
+	buf[len++] = '\n';
+
+	struct iovec  iov = { buf, (size_t)len };
+	struct msghdr msg;
+	memset (&msg, 0, sizeof (msg));
+	msg.msg_iov    = &iov;
+	msg.msg_iovlen = 1;
+
+	union {
+		char           buf[CMSG_SPACE (sizeof (int))];
+		struct cmsghdr align;
+	} ctl;
+	if (fd >= 0) {
+		memset (&ctl, 0, sizeof (ctl));
+		msg.msg_control    = ctl.buf;
+		msg.msg_controllen = sizeof (ctl.buf);
+		struct cmsghdr* cm = CMSG_FIRSTHDR (&msg);
+		cm->cmsg_level     = SOL_SOCKET;
+		cm->cmsg_type      = SCM_RIGHTS;
+		cm->cmsg_len       = CMSG_LEN (sizeof (int));
+		memcpy (CMSG_DATA (cm), &fd, sizeof (int));
+	}
+
+	if (sendmsg (c->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) != len) {
+		fprintf (stderr, "Client %d: cannot reply, disconnecting.\n", c->fd);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+create_shm (size_t size)
+{
+#ifdef __linux__
+	int fd = memfd_create ("beatrix-ring", MFD_CLOEXEC);
+#else
+	static int counter = 0;
+	char       name[64];
+	snprintf (name, sizeof (name), "/beatrix-ring-%d-%d", (int)getpid (), counter++);
+	int fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd >= 0) {
+		shm_unlink (name);
+	}
+#endif
+	if (fd < 0) {
+		return -1;
+	}
+	if (ftruncate (fd, size)) {
+		close (fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* The render thread with the fewest attached instances that has a free one */
+static struct render_slot*
+free_slot (struct render_server* s)
+{
+	struct render_slot* best = NULL;
+	int*                load = (int*)calloc (s->opt->n_workers, sizeof (int));
+	int                 i;
+
+	for (i = 0; i < s->opt->n_instances; ++i) {
+		if (s->slots[i].state.load (std::memory_order_relaxed) != SLOT_FREE) {
+			++load[s->slots[i].thread];
+		}
+	}
+	for (i = 0; i < s->opt->n_instances; ++i) {
+		struct render_slot* slot = &s->slots[i];
+		if (slot->state.load (std::memory_order_relaxed) == SLOT_FREE &&
+		    (!best || load[slot->thread] < load[best->thread])) {
+			best = slot;
+		}
+	}
+	free (load);
+	return best;
+}
+
+static int
+attach (struct render_server* s, struct render_conn* c, int n_periods)
+{
+	if (c->slot) {
+		return reply (c, -1, "error already attached");
+	}
+	if (n_periods < RENDER_MIN_PERIODS || n_periods > RENDER_MAX_PERIODS) {
+		return reply (c, -1, "error periods must be %d .. %d", RENDER_MIN_PERIODS, RENDER_MAX_PERIODS);
+	}
+
+	struct render_slot* slot = free_slot (s);
+	if (!slot) {
+		return reply (c, -1, "error no free instance");
+	}
+
+	const size_t size = render_ring_size (s->opt->period_frames, n_periods);
+	const int    fd   = create_shm (size);
+	void*        p    = fd < 0 ? MAP_FAILED : mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		perror ("render ring");
+		if (fd >= 0) {
+			close (fd);
+		}
+		return reply (c, -1, "error cannot create shared memory");
+	}
+
+	struct render_ring* r = new (p) render_ring ();
+	r->magic              = RENDER_RING_MAGIC;
+	r->version            = RENDER_RING_VERSION;
+	r->instance           = slot->id;
+	r->n_channels         = RENDER_CHANNELS;
+	r->period_frames      = s->opt->period_frames;
+	r->n_periods          = n_periods;
+	r->rate               = s->opt->rate;
+
+	slot->beatrix     = s->pool->acquire ();
+	slot->ring        = r;
+	slot->ring_size   = size;
+	slot->ring_locked = lockMemory (p, size);
+	/* Changes are applied between the MIDI messages around them, in render_period() */
+	slot->beatrix->defer_pending_config = true;
+	slot->midi_head.store (0, std::memory_order_relaxed);
+	slot->midi_tail.store (0, std::memory_order_relaxed);
+	slot->config_queued.store (false, std::memory_order_relaxed);
+	slot->periods.store (0, std::memory_order_relaxed);
+	slot->underruns.store (0, std::memory_order_relaxed);
+	slot->midi_dropped.store (0, std::memory_order_relaxed);
+	slot->midi_errors = 0;
+	slot->state.store (SLOT_ACTIVE, std::memory_order_release);
+	c->slot = slot;
+
+	fprintf (stderr, "Client %d: attached to instance %d, %d periods.\n", c->fd, slot->id, n_periods);
+
+	int rv = reply (c, fd, "ok %d %g %d %d", slot->id, s->opt->rate, s->opt->period_frames, n_periods);
+	close (fd);
+	return rv;
+}
+
+/* Once the render thread has let go, or is gone */
+static void
+release_slot (struct render_server* s, struct render_slot* slot)
+{
+	slot->beatrix->defer_pending_config = false;
+	s->pool->release (slot->beatrix);
+	if (slot->ring_locked) {
+		unlockMemory (slot->ring, slot->ring_size);
+	}
+	munmap (slot->ring, slot->ring_size);
+	slot->beatrix = NULL;
+	slot->ring    = NULL;
+	slot->state.store (SLOT_FREE, std::memory_order_release);
+}
+
+static void
+detach (struct render_server* s, struct render_conn* c)
+{
+	struct render_slot* slot = c->slot;
+	if (!slot) {
+		return;
+	}
+	c->slot = NULL;
+
+	const struct timespec ms = { 0, 1000000 };
+	slot->state.store (SLOT_DETACHING, std::memory_order_release);
+	while (slot->state.load (std::memory_order_acquire) != SLOT_DETACHED) {
+		nanosleep (&ms, NULL);
+	}
+	release_slot (s, slot);
+	fprintf (stderr, "Client %d: detached from instance %d.\n", c->fd, slot->id);
+}
+
+static void
+stat_print (char* buf, size_t size, const char* fmt, ...)
+{
+	const size_t len = strlen (buf);
+	va_list      ap;
+	va_start (ap, fmt);
+	vsnprintf (buf + len, size - len, fmt, ap);
+	va_end (ap);
+}
+
+static int
+stats (struct render_server* s, struct render_conn* c)
+{
+	char buf[4000] = "ok";
+	int  attached  = 0;
+	int  i;
+
+	for (i = 0; i < s->opt->n_instances; ++i) {
+		attached += s->slots[i].state.load (std::memory_order_relaxed) != SLOT_FREE;
+	}
+	stat_print (buf, sizeof (buf), " instances=%d attached=%d threads=%d",
+	            s->opt->n_instances, attached, s->opt->n_workers);
+	for (i = 0; i < s->opt->n_workers; ++i) {
+		const struct render_thread* t = &s->threads[i];
+		stat_print (buf, sizeof (buf), " thread%d_periods=%llu thread%d_busy_ns=%llu thread%d_sleeps=%llu",
+		            i, (unsigned long long)t->periods.load (std::memory_order_relaxed),
+		            i, (unsigned long long)t->busy_ns.load (std::memory_order_relaxed),
+		            i, (unsigned long long)t->sleeps.load (std::memory_order_relaxed));
+	}
+
+	struct render_slot* slot = c->slot;
+	if (slot) {
+		/* The engine counters are those of the instance since it was built */
+		const BeatrixStats st = slot->beatrix->get_stats ();
+		stat_print (buf, sizeof (buf), " instance=%d thread=%d periods=%llu underruns=%llu midi_dropped=%llu midi_errors=%llu",
+		            slot->id, slot->thread,
+		            (unsigned long long)slot->periods.load (std::memory_order_relaxed),
+		            (unsigned long long)slot->underruns.load (std::memory_order_relaxed),
+		            (unsigned long long)slot->midi_dropped.load (std::memory_order_relaxed),
+		            (unsigned long long)slot->midi_errors);
+		stat_print (buf, sizeof (buf), " blocks=%llu block_ns=%llu block_max_ns=%llu deadline_misses=%llu",
+		            (unsigned long long)st.blocks, (unsigned long long)st.block_ns,
+		            (unsigned long long)st.block_max_ns, (unsigned long long)st.deadline_misses);
+		stat_print (buf, sizeof (buf), " fragments=%llu tonegen_ns=%llu preamp_ns=%llu reverb_ns=%llu whirl_ns=%llu fragment_max_ns=%llu",
+		            (unsigned long long)st.fragments,
+		            (unsigned long long)st.stage_ns[BeatrixStats::TONEGEN],
+		            (unsigned long long)st.stage_ns[BeatrixStats::PREAMP],
+		            (unsigned long long)st.stage_ns[BeatrixStats::REVERB],
+		            (unsigned long long)st.stage_ns[BeatrixStats::WHIRL],
+		            (unsigned long long)st.fragment_max_ns);
+		stat_print (buf, sizeof (buf), " load_p50=%.3g load_p99=%.3g", st.load_percentile (0.5), st.load_percentile (0.99));
+		stat_print (buf, sizeof (buf), " active_oscillators=%d active_oscillators_max=%d core_program_length=%d core_program_length_max=%d msg_queue_depth_max=%d",
+		            st.active_oscillators, st.active_oscillators_max,
+		            st.core_program_length, st.core_program_length_max, st.msg_queue_depth_max);
+	}
+	return reply (c, -1, "%s", buf);
+}
+
+static void
+queue_midi (struct render_slot* slot, char* args)
+{
+	struct midi_message m;
+	char*               end;
+
+	memset (&m, 0, sizeof (m));
+	for (m.size = 0; m.size < 3; ++m.size) {
+		const unsigned long v = strtoul (args, &end, 16);
+		if (end == args || v > 0xff) {
+			break;
+		}
+		m.data[m.size] = (uint8_t)v;
+		args           = end;
+	}
+	while (*args == ' ') {
+		++args;
+	}
+	if (m.size < 2 || *args || !(m.data[0] & 0x80)) {
+		++slot->midi_errors;
+		return;
+	}
+
+	const uint32_t head = slot->midi_head.load (std::memory_order_relaxed);
+	if (head - slot->midi_tail.load (std::memory_order_acquire) >= MIDI_QUEUE_SIZE) {
+		Beatrix::stat_add (slot->midi_dropped, 1);
+		return;
+	}
+	slot->midi[head % MIDI_QUEUE_SIZE] = m;
+	slot->midi_head.store (head + 1, std::memory_order_release);
+}
+
+/*
+ * Orders a configuration change handed to the instance after the MIDI
+ * messages queued so far. Changes that meet in one period take effect
+ * together, at the position of the first.
+ */
+static void
+queue_config (struct render_slot* slot)
+{
+	if (slot->config_queued.load (std::memory_order_relaxed)) {
+		return;
+	}
+	slot->config_pos.store (slot->midi_head.load (std::memory_order_relaxed), std::memory_order_relaxed);
+	slot->config_queued.store (true, std::memory_order_release);
+}
+
+/*
+ * Handles one request.
+ * @returns  -1 if the connection is to be closed.
+ */
+static int
+request (struct render_server* s, struct render_conn* c, char* line)
+{
+	char* args = line + strcspn (line, " ");
+	if (*args) {
+		*args++ = '\0';
+	}
+
+	if (!strcmp (line, "midi")) {
+		if (c->slot) {
+			queue_midi (c->slot, args);
+		}
+		return 0;
+	}
+	if (!strcmp (line, "attach")) {
+		return attach (s, c, *args ? atoi (args) : RENDER_DEFAULT_PERIODS);
+	}
+	if (!strcmp (line, "set")) {
+		char* value = args + strcspn (args, " ");
+		if (*value) {
+			*value++ = '\0';
+		}
+		if (!c->slot) {
+			return reply (c, -1, "error not attached");
+		}
+		if (!*args || !*value) {
+			return reply (c, -1, "error usage: set <key> <value>");
+		}
+		const char* k = args;
+		const char* v = value;
+		if (!s->pool->configure (c->slot->beatrix, &k, &v, 1)) {
+			return reply (c, -1, "error %s does not apply to a running engine", k);
+		}
+		queue_config (c->slot);
+		return reply (c, -1, "ok");
+	}
+	if (!strcmp (line, "stats")) {
+		return stats (s, c);
+	}
+	if (!strcmp (line, "detach")) {
+		detach (s, c);
+		return reply (c, -1, "ok");
+	}
+	return reply (c, -1, "error unknown request '%s'", line);
+}
+
+/*
+ * Reads from a client and handles the complete lines.
+ * @returns  -1 if the connection is to be closed.
+ */
+static int
+receive (struct render_server* s, struct render_conn* c)
+{
+	const ssize_t n = read (c->fd, c->line + c->len, sizeof (c->line) - c->len);
+	if (n <= 0) {
+		return -1;
+	}
+	c->len += n;
+
+	char* start = c->line;
+	char* nl;
+	while ((nl = (char*)memchr (start, '\n', c->line + c->len - start)) != NULL) {
+		*nl = '\0';
+		if (nl > start && nl[-1] == '\r') {
+			nl[-1] = '\0';
+		}
+		if (*start && request (s, c, start)) {
+			return -1;
+		}
+		start = nl + 1;
+	}
+
+	c->len -= start - c->line;
+	memmove (c->line, start, c->len);
+	if (c->len == sizeof (c->line)) {
+		fprintf (stderr, "Client %d: request too long.\n", c->fd);
+		return -1;
+	}
+	return 0;
+}
+
+static bool
+stale_socket (const struct sockaddr_un* addr)
+{
+	int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return false;
+	}
+	const bool stale = connect (fd, (const struct sockaddr*)addr, sizeof (*addr)) && errno == ECONNREFUSED;
+	close (fd);
+	return stale;
+}
+
+static int
+listen_socket (const char* path)
+{
+	struct sockaddr_un addr;
+	memset (&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen (path) >= sizeof (addr.sun_path)) {
+		fprintf (stderr, "%s: socket path too long.\n", path);
+		return -1;
+	}
+	strcpy (addr.sun_path, path);
+
+	int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror ("socket");
+		return -1;
+	}
+
+	if (bind (fd, (struct sockaddr*)&addr, sizeof (addr))) {
+		/* Replace a socket left behind by a server that is gone */
+		if (errno != EADDRINUSE || !stale_socket (&addr)) {
+			perror (path);
+			close (fd);
+			return -1;
+		}
+		unlink (path);
+		if (bind (fd, (struct sockaddr*)&addr, sizeof (addr))) {
+			perror (path);
+			close (fd);
+			return -1;
+		}
+	}
+
+	if (listen (fd, 16)) {
+		perror (path);
+		close (fd);
+		unlink (path);
+		return -1;
+	}
+	return fd;
+}
+
+static void
+close_conn (struct render_server* s, struct render_conn* c)
+{
+	detach (s, c);
+	close (c->fd);
+	c->fd = -1;
+}
+
+/* ----------------------------------------------------------------
+ * Configuration reload
+ * ----------------------------------------------------------------*/
+
+/* On the thread of the watcher */
+static void
+files_changed (int files, void* arg)
+{
+	struct render_server* s = (struct render_server*)arg;
+	s->changed_files.fetch_or (files);
+	if (write (s->wake_fd[1], "", 1) < 0 && errno != EAGAIN) {
+		perror ("reload");
+	}
+}
+
+static void
+reload_files (struct render_server* s)
+{
+	char buf[64];
+	while (read (s->wake_fd[0], buf, sizeof (buf)) > 0) {
+	}
+
+	const int files = s->changed_files.exchange (0);
+	if (files & BeatrixConfigWatcher::CONFIG_FILE) {
+		Beatrix::ConfigReload r;
+		const bool            ok = s->pool->reload_config (&r);
+		fprintf (stderr, "%s: %s, %d live, %d need a restart, %d unchanged.\n", s->opt->config_file,
+		         ok ? "reloaded" : "not reloaded", r.live, r.restart, r.unchanged);
+	}
+	if (files & BeatrixConfigWatcher::PROGRAMME_FILE) {
+		const bool ok = s->pool->reload_programmes ();
+		fprintf (stderr, "%s: %s.\n", s->opt->programme_file, ok ? "reloaded" : "not reloaded");
+	}
+
+	/* The attached instances take the changes over after the MIDI
+	 * messages queued so far */
+	for (int i = 0; i < s->opt->n_instances; ++i) {
+		if (s->slots[i].beatrix) {
+			queue_config (&s->slots[i]);
+		}
+	}
+}
+
+static bool
+start_watcher (struct render_server* s)
+{
+	if (pipe2 (s->wake_fd, O_NONBLOCK | O_CLOEXEC)) {
+		perror ("pipe");
+		return false;
+	}
+	s->watcher = new BeatrixConfigWatcher (s->opt->config_file, s->opt->programme_file, files_changed, s);
+	if (!s->watcher->start ()) {
+		fprintf (stderr, "Nothing to watch, -w needs -c or -p.\n");
+		return false;
+	}
+	return true;
+}
+
+/* ----------------------------------------------------------------
+ * Main loop
+ * ----------------------------------------------------------------*/
+
+int
+render_server_main (const struct render_server_options* opt)
+{
+	struct render_server s;
+	struct pollfd        fds[2 + MAX_CONNECTIONS];
+	int                  i;
+
+	memset (&s.conns, 0, sizeof (s.conns));
+	s.opt           = opt;
+	s.n_conns       = 0;
+	s.watcher       = NULL;
+	s.wake_fd[0]    = -1;
+	s.wake_fd[1]    = -1;
+	s.changed_files = 0;
+
+	s.listen_fd = listen_socket (opt->socket_path);
+	if (s.listen_fd < 0) {
+		return 1;
+	}
+
+	/* Every instance is built and warmed up before the first client */
+	s.pool    = new BeatrixPool (opt->rate, opt->config_file, opt->programme_file, opt->n_instances);
+	s.slots   = new render_slot[opt->n_instances]();
+	s.threads = new render_thread[opt->n_workers]();
+	s.running = true;
+
+	for (i = 0; i < opt->n_instances; ++i) {
+		s.slots[i].id     = i;
+		s.slots[i].thread = i % opt->n_workers;
+	}
+	for (i = 0; i < opt->n_workers; ++i) {
+		s.threads[i].server = &s;
+		s.threads[i].id     = i;
+		if (pthread_create (&s.threads[i].thread, NULL, render_thread_main, &s.threads[i])) {
+			fprintf (stderr, "FATAL: cannot create render thread.\n");
+			exit (1);
+		}
+	}
+
+	struct sigaction sa;
+	memset (&sa, 0, sizeof (sa));
+	sa.sa_handler = catchsig;
+	sigaction (SIGINT, &sa, NULL);
+	sigaction (SIGTERM, &sa, NULL);
+	signal (SIGPIPE, SIG_IGN);
+
+	if (opt->watch && !start_watcher (&s)) {
+		stop_requested = 1;
+	}
+
+	fprintf (stderr, "Serving %d instances at %s, %.0f Hz, %d frames per period, %d render threads.\n",
+	         opt->n_instances, opt->socket_path, opt->rate, opt->period_frames, opt->n_workers);
+
+	while (!stop_requested) {
+		fds[0].fd     = s.listen_fd;
+		fds[0].events = POLLIN;
+		for (i = 0; i < s.n_conns; ++i) {
+			fds[1 + i].fd     = s.conns[i].fd;
+			fds[1 + i].events = POLLIN;
+		}
+		const int n_fds = 1 + s.n_conns;
+		fds[n_fds].fd     = s.wake_fd[0];
+		fds[n_fds].events = POLLIN;
+
+		if (poll (fds, n_fds + 1, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror ("poll");
+			break;
+		}
+
+		if (fds[n_fds].revents & POLLIN) {
+			reload_files (&s);
+		}
+
+		for (i = 0; i < s.n_conns; ++i) {
+			if (fds[1 + i].revents && receive (&s, &s.conns[i])) {
+				fprintf (stderr, "Client %d: disconnected.\n", s.conns[i].fd);
+				close_conn (&s, &s.conns[i]);
+			}
+		}
+		/* Compact, preserving the order */
+		int n = 0;
+		for (i = 0; i < s.n_conns; ++i) {
+			if (s.conns[i].fd >= 0) {
+				s.conns[n++] = s.conns[i];
+			}
+		}
+		s.n_conns = n;
+
+		if (fds[0].revents & POLLIN) {
+			const int fd = accept4 (s.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+			if (fd < 0) {
+				perror ("accept");
+			} else if (s.n_conns == MAX_CONNECTIONS) {
+				fprintf (stderr, "Too many clients.\n");
+				close (fd);
+			} else {
+				memset (&s.conns[s.n_conns], 0, sizeof (struct render_conn));
+				s.conns[s.n_conns++].fd = fd;
+				fprintf (stderr, "Client %d: connected.\n", fd);
+			}
+		}
+	}
+
+	fprintf (stderr, "Shutting down.\n");
+
+	delete s.watcher;
+	if (s.wake_fd[0] >= 0) {
+		close (s.wake_fd[0]);
+		close (s.wake_fd[1]);
+	}
+
+	s.running = false;
+	for (i = 0; i < opt->n_workers; ++i) {
+		pthread_join (s.threads[i].thread, NULL);
+	}
+	for (i = 0; i < s.n_conns; ++i) {
+		if (s.conns[i].slot) {
+			release_slot (&s, s.conns[i].slot);
+		}
+		close (s.conns[i].fd);
+	}
+
+	close (s.listen_fd);
+	unlink (opt->socket_path);
+
+	delete[] s.threads;
+	delete[] s.slots;
+	delete s.pool;
+	return 0;
+}
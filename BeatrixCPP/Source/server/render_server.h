@@ -0,0 +1,123 @@
+/*
+OpenB3: an open source sound synthesis engine and JUCE application/plugin that simulates
+the magnificent sound of the Hammond B3 organ and Leslie rotating speaker
+Copyright (C) 2021-2022 Michele Perrone
+Github: https://github.com/michele-perrone/OpenPiano
+Author e-mail: perrone(dot)michele(at)outlook(dot)com
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * render_server.h --- Render server, shared by the server and its clients.
+ *
+ * The server hosts a fixed number of instances for clients on the same
+ * machine. A client connects to a Unix domain socket and sends requests,
+ * one per line of text:
+ *
+ *   attach [periods]   take a free instance, with a ring of the given
+ *                      number of periods (default RENDER_DEFAULT_PERIODS).
+ *                      The reply "ok <instance> <rate> <period frames>
+ *                      <periods>" carries the file descriptor of the
+ *                      shared memory that holds the render_ring.
+ *   midi <hex bytes>   a MIDI message, e.g. "midi 90 3c 7f". It is passed
+ *                      to the instance before the next period is rendered.
+ *                      There is no reply; malformed messages are counted.
+ *   set <key> <value>  change a configuration value of the instance that
+ *                      applies to a running engine, see getConfigScope().
+ *                      MIDI messages sent after it are played with it.
+ *   stats              the instrumentation counters, "ok key=value ...",
+ *                      of the server and of the instance if attached
+ *   detach             give the instance back, it is reset for the next
+ *                      client. Closing the connection does the same.
+ *
+ * Every other reply is "ok" or "error <reason>".
+ */
+
+#ifndef RENDER_SERVER_H
+#define RENDER_SERVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#define RENDER_RING_MAGIC    0x52523342 /* "B3RR" */
+#define RENDER_RING_VERSION  1
+#define RENDER_CHANNELS      2
+
+#define RENDER_MIN_PERIODS     2
+#define RENDER_MAX_PERIODS     64
+#define RENDER_DEFAULT_PERIODS 4
+
+static_assert (std::atomic<uint64_t>::is_always_lock_free,
+               "the ring positions are shared with other processes");
+
+/*
+ * Audio of one instance, in shared memory. There is one producer, the
+ * worker that renders the instance, and one consumer, the client:
+ *
+ *   the server renders into period write_pos while
+ *     write_pos - read_pos < n_periods, then increments write_pos;
+ *   the client reads period read_pos while read_pos < write_pos,
+ *     then increments read_pos.
+ *
+ * The engine renders right into the ring. A period holds period_frames
+ * samples of the left channel, followed by those of the right channel.
+ * The latency of MIDI messages is the number of periods rendered ahead.
+ */
+struct render_ring {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t instance;
+	uint32_t n_channels;
+	uint32_t period_frames;
+	uint32_t n_periods;
+	double   rate;
+
+	alignas (64) std::atomic<uint64_t> write_pos; /**< periods rendered */
+	alignas (64) std::atomic<uint64_t> read_pos;  /**< periods consumed by the client */
+};
+
+static inline size_t
+render_ring_size (uint32_t period_frames, uint32_t n_periods)
+{
+	return sizeof (struct render_ring) + (size_t)n_periods * RENDER_CHANNELS * period_frames * sizeof (float);
+}
+
+/** The first channel of the period at position pos */
+static inline float*
+render_ring_period (struct render_ring* r, uint64_t pos)
+{
+	float* data = (float*)(r + 1);
+	return data + (size_t)(pos % r->n_periods) * r->n_channels * r->period_frames;
+}
+
+struct render_server_options {
+	const char* socket_path;
+	const char* config_file;
+	const char* programme_file;
+	double      rate;
+	int         period_frames;
+	int         n_instances;
+	int         n_workers; /**< render threads, pinned to the first n_workers CPUs */
+	bool        watch;     /**< reload config_file and programme_file when they are saved */
+};
+
+/*
+ * Runs the server until SIGINT or SIGTERM.
+ * @returns  The exit status of the program.
+ */
+extern int render_server_main (const struct render_server_options* opt);
+
+#endif /* RENDER_SERVER_H */
@@ -34,66 +34,106 @@
 
 #define _XOPEN_SOURCE 700
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "arena.h"
+#include "global_definitions.h"
 #include "state.h"
 
 void rc_dump_state (void* t);
-/* simple key-value store */
+/* simple key-value store
+ *
+ * Entries are kept in a list in the order they were first stored, which
+ * ends with an empty terminal node. A hash index finds existing keys.
+ */
+
+#define KV_BUCKETS 256
 
 struct b_kv {
 	struct b_kv* next;
+	struct b_kv* bnext; /* next entry in the same hash bucket */
 	char*        key;
 	char*        value;
 };
 
+struct b_kvstore {
+	void*        arena;
+	struct b_kv* head;
+	struct b_kv* tail; /* terminal node */
+	struct b_kv* bucket[KV_BUCKETS];
+};
+
+static unsigned int
+kvstore_hash (const char* key)
+{
+	unsigned int h = 2166136261u; /* FNV-1a */
+	while (*key) {
+		h ^= (unsigned char)*key++;
+		h *= 16777619u;
+	}
+	return h & (KV_BUCKETS - 1);
+}
+
 static void*
-kvstore_alloc ()
+kvstore_alloc (void* arena)
 {
-	struct b_kv* kv = (struct b_kv*)calloc (1, sizeof (struct b_kv));
-	return kv;
+	struct b_kvstore* kvs = (struct b_kvstore*)arenaAlloc (arena, sizeof (struct b_kvstore));
+	if (!kvs)
+		return NULL;
+	kvs->arena = arena;
+	kvs->head = kvs->tail = (struct b_kv*)arenaAlloc (arena, sizeof (struct b_kv));
+	if (!kvs->head) {
+		arenaFree (arena, kvs);
+		return NULL;
+	}
+	return kvs;
 }
 
 static void
 kvstore_free (void* kvs)
 {
-	struct b_kv* kv = (struct b_kv*)kvs;
+	void*        arena = ((struct b_kvstore*)kvs)->arena;
+	struct b_kv* kv    = ((struct b_kvstore*)kvs)->head;
 	while (kv) {
 		struct b_kv* me = kv;
-		free (kv->key);
-		free (kv->value);
+		arenaFree (arena, kv->key);
+		arenaFree (arena, kv->value);
 		kv = kv->next;
-		free (me);
+		arenaFree (arena, me);
 	}
+	arenaFree (arena, kvs);
+}
+
+static struct b_kv*
+kvstore_lookup (void* kvs, const char* key)
+{
+	struct b_kv* kv = ((struct b_kvstore*)kvs)->bucket[kvstore_hash (key)];
+	while (kv && strcmp (kv->key, key)) {
+		kv = kv->bnext;
+	}
+	return kv;
 }
 
 static void
 kvstore_store (void* kvs, const char* key, const char* value)
 {
-	struct b_kv* kv = (struct b_kv*)kvs;
-	struct b_kv* it = NULL;
-	while (kv) {
-		if (!kv->next) {
-			/* "->next == NULL" : "terminal node" */
-			break;
-		}
-		if (!strcmp (kv->key, key)) {
-			it = kv;
-			break;
-		}
-		kv = kv->next;
-	}
+	struct b_kvstore* s  = (struct b_kvstore*)kvs;
+	struct b_kv*      it = kvstore_lookup (s, key);
 	if (!it) {
 		/* allocate new terminal node */
-		it       = (struct b_kv*)calloc (1, sizeof (struct b_kv));
-		kv->next = it;
-		it       = kv;
-		it->key  = strdup (key);
+		unsigned int h = kvstore_hash (key);
+		it             = s->tail;
+		it->next       = (struct b_kv*)arenaAlloc (s->arena, sizeof (struct b_kv));
+		it->key        = arenaStrdup (s->arena, key);
+		it->bnext      = s->bucket[h];
+		s->bucket[h]   = it;
+		s->tail        = it->next;
 	}
-	free (it->value);
-	it->value = strdup (value);
+	arenaFree (s->arena, it->value);
+	it->value = arenaStrdup (s->arena, value);
 }
 
 /* setBfree resource/running config */
@@ -106,39 +146,41 @@ struct b_midirc {
 };
 
 struct b_rc {
-	struct b_midirc mrc;
-	struct b_kv*    rrc;
+	void*             arena;
+	struct b_midirc   mrc;
+	struct b_kvstore* rrc;
 };
 
 void
 freeRunningConfig (void* t)
 {
 	struct b_rc* rc = (struct b_rc*)t;
-	free (rc->mrc.mcc);
+	arenaFree (rc->arena, rc->mrc.mcc);
 	kvstore_free (rc->rrc);
-	free (rc);
+	arenaFree (rc->arena, rc);
 }
 
 void*
-allocRunningConfig (void)
+allocRunningConfig (void* arena)
 {
 	int          i, mccc;
-	struct b_rc* rc = (struct b_rc*)malloc (sizeof (struct b_rc));
+	struct b_rc* rc = (struct b_rc*)arenaAlloc (arena, sizeof (struct b_rc));
 	if (!rc)
 		return NULL;
+	rc->arena = arena;
 
 	mccc = rc->mrc.mccc = getCCFunctionCount ();
-	rc->mrc.mcc         = (int*)malloc (mccc * sizeof (int));
+	rc->mrc.mcc         = (int*)arenaAlloc (arena, mccc * sizeof (int));
 	if (!rc->mrc.mcc) {
-		free (rc);
+		arenaFree (arena, rc);
 		return NULL;
 	}
 
-	rc->rrc = (struct b_kv*)kvstore_alloc ();
+	rc->rrc = (struct b_kvstore*)kvstore_alloc (arena);
 
 	if (!rc->rrc) {
-		free (rc->mrc.mcc);
-		free (rc);
+		arenaFree (arena, rc->mrc.mcc);
+		arenaFree (arena, rc);
 		return NULL;
 	}
 
@@ -187,6 +229,18 @@ rc_add_cfg (void* t, ConfigContext* cfg)
 	kvstore_store (rc->rrc, cfg->name, cfg->value);
 }
 
+/*
+ * @return the value of a configuration parameter in the running config,
+ *         or NULL if it was never set.
+ */
+const char*
+rc_get_cfg (void* t, const char* key)
+{
+	struct b_rc* rc = (struct b_rc*)t;
+	struct b_kv* kv = kvstore_lookup (rc->rrc, key);
+	return kv ? kv->value : NULL;
+}
+
 void
 rc_loop_state (void* t, void (*cb) (int, const char*, const char*, unsigned char, void*), void* arg)
 {
@@ -198,7 +252,7 @@ rc_loop_state (void* t, void (*cb) (int, const char*, const char*, unsigned char
 		cb (i, getCCFunctionName (i), NULL, (unsigned char)rc->mrc.mcc[i], arg);
 	}
 
-	struct b_kv* kv = rc->rrc;
+	struct b_kv* kv = rc->rrc->head;
 	while (kv && kv->next != NULL) {
 		if (kv->key == NULL)
 			continue;
@@ -207,6 +261,190 @@ rc_loop_state (void* t, void (*cb) (int, const char*, const char*, unsigned char
 	}
 }
 
+/* staged configuration values
+ *
+ * A list of entries allocated off the audio thread, that
+ * rc_commit_staged() stores in the running config without allocating.
+ */
+
+/*
+ * Appends a configuration value to a staged list.
+ * @param staged  The list, or NULL to start one.
+ * @return the list, unchanged if out of memory.
+ */
+void*
+rc_stage_cfg (void* staged, ConfigContext* cfg)
+{
+	struct b_kv*  kv = (struct b_kv*)calloc (1, sizeof (struct b_kv));
+	struct b_kv** it = (struct b_kv**)&staged;
+	if (!kv)
+		return staged;
+	kv->key   = strdup (cfg->name);
+	kv->value = strdup (cfg->value);
+	if (!kv->key || !kv->value) {
+		rc_free_staged (kv);
+		return staged;
+	}
+	while (*it)
+		it = &(*it)->next;
+	*it = kv;
+	return staged;
+}
+
+void
+rc_loop_staged (void* staged, void (*cb) (int, const char*, const char*, unsigned char, void*), void* arg)
+{
+	struct b_kv* kv;
+	for (kv = (struct b_kv*)staged; kv; kv = kv->next) {
+		cb (-1, kv->key, kv->value, 0, arg);
+	}
+}
+
+/*
+ * Stores staged values in the running config, realtime safe. New keys
+ * take the staged entry over, values that were replaced are swapped into it.
+ * @return the entries left over, for rc_free_staged().
+ */
+void*
+rc_commit_staged (void* t, void* staged)
+{
+	struct b_kvstore* s    = ((struct b_rc*)t)->rrc;
+	struct b_kv*      kv   = (struct b_kv*)staged;
+	struct b_kv*      left = NULL;
+
+	while (kv) {
+		struct b_kv* next = kv->next;
+		struct b_kv* it   = kvstore_lookup (s, kv->key);
+		if (it) {
+			char* value = it->value;
+			it->value   = kv->value;
+			kv->value   = value;
+			kv->next    = left;
+			left        = kv;
+		} else {
+			/* fill the terminal node, kv becomes the new one */
+			unsigned int h = kvstore_hash (kv->key);
+			it             = s->tail;
+			it->key        = kv->key;
+			it->value      = kv->value;
+			it->bnext      = s->bucket[h];
+			s->bucket[h]   = it;
+			memset (kv, 0, sizeof (struct b_kv));
+			it->next = kv;
+			s->tail  = kv;
+		}
+		kv = next;
+	}
+	return left;
+}
+
+void
+rc_free_staged (void* staged)
+{
+	struct b_kv* kv = (struct b_kv*)staged;
+	while (kv) {
+		struct b_kv* me = kv;
+		kv              = kv->next;
+		free (me->key);
+		free (me->value);
+		free (me);
+	}
+}
+
+/* binary snapshot
+ *
+ * int32 count of midi-CC functions, int32 value for each of them, both
+ * little endian, followed by "key\0value\0" pairs up to the end of the data.
+ */
+
+size_t
+rc_snapshot_write (void* t, void* buf, size_t len)
+{
+	struct b_rc*   rc   = (struct b_rc*)t;
+	size_t         need = sizeof (int32_t) * (1 + rc->mrc.mccc);
+	struct b_kv*   kv;
+	unsigned char* p;
+	int            i;
+
+	for (kv = rc->rrc->head; kv->next; kv = kv->next) {
+		need += strlen (kv->key) + strlen (kv->value) + 2;
+	}
+	if (len < need)
+		return need;
+
+	p = (unsigned char*)buf;
+	snapshotPut32 (&p, (uint32_t)rc->mrc.mccc);
+	for (i = 0; i < rc->mrc.mccc; ++i) {
+		snapshotPut32 (&p, (uint32_t)rc->mrc.mcc[i]);
+	}
+	for (kv = rc->rrc->head; kv->next; kv = kv->next) {
+		size_t kl = strlen (kv->key) + 1;
+		size_t vl = strlen (kv->value) + 1;
+		memcpy (p, kv->key, kl);
+		memcpy (p + kl, kv->value, vl);
+		p += kl + vl;
+	}
+	return need;
+}
+
+/* Merges a snapshot written by rc_snapshot_write() into the running config.
+ * The callback is invoked like rc_loop_state() does, for every midi-CC
+ * function value and for each config value that was not already set to
+ * the same value. The data is validated before anything is changed.
+ *
+ * @return 0 on success, -1 if the data is not a valid snapshot.
+ */
+int
+rc_snapshot_read (void* t, const void* buf, size_t len, void (*cb) (int, const char*, const char*, unsigned char, void*), void* arg)
+{
+	struct b_rc*         rc = (struct b_rc*)t;
+	const char*          p  = (const char*)buf;
+	const unsigned char* q  = (const unsigned char*)buf;
+	const char*          end;
+	int32_t              v;
+	int                  i, strings;
+
+	if (len < sizeof (v))
+		return -1;
+	v = (int32_t)snapshotGet32 (&q);
+	if (v != rc->mrc.mccc || len < sizeof (v) * (1 + v))
+		return -1;
+
+	end = p + len;
+	p += sizeof (v) * (1 + v);
+	if (p < end && end[-1] != '\0')
+		return -1;
+	/* keys and values alternate */
+	for (strings = 0; p < end; ++strings) {
+		p += strlen (p) + 1;
+	}
+	if (strings & 1)
+		return -1;
+
+	for (i = 0; i < rc->mrc.mccc; ++i) {
+		v = (int32_t)snapshotGet32 (&q);
+		if (v < 0 || v > 127)
+			continue;
+		rc->mrc.mcc[i] = v;
+		cb (i, getCCFunctionName (i), NULL, (unsigned char)v, arg);
+	}
+
+	p = (const char*)q;
+	while (p < end) {
+		const char*  key   = p;
+		const char*  value = key + strlen (key) + 1;
+		struct b_kv* kv    = kvstore_lookup (rc->rrc, key);
+
+		p = value + strlen (value) + 1;
+
+		if (kv && !strcmp (kv->value, value))
+			continue;
+		kvstore_store (rc->rrc, key, value);
+		cb (-1, key, value, 0, arg);
+	}
+	return 0;
+}
+
 /* ------------- */
 
 static void
@@ -23,19 +23,30 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
+
 #include "cfgParser.h"
 
-void* allocRunningConfig (void);
+void* allocRunningConfig (void* arena);
 void initRunningConfig (void* t, void* mcfg);
 void freeRunningConfig (void* t);
 
 void rc_add_midicc (void* t, int id, unsigned char val);
 void rc_add_cfg (void* t, ConfigContext* cfg);
+const char* rc_get_cfg (void* t, const char* key);
 
 void rc_loop_state (void* t, void (*cb) (int, const char*, const char*, unsigned char, void*), void* arg);
 
+void* rc_stage_cfg (void* staged, ConfigContext* cfg);
+void  rc_loop_staged (void* staged, void (*cb) (int, const char*, const char*, unsigned char, void*), void* arg);
+void* rc_commit_staged (void* t, void* staged);
+void  rc_free_staged (void* staged);
+
 void rc_dump_state (void* t);
 
+size_t rc_snapshot_write (void* t, void* buf, size_t len);
+int    rc_snapshot_read (void* t, const void* buf, size_t len, void (*cb) (int, const char*, const char*, unsigned char, void*), void* arg);
+
 #ifdef __cplusplus
 }
 #endif
@@ -60,7 +60,7 @@
 
 /**
  * LE_BLOCKSIZE is the number ListElements we allocate in each call to
- * malloc.
+ * arenaAlloc.
  */
 #define LE_BLOCKSIZE 200
 
@@ -96,6 +96,16 @@
 #define CR_CPYENV 2 /* Copy via envelope instruction */
 #define CR_ADDENV 3 /* Add via envelope instruction */
 
+/*
+ * Target buses of an instruction, or'ed into the opr field by the
+ * instruction compiler. ADD instructions only touch the buses they
+ * target, COPY instructions always initialize all three.
+ */
+#define CR_SWL   0x04 /* Writes the swell bus */
+#define CR_VIB   0x08 /* Writes the vibrato bus */
+#define CR_PRC   0x10 /* Writes the percussion bus */
+#define CR_BUSES (CR_SWL | CR_VIB | CR_PRC)
+
 /* Rendering flag bits */
 #define ORF_MODIFIED 0x0004
 #define ORF_ADDED    0x0002
@@ -111,6 +121,9 @@
 #define RT_LOWRVIB 0x01
 #define RT_VIB     0x03
 
+/* Drawbar bus updates between full recomputations of the manual sums */
+#define DRAWBAR_REBUILD 256
+
 /* Equalisation macro selection. */
 #define EQ_SPLINE 0
 #define EQ_PEAK24 1 /* Legacy */
@@ -254,14 +267,16 @@ initValues (struct b_tonegen* t)
 	t->keyDownCount = 0;
 #endif
 
-	t->swellPedalGain  = 0.07; /* initial level */
+	t->swellPedalGain       = 0.07; /* initial level */
+	t->swellPedalGainTarget = 0.07;
 	t->outputLevelTrim = 0.07; /* 127/127 * midi-signal */
 	t->tuning          = 440.0;
 
 	t->gearTuning = 1;
 
-	t->drawBarChange = 0;
-	t->percEnabled   = FALSE;
+	t->drawBarChange  = 0;
+	t->drawBarUpdates = 0;
+	t->percEnabled    = FALSE;
 
 	t->percTriggerBus  = 8;
 	t->percTrigRestore = 0;
@@ -285,10 +300,12 @@ initValues (struct b_tonegen* t)
 	t->percDrawbarSoftGain      = 1.0;
 	t->percDrawbarGain          = 1.0;
 
-	t->tgVariant   = TG_91FB12;
-	t->tgPrecision = 0.001;
-	t->eqMacro     = EQ_SPLINE;
-	t->eqvCeiling  = 1.0; /**< Normalizing manual osc eq. */
+	t->tgVariant      = TG_91FB12;
+	t->tgPrecision    = 0.001;
+	t->tgMemoryBudget = 0;
+	t->oscPhaseMode   = 0;
+	t->eqMacro        = EQ_SPLINE;
+	t->eqvCeiling     = 1.0; /**< Normalizing manual osc eq. */
 
 	t->eqP1y = 1.0; /* Default is flat */
 	t->eqR1y = 0.0;
@@ -351,7 +368,7 @@ drnd ()
  *             chain of allocated blocks for ListElement.
  */
 static ListElement*
-newListElement (ListElement** pple)
+newListElement (void* arena, ListElement** pple)
 {
 	int          mustAllocate = 0;
 	ListElement* rtn          = NULL;
@@ -369,7 +386,7 @@ newListElement (ListElement** pple)
 		int          freeElements = 0;
 		ListElement* frp          = NULL;
 		ListElement* lep =
-		    (ListElement*)malloc (sizeof (ListElement) * LE_BLOCKSIZE);
+		    (ListElement*)arenaAlloc (arena, sizeof (ListElement) * LE_BLOCKSIZE);
 
 		if (lep == NULL) {
 			fprintf (stderr, "FATAL: memory allocation failed in ListElement\n");
@@ -415,7 +432,7 @@ newListElement (ListElement** pple)
 static ListElement*
 newConfigListElement (struct b_tonegen* t)
 {
-	return newListElement (&t->leConfig);
+	return newListElement (t->arena, &t->leConfig);
 }
 
 /**
@@ -424,7 +441,7 @@ newConfigListElement (struct b_tonegen* t)
 static ListElement*
 newRuntimeListElement (struct b_tonegen* t)
 {
-	return newListElement (&t->leRuntime);
+	return newListElement (t->arena, &t->leRuntime);
 }
 
 /**
@@ -472,13 +489,46 @@ setWavePrecision (struct b_tonegen* t, double precision)
 }
 
 /**
- * Sets the tuning.
+ * This routine sets the memory budget, in MiB, for the wave buffers of
+ * the tonegenerator. Zero removes the limit. The call must be made before
+ * calling initToneGenerator() to have effect. It is the target of startup
+ * configuration values.
+ */
+void
+setWaveMemoryBudget (struct b_tonegen* t, double mebibytes)
+{
+	if (0.0 <= mebibytes) {
+		t->tgMemoryBudget = (size_t)(mebibytes * 1048576.0);
+	}
+}
+
+/**
+ * Lets the tone generator share the wave buffers of another, already
+ * initialized, tone generator. The call must be made before calling
+ * initToneGenerator() to have effect. Buffers are only borrowed for
+ * oscillators whose frequency, attenuation, length and harmonics match;
+ * all others are computed as usual. The source must run at the same
+ * sample rate and outlive this tone generator.
+ */
+void
+setToneGeneratorWaveSource (struct b_tonegen* t, const struct b_tonegen* src)
+{
+	t->waveSource = src;
+}
+
+/**
+ * Sets the tuning. With the phase accumulator oscillators, the change
+ * is heard from the next fragment on; otherwise it takes effect when the
+ * tone generator is initialized.
  */
 void
 setTuning (struct b_tonegen* t, double refA_Hz)
 {
 	if ((220.0 <= refA_Hz) && (refA_Hz <= 880.0)) {
 		t->tuning = refA_Hz;
+		if (t->phaseTables) {
+			__atomic_store_n (&t->tuningChange, 1, __ATOMIC_RELEASE);
+		}
 	}
 }
 
@@ -1060,6 +1110,44 @@ compilePlayMatrix (struct b_tonegen* t)
 #endif
 }
 
+/**
+ * Packs the keyContrib lists into the keyContrib* arrays, which the
+ * message queue phase of oscGenerateFragment() walks.
+ */
+static void
+compileKeyContrib (struct b_tonegen* t)
+{
+	ListElement* lep;
+	int          n = 0;
+	int          k;
+
+	for (k = 0; k < MAX_KEYS; k++) {
+		for (lep = t->keyContrib[k]; lep != NULL; lep = lep->next) {
+			n++;
+		}
+	}
+
+	t->keyContribLevel = (float*)arenaAlloc (t->arena, n * (sizeof (float) + 2 * sizeof (unsigned char)) + 1);
+	if (t->keyContribLevel == NULL) {
+		fprintf (stderr, "FATAL: memory allocation failed for key contributions\n");
+		exit (2);
+	}
+	t->keyContribWheel = (unsigned char*)(t->keyContribLevel + n);
+	t->keyContribBus   = t->keyContribWheel + n;
+
+	n = 0;
+	for (k = 0; k < MAX_KEYS; k++) {
+		t->keyContribStart[k] = n;
+		for (lep = t->keyContrib[k]; lep != NULL; lep = lep->next) {
+			t->keyContribWheel[n] = (unsigned char)LE_WHEEL_NUMBER_OF (lep);
+			t->keyContribBus[n]   = (unsigned char)LE_BUSNUMBER_OF (lep);
+			t->keyContribLevel[n] = LE_LEVEL_OF (lep);
+			n++;
+		}
+	}
+	t->keyContribStart[MAX_KEYS] = n;
+}
+
 /**
  * This function models the attenuation of the tone generators.
  * Note that the tone generator parameters expect the first/lowest
@@ -1105,7 +1193,7 @@ apply_CH_Spline (struct b_tonegen* tg,
 		r = p1y * (2.0 * tCb - 3.0 * tSq + 1.0) + p4y * (-2.0 * tCb + 3.0 * tSq) + r1y * (tCb - 2.0 * tSq + t) + r4y * (tCb - tSq);
 
 		a                              = (r < 0.0) ? 0.0 : (1.0 < r) ? 1.0 : r;
-		tg->oscillators[i].attenuation = a;
+		tg->oscDesign[i].attenuation = a;
 	}
 
 	return 0;
@@ -1120,15 +1208,15 @@ applyOscEQ_peak24 (struct b_tonegen* t, int nofOscillators)
 	int i;
 
 	for (i = 1; i <= 43; i++) {
-		t->oscillators[i].attenuation = damperCurve (i, 1, 43, 0.2, -0.8, 1.0);
+		t->oscDesign[i].attenuation = damperCurve (i, 1, 43, 0.2, -0.8, 1.0);
 	}
 
 	for (i = 44; i <= 48; i++) {
-		t->oscillators[i].attenuation = damperCurve (i, 44, 48, 1.6, -0.4, -0.3);
+		t->oscDesign[i].attenuation = damperCurve (i, 44, 48, 1.6, -0.4, -0.3);
 	}
 
 	for (i = 49; i <= nofOscillators; i++) {
-		t->oscillators[i].attenuation =
+		t->oscDesign[i].attenuation =
 		    damperCurve (i, 49, nofOscillators, 0.9, -1.0, -0.7);
 	}
 
@@ -1144,15 +1232,15 @@ applyOscEQ_peak46 (struct b_tonegen* t, int nofOscillators)
 	int i;
 
 	for (i = 1; i <= 43; i++) {
-		t->oscillators[i].attenuation = damperCurve (i, 1, 43, 0.3, 0.4, 1.0);
+		t->oscDesign[i].attenuation = damperCurve (i, 1, 43, 0.3, 0.4, 1.0);
 	}
 
 	for (i = 44; i <= 48; i++) {
-		t->oscillators[i].attenuation = damperCurve (i, 44, 48, 0.1, -0.4, 0.4);
+		t->oscDesign[i].attenuation = damperCurve (i, 44, 48, 0.1, -0.4, 0.4);
 	}
 
 	for (i = 49; i <= nofOscillators; i++) {
-		t->oscillators[i].attenuation =
+		t->oscDesign[i].attenuation =
 		    damperCurve (i, 49, nofOscillators, 0.8, -1.0, -0.3);
 	}
 
@@ -1160,10 +1248,10 @@ applyOscEQ_peak46 (struct b_tonegen* t, int nofOscillators)
 }
 
 /**
- * This function returns the number of samples required to produce a
+ * This function finds the number of samples required to produce a
  * waveform of the given frequency below the provided precision.
  * The function will not attempt solutions above the maximum number
- * of samples. If no solution is found the best solution is returned.
+ * of samples. If no solution is found the best solution is used.
  * The error/precision value is the positive distance between the
  * ideal number of samples and the nearest integer.
  * As for the maximum number of samples to try, higher frequencies fit
@@ -1172,51 +1260,168 @@ applyOscEQ_peak46 (struct b_tonegen* t, int nofOscillators)
  * Practical experiments seems to indicate that there is no gain in
  * making the maxSamples parameter dependent on the frequency.
  *
+ * Every improvement met on the way is returned as a candidate, so that
+ * planWaveLengths() can trade precision for memory. The candidates are
+ * ordered on increasing length and decreasing error; the last one is the
+ * solution.
+ *
  * @param Hz         The frequency of the wave.
+ * @param rate       The sample rate.
  * @param precision  The absolute value error threshold. Figures in the
  *                   range 0.1 - 0.01 may be adequate. Lower thresholds
  *                   will result in longer (more memory) solutions.
  * @param minSamples The minimum number of samples to use.
  * @param maxSamples The maximum number of samples to use.
+ * @param len        Receives the candidate lengths, in samples.
+ * @param relErr     Receives the relative frequency error of each candidate.
+ * @param maxCands   The size of the len and relErr arrays.
  *
- * @return  The number of samples to allocate for the wave.
+ * @return  The number of candidates, at least one.
  */
-static size_t
-fitWave (double Hz,
-         double precision,
-         int    minSamples,
-         int    maxSamples)
+static int
+fitWave (double  Hz,
+         double  rate,
+         double  precision,
+         int     minSamples,
+         int     maxSamples,
+         size_t* len,
+         double* relErr,
+         int     maxCands)
 {
 	double minErr = 99999.9;
-	double minSpn = 0.0;
+	int    n      = 0;
 	int    i;
 	int    minWaves;
 	int    maxWaves;
 
 	assert (minSamples < maxSamples);
+	assert (0 < maxCands);
 
-	minWaves = ceil ((Hz * (double)minSamples) / SampleRateD);
-	maxWaves = floor ((Hz * (double)maxSamples) / SampleRateD);
+	minWaves = ceil ((Hz * (double)minSamples) / rate);
+	maxWaves = floor ((Hz * (double)maxSamples) / rate);
 
 	assert (minWaves <= maxWaves);
 	assert (minWaves > 0);
 
 	for (i = minWaves; i <= maxWaves; i++) {
-		double nws = (SampleRateD * i) / Hz; /* Compute ideal nof samples */
+		double nws = (rate * i) / Hz; /* Compute ideal nof samples */
 		double spn = rint (nws);             /* Round to a discrete nof samples  */
 		double err = fabs (nws - spn);       /* Compute mismatch */
 		if (err < minErr) {                  /* Remember best so far */
 			minErr = err;
-			minSpn = spn;
+			if (n == maxCands) {
+				n--; /* Replace the last candidate */
+			}
+			len[n]    = (size_t)spn;
+			relErr[n] = err / spn;
+			n++;
 		}
 		if (err < precision)
 			break; /* If ok, stop searching. */
 	}
 
-	assert (0.0 < minSpn);
-	assert (minSpn <= maxSamples);
+	assert (0 < n);
+	assert (0 < len[n - 1]);
+	assert (len[n - 1] <= (size_t)maxSamples);
+
+	return n;
+}
+
+#define WAVE_FIT_CANDIDATES 64
+#define WAVE_BUDGET_STRETCH 16 /* Longest loop with a budget, relative to without */
+
+/**
+ * Chooses the loop length of each wheel. Without a memory budget, each
+ * wheel gets the solution of fitWave(). With a budget, all wheels start
+ * at their shortest candidate, and then the remaining memory is handed
+ * out step by step to the wheel whose relative tuning error drops the
+ * most per extra byte, until no step fits any more. A budget also allows
+ * loops longer than the default search limit, so that a generous budget
+ * buys better tuning than no budget at all.
+ *
+ * @param nofOscillators  The number of wheels, numbered from 1.
+ * @param precision       See fitWave().
+ * @param lengthSamples   Receives the loop length of each wheel.
+ * @return                The maximum tuning error of the plan, in cents.
+ */
+static double
+planWaveLengths (struct b_tonegen* t, int nofOscillators, double precision, size_t* lengthSamples)
+{
+	size_t* len;
+	double* err;
+	int     nofCands[NOF_WHEELS + 1];
+	int     sel[NOF_WHEELS + 1];
+	size_t  total = 0;
+	double  maxErr = 0.0;
+	int     i;
+
+	len = (size_t*)malloc ((nofOscillators + 1) * WAVE_FIT_CANDIDATES * sizeof (size_t));
+	err = (double*)malloc ((nofOscillators + 1) * WAVE_FIT_CANDIDATES * sizeof (double));
+	if (len == NULL || err == NULL) {
+		fprintf (stderr, "FATAL: memory allocation failed in planWaveLengths\n");
+		exit (1);
+	}
+
+	for (i = 1; i <= nofOscillators; i++) {
+		nofCands[i] = fitWave (t->oscDesign[i].frequency,
+		                       t->SampleRateD,
+		                       precision,
+		                       3 * BUFFER_SIZE_SAMPLES, /* Was x1 */
+		                       ceil (t->SampleRateD / 48000.0) * 4096 * (t->tgMemoryBudget ? WAVE_BUDGET_STRETCH : 1),
+		                       &len[i * WAVE_FIT_CANDIDATES],
+		                       &err[i * WAVE_FIT_CANDIDATES],
+		                       WAVE_FIT_CANDIDATES);
+		sel[i] = t->tgMemoryBudget ? 0 : nofCands[i] - 1;
+		total += len[i * WAVE_FIT_CANDIDATES + sel[i]] * sizeof (float);
+	}
+
+	if (t->tgMemoryBudget && t->tgMemoryBudget < total) {
+		fprintf (stderr, "Wave memory budget of %zu bytes is below the minimum of %zu bytes.\n",
+		         t->tgMemoryBudget, total);
+	}
+
+	while (t->tgMemoryBudget && total < t->tgMemoryBudget) {
+		int    bestOsc  = 0;
+		int    bestCand = 0;
+		double bestGain = 0.0;
+
+		for (i = 1; i <= nofOscillators; i++) {
+			const size_t* l = &len[i * WAVE_FIT_CANDIDATES];
+			const double* e = &err[i * WAVE_FIT_CANDIDATES];
+			int           c;
+			for (c = sel[i] + 1; c < nofCands[i]; c++) {
+				const size_t extra = (l[c] - l[sel[i]]) * sizeof (float);
+				if (total + extra <= t->tgMemoryBudget) {
+					const double gain = (e[sel[i]] - e[c]) / extra;
+					if (bestGain < gain) {
+						bestGain = gain;
+						bestOsc  = i;
+						bestCand = c;
+					}
+				}
+			}
+		}
+
+		if (bestOsc == 0) {
+			break;
+		}
+
+		total += (len[bestOsc * WAVE_FIT_CANDIDATES + bestCand] - len[bestOsc * WAVE_FIT_CANDIDATES + sel[bestOsc]]) * sizeof (float);
+		sel[bestOsc] = bestCand;
+	}
+
+	for (i = 1; i <= nofOscillators; i++) {
+		const double e = err[i * WAVE_FIT_CANDIDATES + sel[i]];
+		lengthSamples[i] = len[i * WAVE_FIT_CANDIDATES + sel[i]];
+		if (maxErr < e) {
+			maxErr = e;
+		}
+	}
+
+	free (len);
+	free (err);
 
-	return (size_t)minSpn;
+	return 1200.0 * log2 (1.0 + maxErr);
 }
 
 /**
@@ -1238,6 +1443,7 @@ fitWave (double Hz,
  * @param apLen         Nof elements in ap[]
  * @param attenuation   Final volume of wave (0.0 -- 1.0).
  * @param f1Hz          Frequency of the fundamental.
+ * @param rate          The sample rate.
  *
  * Please note that the amplitudes of the fundamental and harmonic frequencies
  * are normalised so that the volume of the composite curve is 1.0. This
@@ -1256,7 +1462,8 @@ writeSamples (float* buf,
               double ap[],
               size_t apLen,
               double attenuation,
-              double f1Hz)
+              double f1Hz,
+              double rate)
 {
 	const double fullCircle = 2.0 * M_PI;
 	double       apl[MAX_PARTIALS];
@@ -1274,7 +1481,7 @@ writeSamples (float* buf,
 		/* Compute harmonic frequency */
 		plHz[i] = f1Hz * ((double)(i + 1));
 		/* Prevent aliasing; mute just below the Nyquist rate */
-		if ((SampleRateD * 0.5) <= plHz[i]) {
+		if ((rate * 0.5) <= plHz[i]) {
 			apl[i] = 0.0;
 		}
 	}
@@ -1289,7 +1496,7 @@ writeSamples (float* buf,
 
 		for (j = 0; j < MAX_PARTIALS; j++) {
 			s +=
-			    apl[j] * sin (remainder ((plHz[j] * fullCircle * (double)i) / SampleRateD,
+			    apl[j] * sin (remainder ((plHz[j] * fullCircle * (double)i) / rate,
 			                             fullCircle));
 		}
 
@@ -1311,25 +1518,18 @@ writeSamples (float* buf,
 }
 
 /**
- * This routine initializes the oscillators.
- *
- * @param variant  Selects one of tree modelled tonegenerators:
- *                 0 : 91 generators, lowest generator is C-2
- *                 1 : 82 generators, lowest generator is A-2
- *                 2 : 91 generators, lowest generator is C-2, generators
- *                     1--12 have distinct 2f and 3f harmonics.
+ * Computes the frequency of each wheel from the tuning and temperament.
  *
- * @param precision  The loop precision value. See function fitWave().
+ * @param variant  See initOscillators().
+ * @return         The number of oscillators of the variant.
  */
-static void
-initOscillators (struct b_tonegen* t, int variant, double precision)
+static int
+computeFrequencies (struct b_tonegen* t, int variant)
 {
-	int                 i;
-	double              baseTuning;
-	int                 nofOscillators;
-	int                 tuningOsc = 10;
-	struct _oscillator* osp;
-	double              harmonicsList[MAX_PARTIALS];
+	int    i;
+	double baseTuning;
+	int    nofOscillators;
+	int    tuningOsc = 10;
 
 	switch (variant) {
 		case 0:
@@ -1354,39 +1554,9 @@ initOscillators (struct b_tonegen* t, int variant, double precision)
 			assert (0);
 	} /* switch variant */
 
-	/*
-   * Apply equalisation curve. This sets the attenuation field in the
-   * oscillator struct.
-   */
-
-	switch (t->eqMacro) {
-		case EQ_SPLINE:
-			apply_CH_Spline (t, nofOscillators, t->eqP1y, t->eqR1y, t->eqP4y, t->eqR4y);
-			break;
-		case EQ_PEAK24:
-			applyOscEQ_peak24 (t, nofOscillators);
-			break;
-		case EQ_PEAK46:
-			applyOscEQ_peak46 (t, nofOscillators);
-			break;
-	}
-
 	for (i = 1; i <= nofOscillators; i++) {
-		int          j;
-		size_t       wszs; /* Wave size samples */
-		size_t       wszb; /* Wave size bytes */
-		double       tun;
-		ListElement* lep;
-
-		osp = &(t->oscillators[i]);
-
-		if (t->eqvSet[i] != 0) {
-			osp->attenuation = t->eqvAtt[i];
-		}
-
-		osp->aclPos = -1;
-		osp->rflags = 0;
-		osp->pos    = 0;
+		struct _oscdesign* odp = &(t->oscDesign[i]);
+		double             tun;
 
 		tun = (double)(i - tuningOsc);
 
@@ -1415,191 +1585,431 @@ initOscillators (struct b_tonegen* t, int variant, double precision)
 			if (t->gearTuning == 1) {
 				gearA          = gears60ratios[select][0];
 				gearB          = gears60ratios[select][1];
-				osp->frequency = (20.0 * teeth * gearA) / gearB;
+				odp->frequency = (20.0 * teeth * gearA) / gearB;
 			} else {
 				gearA          = gears50ratios[select][0];
 				gearB          = gears50ratios[select][1];
-				osp->frequency = (25.0 * teeth * gearA) / gearB;
+				odp->frequency = (25.0 * teeth * gearA) / gearB;
 			}
-			osp->frequency *= (t->tuning / 440.0);
+			odp->frequency *= (t->tuning / 440.0);
 		} else {
-			osp->frequency = baseTuning * pow (2.0, tun / 12.0);
-		}
-
-		/*
-     * The oscGenerateFragment() routine assumes that samples are at least
-     * BUFFER_SIZE_SAMPLES long, so we must make sure that they are.
-     * If the loop fits in n samples, it certainly will fit in 2n samples.
-     * 31-jun-04/FK: Only if the loop is restarted after n samples. The
-     *               error minimization effort depends critically on the
-     *               value of n. In practice this is a non-issue because
-     *               the search will not consider solutions shorter than
-     *               the minimum length.
-     */
-		wszs = fitWave (osp->frequency,
-		                precision,
-		                3 * BUFFER_SIZE_SAMPLES, /* Was x1 */
-		                ceil (SampleRateD / 48000.0) * 4096);
-
-		/* Compute the number of bytes needed for exactly one wave buffer. */
-
-		wszb = wszs * sizeof (float);
-
-		/* Allocate the wave buffer */
-
-		osp->wave = (float*)malloc (wszb);
-		if (osp->wave == NULL) {
-			fprintf (stderr,
-			         "FATAL:Memory allocation failed in initOscillators. Offending request:\n");
-			fprintf (stderr,
-			         "Wave buffer for osc=%d of size %zu bytes.",
-			         i,
-			         wszb);
-			exit (1);
+			odp->frequency = baseTuning * pow (2.0, tun / 12.0);
 		}
+	}
 
-		/*
-     * Make a note of the number of samples.
-     */
+	return nofOscillators;
+}
 
-		osp->lengthSamples = wszs;
+/**
+ * Collects the partial amplitudes of a wheel: the compile-time values,
+ * plus the global and wheel-specific harmonics from the configuration.
+ */
+static void
+collectHarmonics (const struct b_tonegen* t, int wheel, double harmonicsList[MAX_PARTIALS])
+{
+	int          j;
+	ListElement* lep;
 
-		/* Reset the harmonics list to the compile-time value. */
+	/* Reset the harmonics list to the compile-time value. */
 
-		for (j = 0; j < MAX_PARTIALS; j++) {
-			harmonicsList[j] = t->wheel_Harmonics[j];
-		}
+	for (j = 0; j < MAX_PARTIALS; j++) {
+		harmonicsList[j] = t->wheel_Harmonics[j];
+	}
 
-		/* Add optional global default from configuration */
+	/* Add optional global default from configuration */
 
-		for (lep = t->wheelHarmonics[0]; lep != NULL; lep = lep->next) {
-			int h = LE_HARMONIC_NUMBER_OF (lep) - 1;
-			assert (0 <= h);
-			if (h < MAX_PARTIALS) {
-				harmonicsList[h] += LE_HARMONIC_LEVEL_OF (lep);
-			}
+	for (lep = t->wheelHarmonics[0]; lep != NULL; lep = lep->next) {
+		int h = LE_HARMONIC_NUMBER_OF (lep) - 1;
+		assert (0 <= h);
+		if (h < MAX_PARTIALS) {
+			harmonicsList[h] += LE_HARMONIC_LEVEL_OF (lep);
 		}
+	}
 
-		/* Then add any harmonics specific to this wheel. */
+	/* Then add any harmonics specific to this wheel. */
 
-		for (lep = t->wheelHarmonics[i]; lep != NULL; lep = lep->next) {
-			int h = LE_HARMONIC_NUMBER_OF (lep) - 1;
-			assert (0 <= h);
-			if (h < MAX_PARTIALS) {
-				harmonicsList[h] += LE_HARMONIC_LEVEL_OF (lep);
-			}
+	for (lep = t->wheelHarmonics[wheel]; lep != NULL; lep = lep->next) {
+		int h = LE_HARMONIC_NUMBER_OF (lep) - 1;
+		assert (0 <= h);
+		if (h < MAX_PARTIALS) {
+			harmonicsList[h] += LE_HARMONIC_LEVEL_OF (lep);
 		}
-
-		/* Initialize each buffer, multiplying attenuation with taper. */
-
-		writeSamples (osp->wave,
-		              osp->lengthSamples,
-		              harmonicsList,
-		              (size_t)MAX_PARTIALS,
-		              osp->attenuation,
-		              osp->frequency);
-
-	} /* for each oscillator struct */
+	}
 }
 
 /**
- * Controls the routing of the upper manual through the vibrato scanner.
+ * @return  The number of partials of a wheel below the Nyquist rate.
  */
-void
-setVibratoUpper (struct b_tonegen* t, int isEnabled)
+static int
+partialsBelowNyquist (const struct b_tonegen* t, double frequency)
 {
-	if (isEnabled) {
-		t->newRouting |= RT_UPPRVIB;
-	} else {
-		t->newRouting &= ~RT_UPPRVIB;
+	int j = 0;
+	while (j < MAX_PARTIALS && (t->SampleRateD * 0.5) > frequency * (j + 1)) {
+		j++;
 	}
+	return j;
 }
 
 /**
- * Controls the routing of the lower manual through the vibrato scanner.
+ * Sets the phase increments of the phase accumulator oscillators from
+ * the wheel frequencies, and selects the table with the partials that
+ * are below the Nyquist rate at that frequency.
  */
-void
-setVibratoLower (struct b_tonegen* t, int isEnabled)
+static void
+setPhaseIncrements (struct b_tonegen* t)
 {
-	if (isEnabled) {
-		t->newRouting |= RT_LOWRVIB;
-	} else {
-		t->newRouting &= ~RT_LOWRVIB;
+	int i;
+	for (i = 1; i <= NOF_WHEELS; i++) {
+		struct _oscillator* osp = &(t->oscillators[i]);
+		const int           k   = t->phaseTableOf[i * (MAX_PARTIALS + 1) + partialsBelowNyquist (t, t->oscDesign[i].frequency)];
+		osp->phaseInc           = (uint32_t)llrint (t->oscDesign[i].frequency * 4294967296.0 / t->SampleRateD);
+		if (k >= 0) {
+			osp->wave = t->phaseTables + k * (PHASE_TABLE_SIZE + 1);
+		}
 	}
 }
 
-int
-getVibratoRouting (struct b_tonegen* t)
-{
-	int rv = 0;
-	if ((t->newRouting & RT_LOWRVIB))
-		rv |= 1;
-	if ((t->newRouting & RT_UPPRVIB))
-		rv |= 2;
-	return rv;
-}
-
 /**
- * This routine sets percussion on or off.
- *
- * @param isEnabled  If true, percussion is enabled. If false, percussion
- *                   is disabled.
+ * Builds the single-cycle tables of the phase accumulator oscillators.
+ * Wheels whose partials, after the anti-aliasing cut, have the same
+ * proportions share a table; their attenuation is applied as a gain
+ * while rendering. Since setTuning() moves the cut, a table is built for
+ * each cut a wheel can reach within the tuning range. Unlike
+ * writeSamples(), no noise is added, since it would repeat with every
+ * cycle.
  */
-void
-setPercussionEnabled (struct b_tonegen* t, int isEnabled)
+static void
+initPhaseTables (struct b_tonegen* t, int nofOscillators)
 {
-	if (isEnabled) {
-		t->newRouting |= RT_PERC;
-		if (-1 < t->percTriggerBus) {
-			t->drawBarGain[t->percTriggerBus] = 0.0;
-			t->drawBarChange                  = 1;
+	double (*apl)[MAX_PARTIALS]; /* Normalized partials per table */
+	int    i;
+	int    j;
+	int    k;
+	int    m;
+
+	apl             = (double(*)[MAX_PARTIALS])malloc ((NOF_WHEELS + 1) * (MAX_PARTIALS + 1) * sizeof (*apl));
+	t->phaseTableOf = (int*)arenaAlloc (t->arena, (NOF_WHEELS + 1) * (MAX_PARTIALS + 1) * sizeof (int));
+	if (apl == NULL || t->phaseTableOf == NULL) {
+		fprintf (stderr, "FATAL: memory allocation failed in initPhaseTables\n");
+		exit (1);
+	}
+	for (i = 0; i < (NOF_WHEELS + 1) * (MAX_PARTIALS + 1); i++) {
+		t->phaseTableOf[i] = -1;
+	}
+
+	t->nofPhaseTables = 0;
+
+	for (i = 1; i <= nofOscillators; i++) {
+		const double f = t->oscDesign[i].frequency;
+		double       harmonicsList[MAX_PARTIALS];
+		double       a[MAX_PARTIALS];
+		double       aSum = 0.0;
+		int*         tableOf = t->phaseTableOf + i * (MAX_PARTIALS + 1);
+		/* The cuts within reach of setTuning(), see osc.tuning */
+		const int    mLo = partialsBelowNyquist (t, f * 880.0 / t->tuning);
+		const int    mHi = partialsBelowNyquist (t, f * 220.0 / t->tuning);
+
+		collectHarmonics (t, i, harmonicsList);
+
+		for (j = 0; j < MAX_PARTIALS; j++) {
+			aSum += fabs (harmonicsList[j]);
 		}
-	} else {
-		t->newRouting &= ~RT_PERC;
-		if (-1 < t->percTriggerBus) {
-			t->drawBarGain[t->percTriggerBus] =
-			    t->drawBarLevel[t->percTriggerBus][t->percTrigRestore];
-			t->drawBarChange = 1;
+
+		for (m = mLo; m <= mHi; m++) {
+			for (j = 0; j < MAX_PARTIALS; j++) {
+				a[j] = (j < m) ? harmonicsList[j] / aSum : 0.0;
+			}
+			for (k = 0; k < t->nofPhaseTables; k++) {
+				if (!memcmp (apl[k], a, sizeof (a))) {
+					break;
+				}
+			}
+			if (k == t->nofPhaseTables) {
+				memcpy (apl[k], a, sizeof (a));
+				t->nofPhaseTables++;
+			}
+			tableOf[m] = k;
+		}
+		/* Rounding of the retuned frequencies may step just outside */
+		for (m = 0; m < mLo; m++) {
+			tableOf[m] = tableOf[mLo];
+		}
+		for (m = mHi + 1; m <= MAX_PARTIALS; m++) {
+			tableOf[m] = tableOf[mHi];
 		}
 	}
-	t->percEnabled = isEnabled;
-}
 
-/**
- * This routine sets the percCounterReset variable from the current
- * combination of the control flags percIsFast and percIsSoft.
- */
-static void
-setPercussionResets (struct b_tonegen* t)
-{
-	if (t->percIsFast) {
-		/* Alternate 25-May-2003 */
-		t->percEnvGainDecay =
-		    t->percIsSoft ? t->percEnvGainDecayFastSoft : t->percEnvGainDecayFastNorm;
+	t->phaseTables = (float*)arenaAlloc (t->arena, t->nofPhaseTables * (PHASE_TABLE_SIZE + 1) * sizeof (float));
+	t->phaseBuffer = (float*)arenaAlloc (t->arena, (NOF_WHEELS + 1) * BUFFER_SIZE_SAMPLES * sizeof (float));
+	if (t->phaseTables == NULL || t->phaseBuffer == NULL) {
+		fprintf (stderr, "FATAL: memory allocation failed in initPhaseTables\n");
+		exit (1);
+	}
 
-	} else { /* Slow */
+	for (k = 0; k < t->nofPhaseTables; k++) {
+		float* yp = t->phaseTables + k * (PHASE_TABLE_SIZE + 1);
+		for (i = 0; i < PHASE_TABLE_SIZE; i++) {
+			double s = 0.0;
+			for (j = 0; j < MAX_PARTIALS; j++) {
+				s += apl[k][j] * sin ((2.0 * M_PI * (j + 1) * i) / PHASE_TABLE_SIZE);
+			}
+			yp[i] = s;
+		}
+		yp[PHASE_TABLE_SIZE] = yp[0];
+	}
+	free (apl);
 
-		/* Alternate 25-May-2003 */
-		t->percEnvGainDecay =
-		    t->percIsSoft ? t->percEnvGainDecaySlowSoft : t->percEnvGainDecaySlowNorm;
+	for (i = 1; i <= nofOscillators; i++) {
+		struct _oscillator* osp = &(t->oscillators[i]);
+		osp->lengthSamples      = PHASE_TABLE_SIZE;
+		osp->phase              = 0;
+		osp->gain               = t->oscDesign[i].attenuation;
 	}
-}
 
-/**
- * Selects fast or slow percussion.
- * @param isFast  If true, selects fast percussion decay. If false,
- *                selects slow percussion decay.
- */
-void
-setPercussionFast (struct b_tonegen* t, int isFast)
-{
-	t->percIsFast = isFast;
-	setPercussionResets (t);
+	setPhaseIncrements (t);
+
+	fprintf (stderr, "[%d phase tables, %zu bytes] ",
+	         t->nofPhaseTables,
+	         t->nofPhaseTables * (PHASE_TABLE_SIZE + 1) * sizeof (float) + (NOF_WHEELS + 1) * BUFFER_SIZE_SAMPLES * sizeof (float));
 }
 
 /**
- * Selects soft or normal percussion volume.
- * @param isSoft  If true, selects soft percussion. If false, selects
+ * This routine initializes the oscillators.
+ *
+ * @param variant  Selects one of tree modelled tonegenerators:
+ *                 0 : 91 generators, lowest generator is C-2
+ *                 1 : 82 generators, lowest generator is A-2
+ *                 2 : 91 generators, lowest generator is C-2, generators
+ *                     1--12 have distinct 2f and 3f harmonics.
+ *
+ * @param precision  The loop precision value. See function fitWave().
+ */
+static void
+initOscillators (struct b_tonegen* t, int variant, double precision)
+{
+	int                 i;
+	int                 nofOscillators;
+	struct _oscillator* osp;
+	struct _oscdesign*  odp;
+	double              harmonicsList[MAX_PARTIALS];
+	size_t              wszsPlan[NOF_WHEELS + 1];
+	double              maxErrCents;
+
+	nofOscillators = computeFrequencies (t, variant);
+
+	/*
+   * Apply equalisation curve. This sets the attenuation field in the
+   * oscillator struct.
+   */
+
+	switch (t->eqMacro) {
+		case EQ_SPLINE:
+			apply_CH_Spline (t, nofOscillators, t->eqP1y, t->eqR1y, t->eqP4y, t->eqR4y);
+			break;
+		case EQ_PEAK24:
+			applyOscEQ_peak24 (t, nofOscillators);
+			break;
+		case EQ_PEAK46:
+			applyOscEQ_peak46 (t, nofOscillators);
+			break;
+	}
+
+	for (i = 1; i <= nofOscillators; i++) {
+		osp = &(t->oscillators[i]);
+		odp = &(t->oscDesign[i]);
+
+		if (t->eqvSet[i] != 0) {
+			odp->attenuation = t->eqvAtt[i];
+		}
+
+		osp->aclPos = -1;
+		osp->rflags = 0;
+		osp->pos    = 0;
+	} /* for each oscillator struct */
+
+	if (t->oscPhaseMode) {
+		initPhaseTables (t, nofOscillators);
+		return;
+	}
+
+	/*
+   * The oscGenerateFragment() routine assumes that samples are at least
+   * BUFFER_SIZE_SAMPLES long, so we must make sure that they are.
+   * If the loop fits in n samples, it certainly will fit in 2n samples.
+   * 31-jun-04/FK: Only if the loop is restarted after n samples. The
+   *               error minimization effort depends critically on the
+   *               value of n. In practice this is a non-issue because
+   *               the search will not consider solutions shorter than
+   *               the minimum length.
+   */
+
+	maxErrCents = planWaveLengths (t, nofOscillators, precision, wszsPlan);
+
+	if (t->tgMemoryBudget) {
+		size_t total = 0;
+		for (i = 1; i <= nofOscillators; i++) {
+			total += wszsPlan[i] * sizeof (float);
+		}
+		fprintf (stderr, "[wave tables: %zu bytes, max tuning error %.4f cents] ", total, maxErrCents);
+	}
+
+	for (i = 1; i <= nofOscillators; i++) {
+		size_t wszs = wszsPlan[i]; /* Wave size samples */
+		size_t wszb;               /* Wave size bytes */
+
+		osp = &(t->oscillators[i]);
+		odp = &(t->oscDesign[i]);
+
+		collectHarmonics (t, i, harmonicsList);
+
+		/* Borrow the wave from the source tone generator, if it is the same */
+
+		if (t->waveSource) {
+			const struct _oscillator* src  = &(t->waveSource->oscillators[i]);
+			const struct _oscdesign*  srcd = &(t->waveSource->oscDesign[i]);
+			double                    srcHarmonics[MAX_PARTIALS];
+			collectHarmonics (t->waveSource, i, srcHarmonics);
+			if (src->wave != NULL && !t->waveSource->oscPhaseMode && srcd->frequency == odp->frequency && srcd->attenuation == odp->attenuation && src->lengthSamples == wszs && !memcmp (srcHarmonics, harmonicsList, sizeof (srcHarmonics))) {
+				osp->wave          = src->wave;
+				osp->lengthSamples = src->lengthSamples;
+				continue;
+			}
+		}
+
+		/* Compute the number of bytes needed for exactly one wave buffer. */
+
+		wszb = wszs * sizeof (float);
+
+		/* Allocate the wave buffer */
+
+		osp->wave = (float*)arenaAlloc (t->arena, wszb);
+		if (osp->wave == NULL) {
+			fprintf (stderr,
+			         "FATAL:Memory allocation failed in initOscillators. Offending request:\n");
+			fprintf (stderr,
+			         "Wave buffer for osc=%d of size %zu bytes.",
+			         i,
+			         wszb);
+			exit (1);
+		}
+
+		/*
+     * Make a note of the number of samples.
+     */
+
+		osp->lengthSamples = wszs;
+
+		/* Initialize each buffer, multiplying attenuation with taper. */
+
+		writeSamples (osp->wave,
+		              osp->lengthSamples,
+		              harmonicsList,
+		              (size_t)MAX_PARTIALS,
+		              odp->attenuation,
+		              odp->frequency,
+		              t->SampleRateD);
+
+	} /* for each oscillator struct */
+}
+
+/**
+ * Controls the routing of the upper manual through the vibrato scanner.
+ */
+void
+setVibratoUpper (struct b_tonegen* t, int isEnabled)
+{
+	if (isEnabled) {
+		t->newRouting |= RT_UPPRVIB;
+	} else {
+		t->newRouting &= ~RT_UPPRVIB;
+	}
+}
+
+/**
+ * Controls the routing of the lower manual through the vibrato scanner.
+ */
+void
+setVibratoLower (struct b_tonegen* t, int isEnabled)
+{
+	if (isEnabled) {
+		t->newRouting |= RT_LOWRVIB;
+	} else {
+		t->newRouting &= ~RT_LOWRVIB;
+	}
+}
+
+int
+getVibratoRouting (struct b_tonegen* t)
+{
+	int rv = 0;
+	if ((t->newRouting & RT_LOWRVIB))
+		rv |= 1;
+	if ((t->newRouting & RT_UPPRVIB))
+		rv |= 2;
+	return rv;
+}
+
+/**
+ * This routine sets percussion on or off.
+ *
+ * @param isEnabled  If true, percussion is enabled. If false, percussion
+ *                   is disabled.
+ */
+void
+setPercussionEnabled (struct b_tonegen* t, int isEnabled)
+{
+	if (isEnabled) {
+		t->newRouting |= RT_PERC;
+		if (-1 < t->percTriggerBus) {
+			t->drawBarGain[t->percTriggerBus] = 0.0;
+			__atomic_fetch_or (&t->drawBarChange, 1u << t->percTriggerBus, __ATOMIC_RELEASE);
+		}
+	} else {
+		t->newRouting &= ~RT_PERC;
+		if (-1 < t->percTriggerBus) {
+			t->drawBarGain[t->percTriggerBus] =
+			    t->drawBarLevel[t->percTriggerBus][t->percTrigRestore];
+			__atomic_fetch_or (&t->drawBarChange, 1u << t->percTriggerBus, __ATOMIC_RELEASE);
+		}
+	}
+	t->percEnabled = isEnabled;
+}
+
+/**
+ * This routine sets the percCounterReset variable from the current
+ * combination of the control flags percIsFast and percIsSoft.
+ */
+static void
+setPercussionResets (struct b_tonegen* t)
+{
+	if (t->percIsFast) {
+		/* Alternate 25-May-2003 */
+		t->percEnvGainDecay =
+		    t->percIsSoft ? t->percEnvGainDecayFastSoft : t->percEnvGainDecayFastNorm;
+
+	} else { /* Slow */
+
+		/* Alternate 25-May-2003 */
+		t->percEnvGainDecay =
+		    t->percIsSoft ? t->percEnvGainDecaySlowSoft : t->percEnvGainDecaySlowNorm;
+	}
+}
+
+/**
+ * Selects fast or slow percussion.
+ * @param isFast  If true, selects fast percussion decay. If false,
+ *                selects slow percussion decay.
+ */
+void
+setPercussionFast (struct b_tonegen* t, int isFast)
+{
+	t->percIsFast = isFast;
+	setPercussionResets (t);
+}
+
+/**
+ * Selects soft or normal percussion volume.
+ * @param isSoft  If true, selects soft percussion. If false, selects
  *                normal percussion.
  */
 void
@@ -1653,11 +2063,12 @@ getPercDecayConst_spl (double ig, double tg, double spls)
  * @param ig  Initial gain (e.g. 1.0), must be non-zero positive.
  * @param tg  Target gain (e.g. 0.001 = -60 dB), must be non-zero positive.
  * @param seconds Time expressed as seconds
+ * @param rate The sample rate
  */
 double
-getPercDecayConst_sec (double ig, double tg, double seconds)
+getPercDecayConst_sec (double ig, double tg, double seconds, double rate)
 {
-	return getPercDecayConst_spl (ig, tg, SampleRateD * seconds);
+	return getPercDecayConst_spl (ig, tg, rate * seconds);
 }
 
 /**
@@ -1673,19 +2084,23 @@ computePercResets (struct b_tonegen* t)
 	/* Alternate 25-May-2003 */
 	t->percEnvGainDecayFastNorm = getPercDecayConst_sec (t->percEnvGainResetNorm,
 	                                                     dBToGain (-60.0),
-	                                                     t->percFastDecaySeconds);
+	                                                     t->percFastDecaySeconds,
+	                                                     t->SampleRateD);
 
 	t->percEnvGainDecayFastSoft = getPercDecayConst_sec (t->percEnvGainResetSoft,
 	                                                     dBToGain (-60.0),
-	                                                     t->percFastDecaySeconds);
+	                                                     t->percFastDecaySeconds,
+	                                                     t->SampleRateD);
 
 	t->percEnvGainDecaySlowNorm = getPercDecayConst_sec (t->percEnvGainResetNorm,
 	                                                     dBToGain (-60.0),
-	                                                     t->percSlowDecaySeconds);
+	                                                     t->percSlowDecaySeconds,
+	                                                     t->SampleRateD);
 
 	t->percEnvGainDecaySlowSoft = getPercDecayConst_sec (t->percEnvGainResetSoft,
 	                                                     dBToGain (-60.0),
-	                                                     t->percSlowDecaySeconds);
+	                                                     t->percSlowDecaySeconds,
+	                                                     t->SampleRateD);
 
 	/* Deploy the computed reset values. */
 
@@ -2044,10 +2459,10 @@ dumpOscToText (struct b_tonegen* t, char* fname)
 	for (i = 0; i < NOF_WHEELS; i++) {
 		fprintf (fp, "[%3d]:%7.2lf Hz:%5zu:%6zu:%5.2lf\n",
 		         i,
-		         t->oscillators[i].frequency,
+		         t->oscDesign[i].frequency,
 		         t->oscillators[i].lengthSamples,
 		         t->oscillators[i].lengthSamples * sizeof (float),
-		         t->oscillators[i].attenuation);
+		         t->oscDesign[i].attenuation);
 		bufferSamples += t->oscillators[i].lengthSamples;
 	}
 
@@ -2063,78 +2478,17 @@ dumpOscToText (struct b_tonegen* t, char* fname)
 /**
  * This routine configures this module.
  */
-int
-oscConfig (struct b_tonegen* t, ConfigContext* cfg)
+/*
+ * The per-wheel and per-key tables: osc.eqv.<n>, osc.harmonic.*,
+ * osc.terminal.*, osc.taper.* and osc.crosstalk.*. A voicing consists
+ * mostly of these, so they are matched before the scalar parameters.
+ * @return 0 if the name is not one of these tables.
+ */
+static int
+oscTableConfig (struct b_tonegen* t, ConfigContext* cfg)
 {
-	int    ack = 0;
-	double d;
-	int    ival;
-	if ((ack = getConfigParameter_d ("osc.tuning", cfg, &d)) == 1) {
-		setTuning (t, d);
-	} else if (!strcasecmp (cfg->name, "osc.temperament")) {
-		ack++;
-		if (!strcasecmp (cfg->value, "equal")) {
-			t->gearTuning = 0;
-		} else if (!strcasecmp (cfg->value, "gear60")) {
-			t->gearTuning = 1;
-		} else if (!strcasecmp (cfg->value, "gear50")) {
-			t->gearTuning = 2;
-		} else {
-			showConfigfileContext (cfg, "'equal', 'gear60', or 'gear50' expected");
-		}
-	} else if ((ack = getConfigParameter_d ("osc.x-precision", cfg, &d)) == 1) {
-		setWavePrecision (t, d);
-	} else if ((ack = getConfigParameter_d ("osc.perc.fast",
-	                                        cfg,
-	                                        &t->percFastDecaySeconds))) {
-		;
-	} else if ((ack = getConfigParameter_d ("osc.perc.slow",
-	                                        cfg,
-	                                        &t->percSlowDecaySeconds))) {
-		;
-	} else if ((ack = getConfigParameter_d ("osc.perc.normal", cfg, &d)) == 1) {
-		setNormalPercussionGain (t, d);
-	} else if ((ack = getConfigParameter_d ("osc.perc.soft", cfg, &d)) == 1) {
-		setSoftPercussionGain (t, d);
-	} else if ((ack = getConfigParameter_d ("osc.perc.gain", cfg, &d)) == 1) {
-		setPercussionGainScaling (t, d);
-	} else if ((ack = getConfigParameter_ir ("osc.perc.bus.a",
-	                                         cfg,
-	                                         &ival,
-	                                         0, 8)) == 1) {
-		t->percSendBusA = ival;
-	} else if ((ack = getConfigParameter_ir ("osc.perc.bus.b",
-	                                         cfg,
-	                                         &ival,
-	                                         0, 8)) == 1) {
-		t->percSendBusB = ival;
-	} else if ((ack = getConfigParameter_ir ("osc.perc.bus.trig",
-	                                         cfg,
-	                                         &ival,
-	                                         -1, 8)) == 1) {
-		t->percTriggerBus = ival;
-	} else if (!strcasecmp (cfg->name, "osc.eq.macro")) {
-		ack++;
-		if (!strcasecmp (cfg->value, "chspline")) {
-			t->eqMacro = EQ_SPLINE;
-		} else if (!strcasecmp (cfg->value, "peak24")) {
-			t->eqMacro = EQ_PEAK24;
-		} else if (!strcasecmp (cfg->value, "peak46")) {
-			t->eqMacro = EQ_PEAK46;
-		} else {
-			showConfigfileContext (cfg, "expected chspline, peak24 or peak46");
-		}
-	} else if ((ack = getConfigParameter_d ("osc.eq.p1y", cfg, &t->eqP1y)))
-		;
-	else if ((ack = getConfigParameter_d ("osc.eq.r1y", cfg, &t->eqR1y)))
-		;
-	else if ((ack = getConfigParameter_d ("osc.eq.p4y", cfg, &t->eqP4y)))
-		;
-	else if ((ack = getConfigParameter_d ("osc.eq.r4y", cfg, &t->eqR4y)))
-		;
-	else if ((ack = getConfigParameter_d ("osc.eqv.ceiling", cfg, &t->eqvCeiling)))
-		;
-	else if (!strncasecmp (cfg->name, "osc.eqv.", 8)) {
+	int ack = 0;
+	if (!strncasecmp (cfg->name, "osc.eqv.", 8)) {
 		int    n;
 		double v;
 		ack++;
@@ -2278,7 +2632,88 @@ oscConfig (struct b_tonegen* t, ConfigContext* cfg)
 				showConfigfileContext (cfg, buf);
 			}
 		}
-	} else if ((ack = getConfigParameter_dr ("osc.compartment-crosstalk",
+	}
+	return ack;
+}
+
+int
+oscConfig (struct b_tonegen* t, ConfigContext* cfg)
+{
+	int    ack = 0;
+	double d;
+	int    ival;
+	if (strcasecmp (cfg->name, "osc.eqv.ceiling") && (ack = oscTableConfig (t, cfg)) != 0) {
+		;
+	} else if ((ack = getConfigParameter_d ("osc.tuning", cfg, &d)) == 1) {
+		setTuning (t, d);
+	} else if (!strcasecmp (cfg->name, "osc.temperament")) {
+		ack++;
+		if (!strcasecmp (cfg->value, "equal")) {
+			t->gearTuning = 0;
+		} else if (!strcasecmp (cfg->value, "gear60")) {
+			t->gearTuning = 1;
+		} else if (!strcasecmp (cfg->value, "gear50")) {
+			t->gearTuning = 2;
+		} else {
+			showConfigfileContext (cfg, "'equal', 'gear60', or 'gear50' expected");
+		}
+	} else if ((ack = getConfigParameter_d ("osc.x-precision", cfg, &d)) == 1) {
+		setWavePrecision (t, d);
+	} else if ((ack = getConfigParameter_d ("osc.x-memory-budget", cfg, &d)) == 1) {
+		setWaveMemoryBudget (t, d);
+	} else if ((ack = getConfigParameter_ir ("osc.x-phase-accumulator", cfg, &t->oscPhaseMode, 0, 1)) == 1) {
+		;
+	} else if ((ack = getConfigParameter_d ("osc.perc.fast",
+	                                        cfg,
+	                                        &t->percFastDecaySeconds))) {
+		;
+	} else if ((ack = getConfigParameter_d ("osc.perc.slow",
+	                                        cfg,
+	                                        &t->percSlowDecaySeconds))) {
+		;
+	} else if ((ack = getConfigParameter_d ("osc.perc.normal", cfg, &d)) == 1) {
+		setNormalPercussionGain (t, d);
+	} else if ((ack = getConfigParameter_d ("osc.perc.soft", cfg, &d)) == 1) {
+		setSoftPercussionGain (t, d);
+	} else if ((ack = getConfigParameter_d ("osc.perc.gain", cfg, &d)) == 1) {
+		setPercussionGainScaling (t, d);
+	} else if ((ack = getConfigParameter_ir ("osc.perc.bus.a",
+	                                         cfg,
+	                                         &ival,
+	                                         0, 8)) == 1) {
+		t->percSendBusA = ival;
+	} else if ((ack = getConfigParameter_ir ("osc.perc.bus.b",
+	                                         cfg,
+	                                         &ival,
+	                                         0, 8)) == 1) {
+		t->percSendBusB = ival;
+	} else if ((ack = getConfigParameter_ir ("osc.perc.bus.trig",
+	                                         cfg,
+	                                         &ival,
+	                                         -1, 8)) == 1) {
+		t->percTriggerBus = ival;
+	} else if (!strcasecmp (cfg->name, "osc.eq.macro")) {
+		ack++;
+		if (!strcasecmp (cfg->value, "chspline")) {
+			t->eqMacro = EQ_SPLINE;
+		} else if (!strcasecmp (cfg->value, "peak24")) {
+			t->eqMacro = EQ_PEAK24;
+		} else if (!strcasecmp (cfg->value, "peak46")) {
+			t->eqMacro = EQ_PEAK46;
+		} else {
+			showConfigfileContext (cfg, "expected chspline, peak24 or peak46");
+		}
+	} else if ((ack = getConfigParameter_d ("osc.eq.p1y", cfg, &t->eqP1y)))
+		;
+	else if ((ack = getConfigParameter_d ("osc.eq.r1y", cfg, &t->eqR1y)))
+		;
+	else if ((ack = getConfigParameter_d ("osc.eq.p4y", cfg, &t->eqP4y)))
+		;
+	else if ((ack = getConfigParameter_d ("osc.eq.r4y", cfg, &t->eqR4y)))
+		;
+	else if ((ack = getConfigParameter_d ("osc.eqv.ceiling", cfg, &t->eqvCeiling)))
+		;
+	else if ((ack = getConfigParameter_dr ("osc.compartment-crosstalk",
 	                                         cfg, &d, 0.0, 1.0)) == 1) {
 		t->defaultCompartmentCrosstalk = d;
 	} else if ((ack = getConfigParameter_dr ("osc.transformer-crosstalk",
@@ -2491,13 +2926,14 @@ setDrawBar (struct b_tonegen* t, int bus, unsigned int setting)
 {
 	assert ((0 <= bus) && (bus < NOF_BUSES));
 	assert ((0 <= setting) && (setting < 9));
-	t->drawBarChange = 1;
 	if (bus == t->percTriggerBus) {
 		t->percTrigRestore = setting;
 		if (t->percEnabled)
 			return;
 	}
 	t->drawBarGain[bus] = t->drawBarLevel[bus][setting];
+	/* The audio thread may be taking the mask at the same time */
+	__atomic_fetch_or (&t->drawBarChange, 1u << bus, __ATOMIC_RELEASE);
 }
 
 /**
@@ -2741,7 +3177,7 @@ static void
 setSwellPedal1FromMIDI (void* d, unsigned char u)
 {
 	struct b_tonegen* t = (struct b_tonegen*)d;
-	t->swellPedalGain   = (t->outputLevelTrim * ((double)u)) / 127.0;
+	t->swellPedalGainTarget = (t->outputLevelTrim * ((double)u)) / 127.0;
 	notifyControlChangeByName (t->midi_cfg_ptr, "swellpedal2", u);
 }
 
@@ -2749,7 +3185,7 @@ static void
 setSwellPedal2FromMIDI (void* d, unsigned char u)
 {
 	struct b_tonegen* t = (struct b_tonegen*)d;
-	t->swellPedalGain   = (t->outputLevelTrim * ((double)u)) / 127.0;
+	t->swellPedalGainTarget = (t->outputLevelTrim * ((double)u)) / 127.0;
 	notifyControlChangeByName (t->midi_cfg_ptr, "swellpedal1", u);
 }
 
@@ -2770,7 +3206,8 @@ initToneGenerator (struct b_tonegen* t, void* m)
 	t->percEnvGain                = 0;
 	for (i = 0; i < NOF_BUSES; ++i) {
 		int j;
-		t->drawBarGain[i] = 0;
+		t->drawBarGain[i]        = 0;
+		t->drawBarGainApplied[i] = 0;
 		for (j = 0; j < 9; ++j) {
 			t->drawBarLevel[i][j] = 0;
 		}
@@ -2783,16 +3220,18 @@ initToneGenerator (struct b_tonegen* t, void* m)
 		memset ((void*)&t->corePgm[i], 0, sizeof (CoreIns));
 	for (i = 0; i <= NOF_WHEELS; ++i)
 		memset ((void*)&t->oscillators[i], 0, sizeof (struct _oscillator));
+	for (i = 0; i <= NOF_WHEELS; ++i)
+		memset ((void*)&t->oscDesign[i], 0, sizeof (struct _oscdesign));
 	for (i = 0; i < 128; ++i) {
 		t->eqvAtt[i] = 0.0;
 		t->eqvSet[i] = '\0';
 	}
 
 	if (t->envAtkClkMinLength < 0) {
-		t->envAtkClkMinLength = floor (SampleRateD * 8.0 / 22050.0);
+		t->envAtkClkMinLength = floor (t->SampleRateD * 8.0 / 22050.0);
 	}
 	if (t->envAtkClkMaxLength < 0) {
-		t->envAtkClkMaxLength = ceil (SampleRateD * 40.0 / 22050.0);
+		t->envAtkClkMaxLength = ceil (t->SampleRateD * 40.0 / 22050.0);
 	}
 
 	if (t->envAtkClkMinLength > BUFFER_SIZE_SAMPLES) {
@@ -2809,6 +3248,7 @@ initToneGenerator (struct b_tonegen* t, void* m)
 #endif
 
 	compilePlayMatrix (t);
+	compileKeyContrib (t);
 
 #if DEBUG_TONEGEN_OSC
 	dumpRuntimeData (t, "osc_runtime.txt");
@@ -2897,28 +3337,130 @@ initToneGenerator (struct b_tonegen* t, void* m)
 #endif
 }
 
+/**
+ * Takes over the performance state of another tone generator: the drawbars,
+ * percussion, vibrato and swell pedal settings, the vibrato scanner, and
+ * the keys held down, which are replayed as key-on messages. Meant to be
+ * called between two fragments when t replaces src; it does not allocate.
+ * The MIDI control functions still point at src, see
+ * rebindMIDIControlFunctions().
+ */
+void
+transferToneGeneratorState (struct b_tonegen* t, const struct b_tonegen* src)
+{
+	int i;
+
+	for (i = 0; i < NOF_BUSES; i++) {
+		t->drawBarGain[i] = src->drawBarGain[i];
+	}
+	t->drawBarChange  = (1u << NOF_BUSES) - 1;
+	t->drawBarUpdates = 0;
+
+	t->newRouting      = src->newRouting;
+	t->percEnabled     = src->percEnabled;
+	t->percTrigRestore = src->percTrigRestore;
+	setPercussionFirst (t, src->percSendBus == src->percSendBusA);
+	setPercussionFast (t, src->percIsFast);
+	setPercussionVolume (t, src->percIsSoft);
+
+	t->swellPedalGain       = src->swellPedalGain;
+	t->swellPedalGainTarget = src->swellPedalGainTarget;
+
+	copy_vibrato (&t->inst_vibrato, &src->inst_vibrato);
+
+	for (i = 0; i < MAX_KEYS; i++) {
+		if (src->activeKeys[i] && !t->activeKeys[i]) {
+			oscKeyOn (t, i, 255);
+		}
+	}
+	memcpy (t->_activeKeys, src->_activeKeys, sizeof (t->_activeKeys));
+
+	/* Continue the percussion decay and key compression of the held keys */
+	t->percEnvGain = src->percEnvGain;
+#ifdef KEYCOMPRESSION
+	t->keyCompLevel = src->keyCompLevel;
+#endif /* KEYCOMPRESSION */
+
+	t->midi_cfg_ptr = src->midi_cfg_ptr;
+}
+
+/**
+ * Returns the tone generator to the silence it starts in: the keys are
+ * released without a release envelope, the wheels go back to their first
+ * sample and the vibrato scanner is emptied. The drawbars, percussion,
+ * vibrato and swell pedal settings are kept, the swell pedal gain jumps
+ * to its target. It does not allocate; call it while no fragment is
+ * generated.
+ */
 void
-freeListElements (ListElement* lep)
+resetToneGenerator (struct b_tonegen* t)
+{
+	int i;
+
+	for (i = 1; i <= NOF_WHEELS; i++) {
+		struct _oscillator* osp = &(t->oscillators[i]);
+		osp->aclPos             = -1;
+		osp->rflags             = 0;
+		osp->pos                = 0;
+		osp->phase              = 0;
+	}
+	memset (t->aot, 0, sizeof (t->aot));
+	memset (t->aotBusLevel, 0, sizeof (t->aotBusLevel));
+	memset (t->aotSumUpper, 0, sizeof (t->aotSumUpper));
+	memset (t->aotSumLower, 0, sizeof (t->aotSumLower));
+	memset (t->aotSumPedal, 0, sizeof (t->aotSumPedal));
+	t->activeOscLEnd = 0;
+
+	memset (t->activeKeys, 0, sizeof (t->activeKeys));
+	memset (t->_activeKeys, 0, sizeof (t->_activeKeys));
+	t->msgQueueWriter = t->msgQueueReader = t->msgQueue;
+	t->upperKeyCount                      = 0;
+	t->percEnvGain                        = t->percEnvGainReset;
+#ifdef HIPASS_PERCUSSION
+	t->pz = 0;
+#endif
+#ifdef KEYCOMPRESSION
+	t->keyDownCount = 0;
+	t->keyCompLevel = KEYCOMP_ZERO_LEVEL;
+#endif /* KEYCOMPRESSION */
+
+	memset (t->swlBuffer, 0, sizeof (t->swlBuffer));
+	memset (t->vibBuffer, 0, sizeof (t->vibBuffer));
+	memset (t->vibYBuffr, 0, sizeof (t->vibYBuffr));
+	memset (t->prcBuffer, 0, sizeof (t->prcBuffer));
+
+	t->swellPedalGain = t->swellPedalGainTarget;
+	clearVibrato (t);
+}
+
+void
+freeListElements (void* arena, ListElement* lep)
 {
 	ListElement* l = lep;
 	while (l) {
 		ListElement* t = l;
 		l              = l->next;
-		free (t);
+		arenaFree (arena, t);
 	}
 }
 
 void
 freeToneGenerator (struct b_tonegen* t)
 {
-	freeListElements (t->leConfig);
-	freeListElements (t->leRuntime);
+	freeListElements (t->arena, t->leConfig);
+	freeListElements (t->arena, t->leRuntime);
+	arenaFree (t->arena, t->keyContribLevel);
 	int i;
-	for (i = 1; i <= NOF_WHEELS; i++) {
+	for (i = 1; i <= NOF_WHEELS && !t->phaseTables; i++) {
+		if (t->waveSource && t->oscillators[i].wave == t->waveSource->oscillators[i].wave)
+			continue; /* borrowed */
 		if (t->oscillators[i].wave)
-			free (t->oscillators[i].wave);
+			arenaFree (t->arena, t->oscillators[i].wave);
 	}
-	free (t);
+	arenaFree (t->arena, t->phaseTables);
+	arenaFree (t->arena, t->phaseTableOf);
+	arenaFree (t->arena, t->phaseBuffer);
+	arenaFree (t->arena, t);
 }
 
 /**
@@ -2956,6 +3498,48 @@ oscKeyOff (struct b_tonegen* t, unsigned char keyNumber, unsigned char realKey)
     //printf ("\rOFF:%3d", keyNumber); fflush (stdout);
 }
 
+/**
+ * Renders the next fragment of a wheel with its phase accumulator, reading
+ * the single-cycle table with linear interpolation. Only the table reads
+ * are done one sample at a time; the phase and interpolation arithmetic
+ * are kept in separate loops so that they vectorize.
+ *
+ * @return  The rendered fragment, which is valid until the next call for
+ *          the same wheel.
+ */
+static inline float*
+renderPhaseWheel (struct b_tonegen* t, struct _oscillator* osp, int oscNumber)
+{
+	const float* const tbl   = osp->wave;
+	const uint32_t     inc   = osp->phaseInc;
+	const float        gain  = osp->gain;
+	const uint32_t     phase = osp->phase;
+	float* const       y     = t->phaseBuffer + oscNumber * BUFFER_SIZE_SAMPLES;
+	uint32_t           idx[BUFFER_SIZE_SAMPLES];
+	float              frac[BUFFER_SIZE_SAMPLES];
+	float              y0[BUFFER_SIZE_SAMPLES];
+	float              y1[BUFFER_SIZE_SAMPLES];
+	int                n;
+
+	for (n = 0; n < BUFFER_SIZE_SAMPLES; n++) {
+		const uint32_t p = phase + (uint32_t)n * inc;
+		idx[n]           = p >> (32 - PHASE_TABLE_BITS);
+		frac[n]          = (int32_t)(p & ((1u << (32 - PHASE_TABLE_BITS)) - 1)) * (1.0f / (1u << (32 - PHASE_TABLE_BITS)));
+	}
+
+	for (n = 0; n < BUFFER_SIZE_SAMPLES; n++) {
+		y0[n] = tbl[idx[n]];
+		y1[n] = tbl[idx[n] + 1];
+	}
+
+	for (n = 0; n < BUFFER_SIZE_SAMPLES; n++) {
+		y[n] = gain * (y0[n] + frac[n] * (y1[n] - y0[n]));
+	}
+
+	osp->phase = phase + (uint32_t)BUFFER_SIZE_SAMPLES * inc;
+	return y;
+}
+
 /**
  * This function is the entry point for the MIDI parser when it has received
  * a NOTE ON message on a channel and note number mapped to a playing key.
@@ -2995,6 +3579,68 @@ oscKeyOn (struct b_tonegen* t, unsigned char keyNumber, unsigned char realKey)
  * Tonegenerator version 3, 16-jul-2004
  * ----------------------------------------------------------------*/
 
+/*
+ * Returns the buses an instruction contributes to, from its gains and,
+ * for envelope instructions, its target gains.
+ */
+static inline short
+coreTargets (const CoreIns* c)
+{
+	const int env = c->opr & 2;
+	short     tgt = 0;
+
+	if (c->sgain != 0.0 || (env && c->nsgain != 0.0)) {
+		tgt |= CR_SWL;
+	}
+	if (c->vgain != 0.0 || (env && c->nvgain != 0.0)) {
+		tgt |= CR_VIB;
+	}
+	if (c->pgain != 0.0 || (env && c->npgain != 0.0)) {
+		tgt |= CR_PRC;
+	}
+	return tgt;
+}
+
+/*
+ * Core ADD and ADDENV kernel. The flags are compile time constants at
+ * every call site, so each opcode gets its own loop which only reads
+ * and writes the buses that it targets.
+ */
+static inline void
+coreAdd (const float* xp, const float* ep,
+         float* ys, float* yv, float* yp, int n,
+         const float gs, const float ds,
+         const float gv, const float dv,
+         const float gp, const float dp,
+         const int env, const int toSwl, const int toVib, const int toPrc)
+{
+	for (; 0 < n; n--) {
+		const float x = (float)(*xp++);
+		if (env) {
+			const float e = *ep++;
+			if (toSwl) {
+				*ys++ += x * (gs + (e * ds));
+			}
+			if (toVib) {
+				*yv++ += x * (gv + (e * dv));
+			}
+			if (toPrc) {
+				*yp++ += x * (gp + (e * dp));
+			}
+		} else {
+			if (toSwl) {
+				*ys++ += x * gs;
+			}
+			if (toVib) {
+				*yv++ += x * gv;
+			}
+			if (toPrc) {
+				*yp++ += x * gp;
+			}
+		}
+	}
+}
+
 /*
  * This routine is where the next buffer of output sound is assembled.
  * The routine goes through the following phases:
@@ -3041,6 +3687,7 @@ oscKeyOn (struct b_tonegen* t, unsigned char keyNumber, unsigned char realKey)
  * there are changes to be made, and human fingers are typically quite
  * slow. Sequencers, however, may put some strain on things.
  */
+
 void
 oscGenerateFragment (struct b_tonegen* t, float* buf, size_t lengthSamples)
 {
@@ -3049,8 +3696,14 @@ oscGenerateFragment (struct b_tonegen* t, float* buf, size_t lengthSamples)
 	struct _oscillator*   osp;
 	unsigned int          copyDone = 0;
 	unsigned int          recomputeRouting;
+	unsigned int          drawBarDirty;
 	int                   removedEnd  = 0;
 	unsigned short* const removedList = t->removedList;
+	short                 tgt;
+	short                 tgtAll      = CR_BUSES; /* Buses targeted by every instruction */
+	short                 tgtAny      = 0;        /* Buses targeted by any instruction */
+	short                 tgtWide;                /* Buses added to every instruction */
+	int                   vibOutput   = (t->oldRouting & RT_VIB) != 0;
 	float* const          swlBuffer   = t->swlBuffer;
 	float* const          vibBuffer   = t->vibBuffer;
 	float* const          vibYBuffr   = t->vibYBuffr;
@@ -3077,66 +3730,111 @@ oscGenerateFragment (struct b_tonegen* t, float* buf, size_t lengthSamples)
 	/* Reset the core program */
 	t->coreWriter = t->coreReader = t->corePgm;
 
+	if (__atomic_exchange_n (&t->tuningChange, 0, __ATOMIC_ACQUIRE)) {
+		computeFrequencies (t, t->tgVariant);
+		setPhaseIncrements (t);
+	}
+
 	/* ****************************************************************
 	 *     M E S S S A G E   Q U E U E
 	 * ****************************************************************/
 
-	while (t->msgQueueReader != t->msgQueueWriter) {
-		unsigned short msg = *t->msgQueueReader++; /* Read next message */
-		int            keyNumber;
-		ListElement*   lep;
-
-		/* Check wrap on message queue */
-		if (t->msgQueueReader == t->msgQueueEnd) {
-			t->msgQueueReader = t->msgQueue;
-		}
-
-		if (MSG_GET_MSG (msg) == MSG_MKEYON) {
-			keyNumber = MSG_GET_PRM (msg);
-			for (lep = t->keyContrib[keyNumber]; lep != NULL; lep = lep->next) {
-				int wheelNumber = LE_WHEEL_NUMBER_OF (lep);
-				osp             = &(t->oscillators[wheelNumber]);
-
-				if (t->aot[wheelNumber].refCount == 0) {
-					/* Flag the oscillator as added and modified */
-					osp->rflags = OR_ADD;
-					/* If not already on the active list, add it */
-					if (osp->aclPos == -1) {
-						osp->aclPos                          = t->activeOscLEnd;
-						t->activeOscList[t->activeOscLEnd++] = wheelNumber;
-					}
-				} else {
-					osp->rflags |= ORF_MODIFIED;
-				}
+	/*
+   * All key messages since the last fragment are merged first, into the
+   * net change of each key, in the order in which the keys first appear.
+   * The contributions of the keys that changed are then accumulated into
+   * the bus levels in one pass over the keyContrib arrays, after which
+   * each wheel that was touched is activated, modified or deactivated
+   * once. A key that is released and pressed again within the same
+   * fragment thus leaves its wheels alone.
+   */
 
-				t->aot[wheelNumber].busLevel[LE_BUSNUMBER_OF (lep)] += LE_LEVEL_OF (lep);
-				t->aot[wheelNumber].keyCount[LE_BUSNUMBER_OF (lep)] += 1;
-				t->aot[wheelNumber].refCount += 1;
+	if (t->msgQueueReader != t->msgQueueWriter) {
+		signed char   keyDelta[MAX_KEYS];
+		unsigned char keySeen[MAX_KEYS];
+		unsigned char keyOrder[MAX_KEYS];
+		short         wheelDelta[NOF_WHEELS + 1];
+		unsigned char wheelSeen[NOF_WHEELS + 1];
+		unsigned char wheelOrder[NOF_WHEELS + 1];
+		int           nofKeys   = 0;
+		int           nofWheels = 0;
+		int           e;
+
+		memset (keyDelta, 0, sizeof (keyDelta));
+		memset (keySeen, 0, sizeof (keySeen));
+		memset (wheelDelta, 0, sizeof (wheelDelta));
+		memset (wheelSeen, 0, sizeof (wheelSeen));
+
+		while (t->msgQueueReader != t->msgQueueWriter) {
+			unsigned short msg       = *t->msgQueueReader++; /* Read next message */
+			int            keyNumber = MSG_GET_PRM (msg);
+
+			/* Check wrap on message queue */
+			if (t->msgQueueReader == t->msgQueueEnd) {
+				t->msgQueueReader = t->msgQueue;
 			}
 
-		} else if (MSG_GET_MSG (msg) == MSG_MKEYOFF) {
-			keyNumber = MSG_GET_PRM (msg);
-			for (lep = t->keyContrib[keyNumber]; lep != NULL; lep = lep->next) {
-				int wheelNumber = LE_WHEEL_NUMBER_OF (lep);
-				osp             = &(t->oscillators[wheelNumber]);
+			if (!keySeen[keyNumber]) {
+				keySeen[keyNumber]  = 1;
+				keyOrder[nofKeys++] = keyNumber;
+			}
 
-				t->aot[wheelNumber].busLevel[LE_BUSNUMBER_OF (lep)] -= LE_LEVEL_OF (lep);
-				t->aot[wheelNumber].keyCount[LE_BUSNUMBER_OF (lep)] -= 1;
-				t->aot[wheelNumber].refCount -= 1;
+			if (MSG_GET_MSG (msg) == MSG_MKEYON) {
+				keyDelta[keyNumber] += 1;
+			} else if (MSG_GET_MSG (msg) == MSG_MKEYOFF) {
+				keyDelta[keyNumber] -= 1;
+			} else {
+				assert (0);
+			}
+		} /* while message queue reader */
 
-				assert (0 <= t->aot[wheelNumber].refCount);
-				assert (-1 < osp->aclPos); /* Must be on the active osc list */
+		for (i = 0; i < nofKeys; i++) {
+			const int   keyNumber = keyOrder[i];
+			const float d         = keyDelta[keyNumber];
 
-				if (t->aot[wheelNumber].refCount == 0) {
-					osp->rflags = OR_REM;
-				} else {
-					osp->rflags |= ORF_MODIFIED;
+			if (d == 0) {
+				continue;
+			}
+
+			for (e = t->keyContribStart[keyNumber]; e < t->keyContribStart[keyNumber + 1]; e++) {
+				const int wheelNumber = t->keyContribWheel[e];
+
+				t->aotBusLevel[t->keyContribBus[e]][wheelNumber] += d * t->keyContribLevel[e];
+				wheelDelta[wheelNumber] += keyDelta[keyNumber];
+
+				if (!wheelSeen[wheelNumber]) {
+					wheelSeen[wheelNumber]  = 1;
+					wheelOrder[nofWheels++] = wheelNumber;
 				}
 			}
-		} else {
-			assert (0);
 		}
-	} /* while message queue reader */
+
+		for (i = 0; i < nofWheels; i++) {
+			const int wheelNumber = wheelOrder[i];
+			const int oldCount    = t->aot[wheelNumber].refCount;
+			const int newCount    = oldCount + wheelDelta[wheelNumber];
+
+			osp                          = &(t->oscillators[wheelNumber]);
+			t->aot[wheelNumber].refCount = newCount;
+
+			assert (0 <= newCount);
+
+			if (oldCount == 0 && 0 < newCount) {
+				/* Flag the oscillator as added and modified */
+				osp->rflags = OR_ADD;
+				/* If not already on the active list, add it */
+				if (osp->aclPos == -1) {
+					osp->aclPos                          = t->activeOscLEnd;
+					t->activeOscList[t->activeOscLEnd++] = wheelNumber;
+				}
+			} else if (0 < oldCount && newCount == 0) {
+				assert (-1 < osp->aclPos); /* Must be on the active osc list */
+				osp->rflags = OR_REM;
+			} else if (0 < newCount) {
+				osp->rflags |= ORF_MODIFIED;
+			}
+		}
+	}
 
 	/* ****************************************************************
 	 *     A C T I V A T E D   L I S T
@@ -3146,6 +3844,51 @@ oscGenerateFragment (struct b_tonegen* t, float* buf, size_t lengthSamples)
 		t->oldRouting = t->newRouting;
 	}
 
+	/*
+   * Apply drawbar changes to the manual sums of all wheels: for each
+   * changed bus, the sums get the bus levels times the change in gain.
+   * Wheels that are modified below compute their sums from scratch.
+   * Every DRAWBAR_REBUILD bus updates all sums are recomputed, so that
+   * the rounding errors of the increments do not add up.
+   */
+
+	if ((drawBarDirty = __atomic_exchange_n (&t->drawBarChange, 0, __ATOMIC_ACQUIRE))) {
+		int d;
+		t->drawBarUpdates += __builtin_popcount (drawBarDirty);
+		if (t->drawBarUpdates >= DRAWBAR_REBUILD) {
+			t->drawBarUpdates = 0;
+			drawBarDirty      = (1u << NOF_BUSES) - 1;
+			memset (t->aotSumUpper, 0, sizeof (t->aotSumUpper));
+			memset (t->aotSumLower, 0, sizeof (t->aotSumLower));
+			memset (t->aotSumPedal, 0, sizeof (t->aotSumPedal));
+			for (d = 0; d < NOF_BUSES; d++) {
+				t->drawBarGainApplied[d] = 0;
+			}
+		}
+		for (d = 0; d < NOF_BUSES; d++) {
+			if (drawBarDirty & (1u << d)) {
+				const float  gain  = t->drawBarGain[d];
+				const float  delta = gain - t->drawBarGainApplied[d];
+				const float* lvl   = t->aotBusLevel[d];
+				float*       sum;
+				int          w;
+
+				if (d < UPPER_BUS_END) {
+					sum = t->aotSumUpper;
+				} else if (d < LOWER_BUS_END) {
+					sum = t->aotSumLower;
+				} else {
+					sum = t->aotSumPedal;
+				}
+
+				t->drawBarGainApplied[d] = gain;
+				for (w = 0; w <= NOF_WHEELS; w++) {
+					sum[w] += lvl[w] * delta;
+				}
+			}
+		}
+	}
+
 	/*
    * At this point, new oscillators has been added to the active list
    * and removed oscillators are still on the list.
@@ -3178,8 +3921,15 @@ oscGenerateFragment (struct b_tonegen* t, float* buf, size_t lengthSamples)
 			t->coreWriter->vgain = aop->sumScanr;
 			/* Target gain is zero */
 			t->coreWriter->nsgain = t->coreWriter->npgain = t->coreWriter->nvgain = 0.0;
+			tgt = coreTargets (t->coreWriter);
+			t->coreWriter->opr |= tgt;
+			tgtAll &= tgt;
+			tgtAny |= tgt;
 
-			if (osp->lengthSamples < (osp->pos + BUFFER_SIZE_SAMPLES)) {
+			if (t->phaseTables) {
+				t->coreWriter->src = renderPhaseWheel (t, osp, oscNumber);
+				t->coreWriter->cnt = BUFFER_SIZE_SAMPLES;
+			} else if (osp->lengthSamples < (osp->pos + BUFFER_SIZE_SAMPLES)) {
 				/* Need another instruction because of wrap */
 				CoreIns* prev      = t->coreWriter;
 				t->coreWriter->cnt = osp->lengthSamples - osp->pos;
@@ -3222,49 +3972,51 @@ oscGenerateFragment (struct b_tonegen* t, float* buf, size_t lengthSamples)
 
 			/* Update the oscillator's contribution to each busgroup mix */
 
-			if ((osp->rflags & ORF_MODIFIED) || t->drawBarChange) {
+			if (osp->rflags & ORF_MODIFIED) {
 				int   d;
 				float sum = 0.0;
 
 				for (d = UPPER_BUS_LO; d < UPPER_BUS_END; d++) {
-					sum += aop->busLevel[d] * t->drawBarGain[d];
+					sum += t->aotBusLevel[d][oscNumber] * t->drawBarGainApplied[d];
 				}
-				aop->sumUpper = sum;
-				sum           = 0.0;
+				t->aotSumUpper[oscNumber] = sum;
+				sum                       = 0.0;
 				for (d = LOWER_BUS_LO; d < LOWER_BUS_END; d++) {
-					sum += aop->busLevel[d] * t->drawBarGain[d];
+					sum += t->aotBusLevel[d][oscNumber] * t->drawBarGainApplied[d];
 				}
-				aop->sumLower = sum;
-				sum           = 0.0;
+				t->aotSumLower[oscNumber] = sum;
+				sum                       = 0.0;
 				for (d = PEDAL_BUS_LO; d < PEDAL_BUS_END; d++) {
-					sum += aop->busLevel[d] * t->drawBarGain[d];
+					sum += t->aotBusLevel[d][oscNumber] * t->drawBarGainApplied[d];
 				}
-				aop->sumPedal = sum;
-				reroute       = 1;
+				t->aotSumPedal[oscNumber] = sum;
+				reroute                   = 1;
+			} else if (drawBarDirty) {
+				reroute = 1; /* The sums were updated above */
 			}
 
 			/* If the group mix or routing has changed */
 
 			if (reroute || recomputeRouting) {
 				if (t->oldRouting & RT_PERC) { /* Percussion */
-					aop->sumPercn = aop->busLevel[t->percSendBus];
+					aop->sumPercn = t->aotBusLevel[t->percSendBus][oscNumber];
 				} else {
 					aop->sumPercn = 0.0;
 				}
 
-				aop->sumScanr = 0.0;           /* Initialize scanner level */
-				aop->sumSwell = aop->sumPedal; /* Initialize swell level */
+				aop->sumScanr = 0.0;                       /* Initialize scanner level */
+				aop->sumSwell = t->aotSumPedal[oscNumber]; /* Initialize swell level */
 
-				if (t->oldRouting & RT_UPPRVIB) {       /* Upper manual ... */
-					aop->sumScanr += aop->sumUpper; /* ... to vibrato */
+				if (t->oldRouting & RT_UPPRVIB) {                   /* Upper manual ... */
+					aop->sumScanr += t->aotSumUpper[oscNumber]; /* ... to vibrato */
 				} else {
-					aop->sumSwell += aop->sumUpper; /* ... to swell pedal */
+					aop->sumSwell += t->aotSumUpper[oscNumber]; /* ... to swell pedal */
 				}
 
-				if (t->oldRouting & RT_LOWRVIB) {       /* Lower manual ... */
-					aop->sumScanr += aop->sumLower; /* ... to vibrato */
+				if (t->oldRouting & RT_LOWRVIB) {                   /* Lower manual ... */
+					aop->sumScanr += t->aotSumLower[oscNumber]; /* ... to vibrato */
 				} else {
-					aop->sumSwell += aop->sumLower; /* ... to swell pedal */
+					aop->sumSwell += t->aotSumLower[oscNumber]; /* ... to swell pedal */
 				}
 			} /* if rerouting */
 
@@ -3291,12 +4043,19 @@ oscGenerateFragment (struct b_tonegen* t, float* buf, size_t lengthSamples)
 					copyDone           = 1;
 				}
 			}
+			tgt = coreTargets (t->coreWriter);
+			t->coreWriter->opr |= tgt;
+			tgtAll &= tgt;
+			tgtAny |= tgt;
 
 			/* The source is the wave of the oscillator at its current position */
 			t->coreWriter->src = osp->wave + osp->pos;
 			t->coreWriter->off = 0;
 
-			if (osp->lengthSamples < (osp->pos + BUFFER_SIZE_SAMPLES)) {
+			if (t->phaseTables) {
+				t->coreWriter->src = renderPhaseWheel (t, osp, oscNumber);
+				t->coreWriter->cnt = BUFFER_SIZE_SAMPLES;
+			} else if (osp->lengthSamples < (osp->pos + BUFFER_SIZE_SAMPLES)) {
 				/* Instruction wraps source buffer */
 				CoreIns* prev      = t->coreWriter;                            /* Refer to the first instruction */
 				t->coreWriter->cnt = osp->lengthSamples - osp->pos;            /* Set len count */
@@ -3307,7 +4066,7 @@ oscGenerateFragment (struct b_tonegen* t, float* buf, size_t lengthSamples)
 				t->coreWriter->opr = prev->opr; /* Same operation */
 				t->coreWriter->src = osp->wave; /* Start of wave because of wrap */
 				t->coreWriter->off = prev->cnt;
-				if (t->coreWriter->opr & 2) {
+				if (t->coreWriter->opr & CR_CPYENV) {
 					t->coreWriter->env = prev->env + prev->cnt; /* Continue envelope */
 				}
 				/* The gains are identical to the previous instruction */
@@ -3334,8 +4093,6 @@ oscGenerateFragment (struct b_tonegen* t, float* buf, size_t lengthSamples)
 
 	} /* for the active list */
 
-	t->drawBarChange = 0;
-
 	/* ****************************************************************
 	 *       R E M O V A L   L I S T
 	 * ****************************************************************/
@@ -3384,8 +4141,16 @@ oscGenerateFragment (struct b_tonegen* t, float* buf, size_t lengthSamples)
 		}
 	}
 
+	/*
+   * When the instructions target different sets of buses, alternating
+   * between kernels costs more in mispredicted branches than is saved in
+   * memory traffic. All of them then add into every bus that is in use.
+   */
+
+	tgtWide = (tgtAll != tgtAny) ? tgtAny : 0;
+
 	for (; t->coreReader < t->coreWriter; t->coreReader++) {
-		short        opr = t->coreReader->opr;
+		short        opr = t->coreReader->opr | tgtWide;
 		int          n   = t->coreReader->cnt;
 		float*       ys  = swlBuffer + t->coreReader->off;
 		float*       yv  = vibBuffer + t->coreReader->off;
@@ -3400,42 +4165,70 @@ oscGenerateFragment (struct b_tonegen* t, float* buf, size_t lengthSamples)
 		const float* xp  = t->coreReader->src;
 		//printf("CR: %f %f +:%f  (ns:%f)\n", gs, ds, gs+ds, t->coreReader->nsgain );
 
-		if (opr & 1) {         /* ADD and ADDENV */
-			if (opr & 2) { /* ADDENV */
-				for (; 0 < n; n--) {
-					float       x = (float)(*xp++);
-					const float e = *ep++;
-					*ys++ += x * (gs + (e * ds));
-					*yv++ += x * (gv + (e * dv));
-					*yp++ += x * (gp + (e * dp));
-				}
-			} else { /* ADD */
-				for (; 0 < n; n--) {
-					const float x = (float)(*xp++);
-					*ys++ += x * gs;
-					*yv++ += x * gv;
-					*yp++ += x * gp;
-				}
-			}
-
-		} else {
-			if (opr & 2) {               /* CPY and CPYENV */
-				for (; 0 < n; n--) { /* CPYENV */
-					const float x = (float)(*xp++);
-					const float e = *ep++;
-					*ys++         = x * (gs + (e * ds));
-					*yv++         = x * (gv + (e * dv));
-					*yp++         = x * (gp + (e * dp));
-				}
-
-			} else {
-				for (; 0 < n; n--) { /* CPY */
-					const float x = (float)(*xp++);
-					*ys++         = x * gs;
-					*yv++         = x * gv;
-					*yp++         = x * gp;
+		switch (opr & (CR_ADDENV | CR_BUSES)) { /* ADD and ADDENV, per target buses */
+			case CR_ADD | CR_SWL:
+				coreAdd (xp, ep, ys, yv, yp, n, gs, ds, gv, dv, gp, dp, 0, 1, 0, 0);
+				break;
+			case CR_ADD | CR_VIB:
+				coreAdd (xp, ep, ys, yv, yp, n, gs, ds, gv, dv, gp, dp, 0, 0, 1, 0);
+				break;
+			case CR_ADD | CR_PRC:
+				coreAdd (xp, ep, ys, yv, yp, n, gs, ds, gv, dv, gp, dp, 0, 0, 0, 1);
+				break;
+			case CR_ADD | CR_SWL | CR_VIB:
+				coreAdd (xp, ep, ys, yv, yp, n, gs, ds, gv, dv, gp, dp, 0, 1, 1, 0);
+				break;
+			case CR_ADD | CR_SWL | CR_PRC:
+				coreAdd (xp, ep, ys, yv, yp, n, gs, ds, gv, dv, gp, dp, 0, 1, 0, 1);
+				break;
+			case CR_ADD | CR_VIB | CR_PRC:
+				coreAdd (xp, ep, ys, yv, yp, n, gs, ds, gv, dv, gp, dp, 0, 0, 1, 1);
+				break;
+			case CR_ADD | CR_BUSES:
+				coreAdd (xp, ep, ys, yv, yp, n, gs, ds, gv, dv, gp, dp, 0, 1, 1, 1);
+				break;
+			case CR_ADDENV | CR_SWL:
+				coreAdd (xp, ep, ys, yv, yp, n, gs, ds, gv, dv, gp, dp, 1, 1, 0, 0);
+				break;
+			case CR_ADDENV | CR_VIB:
+				coreAdd (xp, ep, ys, yv, yp, n, gs, ds, gv, dv, gp, dp, 1, 0, 1, 0);
+				break;
+			case CR_ADDENV | CR_PRC:
+				coreAdd (xp, ep, ys, yv, yp, n, gs, ds, gv, dv, gp, dp, 1, 0, 0, 1);
+				break;
+			case CR_ADDENV | CR_SWL | CR_VIB:
+				coreAdd (xp, ep, ys, yv, yp, n, gs, ds, gv, dv, gp, dp, 1, 1, 1, 0);
+				break;
+			case CR_ADDENV | CR_SWL | CR_PRC:
+				coreAdd (xp, ep, ys, yv, yp, n, gs, ds, gv, dv, gp, dp, 1, 1, 0, 1);
+				break;
+			case CR_ADDENV | CR_VIB | CR_PRC:
+				coreAdd (xp, ep, ys, yv, yp, n, gs, ds, gv, dv, gp, dp, 1, 0, 1, 1);
+				break;
+			case CR_ADDENV | CR_BUSES:
+				coreAdd (xp, ep, ys, yv, yp, n, gs, ds, gv, dv, gp, dp, 1, 1, 1, 1);
+				break;
+			case CR_ADD:
+			case CR_ADDENV:
+				break; /* Silent, nothing to add */
+			default: /* CPY and CPYENV initialize all three buses */
+				if (opr & CR_CPYENV) {
+					for (; 0 < n; n--) {
+						const float x = (float)(*xp++);
+						const float e = *ep++;
+						*ys++         = x * (gs + (e * ds));
+						*yv++         = x * (gv + (e * dv));
+						*yp++         = x * (gp + (e * dp));
+					}
+				} else {
+					for (; 0 < n; n--) {
+						const float x = (float)(*xp++);
+						*ys++         = x * gs;
+						*yv++         = x * gv;
+						*yp++         = x * gp;
+					}
 				}
-			}
+				break;
 		}
 	} /* while there are core instructions */
 
@@ -3448,15 +4241,14 @@ oscGenerateFragment (struct b_tonegen* t, float* buf, size_t lengthSamples)
    */
 
 	/* If anything is routed through the scanner, apply FX and get outbuffer */
+	/* (and skip the scanner once both its input and delay line are silent) */
 
 	if (t->oldRouting & RT_VIB) {
-#if 1
-		vibratoProc (&t->inst_vibrato, vibBuffer, vibYBuffr, BUFFER_SIZE_SAMPLES);
-#else
-		size_t ii;
-		for (ii               = 0; ii < BUFFER_SIZE_SAMPLES; ++ii)
-			vibYBuffr[ii] = 0.0;
-#endif
+		if (tgtAny & CR_VIB) {
+			vibratoProc (&t->inst_vibrato, vibBuffer, vibYBuffr, BUFFER_SIZE_SAMPLES);
+		} else {
+			vibOutput = vibratoProcSilence (&t->inst_vibrato, vibBuffer, vibYBuffr, BUFFER_SIZE_SAMPLES);
+		}
 	}
 
 	/* Mix buffers, applying percussion and swell pedal. */
@@ -3466,6 +4258,9 @@ oscGenerateFragment (struct b_tonegen* t, float* buf, size_t lengthSamples)
 		const float* vp = vibYBuffr;
 		const float* pp = prcBuffer;
 
+		float       swell  = t->swellPedalGain;
+		const float dswell = paramRampIncrement (&t->swellPedalGain, t->swellPedalGainTarget, BUFFER_SIZE_SAMPLES, t->SampleRateD);
+
 		if (t->oldRouting & RT_PERC) { /* If percussion is on */
 #ifdef HIPASS_PERCUSSION
 			float* tp   = &(prcBuffer[BUFFER_SIZE_SAMPLES - 1]);
@@ -3480,35 +4275,40 @@ oscGenerateFragment (struct b_tonegen* t, float* buf, size_t lengthSamples)
 			t->pz = temp;
 			pp    = prcBuffer;
 #endif /* HIPASS_PERCUSSION */
-			t->outputGain = t->swellPedalGain * t->percDrawbarGain;
-			if (t->oldRouting & RT_VIB) {                       /* If vibrato is on */
+			const float pgain = t->percDrawbarGain;
+			if (vibOutput) {                                    /* If vibrato is on */
 				for (i = 0; i < BUFFER_SIZE_SAMPLES; i++) { /* Perc and vibrato */
 					*yptr++ =
-					    (t->outputGain * KEYCOMPLEVEL *
+					    (swell * pgain * KEYCOMPLEVEL *
 					     ((*xp++) + (*vp++) + ((*pp++) * t->percEnvGain)));
 					t->percEnvGain *= t->percEnvGainDecay;
+					swell += dswell;
 					KEYCOMPCHASE ();
 				}
 			} else { /* Percussion only */
 				for (i = 0; i < BUFFER_SIZE_SAMPLES; i++) {
 					*yptr++ =
-					    (t->outputGain * KEYCOMPLEVEL * ((*xp++) + ((*pp++) * t->percEnvGain)));
+					    (swell * pgain * KEYCOMPLEVEL * ((*xp++) + ((*pp++) * t->percEnvGain)));
 					t->percEnvGain *= t->percEnvGainDecay;
+					swell += dswell;
 					KEYCOMPCHASE ();
 				}
 			}
+			t->outputGain = t->swellPedalGain * pgain;
 
-		} else if (t->oldRouting & RT_VIB) { /* No percussion and vibrato */
+		} else if (vibOutput) { /* No percussion and vibrato */
 
 			for (i = 0; i < BUFFER_SIZE_SAMPLES; i++) {
 				*yptr++ =
-				    (t->swellPedalGain * KEYCOMPLEVEL * ((*xp++) + (*vp++)));
+				    (swell * KEYCOMPLEVEL * ((*xp++) + (*vp++)));
+				swell += dswell;
 				KEYCOMPCHASE ();
 			}
 		} else { /* No percussion and no vibrato */
 			for (i = 0; i < BUFFER_SIZE_SAMPLES; i++) {
 				*yptr++ =
-				    (t->swellPedalGain * KEYCOMPLEVEL * (*xp++));
+				    (swell * KEYCOMPLEVEL * (*xp++));
+				swell += dswell;
 				KEYCOMPCHASE ();
 			}
 		}
@@ -3520,11 +4320,14 @@ oscGenerateFragment (struct b_tonegen* t, float* buf, size_t lengthSamples)
 } /* oscGenerateFragment */
 
 struct b_tonegen*
-allocTonegen ()
+allocTonegen (void* arena, double rate)
 {
-	struct b_tonegen* t = (struct b_tonegen*)calloc (1, sizeof (struct b_tonegen));
+	struct b_tonegen* t = (struct b_tonegen*)arenaAlloc (arena, sizeof (struct b_tonegen));
 	if (!t)
 		return NULL;
+	t->arena                    = arena;
+	t->SampleRateD              = rate;
+	t->inst_vibrato.SampleRateD = rate;
 	initValues (t);
 	resetVibrato (t);
 	return (t);
@@ -3542,6 +4345,8 @@ static const ConfigDoc doc[] = {
 	{ "osc.tuning", CFG_DOUBLE, "440.0", "Base tuning of the organ.", "Hz", 220.0, 880.0, .5 },
 	{ "osc.temperament", CFG_TEXT, "\"gear60\"", "Tuning temperament, gear-ratios/motor-speed. One of: \"equal\", \"gear60\", \"gear50\"", "", 0, 2, 1 },
 	{ "osc.x-precision", CFG_DOUBLE, "0.001", "Wave precision. Maximum allowed error when calculating wave buffer-length for a given frequency (ideal #of samples - discrete #of samples)", INCOMPLETE_DOC },
+	{ "osc.x-memory-budget", CFG_DOUBLE, "0", "Memory budget in MiB for the wave buffers of all tonewheels. When the buffers that meet osc.x-precision do not fit, the shorter and less accurately tuned loops are picked where they cost the least pitch error. 0 means no limit.", "MiB", 0, 16, 0.25 },
+	{ "osc.x-phase-accumulator", CFG_INT, "0", "If set to 1, the tonewheels are played by phase accumulators from shared single-cycle tables instead of from precomputed loops. The tuning is exact, osc.tuning can be changed while playing, and the wave memory shrinks to a few tens of KB.", "", 0, 1, 1 },
 	{ "osc.perc.fast", CFG_DOUBLE, "1.0", "Fast percussion decay time", "s", 0, 10.0, 0.1 },
 	{ "osc.perc.slow", CFG_DOUBLE, "4.0", "Slow percussion decay time", "s", 0, 10.0, 0.1 },
 	{ "osc.perc.normal", CFG_DECIBEL, "1.0", "Percussion starting gain of the envelope for normal volume.", "dB", 0, 1, 2.0 },
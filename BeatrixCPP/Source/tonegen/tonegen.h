@@ -32,6 +32,8 @@ extern "C" {
 #define M_PI 3.14159265358979323846 /* pi */
 #endif
 
+#include <stdint.h>
+
 #include "cfgParser.h"
 #include "vibrato.h"
 
@@ -101,18 +103,15 @@ typedef struct deflist_element {
 
 /**
  * Active oscillator table element.
+ * Only the fields that are read for every sounding wheel in every
+ * fragment are kept here, four elements fit in a cache line. The
+ * wheel to bus levels and the per manual sums are in b_tonegen.
  */
 typedef struct aot_element {
-	float        busLevel[NOF_BUSES]; /* The signal level from wheel to bus  */
-	int          keyCount[NOF_BUSES]; /* The nof keys adding up the level */
-	int          refCount;            /* Reference count */
-	float        sumUpper;            /* The sum of the upper manual buses */
-	float        sumLower;            /* The sum of the lower manual buses */
-	float        sumPedal;            /* The sum of the pedal buses */
-	float        sumPercn;            /* The amount routed to percussion */
-	float        sumSwell;            /* The sum of U, L and P routed to swell */
-	float        sumScanr;            /* The sum of U, L and P routed to scanner */
-	unsigned int flags;               /* House-holding bits */
+	float sumSwell; /* The sum of U, L and P routed to swell */
+	float sumScanr; /* The sum of U, L and P routed to scanner */
+	float sumPercn; /* The amount routed to percussion */
+	int   refCount; /* Reference count */
 } AOTElement;
 
 /**
@@ -138,20 +137,42 @@ typedef struct _coreins {
 /**
  * There is one oscillator struct for each frequency.
  * The wave pointer points to a 16-bit PCM loop which contains the fundamental
- * frequency and harmonics of the tonewheel.
+ * frequency and harmonics of the tonewheel. With the phase accumulator
+ * oscillators, it points to a shared single-cycle table instead, which is
+ * read at the rate given by phaseInc.
  */
 struct _oscillator {
 	float* wave; /**< Pointer to tonewheel 'sample' */
 
 	size_t lengthSamples; /**< Nof samples in wave */
-	double frequency;     /**< The frequency (Hertz) */
-	double attenuation;   /**< Signal level (0.0 -- 1.0) */
 	size_t pos;           /**< Read position */
 
+	uint32_t phase;    /**< Phase accumulator, a full turn is 2^32 */
+	uint32_t phaseInc; /**< Phase increment per sample */
+	float    gain;     /**< Level applied to the single-cycle table */
+
 	int            aclPos; /**< Position in active list */
 	unsigned short rflags; /**< Rendering flags */
 };
 
+/**
+ * The size of the single-cycle tables read by the phase accumulator
+ * oscillators. Each table has one extra sample, a copy of the first, so
+ * that the interpolation never needs to wrap.
+ */
+#define PHASE_TABLE_BITS 11
+#define PHASE_TABLE_SIZE (1 << PHASE_TABLE_BITS)
+
+/**
+ * The parameters that a tonewheel's wave is computed from. They are only
+ * used while the oscillators are initialized or retuned, and are kept apart
+ * from the struct _oscillator array that is walked while rendering.
+ */
+struct _oscdesign {
+	double frequency;   /**< The frequency (Hertz) */
+	double attenuation; /**< Signal level (0.0 -- 1.0) */
+};
+
 /**
  * A matrix of these structs is used in the initialization stage.
  * The matrix is indexed by MIDI note nr and bus number. Each element
@@ -181,6 +202,12 @@ typedef struct _connection {
 } Connection, *ConnectionPtr;
 
 struct b_tonegen {
+	/** Where the memory of this tone generator comes from, see arenaAlloc() */
+	void* arena;
+
+	/** The sample rate, set by allocTonegen() */
+	double SampleRateD;
+
 	/**
  * The leConfig pointer points to ListElements allocated during config.
  * The referenced memory is released once config is complete.
@@ -200,6 +227,21 @@ struct b_tonegen {
  */
 	AOTElement aot[NOF_WHEELS + 1];
 
+	/**
+ * The signal level from each wheel to each bus. There is one row per
+ * bus, indexed by wheel, so that a drawbar change is applied to the sums
+ * below by a single pass over one row.
+ */
+	float aotBusLevel[NOF_BUSES][NOF_WHEELS + 1];
+
+	/**
+ * For each wheel, the sum of its bus levels times the drawbar gains in
+ * drawBarGainApplied[], per manual.
+ */
+	float aotSumUpper[NOF_WHEELS + 1];
+	float aotSumLower[NOF_WHEELS + 1];
+	float aotSumPedal[NOF_WHEELS + 1];
+
 	/**
  * The numbers of sounding oscillators/wheels are placed on this list.
  */
@@ -275,9 +317,11 @@ struct b_tonegen {
 	unsigned int upperKeyCount;
 
 	/**
- * Swell pedal (volume control)
+ * Swell pedal (volume control). swellPedalGain is the smoothed gain
+ * applied during mixdown, it follows swellPedalGainTarget.
  */
 	float swellPedalGain;
+	float swellPedalGainTarget;
 
 	/**
  * Output level trim. Used to trim the overall output level.
@@ -289,6 +333,12 @@ struct b_tonegen {
  */
 	double tuning;
 
+	/**
+ * Set by setTuning() once the phase accumulator oscillators run, so that
+ * the next fragment picks up the new tuning.
+ */
+	int tuningChange; /**< Accessed atomically */
+
 	/**
  * When gearTuning is FALSE, the tuning is equal-tempered.
  * When TRUE, the tuning is based on the integer ratio approximations found
@@ -301,6 +351,15 @@ struct b_tonegen {
  * Not all of these are used.
  */
 	struct _oscillator oscillators[NOF_WHEELS + 1];
+	struct _oscdesign  oscDesign[NOF_WHEELS + 1];
+
+	/**
+ * Optional tone generator whose wave buffers are borrowed, read-only,
+ * by initOscillators() instead of computing new ones. It must have been
+ * initialized at the same sample rate and must outlive this instance.
+ * See setToneGeneratorWaveSource().
+ */
+	const struct b_tonegen* waveSource;
 
 	/*
  * Vector of active keys, used to correctly manage
@@ -328,11 +387,25 @@ struct b_tonegen {
 	float drawBarLevel[NOF_BUSES][9];
 
 	/**
- * The drawBarChange flag is set by the routine that effectuates a drawbar
- * change. The oscGenerateFragment routine then checks the flag, computes
- * new composed gain values, and resets the flag.
+ * The drawBarChange mask has a bit set, (1 << bus), for each drawbar
+ * whose gain has been changed. The oscGenerateFragment routine then adds
+ * the difference to the per manual sums of the wheels, and resets the mask.
+ * Setters and oscGenerateFragment run on different threads, so the mask
+ * is only changed with atomic operations.
+ */
+	unsigned int drawBarChange;
+
+	/**
+ * Number of bus updates added to the manual sums since they were last
+ * computed from scratch. Only used by oscGenerateFragment.
+ */
+	unsigned int drawBarUpdates;
+
+	/**
+ * The drawbar gains that the per manual sums were computed with.
+ * Only used by oscGenerateFragment.
  */
-	unsigned short drawBarChange;
+	float drawBarGainApplied[NOF_BUSES];
 
 	/**
  * True when percussion is enabled.
@@ -446,6 +519,23 @@ struct b_tonegen {
  */
 	double tgPrecision;
 
+	/**
+ * Upper bound, in bytes, for the wave buffers of all wheels together.
+ * Zero means no limit. See planWaveLengths().
+ */
+	size_t tgMemoryBudget;
+
+	/**
+ * When set, the wheels are played by phase accumulators that read shared
+ * single-cycle tables, instead of from precomputed loops. The tuning is
+ * then exact and setTuning() takes effect immediately.
+ */
+	int    oscPhaseMode;
+	int    nofPhaseTables;
+	float* phaseTables; /**< nofPhaseTables * (PHASE_TABLE_SIZE + 1) samples */
+	int*   phaseTableOf; /**< Table of each wheel by its number of partials below Nyquist */
+	float* phaseBuffer; /**< The current fragment of each wheel, in phase mode */
+
 	int    eqMacro;
 	double eqvCeiling;  /**< Normalizing manual osc eq. */
 	double eqvAtt[128]; /**< Values from config file */
@@ -536,6 +626,17 @@ struct b_tonegen {
  */
 	ListElement* keyContrib[MAX_KEYS];
 
+	/**
+ * The keyContrib lists in compressed sparse row form, built from them by
+ * compileKeyContrib(). The contributions of key k are the entries from
+ * keyContribStart[k] up to keyContribStart[k + 1], sorted on wheel and
+ * then on bus. The three arrays share one allocation.
+ */
+	int            keyContribStart[MAX_KEYS + 1];
+	unsigned char* keyContribWheel;
+	unsigned char* keyContribBus;
+	float*         keyContribLevel;
+
 	unsigned short removedList[NOF_WHEELS + 1];
 	float          swlBuffer[BUFFER_SIZE_SAMPLES];
 	float          vibBuffer[BUFFER_SIZE_SAMPLES];
@@ -559,6 +660,8 @@ struct b_tonegen {
 
 extern void setToneGeneratorModel (struct b_tonegen* t, int variant);
 extern void setWavePrecision (struct b_tonegen* t, double precision);
+extern void setWaveMemoryBudget (struct b_tonegen* t, double mebibytes);
+extern void setToneGeneratorWaveSource (struct b_tonegen* t, const struct b_tonegen* src);
 extern void setTuning (struct b_tonegen* t, double refA_Hz);
 extern void setVibratoUpper (struct b_tonegen* t, int isEnabled);
 extern void setVibratoLower (struct b_tonegen* t, int isEnabled);
@@ -580,13 +683,15 @@ extern int oscConfig (struct b_tonegen* t, ConfigContext* cfg);
 extern const ConfigDoc* oscDoc ();
 extern void initToneGenerator (struct b_tonegen* t, void* m);
 extern void freeToneGenerator (struct b_tonegen* t);
+extern void transferToneGeneratorState (struct b_tonegen* t, const struct b_tonegen* src);
+extern void resetToneGenerator (struct b_tonegen* t);
 
 extern void oscKeyOff (struct b_tonegen* t, unsigned char midiNote, unsigned char realKey);
 extern void oscKeyOn (struct b_tonegen* t, unsigned char midiNote, unsigned char realKey);
 extern void setDrawBars (void* inst, unsigned int manual, unsigned int setting[]);
 extern void oscGenerateFragment (struct b_tonegen* t, float* buf, size_t lengthSamples);
 
-struct b_tonegen* allocTonegen ();
+struct b_tonegen* allocTonegen (void* arena, double rate);
 
 #ifdef __cplusplus
 }
@@ -26,6 +26,7 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "cfgParser.h"
 #include "midi.h"
@@ -75,14 +76,14 @@
  * Sets the scanner frequency. It operates at a fixed frequency beacuse
  * it is driven from the tonegenerator motor which runs at a steady 1200
  * or 1500 rpm (50 Hz models). The usual frequency is somewhere between
- * 7 or 8 Hz.
+ * 7 or 8 Hz. Once running, vibratoProc glides to the new frequency.
  */
 static void
 setScannerFrequency (struct b_vibrato* v, double Hertz)
 {
     v->vibFqHertz = Hertz;
 	v->statorIncrement =
-        (unsigned int)(((v->vibFqHertz * INCTBL_SIZE) / SampleRateD) * 65536.0);
+        (unsigned int)(((v->vibFqHertz * INCTBL_SIZE) / v->SampleRateD) * 65536.0);
 }
 
 /*
@@ -262,11 +263,13 @@ initIncrementTables (struct b_vibrato* v)
 void
 reset_vibrato (struct b_vibrato* v)
 {
-	v->offsetTable     = v->offset3Table;
-	v->stator          = 0;
-	v->statorIncrement = 0;
+	v->offsetTable      = v->offset3Table;
+	v->stator           = 0;
+	v->statorIncrement  = 0;
+	v->statorIncrementZ = 0;
 
-	v->outPos = BUF_MASK_SAMPLES / 2;
+	v->outPos        = BUF_MASK_SAMPLES / 2;
+	v->silentSamples = 0;
 
 	v->vib1OffAmp = 3.0;
 	v->vib2OffAmp = 6.0;
@@ -278,6 +281,31 @@ reset_vibrato (struct b_vibrato* v)
 	v->effectEnabled = FALSE;
 }
 
+/*
+ * Takes over the vibrato selection, scanner position and delay line of
+ * another vibrato, so that the output continues seamlessly. The modulation
+ * depths and the scanner frequency stay the configured ones of v, the
+ * scanner glides to that frequency.
+ */
+void
+copy_vibrato (struct b_vibrato* v, const struct b_vibrato* src)
+{
+	v->stator           = src->stator;
+	v->statorIncrementZ = src->statorIncrementZ;
+	v->outPos           = src->outPos;
+	memcpy (v->vibBuffer, src->vibBuffer, sizeof (v->vibBuffer));
+	v->silentSamples = src->silentSamples;
+	v->mixedBuffers  = src->mixedBuffers;
+	v->effectEnabled = src->effectEnabled;
+	if (src->offsetTable == src->offset1Table) {
+		v->offsetTable = v->offset1Table;
+	} else if (src->offsetTable == src->offset2Table) {
+		v->offsetTable = v->offset2Table;
+	} else {
+		v->offsetTable = v->offset3Table;
+	}
+}
+
 void
 resetVibrato (void* t)
 {
@@ -285,10 +313,32 @@ resetVibrato (void* t)
 	reset_vibrato (v);
 }
 
+/*
+ * Empties the delay line and returns the scanner to its start position,
+ * the settings are kept.
+ */
+void
+clear_vibrato (struct b_vibrato* v)
+{
+	memset (v->vibBuffer, 0, sizeof (v->vibBuffer));
+	v->stator           = 0;
+	v->statorIncrementZ = v->statorIncrement;
+	v->outPos           = BUF_MASK_SAMPLES / 2;
+	v->silentSamples    = 0;
+}
+
+void
+clearVibrato (void* t)
+{
+	struct b_vibrato* v = &(((struct b_tonegen*)t)->inst_vibrato);
+	clear_vibrato (v);
+}
+
 void
 init_vibrato (struct b_vibrato* v)
 {
     setScannerFrequency (v, v->vibFqHertz);
+	v->statorIncrementZ = v->statorIncrement;
 	initIncrementTables (v);
     set_vibrato (v, 0);
 }
@@ -311,6 +361,15 @@ setVibrato (void* t, int select)
     set_vibrato(v, select);
 }
 
+void
+setVibratoFrequency (void* t, double Hertz)
+{
+	struct b_vibrato* v = &(((struct b_tonegen*)t)->inst_vibrato);
+	if (4.0 <= Hertz && Hertz <= 22.0) {
+		setScannerFrequency (v, Hertz);
+	}
+}
+
 
 /*
  * Configuration interface.
@@ -342,53 +401,154 @@ scannerConfig (void* t, ConfigContext* cfg)
 	return ack;
 } /* scannerConfig */
 
+/*
+ * Advances the gliding stator increment by n samples and returns the
+ * per-sample step. The increment is applied rounded to an integer, so
+ * it snaps to the target once it is within half a step of it; a float
+ * near 2e4 can not get closer than a few thousandths, and the integer
+ * fast path would otherwise never resume.
+ */
+static inline float
+statorRampIncrement (struct b_vibrato* v, unsigned int n)
+{
+	const float target = (float)v->statorIncrement;
+	const float dinc   = paramRampIncrement (&v->statorIncrementZ, target, n, v->SampleRateD);
+	if (fabsf (target - v->statorIncrementZ) < .5f) {
+		v->statorIncrementZ = target;
+	}
+	return dinc;
+}
+
+/*
+ * Adds one input sample to the delay buffer at the writing position,
+ * which is relative to the reading position pos.
+ */
+static inline void
+vibratoWriteSample (float* const buf, const unsigned int* offsets, const float x, unsigned int pos, unsigned int stator)
+{
+	const float        fnorm = 1.0 / 65536.0;
+	const unsigned int j     = ((pos << 16) + offsets[stator >> 16]) & BUF_MASK_POSN;
+	const unsigned int h     = j >> 16;
+	const float        g     = fnorm * ((float)(j & 0xFFFF)) * x;
+
+	buf[h] += x - g;
+	buf[(h + 1) & BUF_MASK_SAMPLES] += g;
+}
+
 /*
  * Floating-point version of vibrato scanner.
  * Since this is a variable delay, delayed samples take a rest in vibBuffer
  * between calls to this function.
+ *
+ * The work is done in blocks of up to VIB_BLOCK samples: first the whole
+ * block is written to the delay buffer, then the output is read, and
+ * cleared, in at most two contiguous runs. Every offset in the tables is
+ * at least one sample, so a write never lands at or behind the reading
+ * position of the same block, and as a block is much shorter than the
+ * delay buffer the two passes give the same result as interleaving them.
  */
-void
-vibratoProc (struct b_vibrato* v, float const* inbuffer, float* outbuffer, size_t bufferLengthSamples)
+#define VIB_BLOCK 64
+
+static void
+vibratoRun (struct b_vibrato* v, float const* inbuffer, float* outbuffer, size_t bufferLengthSamples)
 {
-	const float  fnorm   = 1.0 / 65536.0;
 	const float  mixnorm = 0.7071067811865475; /* 1/sqrt(2) */
-	unsigned int i;
-	float const* xp = inbuffer;
-	float*       yp = outbuffer;
-
-	for (i = 0; i < bufferLengthSamples; i++) {
-		/* Fetch the next input sample */
-		const float x = *xp++;
-		/* Determine the fixed point writing position. This is relative to */
-		/* the current output position (outpos). */
-		const unsigned int j =
-		    ((v->outPos << 16) + v->offsetTable[v->stator >> 16]) & BUF_MASK_POSN;
-		/* Convert fixpoint writing position to integer sample */
-		const int h = j >> 16;
-		/* And the following sample, possibly wrapping the delay buffer. */
-		const int k = (h + 1) & BUF_MASK_SAMPLES;
-		/* Drop the integer part of the fixpoint position. */
-		const float f = fnorm * ((float)(j & 0xFFFF));
-		/* Amplify incoming sample and normalise */
-		const float g = f * x;
-
-		/* Write to delay buffer */
-		v->vibBuffer[h] += x - g;
-		v->vibBuffer[k] += g;
-
-		if (v->mixedBuffers) {
-			*yp++ = (x + v->vibBuffer[v->outPos]) * mixnorm;
+	float* const buf     = v->vibBuffer;
+
+	while (bufferLengthSamples > 0) {
+		const unsigned int  n       = MIN (bufferLengthSamples, VIB_BLOCK);
+		const unsigned int* offsets = v->offsetTable;
+		unsigned int        outPos  = v->outPos;
+		unsigned int        stator  = v->stator;
+		unsigned int        i;
+
+		/* Write. The increment glides to a changed scanner frequency. */
+		if (v->statorIncrementZ == (float)v->statorIncrement) {
+			const unsigned int inc = v->statorIncrement;
+			for (i = 0; i < n; i++) {
+				vibratoWriteSample (buf, offsets, inbuffer[i], outPos + i, stator);
+				stator = (stator + inc) & INCTBL_MASK;
+			}
 		} else {
-			*yp++ = v->vibBuffer[v->outPos];
+			float       inc  = v->statorIncrementZ;
+			const float dinc = statorRampIncrement (v, n);
+			for (i = 0; i < n; i++) {
+				vibratoWriteSample (buf, offsets, inbuffer[i], outPos + i, stator);
+				stator = (stator + (unsigned int)lrintf (inc)) & INCTBL_MASK;
+				inc += dinc;
+			}
+		}
+		v->stator = stator;
+
+		/* Read and clear */
+		for (i = 0; i < n;) {
+			const unsigned int run = MIN (n - i, BUF_SIZE_BYTES - outPos);
+			float*             yb  = &buf[outPos];
+			unsigned int       r;
+			if (v->mixedBuffers) {
+				for (r = 0; r < run; r++) {
+					outbuffer[i + r] = (inbuffer[i + r] + yb[r]) * mixnorm;
+				}
+			} else {
+				for (r = 0; r < run; r++) {
+					outbuffer[i + r] = yb[r];
+				}
+			}
+			memset (yb, 0, run * sizeof (float));
+			outPos = (outPos + run) & BUF_MASK_SAMPLES;
+			i += run;
 		}
+		v->outPos = outPos;
+
+		inbuffer += n;
+		outbuffer += n;
+		bufferLengthSamples -= n;
+	}
+}
 
-		/* Zero delay buffer at the reading position. */
-		v->vibBuffer[v->outPos] = 0;
-		/* Update the reading position, wrapping back to start if needed. */
-		v->outPos = (v->outPos + 1) & BUF_MASK_SAMPLES;
-		/* Update the delay amount index. */
-		v->stator = (v->stator + v->statorIncrement) & INCTBL_MASK;
+void
+vibratoProc (struct b_vibrato* v, float const* inbuffer, float* outbuffer, size_t bufferLengthSamples)
+{
+	v->silentSamples = 0;
+	vibratoRun (v, inbuffer, outbuffer, bufferLengthSamples);
+}
+
+/*
+ * Same as vibratoProc, for a block of input that is known to be all zero.
+ * Once the input has been silent for the length of the delay buffer,
+ * every slot of it has been read and cleared, so the output is silent
+ * as well. From then on only the reading position and the stator move
+ * on, exactly as they would when processing the block.
+ * @returns  1 if outbuffer was written, 0 if the output is silent and
+ *           outbuffer was left untouched.
+ */
+int
+vibratoProcSilence (struct b_vibrato* v, float const* zeros, float* outbuffer, size_t bufferLengthSamples)
+{
+	if (v->silentSamples < BUF_SIZE_BYTES) {
+		vibratoRun (v, zeros, outbuffer, bufferLengthSamples);
+		v->silentSamples += bufferLengthSamples;
+		return 1;
+	}
+
+	v->outPos = (v->outPos + bufferLengthSamples) & BUF_MASK_SAMPLES;
+
+	while (bufferLengthSamples > 0) {
+		const unsigned int n = MIN (bufferLengthSamples, VIB_BLOCK);
+		unsigned int       i;
+		if (v->statorIncrementZ == (float)v->statorIncrement) {
+			v->stator = (v->stator + n * v->statorIncrement) & INCTBL_MASK;
+		} else {
+			float       inc  = v->statorIncrementZ;
+			const float dinc = statorRampIncrement (v, n);
+			for (i = 0; i < n; i++) {
+				v->stator = (v->stator + (unsigned int)lrintf (inc)) & INCTBL_MASK;
+				inc += dinc;
+			}
+		}
+		bufferLengthSamples -= n;
 	}
+	return 0;
 }
 
 #else
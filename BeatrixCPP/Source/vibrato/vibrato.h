@@ -40,6 +40,8 @@ extern "C" {
 #define BUF_SIZE_BYTES 1024
 
 struct b_vibrato {
+	double SampleRateD; /**< set with the tone generator's, see allocTonegen() */
+
 	unsigned int offset1Table[INCTBL_SIZE];
 	unsigned int offset2Table[INCTBL_SIZE];
 	unsigned int offset3Table[INCTBL_SIZE];
@@ -48,10 +50,12 @@ struct b_vibrato {
 
 	unsigned int stator;
 	unsigned int statorIncrement;
+	float        statorIncrementZ; /**< smoothed statorIncrement, used by vibratoProc */
 
 	unsigned int outPos;
 
-	float vibBuffer[BUF_SIZE_BYTES];
+	float  vibBuffer[BUF_SIZE_BYTES];
+	size_t silentSamples; /**< samples of silent input since the last sound */
 
 	/*
  * Amplitudes of phase shift for the three vibrato settings.
@@ -68,15 +72,20 @@ struct b_vibrato {
 };
 
 extern void vibratoProc (struct b_vibrato* v, float const* inbuffer, float* outbuffer, size_t bufferLengthSamples);
+extern int vibratoProcSilence (struct b_vibrato* v, float const* zeros, float* outbuffer, size_t bufferLengthSamples);
 
 /* for standalone use */
 extern void reset_vibrato (struct b_vibrato* v);
 extern void init_vibrato (struct b_vibrato* v);
+extern void copy_vibrato (struct b_vibrato* v, const struct b_vibrato* src);
+extern void clear_vibrato (struct b_vibrato* v);
 
 /* tonegen integration */
 extern void resetVibrato (void* tonegen);
+extern void clearVibrato (void* tonegen);
 extern void initVibrato (void* tonegen, void* m);
 extern void setVibrato (void* t, int select);
+extern void setVibratoFrequency (void* t, double Hertz);
 
 extern int scannerConfig (void* t, ConfigContext* cfg);
 extern const ConfigDoc* scannerDoc ();
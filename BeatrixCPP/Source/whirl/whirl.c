@@ -32,6 +32,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "arena.h"
 #include "eqcomp.h"
 #include "whirl.h"
 
@@ -134,11 +135,12 @@ initValues (struct b_whirl* w)
 }
 
 struct b_whirl*
-allocWhirl ()
+allocWhirl (void* arena)
 {
-	struct b_whirl* w = (struct b_whirl*)calloc (1, sizeof (struct b_whirl));
+	struct b_whirl* w = (struct b_whirl*)arenaAlloc (arena, sizeof (struct b_whirl));
 	if (!w)
 		return NULL;
+	w->arena = arena;
 	initValues (w);
 	return (w);
 }
@@ -146,7 +148,7 @@ allocWhirl ()
 void
 freeWhirl (struct b_whirl* w)
 {
-	free (w);
+	arenaFree (w->arena, w);
 }
 
 static void
@@ -1008,6 +1010,41 @@ initWhirl (struct b_whirl* w, void* m, double rate)
 	computeRotationSpeeds (w);
 }
 
+/*
+ * Empties the delay lines and filters, and stops the rotors at their
+ * start position, from where they speed up to the selected speed again.
+ * The settings are kept.
+ */
+void
+resetWhirl (struct b_whirl* w)
+{
+	unsigned int i;
+	for (i          = 0; i < 4; ++i)
+		w->z[i] = 0;
+
+	w->drfL[z0] = w->drfL[z1] = 0;
+	w->drfR[z0] = w->drfR[z1] = 0;
+	w->hafw[z0] = w->hafw[z1] = 0;
+	w->hbfw[z0] = w->hbfw[z1] = 0;
+#ifdef HORN_COMB_FILTER
+	memset (w->comb0, 0, sizeof (float) * COMB_SIZE);
+	memset (w->comb1, 0, sizeof (float) * COMB_SIZE);
+	w->cb0rp = &(w->comb0[COMB_SIZE - w->cb0dl]);
+	w->cb0wp = &(w->comb0[0]);
+	w->cb1rp = &(w->comb1[COMB_SIZE - w->cb1dl]);
+	w->cb1wp = &(w->comb1[0]);
+#endif
+
+	zeroBuffers (w);
+
+	w->hornAngleGRD = 0;
+	w->drumAngleGRD = 0;
+	w->hornIncr     = 0;
+	w->drumIncr     = 0;
+	w->hornAcDc     = (0 < w->hornTarget) ? 1 : 0;
+	w->drumAcDc     = (0 < w->drumTarget) ? 1 : 0;
+}
+
 /*
  * Configuration interface.
  */
@@ -1572,6 +1609,21 @@ void whirlProc3 (struct b_whirl *w,
                  float * tmpL, float * tmpR,
                  size_t bufferLengthSamples)
 {
+	whirlProc4(w, inbuffer, outL, outR, outL, outR, tmpL, tmpR, bufferLengthSamples);
+}
+
+/*
+ * Like whirlProc3, but also returns the horn and the drum before
+ * they are mixed by the microphone matrix, for separate outputs.
+ * The horn buffers may be the output buffers.
+ */
+void whirlProc4 (struct b_whirl *w,
+                 const float * inbuffer,
+                 float * outL, float * outR,
+                 float * hornL, float * hornR,
+                 float * drumL, float * drumR,
+                 size_t bufferLengthSamples)
+{
 
 	size_t i;
 	const float dll = w->drumMic_dll;
@@ -1585,14 +1637,15 @@ void whirlProc3 (struct b_whirl *w,
 
 	whirlProc2(w,
 	           inbuffer, NULL, NULL,
-	           outL, outR,
-	           tmpL, tmpR,
+	           hornL, hornR,
+	           drumL, drumR,
 	           bufferLengthSamples);
 
 	for (i = 0; i < bufferLengthSamples; ++i) {
-		const float tmp = outL[i];
-		outL[i] = outL[i] * hll + outR[i] * hlr + tmpL[i] * dll + tmpR[i] * dlr;
-		outR[i] = tmp     * hrl + outR[i] * hrr + tmpL[i] * drl + tmpR[i] * drr;
+		const float hl = hornL[i];
+		const float hr = hornR[i];
+		outL[i] = hl * hll + hr * hlr + drumL[i] * dll + drumR[i] * dlr;
+		outR[i] = hl * hrl + hr * hrr + drumL[i] * drl + drumR[i] * drr;
 	}
 }
 
@@ -62,6 +62,7 @@ struct _bw {
 };
 
 struct b_whirl {
+	void*  arena; ///< of this struct
 	double SampleRateD;
 	int    bypass;     ///< if set to 1 completely bypass this effect
 	double hnBrakePos; ///< where to stop horn - 0: free, 1.0: front-center, ]0..1] clockwise circle */
@@ -219,12 +220,13 @@ struct b_whirl {
 	void* midi_cfg_ptr;
 };
 
-extern struct b_whirl* allocWhirl ();
+extern struct b_whirl* allocWhirl (void* arena);
 extern void freeWhirl (struct b_whirl* w);
 extern int whirlConfig (struct b_whirl* w, ConfigContext* cfg);
 extern const ConfigDoc* whirlDoc ();
 
 extern void initWhirl (struct b_whirl* w, void* m, double rate);
+extern void resetWhirl (struct b_whirl* w);
 
 extern void whirlProc (struct b_whirl* w,
                        const float*    inbuffer,
@@ -245,6 +247,13 @@ extern void whirlProc3 (struct b_whirl* w,
                         float* tmpL, float* tmpR,
                         size_t bufferLengthSamples);
 
+extern void whirlProc4 (struct b_whirl* w,
+                        const float*    inbuffer,
+                        float* outL, float* outR,
+                        float* hornL, float* hornR,
+                        float* drumL, float* drumR,
+                        size_t bufferLengthSamples);
+
 /* match revselects[] */
 #define WHIRL_FAST 2
 #define WHIRL_SLOW 0
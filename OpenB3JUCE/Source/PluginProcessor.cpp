@@ -21,6 +21,17 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "PluginProcessor.h"
 #include "PluginEditor.h"
 
+// Programmes, running config, MIDI mapping and rotor positions of an engine
+static juce::MemoryBlock snapshotOf (Beatrix& engine)
+{
+    juce::MemoryBlock snapshot (engine.write_snapshot (nullptr, 0));
+    size_t size;
+    while ((size = engine.write_snapshot (snapshot.getData(), snapshot.getSize())) > snapshot.getSize())
+        snapshot.setSize (size);
+    snapshot.setSize (size);
+    return snapshot;
+}
+
 //==============================================================================
 OpenB3AudioProcessor::OpenB3AudioProcessor()
 #ifndef JucePlugin_PreferredChannelConfigurations
@@ -30,6 +41,9 @@ OpenB3AudioProcessor::OpenB3AudioProcessor()
                        .withInput  ("Input",  juce::AudioChannelSet::stereo(), true)
                       #endif
                        .withOutput ("Output", juce::AudioChannelSet::stereo(), true)
+                       .withOutput ("Horn",   juce::AudioChannelSet::stereo(), false)
+                       .withOutput ("Drum",   juce::AudioChannelSet::stereo(), false)
+                       .withOutput ("Dry",    juce::AudioChannelSet::mono(),   false)
                      #endif
                        ), apvts(*this, nullptr, "Main parameters", createParameters())
 #endif
@@ -38,6 +52,12 @@ OpenB3AudioProcessor::OpenB3AudioProcessor()
 
 OpenB3AudioProcessor::~OpenB3AudioProcessor()
 {
+    rebuildPool.removeAllJobs (true, 10000);
+    cancelPendingUpdate();
+
+    delete pendingBeatrix.exchange (nullptr);
+    delete retiredBeatrix.exchange (nullptr);
+    delete beatrix.exchange (nullptr);
 }
 
 //==============================================================================
@@ -107,14 +127,69 @@ void OpenB3AudioProcessor::prepareToPlay (double sampleRate, int samplesPerBlock
 {
     // Use this method as the place to do any pre-playback
     // initialisation that you need..
-    beatrix = new Beatrix(sampleRate);
+    Beatrix* current = beatrix.load();
+
+    if (current == nullptr)
+    {
+        Beatrix* fresh = new Beatrix(sampleRate);
+        fresh->warmup();
+        const juce::ScopedLock sl (engineLock);
+        if (engineSnapshot.getSize() > 0)
+        {
+            fresh->read_snapshot (engineSnapshot.getData(), engineSnapshot.getSize());
+            engineSnapshot.reset();
+        }
+        beatrix = fresh;
+        return;
+    }
+
+    // Hosts call prepareToPlay for buffer size changes, transport and
+    // offline bounces, too. Only a new sample rate requires new tables.
+    if (current->get_sample_rate() == sampleRate)
+        return;
+
+    // The host does not call processBlock while prepareToPlay runs, so the
+    // state of the current engine is copied here and the rebuild only
+    // reads the copy, never the engine the audio thread renders with.
+    const juce::MemoryBlock snapshot (snapshotOf (*current));
+    rebuildPool.addJob ([this, sampleRate, snapshot]
+    {
+        Beatrix* fresh = new Beatrix(sampleRate);
+        fresh->warmup();
+        fresh->read_snapshot (snapshot.getData(), snapshot.getSize());
+        // Keys held down and the rotors are taken over at the swap, they
+        // have moved on since the copy was made
+        fresh->snapshot_restored = false;
+        delete pendingBeatrix.exchange (fresh);
+    });
 }
 
 void OpenB3AudioProcessor::releaseResources()
 {
     // When playback stops, you can use this as an opportunity to free up any
     // spare memory, etc.
-    delete beatrix;
+    // The engine is kept alive so that the next prepareToPlay is cheap.
+}
+
+void OpenB3AudioProcessor::handleAsyncUpdate()
+{
+    {
+        const juce::ScopedLock sl (engineLock);
+        delete retiredBeatrix.exchange (nullptr);
+    }
+
+    // The engine state was copied at 7-bit MIDI resolution and parameter
+    // changes may have reached the old engine during the rebuild.
+    pushParametersToEngine();
+}
+
+void OpenB3AudioProcessor::pushParametersToEngine()
+{
+    for (auto* parameter : getParameters())
+    {
+        if (auto* ranged = dynamic_cast<juce::RangedAudioParameter*> (parameter))
+            parameterChanged (ranged->paramID, ranged->convertFrom0to1 (ranged->getValue()));
+    }
 }
 
 #ifndef JucePlugin_PreferredChannelConfigurations
@@ -125,10 +200,21 @@ bool OpenB3AudioProcessor::isBusesLayoutSupported (const BusesLayout& layouts) c
     return true;
   #else
     // This is the place where you check if the layout is supported.
-    // In OpenB3, we only support stereo output.
+    // In OpenB3, we only support stereo output, plus the stems of the
+    // rotary speaker, each either disabled or in its own layout.
     if (layouts.getMainOutputChannelSet() != juce::AudioChannelSet::stereo())
         return false;
 
+    const juce::AudioChannelSet stems[] = { juce::AudioChannelSet::stereo(),   // horn
+                                            juce::AudioChannelSet::stereo(),   // drum
+                                            juce::AudioChannelSet::mono() };   // dry
+    for (int bus = hornBus; bus <= dryBus; ++bus)
+    {
+        const juce::AudioChannelSet set = layouts.getChannelSet (false, bus);
+        if (! set.isDisabled() && set != stems[bus - hornBus])
+            return false;
+    }
+
     // This checks if the input layout matches the output layout
    #if ! JucePlugin_IsSynth
     if (layouts.getMainOutputChannelSet() != layouts.getMainInputChannelSet())
@@ -144,6 +230,25 @@ void OpenB3AudioProcessor::processBlock (juce::AudioBuffer<float>& buffer, juce:
 {
     juce::ScopedNoDenormals noDenormals;
 
+    // Swap in an engine that was rebuilt for a new sample rate. The old
+    // engine is freed on the message thread, so wait until the previous
+    // one has been collected.
+    if (retiredBeatrix.load() == nullptr)
+    {
+        if (Beatrix* fresh = pendingBeatrix.exchange (nullptr))
+        {
+            Beatrix* old = beatrix.load();
+            // An engine restored from a saved state keeps its saved rotors
+            if (! fresh->snapshot_restored)
+                fresh->transfer_realtime_state_from(*old);
+            beatrix.store (fresh);
+            retiredBeatrix.store (old);
+            triggerAsyncUpdate();
+        }
+    }
+
+    Beatrix* engine = beatrix.load();
+
     // Process the MIDI messages coming from the keyboards and append them to the midi buffer
     keyboardState.processNextMidiBuffer (midiMessages, 0, buffer.getNumSamples(), true);
 
@@ -157,15 +262,40 @@ void OpenB3AudioProcessor::processBlock (juce::AudioBuffer<float>& buffer, juce:
         if(raw_message_size == 2 || raw_message_size == 3)
         {
             // Forward the current midi message to Beatrix
-            beatrix->process_midi_message(message.getRawData(), raw_message_size);
+            engine->process_midi_message(message.getRawData(), raw_message_size);
         }
     }
 
-    // Compute the next audio block
-    size_t samplesPerBlock = (size_t)buffer.getNumSamples();
-    float* outputChannelData_L = buffer.getWritePointer(0);
-    float* outputChannelData_R = buffer.getWritePointer(1);
-    beatrix->get_next_block(outputChannelData_L, outputChannelData_R, samplesPerBlock);
+    // Compute the next audio block, with the stems of the enabled buses
+    int samplesPerBlock = buffer.getNumSamples();
+    float* outputs[Beatrix::N_OUTPUTS] = {
+        getStemPointer (buffer, mainBus, 0), getStemPointer (buffer, mainBus, 1),
+        getStemPointer (buffer, hornBus, 0), getStemPointer (buffer, hornBus, 1),
+        getStemPointer (buffer, drumBus, 0), getStemPointer (buffer, drumBus, 1),
+        getStemPointer (buffer, dryBus, 0)
+    };
+    engine->get_next_block_stems(outputs, samplesPerBlock);
+
+    // Until the rebuilt engine is ready the old one keeps track of the
+    // key state, but its output is at the wrong pitch.
+    if (engine->get_sample_rate() != getSampleRate())
+        buffer.clear();
+}
+
+float* OpenB3AudioProcessor::getStemPointer (juce::AudioBuffer<float>& buffer, int bus, int channel)
+{
+    const auto* b = getBus (false, bus);
+    if (b == nullptr || ! b->isEnabled() || channel >= b->getNumberOfChannels())
+        return nullptr;
+    return buffer.getWritePointer (getChannelIndexInProcessBlockBuffer (false, bus, channel));
+}
+
+BeatrixStats OpenB3AudioProcessor::getEngineStats() const
+{
+    Beatrix* engine = beatrix.load();
+    if (engine == nullptr)
+        return BeatrixStats();
+    return engine->get_stats();
 }
 
 //==============================================================================
@@ -188,6 +318,16 @@ void OpenB3AudioProcessor::getStateInformation (juce::MemoryBlock& destData)
     auto state = apvts.copyState();
     std::unique_ptr<juce::XmlElement> xml (state.createXml());
     copyXmlToBinary(*xml, destData);
+
+    // The engine snapshot (programmes, running config, MIDI mapping and
+    // rotor positions) follows the XML. Hosts and older versions that only
+    // read the XML ignore it.
+    const juce::ScopedLock sl (engineLock);
+    if (Beatrix* engine = beatrix.load())
+    {
+        const juce::MemoryBlock snapshot (snapshotOf (*engine));
+        destData.append (snapshot.getData(), snapshot.getSize());
+    }
 }
 
 void OpenB3AudioProcessor::setStateInformation (const void* data, int sizeInBytes)
@@ -198,6 +338,39 @@ void OpenB3AudioProcessor::setStateInformation (const void* data, int sizeInByte
     if (xmlState.get() != nullptr)
         if(xmlState->hasTagName(apvts.state.getType()))
             apvts.replaceState(juce::ValueTree::fromXml(*xmlState));
+
+    // copyXmlToBinary writes a magic number, the string length and the
+    // zero-terminated string; an engine snapshot may follow.
+    if (xmlState.get() == nullptr || sizeInBytes < 8)
+        return;
+    const size_t xmlSize = 8 + (size_t) juce::ByteOrder::littleEndianInt (juce::addBytesToPointer (data, 4)) + 1;
+    if (xmlSize >= (size_t) sizeInBytes)
+        return;
+
+    juce::MemoryBlock snapshot (juce::addBytesToPointer (data, xmlSize), (size_t) sizeInBytes - xmlSize);
+    Beatrix* current = beatrix.load();
+    if (current == nullptr)
+    {
+        // Restored into the engine that prepareToPlay creates
+        const juce::ScopedLock sl (engineLock);
+        engineSnapshot = std::move (snapshot);
+        return;
+    }
+
+    // Restore into a fresh engine and swap it in like a rebuilt one, so
+    // that the audio thread never sees a half restored engine.
+    const double sampleRate = current->get_sample_rate();
+    rebuildPool.addJob ([this, sampleRate, snapshot]
+    {
+        Beatrix* fresh = new Beatrix(sampleRate);
+        fresh->warmup();
+        if (! fresh->read_snapshot (snapshot.getData(), snapshot.getSize()))
+        {
+            delete fresh;
+            return;
+        }
+        delete pendingBeatrix.exchange (fresh);
+    });
 }
 
 //==============================================================================
@@ -263,6 +436,10 @@ juce::AudioProcessorValueTreeState::ParameterLayout OpenB3AudioProcessor::create
 
 void OpenB3AudioProcessor::parameterChanged (const String &parameterID, float newValue)
 {
+    Beatrix* beatrix = this->beatrix.load();
+    if (beatrix == nullptr)
+        return;
+
     if(parameterID == "VIBRATO_UPPER")
         beatrix->set_vibrato_upper((bool)newValue);
 
@@ -30,7 +30,8 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 class OpenB3AudioProcessor  :
         public juce::AudioProcessor,
-        public juce::AudioProcessorValueTreeState::Listener
+        public juce::AudioProcessorValueTreeState::Listener,
+        private juce::AsyncUpdater
 {
 public:
     //==============================================================================
@@ -75,9 +76,30 @@ public:
     juce::AudioProcessorValueTreeState apvts;
     void parameterChanged (const String &parameterID, float newValue) override;
 
+    // Instrumentation counters of the running engine. Call from the message
+    // thread only, which is where retired engines are deleted.
+    BeatrixStats getEngineStats() const;
+
 private:
     //==============================================================================
-    Beatrix* beatrix;
+    // The engine is kept across prepareToPlay calls. When the sample rate
+    // changes, a replacement is built on rebuildPool and handed over to the
+    // audio thread through pendingBeatrix; the audio thread swaps it in at
+    // the start of a block and passes the old engine back via retiredBeatrix.
+    std::atomic<Beatrix*> beatrix { nullptr };
+    std::atomic<Beatrix*> pendingBeatrix { nullptr };
+    std::atomic<Beatrix*> retiredBeatrix { nullptr };
+    juce::ThreadPool rebuildPool { 1 };
+    juce::CriticalSection engineLock; // keeps a retired engine alive while its state is saved
+    juce::MemoryBlock engineSnapshot; // restored state for the engine prepareToPlay creates
+
+    void handleAsyncUpdate() override;
+    void pushParametersToEngine();
+
+    // Output buses. The stems are disabled unless the host enables them.
+    enum { mainBus, hornBus, drumBus, dryBus };
+    float* getStemPointer (juce::AudioBuffer<float>& buffer, int bus, int channel);
+
     juce::AudioProcessorValueTreeState::ParameterLayout createParameters();
 
     //==============================================================================